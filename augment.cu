@@ -0,0 +1,257 @@
+#include "augment.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+#include "buffer_pool.h"
+#include "tile_order.cuh"
+
+namespace {
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3").
+// Each (key, counter) pair gives four independent 32-bit outputs.
+struct PhiloxBlock {
+    uint32_t v[4];
+};
+
+PhiloxBlock philox4x32(PhiloxBlock counter, uint32_t key0, uint32_t key1) {
+    const uint32_t kMultiplier0 = 0xD2511F53;
+    const uint32_t kMultiplier1 = 0xCD9E8D57;
+    const uint32_t kWeyl0 = 0x9E3779B9;
+    const uint32_t kWeyl1 = 0xBB67AE85;
+    for (int round = 0; round < 10; round++) {
+        uint64_t product0 = (uint64_t)kMultiplier0 * counter.v[0];
+        uint64_t product1 = (uint64_t)kMultiplier1 * counter.v[2];
+        counter = {{(uint32_t)(product1 >> 32) ^ counter.v[1] ^ key0, (uint32_t)product1,
+                    (uint32_t)(product0 >> 32) ^ counter.v[3] ^ key1, (uint32_t)product0}};
+        key0 += kWeyl0;
+        key1 += kWeyl1;
+    }
+    return counter;
+}
+
+// Uniform draws in [0, 1) for one variant, two Philox blocks' worth.
+class VariantRandom {
+public:
+    VariantRandom(uint64_t seed, uint64_t stream, int variant) : seed_(seed), stream_(stream), variant_(variant) {}
+
+    double uniform() {
+        if (next_ % 4 == 0) {
+            PhiloxBlock counter = {{(uint32_t)variant_, (uint32_t)(next_ / 4), (uint32_t)stream_,
+                                    (uint32_t)(stream_ >> 32)}};
+            block_ = philox4x32(counter, (uint32_t)seed_, (uint32_t)(seed_ >> 32));
+        }
+        return block_.v[next_++ % 4] * (1.0 / 4294967296.0);
+    }
+
+    double uniform(double low, double high) { return low + (high - low) * uniform(); }
+
+private:
+    uint64_t seed_;
+    uint64_t stream_;
+    int variant_;
+    uint32_t next_ = 0;
+    PhiloxBlock block_ = {};
+};
+
+// FNV-1a of the file name, so the draws do not depend on the input directory.
+uint64_t nameHash(const std::string& file) {
+    std::string name = file.substr(file.find_last_of('/') + 1);
+    uint64_t hash = 1469598103934665603ull;
+    for (unsigned char c : name) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+struct AugmentKernelParams {
+    float cropX;
+    float cropY;
+    float scaleX;  // source pixels per output pixel
+    float scaleY;
+    bool flip;
+    float brightness;
+    float contrast;
+    float saturation;
+    float mean;  // luma the contrast pivots on, after brightness
+};
+
+__device__ __forceinline__ float clamp255(float v) {
+    return fminf(fmaxf(v, 0.0f), 255.0f);
+}
+
+// Crop, flip, bilinear resize back to the source size and colour jitter
+// (brightness, contrast, saturation, each clamped as torchvision does) in one
+// pass, so the only intermediate is the jittered image the blur reads.
+__global__ void augmentKernel(const unsigned char* input, unsigned char* output, int width, int height,
+                              int channels, AugmentKernelParams params, TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * blockDim.x + threadIdx.x;
+    int y = tileY * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+
+    int u = params.flip ? width - 1 - x : x;
+    float sx = fminf(fmaxf(params.cropX + (u + 0.5f) * params.scaleX - 0.5f, 0.0f), width - 1.0f);
+    float sy = fminf(fmaxf(params.cropY + (y + 0.5f) * params.scaleY - 0.5f, 0.0f), height - 1.0f);
+    int x0 = (int)sx;
+    int y0 = (int)sy;
+    int x1 = min(x0 + 1, width - 1);
+    int y1 = min(y0 + 1, height - 1);
+    float fx = sx - x0;
+    float fy = sy - y0;
+
+    float v[4];
+    int colour = min(channels, 4);
+    for (int c = 0; c < colour; c++) {
+        float top = input[((size_t)y0 * width + x0) * channels + c] * (1 - fx) +
+                    input[((size_t)y0 * width + x1) * channels + c] * fx;
+        float bottom = input[((size_t)y1 * width + x0) * channels + c] * (1 - fx) +
+                       input[((size_t)y1 * width + x1) * channels + c] * fx;
+        v[c] = top * (1 - fy) + bottom * fy;
+    }
+    int jittered = channels >= 3 ? 3 : 1;  // alpha is left alone
+    for (int c = 0; c < jittered; c++) {
+        v[c] = clamp255(v[c] * params.brightness);
+        v[c] = clamp255(params.contrast * v[c] + (1 - params.contrast) * params.mean);
+    }
+    if (channels >= 3) {
+        float luma = 0.114f * v[0] + 0.587f * v[1] + 0.299f * v[2];
+        for (int c = 0; c < 3; c++) v[c] = clamp255(params.saturation * v[c] + (1 - params.saturation) * luma);
+    }
+    for (int c = 0; c < colour; c++) output[((size_t)y * width + x) * channels + c] = (unsigned char)(v[c] + 0.5f);
+}
+
+// Sum of per-pixel luma, one shared-memory reduction and atomic per block.
+__global__ void lumaSumKernel(const unsigned char* image, int width, int height, int channels,
+                              unsigned long long* sum, TileGrid grid) {
+    __shared__ unsigned int partial[kTileSize * kTileSize];
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * kTileSize + threadIdx.x;
+    int y = tileY * kTileSize + threadIdx.y;
+    int thread = threadIdx.y * kTileSize + threadIdx.x;
+    unsigned int luma = 0;
+    if (x < width && y < height) {
+        const unsigned char* p = image + ((size_t)y * width + x) * channels;
+        luma = channels >= 3 ? (29 * p[0] + 150 * p[1] + 77 * p[2]) >> 8 : p[0];
+    }
+    partial[thread] = luma;
+    __syncthreads();
+    for (int stride = kTileSize * kTileSize / 2; stride > 0; stride /= 2) {
+        if (thread < stride) partial[thread] += partial[thread + stride];
+        __syncthreads();
+    }
+    if (thread == 0) atomicAdd(sum, (unsigned long long)partial[0]);
+}
+
+}  // namespace
+
+AugmentParams augmentParams(const AugmentOptions& options, const std::string& file, int variant, int width,
+                            int height) {
+    VariantRandom random(options.seed, nameHash(file), variant);
+    AugmentParams params;
+    params.variant = variant;
+    double scale = std::sqrt(random.uniform(std::min(std::max(options.minCropScale, 0.01), 1.0), 1.0));
+    params.cropWidth = width * scale;
+    params.cropHeight = height * scale;
+    params.cropX = random.uniform(0, width - params.cropWidth);
+    params.cropY = random.uniform(0, height - params.cropHeight);
+    params.flip = options.flip && random.uniform() < 0.5;
+    params.brightness = random.uniform(std::max(0.0, 1 - options.brightness), 1 + options.brightness);
+    params.contrast = random.uniform(std::max(0.0, 1 - options.contrast), 1 + options.contrast);
+    params.saturation = random.uniform(std::max(0.0, 1 - options.saturation), 1 + options.saturation);
+    params.sigma = random.uniform(options.minSigma, options.maxSigma);
+    if (filterOptions().pixelateBlock > 0) params.sigma = 0;  // a redaction is never swapped for a blur
+    return params;
+}
+
+double meanLuma(const unsigned char* d_image, int width, int height, int channels, cudaStream_t stream) {
+    unsigned char* d_sum = deviceBufferPool().acquire(sizeof(unsigned long long));
+    if (!d_sum) return 128;
+    unsigned long long* sum = reinterpret_cast<unsigned long long*>(d_sum);
+    cudaMemsetAsync(sum, 0, sizeof(*sum), stream);
+    TileGrid grid = makeTileGrid(width, height, TileOrder::RowMajor);
+    lumaSumKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_image, width, height, channels, sum, grid);
+    unsigned long long total = 0;
+    cudaMemcpyAsync(&total, sum, sizeof(total), cudaMemcpyDeviceToHost, stream);
+    cudaStreamSynchronize(stream);
+    deviceBufferPool().release(d_sum);
+    return (double)total / ((double)width * height);
+}
+
+SourceView augmentView(const AugmentParams& params, int width, int height) {
+    // The kernel samples the source at crop + (u + 0.5) * crop / size - 0.5
+    SourceView view;
+    view.scaleX = width / params.cropWidth;
+    view.scaleY = height / params.cropHeight;
+    view.offsetX = (0.5 - params.cropX) * view.scaleX - 0.5;
+    view.offsetY = (0.5 - params.cropY) * view.scaleY - 0.5;
+    view.sourceWidth = width;
+    view.sourceHeight = height;
+    if (params.flip) {
+        view.scaleX = -view.scaleX;
+        view.offsetX = width - 1 - view.offsetX;
+    }
+    return view;
+}
+
+cv::Mat augmentDeviceImage(const unsigned char* d_input, int width, int height, int channels, double meanLuma,
+                           const AugmentParams& params, cudaStream_t stream, const DeviceImageHook& onDevice,
+                           const OverlayPlacement& overlay) {
+    size_t size = (size_t)width * height * channels;
+    DeviceBufferPool& pool = deviceBufferPool();
+    unsigned char* d_jittered = pool.acquire(size);
+    unsigned char* d_output = pool.acquire(size);
+    if (!d_jittered || !d_output) {
+        if (d_jittered) pool.release(d_jittered);
+        if (d_output) pool.release(d_output);
+        return cv::Mat();
+    }
+
+    AugmentKernelParams kernelParams;
+    kernelParams.cropX = (float)params.cropX;
+    kernelParams.cropY = (float)params.cropY;
+    kernelParams.scaleX = (float)(params.cropWidth / width);
+    kernelParams.scaleY = (float)(params.cropHeight / height);
+    kernelParams.flip = params.flip;
+    kernelParams.brightness = (float)params.brightness;
+    kernelParams.contrast = (float)params.contrast;
+    kernelParams.saturation = (float)params.saturation;
+    kernelParams.mean = (float)std::min(255.0, meanLuma * params.brightness);
+    TileGrid grid = makeTileGrid(width, height, filterOptions().tileOrder);
+    augmentKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_input, d_jittered, width, height, channels,
+                                                                      kernelParams, grid);
+    bool filtered = runFilter(d_jittered, d_output, width, height, channels, stream,
+                              augmentView(params, width, height), overlay, params.sigma);
+    if (!filtered) {
+        cudaStreamSynchronize(stream);
+        pool.release(d_jittered);
+        pool.release(d_output);
+        return cv::Mat();
+    }
+    if (onDevice) onDevice(d_output, width, height, channels, stream);
+
+    cv::Mat output(height, width, CV_8UC(channels));
+    cudaMemcpyAsync(output.data, d_output, size, cudaMemcpyDeviceToHost, stream);
+    cudaError_t status = cudaStreamSynchronize(stream);
+    pool.release(d_jittered);
+    pool.release(d_output);
+    return status == cudaSuccess ? output : cv::Mat();
+}
+
+bool writeAugmentParams(const std::string& path, const std::vector<std::string>& files,
+                        const std::vector<AugmentParams>& params) {
+    std::ofstream out(path);
+    if (!out.is_open()) return false;
+    out << "variant,file,crop_x,crop_y,crop_width,crop_height,flip,brightness,contrast,saturation,sigma\n";
+    for (size_t i = 0; i < params.size() && i < files.size(); i++) {
+        const AugmentParams& p = params[i];
+        out << p.variant << "," << files[i] << "," << p.cropX << "," << p.cropY << "," << p.cropWidth << ","
+            << p.cropHeight << "," << (p.flip ? 1 : 0) << "," << p.brightness << "," << p.contrast << ","
+            << p.saturation << "," << p.sigma << "\n";
+    }
+    return out.good();
+}
@@ -0,0 +1,65 @@
+#ifndef AUGMENT_H_
+#define AUGMENT_H_
+
+#include <cuda_runtime.h>
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "filters.h"
+
+// Training-data augmentation: every input yields `variants` randomly
+// transformed copies from one decode. Random choices come from Philox4x32-10
+// keyed by the seed and the file name, with the variant number as counter, so
+// a variant is reproducible regardless of thread count or batch order.
+struct AugmentOptions {
+    int variants = 0;  // 0 disables augmentation
+    uint64_t seed = 0;
+    double minCropScale = 0.6;  // crop area fraction drawn from [minCropScale, 1], aspect kept
+    bool flip = true;           // horizontal flip with probability 1/2
+    double brightness = 0.2;    // factors drawn from [1 - j, 1 + j]
+    double contrast = 0.2;
+    double saturation = 0.2;
+    double minSigma = 0;        // blur sigma drawn from [minSigma, maxSigma];
+    double maxSigma = 0;        // 0 keeps the configured blur
+
+    bool enabled() const { return variants > 0; }
+};
+
+// The random draws of one variant.
+struct AugmentParams {
+    int variant;
+    double cropX;
+    double cropY;
+    double cropWidth;
+    double cropHeight;
+    bool flip;
+    double brightness;
+    double contrast;
+    double saturation;
+    double sigma;  // 0: configured blur (always with --pixelate)
+};
+
+AugmentParams augmentParams(const AugmentOptions& options, const std::string& file, int variant, int width,
+                            int height);
+
+// Where source pixels land in the variant, so options given in source pixels
+// (--pixelate_region) follow its crop and flip.
+SourceView augmentView(const AugmentParams& params, int width, int height);
+
+// Mean luma of an interleaved 8-bit image on the device; contrast jitter pivots on it.
+double meanLuma(const unsigned char* d_image, int width, int height, int channels, cudaStream_t stream);
+
+// Produce one variant of a device image at the source size: crop, flip, bilinear
+// resize and colour jitter in one kernel, then the blur, which composites a
+// placed overlay onto the variant. Empty on failure.
+cv::Mat augmentDeviceImage(const unsigned char* d_input, int width, int height, int channels, double meanLuma,
+                           const AugmentParams& params, cudaStream_t stream = 0,
+                           const DeviceImageHook& onDevice = nullptr, const OverlayPlacement& overlay = {});
+
+// One CSV row per variant with its output file and draws, for remapping labels.
+bool writeAugmentParams(const std::string& path, const std::vector<std::string>& files,
+                        const std::vector<AugmentParams>& params);
+
+#endif  // AUGMENT_H_
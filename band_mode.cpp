@@ -0,0 +1,451 @@
+#include "band_mode.h"
+
+#include <cuda_runtime.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+#include "common.h"
+#include "filters.h"
+#include "tiff_writer.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Upper bound on the rows a worker uploads to the GPU at once, so a worker's
+// memory use depends on the chunk size rather than on its band height.
+const size_t kChunkBytes = 256u << 20;
+
+// Where band rows come from. Binary PPM (P6) is read directly from disk by each
+// worker; any other format is decoded once by the coordinator into a shared
+// mapping that the forked workers read their rows from.
+struct BandSource {
+    int width = 0;
+    int height = 0;
+    int channels = 3;
+    int fd = -1;
+    uint64_t dataOffset = 0;
+    unsigned char* shared = nullptr;
+    size_t sharedSize = 0;
+};
+
+// Per-worker timings sent back to the coordinator over the result pipe.
+struct WorkerReport {
+    int worker;
+    int ok;
+    double readMs;
+    double exchangeMs;
+    double gpuMs;
+    double writeMs;
+};
+
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool readFull(int fd, void* data, size_t size) {
+    unsigned char* p = static_cast<unsigned char*>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool writeFull(int fd, const void* data, size_t size) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool preadFull(int fd, void* data, size_t size, uint64_t offset) {
+    unsigned char* p = static_cast<unsigned char*>(data);
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, offset);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+bool pwriteFull(int fd, const void* data, size_t size, uint64_t offset) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Parse a binary PPM header: "P6 <width> <height> 255" with optional comments.
+bool openPpm(const std::string& path, BandSource& source) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    char header[512];
+    ssize_t n = pread(fd, header, sizeof(header), 0);
+    int fields[3];
+    int field = 0;
+    ssize_t pos = 2;
+    if (n < 2 || header[0] != 'P' || header[1] != '6') {
+        close(fd);
+        return false;
+    }
+    while (field < 3 && pos < n) {
+        if (header[pos] == '#') {
+            while (pos < n && header[pos] != '\n') pos++;
+        } else if (isspace((unsigned char)header[pos])) {
+            pos++;
+        } else {
+            int value = 0;
+            while (pos < n && isdigit((unsigned char)header[pos])) value = value * 10 + (header[pos++] - '0');
+            fields[field++] = value;
+        }
+    }
+    if (field < 3 || pos >= n || fields[2] != 255) {
+        close(fd);
+        return false;
+    }
+
+    source.width = fields[0];
+    source.height = fields[1];
+    source.channels = 3;
+    source.fd = fd;
+    source.dataOffset = pos + 1;  // exactly one whitespace byte follows maxval
+    return true;
+}
+
+bool openBandSource(const std::string& path, BandSource& source) {
+    if (fs::path(path).extension() == ".ppm" && openPpm(path, source)) return true;
+
+    cv::Mat img = cv::imread(path, cv::IMREAD_COLOR);
+    if (img.empty()) return false;
+    source.width = img.cols;
+    source.height = img.rows;
+    source.channels = img.channels();
+    source.sharedSize = (size_t)img.cols * img.rows * img.channels();
+    void* mapping = mmap(nullptr, source.sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return false;
+    source.shared = static_cast<unsigned char*>(mapping);
+    size_t rowBytes = (size_t)img.cols * img.channels();
+    for (int y = 0; y < img.rows; y++) {
+        memcpy(source.shared + y * rowBytes, img.ptr(y), rowBytes);
+    }
+    return true;
+}
+
+void closeBandSource(BandSource& source) {
+    if (source.fd >= 0) close(source.fd);
+    if (source.shared) munmap(source.shared, source.sharedSize);
+    source = BandSource();
+}
+
+// Read `count` rows starting at row `y` as interleaved BGR.
+bool readSourceRows(const BandSource& source, int y, int count, unsigned char* dst) {
+    size_t rowBytes = (size_t)source.width * source.channels;
+    size_t bytes = rowBytes * count;
+    if (source.shared) {
+        memcpy(dst, source.shared + y * rowBytes, bytes);
+        return true;
+    }
+    if (!preadFull(source.fd, dst, bytes, source.dataOffset + y * rowBytes)) return false;
+    swapRedBlue(dst, (size_t)source.width * count, source.channels);  // PPM stores RGB
+    return true;
+}
+
+// Pipes between neighbouring workers: down[k] carries worker k's last rows to
+// worker k + 1, up[k] carries worker k + 1's first rows to worker k.
+struct HaloPipes {
+    std::vector<int> downRead, downWrite, upRead, upWrite;
+};
+
+// Keep only the pipe ends worker `index` uses, so a neighbour that dies shows
+// up as EOF instead of a read that blocks forever.
+void closeUnusedPipes(const HaloPipes& pipes, int index) {
+    for (int k = 0; k < (int)pipes.downRead.size(); k++) {
+        if (k != index - 1) {
+            close(pipes.downRead[k]);
+            close(pipes.upWrite[k]);
+        }
+        if (k != index) {
+            close(pipes.downWrite[k]);
+            close(pipes.upRead[k]);
+        }
+    }
+}
+
+// The parent's ends, once the workers have theirs, or on a setup failure.
+void closeHaloPipes(const HaloPipes& pipes) {
+    for (size_t k = 0; k < pipes.downRead.size(); k++) {
+        close(pipes.downRead[k]);
+        close(pipes.downWrite[k]);
+        close(pipes.upRead[k]);
+        close(pipes.upWrite[k]);
+    }
+}
+
+struct WorkerContext {
+    int index;
+    int workers;
+    int y0;
+    int y1;
+    int radius;
+    int outputFd;
+    uint64_t outputOffset;
+    bool tiffOutput;
+};
+
+bool runBandWorker(const BandSource& source, const WorkerContext& ctx, const HaloPipes& pipes,
+                   WorkerReport& report) {
+    int width = source.width;
+    int channels = source.channels;
+    size_t rowBytes = (size_t)width * channels;
+    int radius = ctx.radius;
+    int topHaloRows = ctx.index > 0 ? radius : 0;
+    int bottomHaloRows = ctx.index < ctx.workers - 1 ? radius : 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<unsigned char> firstRows(rowBytes * topHaloRows);
+    std::vector<unsigned char> lastRows(rowBytes * bottomHaloRows);
+    bool ok = readSourceRows(source, ctx.y0, topHaloRows, firstRows.data()) &&
+              readSourceRows(source, ctx.y1 - bottomHaloRows, bottomHaloRows, lastRows.data());
+    report.readMs += elapsedMs(start);
+    if (!ok) return false;
+
+    // Send our edge rows to the neighbours on a separate thread while receiving
+    // theirs, so two workers writing to each other can never deadlock on full pipes.
+    start = std::chrono::steady_clock::now();
+    std::vector<unsigned char> topHalo(rowBytes * topHaloRows);
+    std::vector<unsigned char> bottomHalo(rowBytes * bottomHaloRows);
+    bool sent = true;
+    std::thread sender([&] {
+        if (topHaloRows) sent = writeFull(pipes.upWrite[ctx.index - 1], firstRows.data(), firstRows.size());
+        if (bottomHaloRows) sent = sent && writeFull(pipes.downWrite[ctx.index], lastRows.data(), lastRows.size());
+    });
+    if (topHaloRows) ok = ok && readFull(pipes.downRead[ctx.index - 1], topHalo.data(), topHalo.size());
+    if (bottomHaloRows) ok = ok && readFull(pipes.upRead[ctx.index], bottomHalo.data(), bottomHalo.size());
+    sender.join();
+    ok = ok && sent;
+    report.exchangeMs = elapsedMs(start);
+    if (!ok) return false;
+
+    int deviceCount = 0;
+    cudaGetDeviceCount(&deviceCount);
+    if (deviceCount > 0) cudaSetDevice(ctx.index % deviceCount);
+
+    int chunkRows = std::max<int>(1, kChunkBytes / rowBytes);
+    int maxInputRows = chunkRows + 2 * radius;
+    unsigned char *h_input, *h_output, *d_input, *d_output;
+    if (cudaMallocHost(&h_input, rowBytes * maxInputRows) != cudaSuccess) return false;
+    if (cudaMallocHost(&h_output, rowBytes * maxInputRows) != cudaSuccess) return false;
+    if (cudaMalloc(&d_input, rowBytes * maxInputRows) != cudaSuccess) return false;
+    if (cudaMalloc(&d_output, rowBytes * maxInputRows) != cudaSuccess) return false;
+
+    for (int a = ctx.y0; a < ctx.y1 && ok; a += chunkRows) {
+        int b = std::min(a + chunkRows, ctx.y1);
+        int inStart = std::max(a - radius, ctx.y0 - topHaloRows);
+        int inEnd = std::min(b + radius, ctx.y1 + bottomHaloRows);
+
+        // Assemble the chunk: halo rows from the neighbours, the rest from the source.
+        start = std::chrono::steady_clock::now();
+        int readStart = std::max(inStart, ctx.y0);
+        int readEnd = std::min(inEnd, ctx.y1);
+        if (inStart < ctx.y0) {
+            memcpy(h_input, topHalo.data() + (inStart - (ctx.y0 - topHaloRows)) * rowBytes,
+                   (ctx.y0 - inStart) * rowBytes);
+        }
+        ok = readSourceRows(source, readStart, readEnd - readStart, h_input + (readStart - inStart) * rowBytes);
+        if (inEnd > ctx.y1) {
+            memcpy(h_input + (ctx.y1 - inStart) * rowBytes, bottomHalo.data(), (inEnd - ctx.y1) * rowBytes);
+        }
+        report.readMs += elapsedMs(start);
+
+        start = std::chrono::steady_clock::now();
+        int inRows = inEnd - inStart;
+        cudaMemcpy(d_input, h_input, rowBytes * inRows, cudaMemcpyHostToDevice);
+        ok = ok && runFilter(d_input, d_output, width, inRows, channels);
+        cudaMemcpy(h_output, d_output, rowBytes * inRows, cudaMemcpyDeviceToHost);
+        ok = ok && cudaGetLastError() == cudaSuccess;
+        report.gpuMs += elapsedMs(start);
+
+        start = std::chrono::steady_clock::now();
+        unsigned char* rows = h_output + (a - inStart) * rowBytes;
+        if (ctx.tiffOutput) swapRedBlue(rows, (size_t)width * (b - a), channels);
+        ok = ok && pwriteFull(ctx.outputFd, rows, rowBytes * (b - a), ctx.outputOffset + a * rowBytes);
+        report.writeMs += elapsedMs(start);
+    }
+
+    cudaFreeHost(h_input);
+    cudaFreeHost(h_output);
+    cudaFree(d_input);
+    cudaFree(d_output);
+    return ok;
+}
+
+}  // namespace
+
+double processImageInBands(const std::string& file, const std::string& outputDir, const BandOptions& options,
+                           std::ofstream& logFile) {
+    auto start = std::chrono::steady_clock::now();
+    BandSource source;
+    if (!openBandSource(file, source)) {
+        std::cerr << "Failed to load " << file << std::endl;
+        logFile << "[" << getTimestamp() << "] ERROR: Failed to load " << file << std::endl;
+        return -1;
+    }
+
+    // Every band must be at least one halo deep, otherwise a halo would span
+    // more than one neighbour.
+    int radius = filterRadius();
+    int workers = std::max(1, std::min(options.workers, source.height / std::max(radius, 1)));
+
+    std::string outputFile = outputDir + "/" + fs::path(file).stem().string() + (options.tiffOutput ? ".tif" : ".raw");
+    uint64_t outputOffset = 0;
+    if (!preallocateImageFile(outputFile, source.width, source.height, source.channels, options.tiffOutput,
+                              &outputOffset)) {
+        std::cerr << "Failed to create " << outputFile << std::endl;
+        logFile << "[" << getTimestamp() << "] ERROR: Failed to create " << outputFile << std::endl;
+        closeBandSource(source);
+        return -1;
+    }
+    int outputFd = open(outputFile.c_str(), O_WRONLY);
+    if (outputFd < 0) {
+        std::cerr << "Failed to open " << outputFile << std::endl;
+        logFile << "[" << getTimestamp() << "] ERROR: Failed to open " << outputFile << std::endl;
+        closeBandSource(source);
+        return -1;
+    }
+
+    HaloPipes pipes;
+    int results[2];
+    bool piped = true;
+    for (int k = 0; k < workers - 1 && piped; k++) {
+        int down[2], up[2];
+        if (pipe(down) != 0) {
+            piped = false;
+        } else if (pipe(up) != 0) {
+            close(down[0]);
+            close(down[1]);
+            piped = false;
+        } else {
+            pipes.downRead.push_back(down[0]);
+            pipes.downWrite.push_back(down[1]);
+            pipes.upRead.push_back(up[0]);
+            pipes.upWrite.push_back(up[1]);
+        }
+    }
+    if (!piped || pipe(results) != 0) {
+        std::cerr << "Failed to create band worker pipes for " << file << std::endl;
+        logFile << "[" << getTimestamp() << "] ERROR: Failed to create band worker pipes for " << file << std::endl;
+        closeHaloPipes(pipes);
+        close(outputFd);
+        closeBandSource(source);
+        return -1;
+    }
+
+    // Children inherit unflushed stream buffers; flush so nothing is logged twice.
+    logFile.flush();
+    std::cout.flush();
+    std::vector<pid_t> pids;
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            closeUnusedPipes(pipes, i);
+            close(results[0]);
+            WorkerContext ctx = {i, workers, (int)((int64_t)source.height * i / workers),
+                                 (int)((int64_t)source.height * (i + 1) / workers), radius, outputFd, outputOffset,
+                                 options.tiffOutput};
+            WorkerReport report = {i, 0, 0, 0, 0, 0};
+            report.ok = runBandWorker(source, ctx, pipes, report) ? 1 : 0;
+            writeFull(results[1], &report, sizeof(report));
+            _exit(report.ok ? 0 : 1);
+        }
+        pids.push_back(pid);
+    }
+
+    close(results[1]);
+    closeHaloPipes(pipes);
+
+    bool ok = true;
+    WorkerReport report;
+    while (readFull(results[0], &report, sizeof(report))) {
+        ok = ok && report.ok;
+        logFile << "[" << getTimestamp() << "] INFO: Band worker " << report.worker << "/" << workers
+                << (report.ok ? "" : " FAILED") << " (read " << report.readMs << " ms, halo exchange "
+                << report.exchangeMs << " ms, GPU " << report.gpuMs << " ms, write " << report.writeMs << " ms)"
+                << std::endl;
+    }
+    close(results[0]);
+    for (pid_t pid : pids) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    close(outputFd);
+
+    double wallMs = elapsedMs(start);
+    if (!ok) {
+        std::cerr << "Band processing failed for " << file << std::endl;
+        logFile << "[" << getTimestamp() << "] ERROR: Band processing failed for " << file << std::endl;
+    } else {
+        std::cout << "Processed: " << file << " -> " << outputFile << std::endl;
+        logFile << "[" << getTimestamp() << "] INFO: Processed " << file << " -> " << outputFile
+                << " (Size: " << source.width << "x" << source.height << ", " << workers << " band workers, "
+                << wallMs << " ms)" << std::endl;
+    }
+    closeBandSource(source);
+    return ok ? wallMs : -1;
+}
+
+void processImagesInBands(const std::vector<std::string>& files, const std::string& outputDir,
+                          const BandOptions& options, std::ofstream& logFile) {
+    logFile << "[" << getTimestamp() << "] INFO: Starting band processing of " << files.size() << " images with "
+            << options.workers << " workers" << std::endl;
+
+    for (const auto& file : files) {
+        if (!options.scaling) {
+            processImageInBands(file, outputDir, options, logFile);
+            continue;
+        }
+
+        // Efficiency(n) = T(1) / (n * T(n)); 1.0 means perfect linear scaling.
+        double baseMs = 0;
+        for (int n = 1; n <= options.workers; n++) {
+            BandOptions run = options;
+            run.workers = n;
+            double ms = processImageInBands(file, outputDir, run, logFile);
+            if (ms < 0) break;
+            if (n == 1) baseMs = ms;
+            logFile << "[" << getTimestamp() << "] INFO: Band scaling " << file << " workers=" << n << " wall=" << ms
+                    << " ms speedup=" << baseMs / ms << " efficiency=" << baseMs / (n * ms) << std::endl;
+            std::cout << "Band scaling: workers=" << n << " wall=" << ms << " ms efficiency=" << baseMs / (n * ms)
+                      << std::endl;
+        }
+    }
+
+    logFile << "[" << getTimestamp() << "] INFO: Band processing completed" << std::endl;
+}
@@ -0,0 +1,27 @@
+#ifndef BAND_MODE_H_
+#define BAND_MODE_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Band mode splits one (possibly huge) image into horizontal bands, one per
+// worker process. Each worker reads only its own rows, swaps filterRadius()
+// halo rows with its neighbours over pipes and writes its output rows straight
+// into a preallocated raw or BigTIFF file, so no process ever holds the image.
+struct BandOptions {
+    int workers = 1;
+    bool tiffOutput = true;  // false: headerless raw BGR
+    bool scaling = false;    // also time 1..workers and log scaling efficiency
+};
+
+// Process one image with `options.workers` band workers. Returns the wall time
+// in milliseconds, or a negative value on failure.
+double processImageInBands(const std::string& file, const std::string& outputDir, const BandOptions& options,
+                           std::ofstream& logFile);
+
+// Run band mode over every file, optionally followed by a 1..N scaling sweep.
+void processImagesInBands(const std::vector<std::string>& files, const std::string& outputDir,
+                          const BandOptions& options, std::ofstream& logFile);
+
+#endif  // BAND_MODE_H_
@@ -0,0 +1,300 @@
+#include "bayer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+
+#include "blur_kernel.cuh"
+#include "buffer_pool.h"
+#include "filter_output.cuh"
+#include "tile_order.cuh"
+
+namespace {
+
+BayerOptions options;
+std::atomic<uint64_t> fusedFrames{0};
+std::atomic<uint64_t> separateFrames{0};
+
+// Malvar-He-Cutler reads a 5x5 neighbourhood; bilinear only the inner 3x3.
+const int kDemosaicReach = 2;
+// Raw samples a tile needs: the tile, the blur's one-pixel border, and the
+// demosaic's reach around that.
+const int kRawSpan = kTileSize + 2 + 2 * kDemosaicReach;
+const int kColorSpan = kTileSize + 2;
+const int kSumBlocks = 128;
+
+// The options in the form the kernels read them.
+struct RawParams {
+    int cfa[4];      // colour (0 R, 1 G, 2 B) of each site of the 2x2 cell, row-major
+    bool wide;       // 16-bit samples
+    bool mhc;
+    float gains[3];  // white balance times 255 / full scale, per colour
+};
+
+// Per-colour sample totals of a frame, for gray world white balance.
+struct ColorSums {
+    unsigned long long sum[3];
+    unsigned long long count[3];
+};
+
+// Mirror across the edge sample, which keeps the CFA phase of the position.
+__device__ __forceinline__ int reflect(int i, int n) {
+    if (i < 0) i = -i;
+    if (i >= n) i = 2 * n - 2 - i;
+    return min(max(i, 0), n - 1);
+}
+
+__device__ __forceinline__ int rawSample(const unsigned char* raw, size_t index, bool wide) {
+    return wide ? raw[2 * index] | raw[2 * index + 1] << 8 : raw[index];
+}
+
+__device__ __forceinline__ int siteColor(const RawParams& params, int x, int y) {
+    return params.cfa[(y & 1) * 2 + (x & 1)];
+}
+
+__device__ __forceinline__ unsigned char toByte(float value) {
+    return (unsigned char)fminf(fmaxf(value + 0.5f, 0.0f), 255.0f);
+}
+
+__global__ void colorSumsKernel(const unsigned char* raw, int width, int height, RawParams params,
+                                ColorSums* sums) {
+    __shared__ unsigned long long block[6];
+    if (threadIdx.x < 6) block[threadIdx.x] = 0;
+    __syncthreads();
+    unsigned long long sum[3] = {0, 0, 0};
+    unsigned long long count[3] = {0, 0, 0};
+    size_t pixels = (size_t)width * height;
+    for (size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x; i < pixels; i += (size_t)gridDim.x * blockDim.x) {
+        int color = siteColor(params, (int)(i % width), (int)(i / width));
+        sum[color] += rawSample(raw, i, params.wide);
+        count[color]++;
+    }
+    for (int c = 0; c < 3; c++) {
+        atomicAdd(&block[c], sum[c]);
+        atomicAdd(&block[3 + c], count[c]);
+    }
+    __syncthreads();
+    if (threadIdx.x < 3) atomicAdd(&sums->sum[threadIdx.x], block[threadIdx.x]);
+    if (threadIdx.x >= 3 && threadIdx.x < 6) atomicAdd(&sums->count[threadIdx.x - 3], block[threadIdx.x]);
+}
+
+// Red, green and blue at window position (wx, wy), image position (x, y).
+// Malvar-He-Cutler adds each colour's bilinear estimate a scaled Laplacian of
+// the site's own channel, which keeps edges sharp at the cost of a 5x5 read.
+__device__ void demosaicPixel(const float (*s)[kRawSpan + 1], int wx, int wy, int x, int y,
+                              const RawParams& params, float rgb[3]) {
+    auto at = [&](int dx, int dy) { return s[wy + dy][wx + dx]; };
+    float centre = at(0, 0);
+    float cross = at(-1, 0) + at(1, 0) + at(0, -1) + at(0, 1);
+    float diagonal = at(-1, -1) + at(1, -1) + at(-1, 1) + at(1, 1);
+    float farX = at(-2, 0) + at(2, 0);
+    float farY = at(0, -2) + at(0, 2);
+    int site = siteColor(params, x, y);
+    rgb[site] = centre;
+    if (site == 1) {
+        // The neighbours across the row hold one of red or blue, those up and down the other
+        int across = siteColor(params, x + 1, y);
+        float nearX = at(-1, 0) + at(1, 0);
+        float nearY = at(0, -1) + at(0, 1);
+        if (params.mhc) {
+            rgb[across] = (5 * centre + 4 * nearX - farX - diagonal + 0.5f * farY) / 8;
+            rgb[2 - across] = (5 * centre + 4 * nearY - farY - diagonal + 0.5f * farX) / 8;
+        } else {
+            rgb[across] = nearX / 2;
+            rgb[2 - across] = nearY / 2;
+        }
+    } else if (params.mhc) {
+        rgb[1] = (4 * centre + 2 * cross - farX - farY) / 8;
+        rgb[2 - site] = (6 * centre + 2 * diagonal - 1.5f * (farX + farY)) / 8;
+    } else {
+        rgb[1] = cross / 4;
+        rgb[2 - site] = diagonal / 4;
+    }
+}
+
+// White balance, then demosaic each tile plus a one-pixel border into shared
+// memory and, with kBlur, apply the 3x3 blur from there. The raw window is
+// read with mirrored edges, which keeps the CFA phase, and border pixels are
+// demosaiced at image-clamped positions, so the blurred result is identical
+// to demosaicing the whole frame and then running gaussianBlurKernel.
+template <bool kBlur>
+__global__ void rawFilterKernel(const unsigned char* raw, FilterOutput output, int width, int height,
+                                RawParams params, const ColorSums* sums, TileGrid grid) {
+    __shared__ float samples[kRawSpan][kRawSpan + 1];
+    __shared__ unsigned char color[kColorSpan * kColorSpan * 3];
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * kTileSize + threadIdx.x;
+    int y = tileY * kTileSize + threadIdx.y;
+    int thread = threadIdx.y * kTileSize + threadIdx.x;
+
+    float gains[3] = {params.gains[0], params.gains[1], params.gains[2]};
+    if (sums) {
+        // Gray world: scale red and blue to the green mean
+        double green = sums->count[1] ? (double)sums->sum[1] / sums->count[1] : 0;
+        for (int c = 0; c < 3; c += 2) {
+            double mean = sums->count[c] ? (double)sums->sum[c] / sums->count[c] : 0;
+            if (mean > 0 && green > 0) gains[c] *= (float)(green / mean);
+        }
+    }
+
+    int originX = tileX * kTileSize - 1 - kDemosaicReach;
+    int originY = tileY * kTileSize - 1 - kDemosaicReach;
+    for (int i = thread; i < kRawSpan * kRawSpan; i += kTileSize * kTileSize) {
+        int px = originX + i % kRawSpan;
+        int py = originY + i / kRawSpan;
+        size_t index = (size_t)reflect(py, height) * width + reflect(px, width);
+        samples[i / kRawSpan][i % kRawSpan] = rawSample(raw, index, params.wide) * gains[siteColor(params, px, py)];
+    }
+    __syncthreads();
+    for (int i = thread; i < kColorSpan * kColorSpan; i += kTileSize * kTileSize) {
+        int px = min(max(tileX * kTileSize - 1 + i % kColorSpan, 0), width - 1);
+        int py = min(max(tileY * kTileSize - 1 + i / kColorSpan, 0), height - 1);
+        float rgb[3];
+        demosaicPixel(samples, px - originX, py - originY, px, py, params, rgb);
+        for (int c = 0; c < 3; c++) color[i * 3 + c] = toByte(rgb[2 - c]);  // BGR
+    }
+    __syncthreads();
+    if (x >= width || y >= height) return;
+
+    if (!kBlur) {
+        int i = (threadIdx.y + 1) * kColorSpan + threadIdx.x + 1;
+        for (int c = 0; c < 3; c++) storeOutput(output, x, y, c, width, height, 3, color[i * 3 + c]);
+        return;
+    }
+
+    for (int c = 0; c < 3; c++) {
+        unsigned char value = blur3x3([&](int kx, int ky) {
+            return color[((threadIdx.y + 1 + ky) * kColorSpan + threadIdx.x + 1 + kx) * 3 + c];
+        });
+        storeOutput(output, x, y, c, width, height, 3, value);
+    }
+}
+
+RawParams rawParams() {
+    static const int layouts[4][4] = {{0, 1, 1, 2}, {2, 1, 1, 0}, {1, 0, 2, 1}, {1, 2, 0, 1}};
+    RawParams params;
+    std::copy(layouts[(int)options.pattern], layouts[(int)options.pattern] + 4, params.cfa);
+    params.wide = options.bytesPerSample() == 2;
+    params.mhc = options.method == DemosaicMethod::MalvarHeCutler;
+    float scale = 255.0f / ((1 << options.bits) - 1);
+    for (int c = 0; c < 3; c++) params.gains[c] = scale * (options.autoWhiteBalance ? 1.0f : (float)options.gains[c]);
+    return params;
+}
+
+// One pass from the raw frame to `output`; false if out of device memory.
+bool launchRawFilter(const unsigned char* d_raw, const FilterOutput& output, int width, int height, bool blur,
+                     cudaStream_t stream) {
+    RawParams params = rawParams();
+    DeviceBufferPool& pool = deviceBufferPool();
+    ColorSums* d_sums = nullptr;
+    if (options.autoWhiteBalance) {
+        d_sums = reinterpret_cast<ColorSums*>(pool.acquire(sizeof(ColorSums)));
+        if (!d_sums) return false;
+        cudaMemsetAsync(d_sums, 0, sizeof(ColorSums), stream);
+        colorSumsKernel<<<kSumBlocks, 256, 0, stream>>>(d_raw, width, height, params, d_sums);
+    }
+    TileGrid grid = makeTileGrid(width, height, filterOptions().tileOrder);
+    if (blur) {
+        rawFilterKernel<true><<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_raw, output, width, height,
+                                                                                  params, d_sums, grid);
+    } else {
+        rawFilterKernel<false><<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_raw, output, width, height,
+                                                                                   params, d_sums, grid);
+    }
+    if (d_sums) {
+        cudaStreamSynchronize(stream);
+        pool.release(reinterpret_cast<unsigned char*>(d_sums));
+    }
+    (blur ? fusedFrames : separateFrames)++;
+    return true;
+}
+
+}  // namespace
+
+void setBayerOptions(const BayerOptions& newOptions) { options = newOptions; }
+
+const BayerOptions& bayerOptions() { return options; }
+
+bool parseBayerPattern(const std::string& name, BayerPattern* pattern) {
+    static const char* names[] = {"rggb", "bggr", "grbg", "gbrg"};
+    for (int i = 0; i < 4; i++) {
+        if (name == names[i]) {
+            *pattern = (BayerPattern)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parseDemosaicMethod(const std::string& name, DemosaicMethod* method) {
+    if (name == "bilinear") {
+        *method = DemosaicMethod::Bilinear;
+    } else if (name == "mhc") {
+        *method = DemosaicMethod::MalvarHeCutler;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* demosaicMethodName(DemosaicMethod method) {
+    return method == DemosaicMethod::Bilinear ? "bilinear" : "mhc";
+}
+
+bool isRawFile(const std::string& file) {
+    return options.enabled && std::filesystem::path(file).extension() == ".raw";
+}
+
+std::string rawOutputName(const std::string& file) {
+    return std::filesystem::path(file).stem().string() + ".png";
+}
+
+bool rawFilterFused() {
+    const FilterOptions& filter = filterOptions();
+    return filterSupportsTiles() && filter.waveletLayers == 0;
+}
+
+void demosaicRawFrame(const unsigned char* d_raw, unsigned char* d_bgr, int width, int height, cudaStream_t stream) {
+    launchRawFilter(d_raw, FilterOutput(d_bgr), width, height, false, stream);
+}
+
+cv::Mat filterRawDeviceImage(const unsigned char* d_raw, int width, int height, cudaStream_t stream,
+                             const DeviceImageHook& onDevice, const OverlayPlacement& overlay) {
+    size_t size = (size_t)width * height * 3;
+    DeviceBufferPool& pool = deviceBufferPool();
+    unsigned char* d_output = pool.acquire(size);
+    if (!d_output) return cv::Mat();
+
+    cv::Mat output(height, width, CV_8UC3);
+    FilterOutput target(d_output);
+    target.overlay = overlay;
+    bool launched = launchRawFilter(d_raw, target, width, height, true, stream);
+    if (launched && onDevice) onDevice(d_output, width, height, 3, stream);
+    if (launched) cudaMemcpyAsync(output.data, d_output, size, cudaMemcpyDeviceToHost, stream);
+    cudaError_t status = cudaStreamSynchronize(stream);
+
+    pool.release(d_output);
+    return launched && status == cudaSuccess ? output : cv::Mat();
+}
+
+bool filterRawDeviceImageToTensor(const unsigned char* d_raw, int width, int height, const TensorFormat& format,
+                                  size_t tensorBytes, void* tensor, cudaStream_t stream,
+                                  const OverlayPlacement& overlay) {
+    DeviceBufferPool& pool = deviceBufferPool();
+    unsigned char* d_tensor = pool.acquire(tensorBytes);
+    if (!d_tensor) return false;
+
+    FilterOutput target(static_cast<void*>(d_tensor), format);
+    target.overlay = overlay;
+    bool launched = launchRawFilter(d_raw, target, width, height, true, stream);
+    if (launched) cudaMemcpyAsync(tensor, d_tensor, tensorBytes, cudaMemcpyDeviceToHost, stream);
+    cudaError_t status = cudaStreamSynchronize(stream);
+
+    pool.release(d_tensor);
+    return launched && status == cudaSuccess;
+}
+
+uint64_t rawFramesFused() { return fusedFrames; }
+
+uint64_t rawFramesDemosaiced() { return separateFrames; }
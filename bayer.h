@@ -0,0 +1,77 @@
+#ifndef BAYER_H_
+#define BAYER_H_
+
+#include <cuda_runtime.h>
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <string>
+
+#include "filters.h"
+#include "overlay.h"
+#include "tensor_output.h"
+
+// Colour filter array layout, named by the top-left 2x2 cell read row by row.
+enum class BayerPattern { RGGB, BGGR, GRBG, GBRG };
+
+enum class DemosaicMethod { Bilinear, MalvarHeCutler };
+
+// Process-wide raw input configuration, set once from the command line.
+// Raw frames are headerless .raw files holding one sensor sample per pixel:
+// a byte for 8-bit sensors, a little-endian 16-bit word otherwise (12-bit
+// samples in the low bits).
+struct BayerOptions {
+    bool enabled = false;
+    BayerPattern pattern = BayerPattern::RGGB;
+    DemosaicMethod method = DemosaicMethod::MalvarHeCutler;
+    int width = 0;
+    int height = 0;
+    int bits = 8;                   // 8, 12 or 16
+    double gains[3] = {1, 1, 1};    // white balance multipliers for R, G and B samples
+    bool autoWhiteBalance = false;  // gray world per frame instead of `gains`
+
+    int bytesPerSample() const { return bits > 8 ? 2 : 1; }
+    size_t frameBytes() const { return (size_t)width * height * bytesPerSample(); }
+};
+
+void setBayerOptions(const BayerOptions& options);
+const BayerOptions& bayerOptions();
+
+// "rggb", "bggr", "grbg" or "gbrg"
+bool parseBayerPattern(const std::string& name, BayerPattern* pattern);
+// "bilinear" or "mhc"
+bool parseDemosaicMethod(const std::string& name, DemosaicMethod* method);
+const char* demosaicMethodName(DemosaicMethod method);
+
+// Whether `file` is a raw frame (a .raw file while raw input is enabled).
+bool isRawFile(const std::string& file);
+
+// Raw frames are written as PNG under the same stem.
+std::string rawOutputName(const std::string& file);
+
+// Whether the configured filter chain is the 3x3 blur, which the raw path runs
+// in the same pass as the demosaic.
+bool rawFilterFused();
+
+// Demosaic a raw frame in device memory (frameBytes() long) into an
+// interleaved 8-bit BGR device image, white balanced. For filter chains that
+// cannot be fused.
+void demosaicRawFrame(const unsigned char* d_raw, unsigned char* d_bgr, int width, int height,
+                      cudaStream_t stream = 0);
+
+// Raw frame to blurred BGR in one pass (requires rawFilterFused()): each tile
+// is white balanced and demosaiced into shared memory with the blur's halo and
+// blurred from there, so the demosaiced image never exists in global memory.
+// Identical to demosaicRawFrame followed by runFilter. Empty on failure.
+cv::Mat filterRawDeviceImage(const unsigned char* d_raw, int width, int height, cudaStream_t stream = 0,
+                             const DeviceImageHook& onDevice = nullptr, const OverlayPlacement& overlay = {});
+
+// Same, straight into a host tensor of `tensorBytes` bytes.
+bool filterRawDeviceImageToTensor(const unsigned char* d_raw, int width, int height, const TensorFormat& format,
+                                  size_t tensorBytes, void* tensor, cudaStream_t stream = 0,
+                                  const OverlayPlacement& overlay = {});
+
+// Raw frames filtered in the fused pass vs. demosaiced on their own, since startup.
+uint64_t rawFramesFused();
+uint64_t rawFramesDemosaiced();
+
+#endif  // BAYER_H_
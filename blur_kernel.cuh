@@ -0,0 +1,28 @@
+#ifndef BLUR_KERNEL_CUH_
+#define BLUR_KERNEL_CUH_
+
+#include <cuda_runtime.h>
+
+// The 3x3 blur of one channel of one pixel. `sample(kx, ky)` returns the
+// 8-bit neighbour at offset (kx, ky), each in -1..1, clamped or staged in
+// shared memory by the caller. Every kernel that blurs (plain, remap- and
+// raw-fused, tiny groups) goes through here, so weights, summation order and
+// rounding are the same and their results stay identical.
+template <typename Sample>
+__device__ __forceinline__ unsigned char blur3x3(Sample sample) {
+    const float kernel[3][3] = {
+        {1.0/16, 2.0/16, 1.0/16},
+        {2.0/16, 4.0/16, 2.0/16},
+        {1.0/16, 2.0/16, 1.0/16}
+    };
+
+    float sum = 0.0;
+    for (int ky = -1; ky <= 1; ky++) {
+        for (int kx = -1; kx <= 1; kx++) {
+            sum += sample(kx, ky) * kernel[ky + 1][kx + 1];
+        }
+    }
+    return (unsigned char)sum;
+}
+
+#endif  // BLUR_KERNEL_CUH_
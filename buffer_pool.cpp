@@ -0,0 +1,84 @@
+#include "buffer_pool.h"
+
+#include <cuda_runtime.h>
+
+void DeviceBufferPool::setCapacity(uint64_t capacity) {
+    bool overCapacity;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = capacity;
+        overCapacity = cached_ > capacity_;
+    }
+    if (overCapacity) trim();
+}
+
+uint64_t DeviceBufferPool::capacity() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return capacity_;
+}
+
+unsigned char* DeviceBufferPool::acquire(size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = free_.lower_bound(size);
+        if (it != free_.end() && it->first <= 2 * size) {
+            unsigned char* buffer = it->second;
+            cached_ -= it->first;
+            free_.erase(it);
+            hits_++;
+            return buffer;
+        }
+        misses_++;
+    }
+
+    unsigned char* buffer = nullptr;
+    if (cudaMalloc(&buffer, size) != cudaSuccess) {
+        // Give the cached buffers back to the device and retry once.
+        trim();
+        if (cudaMalloc(&buffer, size) != cudaSuccess) return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    sizes_[buffer] = size;
+    return buffer;
+}
+
+void DeviceBufferPool::release(unsigned char* buffer) {
+    if (!buffer) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t size = sizes_[buffer];
+        if (cached_ + size <= capacity_) {
+            free_.emplace(size, buffer);
+            cached_ += size;
+            return;
+        }
+        sizes_.erase(buffer);
+    }
+    cudaFree(buffer);
+}
+
+void DeviceBufferPool::trim() {
+    std::multimap<size_t, unsigned char*> buffers;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffers.swap(free_);
+        cached_ = 0;
+        for (auto& entry : buffers) sizes_.erase(entry.second);
+    }
+    for (auto& entry : buffers) cudaFree(entry.second);
+}
+
+uint64_t DeviceBufferPool::hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+}
+
+uint64_t DeviceBufferPool::misses() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+}
+
+DeviceBufferPool& deviceBufferPool() {
+    static DeviceBufferPool pool;
+    return pool;
+}
@@ -0,0 +1,42 @@
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+// Cache of device allocations. cudaMalloc/cudaFree synchronize the device and
+// cost far more than a small image's kernel, so released buffers are kept for
+// reuse up to `capacity` bytes; anything beyond that is freed immediately.
+class DeviceBufferPool {
+public:
+    void setCapacity(uint64_t capacity);
+    uint64_t capacity() const;
+
+    // Smallest cached buffer of at least `size` bytes (and at most twice that),
+    // or a fresh allocation. Returns nullptr if the device is out of memory.
+    unsigned char* acquire(size_t size);
+    void release(unsigned char* buffer);
+
+    // Free every cached buffer.
+    void trim();
+
+    uint64_t hits() const;
+    uint64_t misses() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::multimap<size_t, unsigned char*> free_;  // keyed by allocation size
+    std::unordered_map<unsigned char*, size_t> sizes_;
+    uint64_t capacity_ = 0;
+    uint64_t cached_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+// Process-wide pool shared by every filter path.
+DeviceBufferPool& deviceBufferPool();
+
+#endif  // BUFFER_POOL_H_
@@ -0,0 +1,32 @@
+#include "common.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <mutex>
+
+namespace {
+std::mutex logMutex;
+}
+
+// Get current timestamp for logging
+std::string getTimestamp() {
+    time_t now = time(0);
+    char buffer[32];
+    ctime_r(&now, buffer);  // ctime's static buffer is not safe across worker threads
+    std::string timestamp(buffer);
+    return timestamp.substr(0, timestamp.length() - 1); // Remove newline
+}
+
+void logMessage(std::ofstream& logFile, const std::string& level, const std::string& message) {
+    std::string timestamp = getTimestamp();
+    std::lock_guard<std::mutex> lock(logMutex);
+    logFile << "[" << timestamp << "] " << level << ": " << message << std::endl;
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p / 100.0 * values.size());
+    return values[std::min(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
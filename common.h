@@ -0,0 +1,17 @@
+#ifndef COMMON_H_
+#define COMMON_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Get current timestamp for logging
+std::string getTimestamp();
+
+// Append "[timestamp] LEVEL: message" to the log. Safe to call from worker threads.
+void logMessage(std::ofstream& logFile, const std::string& level, const std::string& message);
+
+// p-th percentile (0-100) of `values`, nearest-rank; 0 when empty.
+double percentile(std::vector<double> values, double p);
+
+#endif  // COMMON_H_
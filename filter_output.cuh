@@ -0,0 +1,55 @@
+#ifndef FILTER_OUTPUT_CUH_
+#define FILTER_OUTPUT_CUH_
+
+#include <cuda_runtime.h>
+
+#include "overlay.h"
+#include "tensor_output.h"
+
+// Destination of a filter's final pass: an interleaved 8-bit image, or a
+// tensor whose layout, channel order, normalization and dtype conversion are
+// applied as each value is stored. An optional overlay is composited first.
+struct FilterOutput {
+    unsigned char* image = nullptr;
+    void* tensor = nullptr;
+    TensorFormat format;
+    OverlayPlacement overlay;
+
+    FilterOutput(unsigned char* image) : image(image) {}
+    FilterOutput(void* tensor, const TensorFormat& format) : tensor(tensor), format(format) {}
+};
+
+// "Over" with a premultiplied overlay pixel: overlay + value * (1 - alpha).
+// Gray images take the overlay's luma.
+__device__ __forceinline__ unsigned char compositeOverlay(const OverlayPlacement& overlay, int x, int y, int c,
+                                                          int channels, unsigned char value) {
+    int ox = x - overlay.x;
+    int oy = y - overlay.y;
+    if (ox < 0 || oy < 0 || ox >= overlay.width || oy >= overlay.height) return value;
+    uchar4 p = overlay.pixels[oy * overlay.width + ox];
+    int top = c == 0 ? p.x : c == 1 ? p.y : c == 2 ? p.z : p.w;
+    if (channels == 1) top = (29 * p.x + 150 * p.y + 77 * p.z) >> 8;
+    return (unsigned char)(top + (value * (255 - p.w) + 127) / 255);
+}
+
+// Store the 8-bit result for channel `c` of pixel (x, y).
+__device__ __forceinline__ void storeOutput(const FilterOutput& output, int x, int y, int c, int width, int height,
+                                            int channels, unsigned char value) {
+    if (output.overlay.pixels) value = compositeOverlay(output.overlay, x, y, c, channels, value);
+    size_t pixel = (size_t)y * width + x;
+    if (output.image) {
+        output.image[pixel * channels + c] = value;
+        return;
+    }
+    const TensorFormat& format = output.format;
+    int channel = format.rgb && channels >= 3 && c < 3 ? 2 - c : c;
+    size_t index = format.layout == TensorLayout::NCHW ? channel * ((size_t)width * height) + pixel
+                                                       : pixel * channels + channel;
+    if (format.type == TensorType::Float32) {
+        static_cast<float*>(output.tensor)[index] = value * format.scale[channel] + format.bias[channel];
+    } else {
+        static_cast<unsigned char*>(output.tensor)[index] = value;
+    }
+}
+
+#endif  // FILTER_OUTPUT_CUH_
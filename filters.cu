@@ -0,0 +1,1022 @@
+#include "filters.h"
+
+#include <cuda_fp16.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <utility>
+
+#include "blur_kernel.cuh"
+#include "buffer_pool.h"
+#include "common.h"
+#include "remap.cuh"
+#include "filter_output.cuh"
+
+namespace {
+FilterOptions options;
+
+const int kMaxBlurRadius = 32;
+
+// Channels the fused remap + blur kernel stages in shared memory (BGR, BGRA, gray)
+const int kMaxFusedRemapChannels = 4;
+
+// Half of a normalized Gaussian kernel; taps are symmetric.
+struct GaussianTaps {
+    float weight[kMaxBlurRadius + 1];
+    int radius;
+};
+
+// sRGB code -> linear light, passed by value so no device state is needed.
+struct SrgbTable {
+    float toLinear[256];
+};
+
+int gaussianRadius(double sigma) {
+    return std::min(kMaxBlurRadius, std::max(1, (int)std::ceil(3 * sigma)));
+}
+
+GaussianTaps makeGaussianTaps(double sigma) {
+    GaussianTaps taps;
+    taps.radius = gaussianRadius(sigma);
+    double sum = 0;
+    for (int i = 0; i <= taps.radius; i++) {
+        taps.weight[i] = (float)std::exp(-0.5 * i * i / (sigma * sigma));
+        sum += i == 0 ? taps.weight[i] : 2 * taps.weight[i];
+    }
+    for (int i = 0; i <= taps.radius; i++) taps.weight[i] = (float)(taps.weight[i] / sum);
+    return taps;
+}
+
+// Radii up to this get separable kernels unrolled at compile time; larger
+// ones use the runtime loop.
+const int kMaxUnrolledRadius = 8;
+
+// Sigma presets 0.5, 1.0, ..., 2.5 (radius 2 to 8), counted in half steps.
+// Their taps are built at compile time and folded into the kernels.
+const int kSigmaPresets = 5;
+const int kPresetTapBits = 14;  // preset taps are Q14 and sum to exactly 1 << 14
+
+__host__ __device__ constexpr int presetRadius(int halfSigmas) {
+    return (3 * halfSigmas + 1) / 2;  // ceil(3 * sigma), as gaussianRadius
+}
+
+template <int R>
+struct PresetTaps {
+    int weight[R + 1];
+};
+
+// exp(x) for x <= 0 in constant expressions: a Taylor series on x / 64,
+// squared back up.
+__host__ __device__ constexpr double constexprExp(double x) {
+    double y = x / 64;
+    double term = 1;
+    double sum = 1;
+    for (int i = 1; i < 16; i++) {
+        term *= y / i;
+        sum += term;
+    }
+    for (int i = 0; i < 6; i++) sum *= sum;
+    return sum;
+}
+
+// Q14 half-kernel of the preset, rounded and with the centre tap absorbing the
+// rounding so the full kernel sums to exactly 1 << kPresetTapBits.
+template <int R>
+__host__ __device__ constexpr PresetTaps<R> presetTaps(int halfSigmas) {
+    PresetTaps<R> taps = {};
+    if (halfSigmas <= 0) return taps;
+    double sigma = halfSigmas / 2.0;
+    double weight[R + 1] = {};
+    double sum = 0;
+    for (int i = 0; i <= R; i++) {
+        weight[i] = constexprExp(-0.5 * i * i / (sigma * sigma));
+        sum += i == 0 ? weight[i] : 2 * weight[i];
+    }
+    int total = 0;
+    for (int i = 1; i <= R; i++) {
+        taps.weight[i] = (int)(weight[i] / sum * (1 << kPresetTapBits) + 0.5);
+        total += 2 * taps.weight[i];
+    }
+    taps.weight[0] = (1 << kPresetTapBits) - total;
+    return taps;
+}
+
+static_assert(presetTaps<presetRadius(2)>(2).weight[0] == 6536, "sigma 1.0 centre tap");
+
+// Per-layer wavelet settings, passed by value like the Gaussian taps.
+struct WaveletParams {
+    int layers;
+    float gain[kMaxWaveletLayers];
+    float threshold[kMaxWaveletLayers];
+};
+
+// Dilated B3-spline kernels of layers 0..n-1 reach 2 * (1 + 2 + ... + 2^(n-1)).
+__host__ __device__ inline int waveletHalo(int layers) {
+    return 2 * ((1 << layers) - 1);
+}
+
+const int kWaveletSpan = kTileSize + 2 * 2 * ((1 << kMaxWaveletLayers) - 1);
+
+const SrgbTable& srgbTable() {
+    static SrgbTable table = [] {
+        SrgbTable t;
+        for (int i = 0; i < 256; i++) {
+            double v = i / 255.0;
+            t.toLinear[i] = (float)(v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4));
+        }
+        return t;
+    }();
+    return table;
+}
+}  // namespace
+
+// CUDA kernel for 2D Gaussian blur (simplified 3x3 kernel)
+__global__ void gaussianBlurKernel(const unsigned char* input, FilterOutput output, int width, int height, int channels,
+                                   TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * blockDim.x + threadIdx.x;
+    int y = tileY * blockDim.y + threadIdx.y;
+
+    if (x >= width || y >= height) return;
+
+    for (int c = 0; c < channels; c++) {
+        unsigned char value = blur3x3([&](int kx, int ky) {
+            int px = min(max(x + kx, 0), width - 1);
+            int py = min(max(y + ky, 0), height - 1);
+            return input[((size_t)py * width + px) * channels + c];
+        });
+        storeOutput(output, x, y, c, width, height, channels, value);
+    }
+}
+
+// Rotate about the image centre by the angle whose cosine/sine are given,
+// sampling the source bilinearly; pixels that map outside the source are black.
+__global__ void rotateKernel(const unsigned char* input, unsigned char* output, int width, int height, int channels,
+                             float cosA, float sinA, TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * blockDim.x + threadIdx.x;
+    int y = tileY * blockDim.y + threadIdx.y;
+
+    if (x >= width || y >= height) return;
+
+    // Inverse mapping: output pixel -> source position
+    float cx = 0.5f * (width - 1);
+    float cy = 0.5f * (height - 1);
+    float sx = cosA * (x - cx) + sinA * (y - cy) + cx;
+    float sy = -sinA * (x - cx) + cosA * (y - cy) + cy;
+    int x0 = (int)floorf(sx);
+    int y0 = (int)floorf(sy);
+    float fx = sx - x0;
+    float fy = sy - y0;
+
+    for (int c = 0; c < channels; c++) {
+        float sum = 0.0f;
+        for (int ky = 0; ky <= 1; ky++) {
+            for (int kx = 0; kx <= 1; kx++) {
+                int px = x0 + kx;
+                int py = y0 + ky;
+                if (px < 0 || py < 0 || px >= width || py >= height) continue;
+                float weight = (kx ? fx : 1.0f - fx) * (ky ? fy : 1.0f - fy);
+                sum += input[((size_t)py * width + px) * channels + c] * weight;
+            }
+        }
+        output[((size_t)y * width + x) * channels + c] = (unsigned char)(sum + 0.5f);
+    }
+}
+
+// Remap fused with the 3x3 blur: each block remaps its tile plus a one-pixel
+// border into shared memory, then blurs from there, so the warped image never
+// goes through global memory. Border pixels are remapped at image-clamped
+// positions, which makes the result identical to remapKernel followed by
+// gaussianBlurKernel.
+__global__ void remapBlurKernel(const unsigned char* input, FilterOutput output, int width, int height,
+                                int channels, const int2* map, TileGrid grid) {
+    const int span = kTileSize + 2;
+    __shared__ unsigned char warped[span * span * kMaxFusedRemapChannels];
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * kTileSize + threadIdx.x;
+    int y = tileY * kTileSize + threadIdx.y;
+
+    for (int i = threadIdx.y * kTileSize + threadIdx.x; i < span * span; i += kTileSize * kTileSize) {
+        int px = min(max(tileX * kTileSize - 1 + i % span, 0), width - 1);
+        int py = min(max(tileY * kTileSize - 1 + i / span, 0), height - 1);
+        remapPixel(input, width, height, channels, map[(size_t)py * width + px], warped + i * channels);
+    }
+    __syncthreads();
+    if (x >= width || y >= height) return;
+
+    for (int c = 0; c < channels; c++) {
+        unsigned char value = blur3x3([&](int kx, int ky) {
+            return warped[((threadIdx.y + 1 + ky) * span + threadIdx.x + 1 + kx) * channels + c];
+        });
+        storeOutput(output, x, y, c, width, height, channels, value);
+    }
+}
+
+// Intermediates are computed and accumulated in float registers; only the
+// stored plane changes type, so half precision halves its memory and traffic.
+__device__ __forceinline__ float loadIntermediate(const float* p) { return *p; }
+__device__ __forceinline__ float loadIntermediate(const __half* p) { return __half2float(*p); }
+__device__ __forceinline__ void storeIntermediate(float* p, float v) { *p = v; }
+__device__ __forceinline__ void storeIntermediate(__half* p, float v) { *p = __float2half_rn(v); }
+
+// Horizontal pass of the separable Gaussian: 8-bit input (optionally
+// linearized) -> normalized [0, 1] intermediate plane.
+template <typename T>
+__global__ void blurRowsKernel(const unsigned char* input, T* output, int width, int height, int channels,
+                               GaussianTaps taps, bool linearLight, SrgbTable srgb, TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * blockDim.x + threadIdx.x;
+    int y = tileY * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+
+    const unsigned char* row = input + (size_t)y * width * channels;
+    for (int c = 0; c < channels; c++) {
+        float sum = 0.0f;
+        for (int k = -taps.radius; k <= taps.radius; k++) {
+            int px = min(max(x + k, 0), width - 1);
+            unsigned char v = row[px * channels + c];
+            sum += taps.weight[abs(k)] * (linearLight ? srgb.toLinear[v] : v * (1.0f / 255.0f));
+        }
+        storeIntermediate(output + ((size_t)y * width + x) * channels + c, sum);
+    }
+}
+
+// Vertical pass: intermediate plane -> rounded 8-bit output (back to sRGB
+// codes in linear-light mode).
+template <typename T>
+__global__ void blurColumnsKernel(const T* input, FilterOutput output, int width, int height, int channels,
+                                  GaussianTaps taps, bool linearLight, TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * blockDim.x + threadIdx.x;
+    int y = tileY * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+
+    for (int c = 0; c < channels; c++) {
+        float sum = 0.0f;
+        for (int k = -taps.radius; k <= taps.radius; k++) {
+            int py = min(max(y + k, 0), height - 1);
+            sum += taps.weight[abs(k)] * loadIntermediate(input + ((size_t)py * width + x) * channels + c);
+        }
+        sum = __saturatef(sum);
+        if (linearLight) sum = sum <= 0.0031308f ? 12.92f * sum : 1.055f * __powf(sum, 1.0f / 2.4f) - 0.055f;
+        storeOutput(output, x, y, c, width, height, channels, (unsigned char)(sum * 255.0f + 0.5f));
+    }
+}
+
+// Rows and columns passes for a radius R known at compile time. The tap loop
+// is unrolled and folded around the centre, so each pair of symmetric samples
+// costs one multiply. With a preset (HalfSigmas > 0) the taps are
+// compile-time constants and the rows pass over sRGB codes is pure integer
+// arithmetic; otherwise the taps come from `taps` as in the runtime loop.
+template <int R, int HalfSigmas, typename T>
+__global__ void blurRowsUnrolledKernel(const unsigned char* input, T* output, int width, int height, int channels,
+                                       GaussianTaps taps, bool linearLight, SrgbTable srgb, TileGrid grid) {
+    constexpr PresetTaps<R> preset = presetTaps<R>(HalfSigmas);
+    constexpr float kPresetScale = 1.0f / (1 << kPresetTapBits);
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * blockDim.x + threadIdx.x;
+    int y = tileY * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+
+    const unsigned char* row = input + (size_t)y * width * channels;
+    for (int c = 0; c < channels; c++) {
+        float sum;
+        if (HalfSigmas > 0 && !linearLight) {
+            int acc = preset.weight[0] * row[x * channels + c];
+#pragma unroll
+            for (int k = 1; k <= R; k++) {
+                int left = max(x - k, 0);
+                int right = min(x + k, width - 1);
+                acc += preset.weight[k] * (row[left * channels + c] + row[right * channels + c]);
+            }
+            sum = acc * (kPresetScale / 255.0f);
+        } else {
+            auto sample = [&](int px) {
+                unsigned char v = row[px * channels + c];
+                return linearLight ? srgb.toLinear[v] : v * (1.0f / 255.0f);
+            };
+            sum = (HalfSigmas > 0 ? preset.weight[0] * kPresetScale : taps.weight[0]) * sample(x);
+#pragma unroll
+            for (int k = 1; k <= R; k++) {
+                float weight = HalfSigmas > 0 ? preset.weight[k] * kPresetScale : taps.weight[k];
+                sum += weight * (sample(max(x - k, 0)) + sample(min(x + k, width - 1)));
+            }
+        }
+        storeIntermediate(output + ((size_t)y * width + x) * channels + c, sum);
+    }
+}
+
+template <int R, int HalfSigmas, typename T>
+__global__ void blurColumnsUnrolledKernel(const T* input, FilterOutput output, int width, int height, int channels,
+                                          GaussianTaps taps, bool linearLight, TileGrid grid) {
+    constexpr PresetTaps<R> preset = presetTaps<R>(HalfSigmas);
+    constexpr float kPresetScale = 1.0f / (1 << kPresetTapBits);
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * blockDim.x + threadIdx.x;
+    int y = tileY * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+
+    for (int c = 0; c < channels; c++) {
+        auto sample = [&](int py) { return loadIntermediate(input + ((size_t)py * width + x) * channels + c); };
+        float sum = (HalfSigmas > 0 ? preset.weight[0] * kPresetScale : taps.weight[0]) * sample(y);
+#pragma unroll
+        for (int k = 1; k <= R; k++) {
+            float weight = HalfSigmas > 0 ? preset.weight[k] * kPresetScale : taps.weight[k];
+            sum += weight * (sample(max(y - k, 0)) + sample(min(y + k, height - 1)));
+        }
+        sum = __saturatef(sum);
+        if (linearLight) sum = sum <= 0.0031308f ? 12.92f * sum : 1.055f * __powf(sum, 1.0f / 2.4f) - 0.055f;
+        storeOutput(output, x, y, c, width, height, channels, (unsigned char)(sum * 255.0f + 0.5f));
+    }
+}
+
+// Both passes of the separable blur, from the input into `intermediate` and on into `output`
+template <typename T>
+using SeparablePasses = void (*)(const unsigned char* d_input, T* intermediate, const FilterOutput& output,
+                                 int width, int height, int channels, const GaussianTaps& taps, bool linearLight,
+                                 const TileGrid& grid, cudaStream_t stream);
+
+template <typename T>
+void runtimeSeparablePasses(const unsigned char* d_input, T* intermediate, const FilterOutput& output, int width,
+                            int height, int channels, const GaussianTaps& taps, bool linearLight,
+                            const TileGrid& grid, cudaStream_t stream) {
+    blurRowsKernel<T><<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_input, intermediate, width, height, channels,
+                                                                        taps, linearLight, srgbTable(), grid);
+    blurColumnsKernel<T><<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(intermediate, output, width, height,
+                                                                           channels, taps, linearLight, grid);
+}
+
+template <int R, int HalfSigmas, typename T>
+void unrolledSeparablePasses(const unsigned char* d_input, T* intermediate, const FilterOutput& output, int width,
+                             int height, int channels, const GaussianTaps& taps, bool linearLight,
+                             const TileGrid& grid, cudaStream_t stream) {
+    blurRowsUnrolledKernel<R, HalfSigmas, T><<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(
+        d_input, intermediate, width, height, channels, taps, linearLight, srgbTable(), grid);
+    blurColumnsUnrolledKernel<R, HalfSigmas, T><<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(
+        intermediate, output, width, height, channels, taps, linearLight, grid);
+}
+
+// Jump tables: unrolled passes by radius (runtime taps) and by preset
+// (compile-time taps). Index 0 is unused in both.
+template <typename T, int... R>
+constexpr std::array<SeparablePasses<T>, sizeof...(R) + 1> unrolledByRadius(std::integer_sequence<int, R...>) {
+    return {{nullptr, &unrolledSeparablePasses<R + 1, 0, T>...}};
+}
+
+template <typename T, int... P>
+constexpr std::array<SeparablePasses<T>, sizeof...(P) + 1> unrolledByPreset(std::integer_sequence<int, P...>) {
+    return {{nullptr, &unrolledSeparablePasses<presetRadius(P + 1), P + 1, T>...}};
+}
+
+// The passes for `sigma`: its preset if it has one, else the unrolled kernel
+// for its radius, else the runtime loop.
+template <typename T>
+SeparablePasses<T> selectSeparablePasses(double sigma) {
+    static constexpr auto byRadius = unrolledByRadius<T>(std::make_integer_sequence<int, kMaxUnrolledRadius>());
+    static constexpr auto byPreset = unrolledByPreset<T>(std::make_integer_sequence<int, kSigmaPresets>());
+    int halfSigmas = (int)std::lround(2 * sigma);
+    if (halfSigmas >= 1 && halfSigmas <= kSigmaPresets && std::fabs(2 * sigma - halfSigmas) < 1e-9) {
+        return byPreset[halfSigmas];
+    }
+    int radius = gaussianRadius(sigma);
+    return radius <= kMaxUnrolledRadius ? byRadius[radius] : &runtimeSeparablePasses<T>;
+}
+
+// False if the intermediate plane could not be allocated; `output` is then untouched.
+template <typename T>
+bool launchSeparableBlurAs(const unsigned char* d_input, const FilterOutput& output, int width, int height,
+                           int channels, double sigma, bool linearLight, TileOrder order, cudaStream_t stream) {
+    unsigned char* d_intermediate = deviceBufferPool().acquire((size_t)width * height * channels * sizeof(T));
+    if (!d_intermediate) return false;
+    T* intermediate = reinterpret_cast<T*>(d_intermediate);
+    TileGrid grid = makeTileGrid(width, height, order);
+    GaussianTaps taps = makeGaussianTaps(sigma);
+    selectSeparablePasses<T>(sigma)(d_input, intermediate, output, width, height, channels, taps, linearLight, grid,
+                                    stream);
+    cudaStreamSynchronize(stream);
+    deviceBufferPool().release(d_intermediate);
+    return true;
+}
+
+bool launchSeparableBlur(const unsigned char* d_input, const FilterOutput& output, int width, int height,
+                         int channels, double sigma, bool linearLight, bool fp16Intermediate, TileOrder order,
+                         cudaStream_t stream) {
+    if (fp16Intermediate) {
+        return launchSeparableBlurAs<__half>(d_input, output, width, height, channels, sigma, linearLight, order,
+                                             stream);
+    }
+    return launchSeparableBlurAs<float>(d_input, output, width, height, channels, sigma, linearLight, order, stream);
+}
+
+__device__ __forceinline__ float b3Weight(int k) {
+    return k == 0 ? 6.0f / 16 : (k == 1 || k == -1) ? 4.0f / 16 : 1.0f / 16;
+}
+
+__device__ __forceinline__ float softThreshold(float v, float t) {
+    return v > t ? v - t : v < -t ? v + t : 0.0f;
+}
+
+// À-trous (stationary) wavelet detail processing in one sweep. Each block
+// loads its tile plus a halo covering every dilated kernel into shared memory
+// and smooths it in place layer by layer with the separable B3-spline
+// [1 4 6 4 1] / 16 dilated by 2^layer. The region that later layers still need
+// shrinks each time, so later layers compute less. Every thread keeps only its
+// own pixel's running sum of gain * softThreshold(detail), so no layer is
+// stored at full size; the output is the coarsest smooth plus that sum.
+// Sample coordinates are clamped to the image at every layer, which matches a
+// full-image multi-pass decomposition with replicated edges exactly.
+__global__ void waveletKernel(const unsigned char* input, FilterOutput output, int width, int height, int channels,
+                              WaveletParams params, TileGrid grid) {
+    __shared__ float planes[2][kWaveletSpan * kWaveletSpan];
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int halo = waveletHalo(params.layers);
+    int span = kTileSize + 2 * halo;
+    int originX = tileX * kTileSize - halo;
+    int originY = tileY * kTileSize - halo;
+    int thread = threadIdx.y * kTileSize + threadIdx.x;
+    int x = tileX * kTileSize + threadIdx.x;
+    int y = tileY * kTileSize + threadIdx.y;
+    bool inside = x < width && y < height;
+    int center = (threadIdx.y + halo) * span + threadIdx.x + halo;
+    float* smooth = planes[0];
+    float* rows = planes[1];
+
+    for (int c = 0; c < channels; c++) {
+        for (int i = thread; i < span * span; i += kTileSize * kTileSize) {
+            int px = min(max(originX + i % span, 0), width - 1);
+            int py = min(max(originY + i / span, 0), height - 1);
+            smooth[i] = input[((size_t)py * width + px) * channels + c];
+        }
+        __syncthreads();
+
+        float detailSum = 0.0f;
+        int rowMargin = halo;  // smooth is valid this far around the tile
+        for (int layer = 0; layer < params.layers; layer++) {
+            int step = 1 << layer;
+            int margin = rowMargin - 2 * step;  // what the remaining layers need
+            int rowsHigh = kTileSize + 2 * rowMargin;
+            int wide = kTileSize + 2 * margin;
+
+            // Horizontal taps over every row the vertical taps will read
+            for (int i = thread; i < rowsHigh * wide; i += kTileSize * kTileSize) {
+                int sx = halo - margin + i % wide;
+                int sy = halo - rowMargin + i / wide;
+                int gx = originX + sx;
+                int gy = originY + sy;
+                if (gx < 0 || gy < 0 || gx >= width || gy >= height) continue;
+                float sum = 0.0f;
+                for (int k = -2; k <= 2; k++) {
+                    int px = min(max(gx + k * step, 0), width - 1);
+                    sum += b3Weight(k) * smooth[sy * span + px - originX];
+                }
+                rows[sy * span + sx] = sum;
+            }
+            float previous = smooth[center];
+            __syncthreads();
+
+            // Vertical taps, overwriting smooth with the next layer
+            for (int i = thread; i < wide * wide; i += kTileSize * kTileSize) {
+                int sx = halo - margin + i % wide;
+                int sy = halo - margin + i / wide;
+                int gx = originX + sx;
+                int gy = originY + sy;
+                if (gx < 0 || gy < 0 || gx >= width || gy >= height) continue;
+                float sum = 0.0f;
+                for (int k = -2; k <= 2; k++) {
+                    int py = min(max(gy + k * step, 0), height - 1);
+                    sum += b3Weight(k) * rows[(py - originY) * span + sx];
+                }
+                smooth[sy * span + sx] = sum;
+            }
+            __syncthreads();
+            detailSum += params.gain[layer] * softThreshold(previous - smooth[center], params.threshold[layer]);
+            rowMargin = margin;
+        }
+
+        if (inside) {
+            float v = smooth[center] + detailSum;
+            storeOutput(output, x, y, c, width, height, channels,
+                        (unsigned char)fminf(fmaxf(v + 0.5f, 0.0f), 255.0f));
+        }
+        __syncthreads();  // before the next channel overwrites the planes
+    }
+}
+
+void launchWavelet(const unsigned char* d_input, const FilterOutput& output, int width, int height, int channels,
+                   const FilterOptions& filterOptions, const TileGrid& grid, cudaStream_t stream) {
+    WaveletParams params;
+    params.layers = std::min(filterOptions.waveletLayers, kMaxWaveletLayers);
+    for (int i = 0; i < kMaxWaveletLayers; i++) {
+        params.gain[i] = (float)filterOptions.waveletGain[i];
+        params.threshold[i] = (float)filterOptions.waveletThreshold[i];
+    }
+    waveletKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_input, output, width, height, channels, params,
+                                                                      grid);
+}
+
+// Pixelation rectangles, clipped to the image, passed by value.
+struct PixelateRegions {
+    int4 rect[kMaxPixelateRegions];  // x, y, width, height
+    int count;
+};
+
+const int kPixelateThreads = 128;
+const int kMaxPixelateChannels = 4;
+
+// Pixel-for-pixel copy through storeOutput, for what lies outside the
+// pixelated regions when the output is a tensor or carries an overlay.
+__global__ void copyKernel(const unsigned char* input, FilterOutput output, int width, int height, int channels,
+                           TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * blockDim.x + threadIdx.x;
+    int y = tileY * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+    for (int c = 0; c < channels; c++) {
+        storeOutput(output, x, y, c, width, height, channels, input[((size_t)y * width + x) * channels + c]);
+    }
+}
+
+// One block per mosaic cell of region blockIdx.z. Cells sit on a grid aligned
+// to the image origin and are clipped to the region. The cell is read once:
+// each thread sums a strided share of its pixels, then warp shuffles and one
+// shared-memory step reduce the per-channel sums. The rounded mean goes back
+// over the cell with 4-byte stores, each warp filling whole rows; tensors and
+// overlays go through storeOutput instead.
+__global__ void pixelateKernel(const unsigned char* input, FilterOutput output, int width, int height, int channels,
+                               int block, PixelateRegions regions) {
+    int4 region = regions.rect[blockIdx.z];
+    int cellX = (region.x / block + (int)blockIdx.x) * block;
+    int cellY = (region.y / block + (int)blockIdx.y) * block;
+    int x0 = max(cellX, region.x);
+    int y0 = max(cellY, region.y);
+    int x1 = min(cellX + block, region.x + region.z);
+    int y1 = min(cellY + block, region.y + region.w);
+    if (x0 >= x1 || y0 >= y1) return;
+    int cellWidth = x1 - x0;
+    int pixels = cellWidth * (y1 - y0);
+
+    unsigned sum[kMaxPixelateChannels] = {0, 0, 0, 0};
+    for (int i = threadIdx.x; i < pixels; i += blockDim.x) {
+        const unsigned char* p = input + ((size_t)(y0 + i / cellWidth) * width + x0 + i % cellWidth) * channels;
+        for (int c = 0; c < channels; c++) sum[c] += p[c];
+    }
+    __shared__ unsigned partial[kPixelateThreads / 32][kMaxPixelateChannels];
+    __shared__ unsigned char mean[kMaxPixelateChannels];
+    __shared__ unsigned pattern[kMaxPixelateChannels];
+    int lane = threadIdx.x % 32;
+    int warp = threadIdx.x / 32;
+    for (int c = 0; c < channels; c++) {
+        for (int offset = 16; offset > 0; offset /= 2) sum[c] += __shfl_down_sync(0xffffffff, sum[c], offset);
+        if (lane == 0) partial[warp][c] = sum[c];
+    }
+    __syncthreads();
+    if ((int)threadIdx.x < channels) {
+        unsigned total = 0;
+        for (int w = 0; w < kPixelateThreads / 32; w++) total += partial[w][threadIdx.x];
+        mean[threadIdx.x] = (unsigned char)((total + pixels / 2) / pixels);
+    }
+    __syncthreads();
+
+    if (!output.image || output.overlay.pixels) {
+        for (int i = threadIdx.x; i < pixels; i += blockDim.x) {
+            for (int c = 0; c < channels; c++) {
+                storeOutput(output, x0 + i % cellWidth, y0 + i / cellWidth, c, width, height, channels, mean[c]);
+            }
+        }
+        return;
+    }
+
+    // The word starting at byte offset o of a row repeats the mean pixel from channel o % channels
+    if ((int)threadIdx.x < channels) {
+        unsigned word = 0;
+        for (int k = 0; k < 4; k++) word |= (unsigned)mean[(threadIdx.x + k) % channels] << (8 * k);
+        pattern[threadIdx.x] = word;
+    }
+    __syncthreads();
+    int rowBytes = cellWidth * channels;
+    for (int y = y0 + warp; y < y1; y += kPixelateThreads / 32) {
+        unsigned char* row = output.image + ((size_t)y * width + x0) * channels;
+        int head = min((int)((4 - reinterpret_cast<size_t>(row) % 4) % 4), rowBytes);
+        int words = (rowBytes - head) / 4;
+        int tail = head + words * 4;
+        if (lane < head) row[lane] = mean[lane % channels];
+        for (int j = lane; j < words; j += 32) {
+            reinterpret_cast<unsigned*>(row + head)[j] = pattern[(head + 4 * j) % channels];
+        }
+        if (tail + lane < rowBytes) row[tail + lane] = mean[(tail + lane) % channels];
+    }
+}
+
+// `rect` in the view's pixels. The result also covers the neighbouring pixels
+// a resampling filter may have blended the rectangle into, so nothing of it
+// survives outside the mosaic.
+PixelRect viewRect(const SourceView& view, const PixelRect& rect) {
+    auto span = [](double scale, double offset, int start, int length, int* viewStart, int* viewLength) {
+        double a = scale * start + offset;
+        double b = scale * (start + length - 1) + offset;
+        double reach = std::fabs(scale) / 2 + 1;
+        int first = (int)std::floor(std::min(a, b) - reach);
+        *viewStart = first;
+        *viewLength = (int)std::ceil(std::max(a, b) + reach) - first + 1;
+    };
+    PixelRect mapped;
+    span(view.scaleX, view.offsetX, rect.x, rect.width, &mapped.x, &mapped.width);
+    span(view.scaleY, view.offsetY, rect.y, rect.height, &mapped.y, &mapped.height);
+    return mapped;
+}
+
+// Mosaic over the configured regions, or the whole image when there are none.
+// Pixels outside the regions are copied unchanged. Regions and the cell size
+// are in source pixels and are mapped through `view`.
+void launchPixelate(const unsigned char* d_input, const FilterOutput& output, int width, int height, int channels,
+                    const FilterOptions& filterOptions, const SourceView& view, cudaStream_t stream) {
+    int block = filterOptions.pixelateBlock;
+    if (!view.identity()) {
+        double scale = std::min(std::fabs(view.scaleX), std::fabs(view.scaleY));
+        block = std::max(2, (int)std::lround(block * scale));
+    }
+    PixelateRegions regions;
+    regions.count = 0;
+    int cellsX = 0;
+    int cellsY = 0;
+    auto addRegion = [&](int x, int y, int w, int h) {
+        int x1 = std::min(x + w, width);
+        int y1 = std::min(y + h, height);
+        x = std::max(x, 0);
+        y = std::max(y, 0);
+        if (x >= x1 || y >= y1 || regions.count == kMaxPixelateRegions) return;
+        regions.rect[regions.count++] = make_int4(x, y, x1 - x, y1 - y);
+        cellsX = std::max(cellsX, (x1 - 1) / block - x / block + 1);
+        cellsY = std::max(cellsY, (y1 - 1) / block - y / block + 1);
+    };
+    if (filterOptions.pixelateRegions.empty()) {
+        addRegion(0, 0, width, height);
+    } else {
+        for (PixelRect rect : filterOptions.pixelateRegions) {
+            if (!view.identity()) rect = viewRect(view, rect);
+            addRegion(rect.x, rect.y, rect.width, rect.height);
+        }
+    }
+
+    bool wholeImage = regions.count == 1 && regions.rect[0].z == width && regions.rect[0].w == height;
+    if (!wholeImage) {
+        if (output.image && !output.overlay.pixels) {
+            cudaMemcpyAsync(output.image, d_input, (size_t)width * height * channels, cudaMemcpyDeviceToDevice,
+                            stream);
+        } else {
+            TileGrid grid = makeTileGrid(width, height, filterOptions.tileOrder);
+            copyKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_input, output, width, height, channels,
+                                                                           grid);
+        }
+    }
+    if (regions.count == 0) return;
+    pixelateKernel<<<dim3(cellsX, cellsY, regions.count), kPixelateThreads, 0, stream>>>(
+        d_input, output, width, height, channels, block, regions);
+}
+
+void setFilterOptions(const FilterOptions& filterOptions) {
+    options = filterOptions;
+}
+
+const FilterOptions& filterOptions() {
+    return options;
+}
+
+bool parseTileOrder(const std::string& name, TileOrder* order) {
+    if (name == "row") *order = TileOrder::RowMajor;
+    else if (name == "morton") *order = TileOrder::Morton;
+    else if (name == "hilbert") *order = TileOrder::Hilbert;
+    else return false;
+    return true;
+}
+
+const char* tileOrderName(TileOrder order) {
+    switch (order) {
+        case TileOrder::Morton: return "morton";
+        case TileOrder::Hilbert: return "hilbert";
+        default: return "row";
+    }
+}
+
+int filterRadius() {
+    if (options.waveletLayers > 0) return waveletHalo(std::min(options.waveletLayers, kMaxWaveletLayers));
+    return options.sigma > 0 ? gaussianRadius(options.sigma) : 1;
+}
+
+void launchBlur(const unsigned char* d_input, const FilterOutput& output, int width, int height, int channels,
+                const TileGrid& grid, cudaStream_t stream) {
+    gaussianBlurKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_input, output, width, height, channels, grid);
+}
+
+void launchRotate(const unsigned char* d_input, unsigned char* d_output, int width, int height, int channels,
+                  double degrees, TileOrder order, cudaStream_t stream) {
+    TileGrid grid = makeTileGrid(width, height, order);
+    float radians = (float)(degrees * M_PI / 180.0);
+    rotateKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_input, d_output, width, height, channels,
+                                                                     cosf(radians), sinf(radians), grid);
+}
+
+// The pass selected by the options: pixelation, wavelet detail processing,
+// the separable Gaussian or the 3x3 kernel. False if it could not run.
+bool launchConfiguredBlur(const unsigned char* d_input, const FilterOutput& output, int width, int height,
+                          int channels, const SourceView& view, double sigma, cudaStream_t stream) {
+    if (sigma > 0) {
+        return launchSeparableBlur(d_input, output, width, height, channels, sigma, options.linearLight,
+                                   options.fp16Intermediate, options.tileOrder, stream);
+    } else if (options.pixelateBlock > 0) {
+        launchPixelate(d_input, output, width, height, channels, options, view, stream);
+    } else if (options.waveletLayers > 0) {
+        launchWavelet(d_input, output, width, height, channels, options,
+                      makeTileGrid(width, height, options.tileOrder), stream);
+    } else if (options.sigma > 0) {
+        return launchSeparableBlur(d_input, output, width, height, channels, options.sigma, options.linearLight,
+                                   options.fp16Intermediate, options.tileOrder, stream);
+    } else {
+        launchBlur(d_input, output, width, height, channels, makeTileGrid(width, height, options.tileOrder), stream);
+    }
+    return true;
+}
+
+// Warp through the cached map for the configured model, then blur. The 3x3
+// blur is fused with the remap; the other passes read a remapped scratch copy.
+bool runRemapFilter(const unsigned char* d_input, const FilterOutput& output, int width, int height, int channels,
+                    const SourceView& view, double sigma, cudaStream_t stream) {
+    // The model is in full-resolution pixels; previews and variants get their own map
+    RemapModel model = view.identity() ? options.remap
+                                       : viewRemapModel(options.remap, view.sourceWidth, view.sourceHeight,
+                                                        view.scaleX, view.offsetX, view.scaleY, view.offsetY);
+    std::shared_ptr<const RemapMap> map = remapMap(model, width, height, stream);
+    if (!map) return false;
+    if (sigma <= 0 && options.sigma <= 0 && options.waveletLayers == 0 && options.pixelateBlock == 0 &&
+        channels <= kMaxFusedRemapChannels) {
+        TileGrid grid = makeTileGrid(width, height, options.tileOrder);
+        remapBlurKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_input, output, width, height, channels,
+                                                                            map->d_map, grid);
+        cudaStreamSynchronize(stream);  // the map may be evicted once we drop it
+        return true;
+    }
+
+    size_t size = (size_t)width * height * channels;
+    unsigned char* d_warped = deviceBufferPool().acquire(size);
+    if (!d_warped) return false;
+    launchRemap(d_input, d_warped, width, height, channels, *map, options.tileOrder, stream);
+    bool ok = launchConfiguredBlur(d_warped, output, width, height, channels, view, sigma, stream);
+    cudaStreamSynchronize(stream);
+    deviceBufferPool().release(d_warped);
+    return ok;
+}
+
+// The whole chain; only the last pass writes `output`. False if a scratch
+// buffer could not be allocated, leaving `output` unwritten.
+bool runFilterTo(const unsigned char* d_input, const FilterOutput& output, int width, int height, int channels,
+                 cudaStream_t stream, const SourceView& view = {}, double sigma = 0) {
+    if (options.remap.kind != RemapKind::None) {
+        return runRemapFilter(d_input, output, width, height, channels, view, sigma, stream);
+    }
+    if (options.rotateDegrees == 0) {
+        return launchConfiguredBlur(d_input, output, width, height, channels, view, sigma, stream);
+    }
+
+    // Rotate into a scratch buffer, then blur the rotated image
+    size_t size = (size_t)width * height * channels;
+    unsigned char* d_rotated = deviceBufferPool().acquire(size);
+    if (!d_rotated) return false;
+    launchRotate(d_input, d_rotated, width, height, channels, options.rotateDegrees, options.tileOrder, stream);
+    bool ok = launchConfiguredBlur(d_rotated, output, width, height, channels, view, sigma, stream);
+    cudaStreamSynchronize(stream);
+    deviceBufferPool().release(d_rotated);
+    return ok;
+}
+
+bool runFilter(const unsigned char* d_input, unsigned char* d_output, int width, int height, int channels,
+               cudaStream_t stream, const SourceView& view, const OverlayPlacement& overlay, double sigma) {
+    FilterOutput target(d_output);
+    target.overlay = overlay;
+    return runFilterTo(d_input, target, width, height, channels, stream, view, sigma);
+}
+
+bool filterSupportsTiles() {
+    return options.remap.kind == RemapKind::None && options.rotateDegrees == 0 && options.sigma <= 0 &&
+           options.pixelateBlock == 0;
+}
+
+void runFilterTiles(const unsigned char* d_input, unsigned char* d_output, int width, int height, int channels,
+                    const int* d_tiles, int tileCount, const OverlayPlacement& overlay, cudaStream_t stream) {
+    if (tileCount == 0) return;
+    FilterOutput target(d_output);
+    target.overlay = overlay;
+    TileGrid grid = makeTileGrid(width, height, TileOrder::RowMajor);
+    grid.tiles = d_tiles;
+    grid.tileCount = tileCount;
+    if (options.waveletLayers > 0) {
+        launchWavelet(d_input, target, width, height, channels, options, grid, stream);
+    } else {
+        launchBlur(d_input, target, width, height, channels, grid, stream);
+    }
+}
+
+bool runFilterToTensor(const unsigned char* d_input, void* d_tensor, const TensorFormat& format, int width,
+                       int height, int channels, cudaStream_t stream) {
+    return runFilterTo(d_input, FilterOutput(d_tensor, format), width, height, channels, stream);
+}
+
+// Each pool worker lazily creates one CUDA stream per priority, so images
+// handled by different workers overlap on the GPU and preview work can
+// preempt full-resolution kernels at block granularity.
+cudaStream_t workerStream(bool highPriority) {
+    thread_local cudaStream_t streams[2] = {nullptr, nullptr};
+    cudaStream_t& stream = streams[highPriority ? 1 : 0];
+    if (!stream) {
+        int leastPriority = 0;
+        int greatestPriority = 0;
+        cudaDeviceGetStreamPriorityRange(&leastPriority, &greatestPriority);
+        cudaStreamCreateWithPriority(&stream, cudaStreamNonBlocking, highPriority ? greatestPriority : leastPriority);
+    }
+    return stream;
+}
+
+cv::Mat filterImage(const cv::Mat& image, cudaStream_t stream, const DeviceImageHook& onDevice,
+                    const SourceView& view, const OverlayPlacement& overlay) {
+    cv::Mat input = image.isContinuous() ? image : image.clone();
+    size_t size = input.total() * input.elemSize();
+
+    // Allocate device memory
+    DeviceBufferPool& pool = deviceBufferPool();
+    unsigned char* d_input = pool.acquire(size);
+    if (!d_input) return cv::Mat();
+    cudaMemcpyAsync(d_input, input.data, size, cudaMemcpyHostToDevice, stream);
+    cv::Mat output =
+        filterDeviceImage(d_input, input.cols, input.rows, input.channels(), stream, onDevice, overlay, view);
+    if (output.empty()) cudaStreamSynchronize(stream);  // the upload may still be reading d_input
+
+    // Clean up
+    pool.release(d_input);
+    return output;
+}
+
+cv::Mat filterDeviceImage(const unsigned char* d_input, int width, int height, int channels, cudaStream_t stream,
+                          const DeviceImageHook& onDevice, const OverlayPlacement& overlay, const SourceView& view) {
+    size_t size = (size_t)width * height * channels;
+    DeviceBufferPool& pool = deviceBufferPool();
+    unsigned char* d_output = pool.acquire(size);
+    if (!d_output) return cv::Mat();
+
+    cv::Mat output(height, width, CV_8UC(channels));
+    FilterOutput target(d_output);
+    target.overlay = overlay;
+    if (!runFilterTo(d_input, target, width, height, channels, stream, view)) {
+        cudaStreamSynchronize(stream);
+        pool.release(d_output);
+        return cv::Mat();
+    }
+    if (onDevice) onDevice(d_output, width, height, channels, stream);
+    cudaMemcpyAsync(output.data, d_output, size, cudaMemcpyDeviceToHost, stream);
+    cudaError_t status = cudaStreamSynchronize(stream);
+
+    pool.release(d_output);
+    return status == cudaSuccess ? output : cv::Mat();
+}
+
+bool filterDeviceImageToTensor(const unsigned char* d_input, int width, int height, int channels,
+                               const TensorFormat& format, size_t tensorBytes, void* tensor, cudaStream_t stream,
+                               const OverlayPlacement& overlay) {
+    DeviceBufferPool& pool = deviceBufferPool();
+    unsigned char* d_tensor = pool.acquire(tensorBytes);
+    if (!d_tensor) return false;
+
+    FilterOutput target(static_cast<void*>(d_tensor), format);
+    target.overlay = overlay;
+    if (!runFilterTo(d_input, target, width, height, channels, stream)) {
+        cudaStreamSynchronize(stream);
+        pool.release(d_tensor);
+        return false;
+    }
+    cudaMemcpyAsync(tensor, d_tensor, tensorBytes, cudaMemcpyDeviceToHost, stream);
+    cudaError_t status = cudaStreamSynchronize(stream);
+
+    pool.release(d_tensor);
+    return status == cudaSuccess;
+}
+
+void benchmarkTileOrders(const cv::Mat& image, const std::string& name, std::ofstream& logFile) {
+    const int kIterations = 20;
+    cv::Mat input = image.isContinuous() ? image : image.clone();
+    size_t size = input.total() * input.elemSize();
+    unsigned char *d_input, *d_output;
+    if (cudaMalloc(&d_input, size) != cudaSuccess) return;
+    if (cudaMalloc(&d_output, size) != cudaSuccess) {
+        cudaFree(d_input);
+        return;
+    }
+    cudaMemcpy(d_input, input.data, size, cudaMemcpyHostToDevice);
+
+    cudaEvent_t start, stop;
+    cudaEventCreate(&start);
+    cudaEventCreate(&stop);
+    double degrees = options.rotateDegrees != 0 ? options.rotateDegrees : 30.0;
+    double megapixels = input.total() / 1e6;
+    for (int op = 0; op < 2; op++) {
+        for (TileOrder order : {TileOrder::RowMajor, TileOrder::Morton, TileOrder::Hilbert}) {
+            auto launch = [&] {
+                TileGrid grid = makeTileGrid(input.cols, input.rows, order);
+                if (op == 0) launchBlur(d_input, d_output, input.cols, input.rows, input.channels(), grid, 0);
+                else launchRotate(d_input, d_output, input.cols, input.rows, input.channels(), degrees, order, 0);
+            };
+            launch();  // warm-up
+            cudaEventRecord(start);
+            for (int i = 0; i < kIterations; i++) launch();
+            cudaEventRecord(stop);
+            cudaEventSynchronize(stop);
+            float ms = 0;
+            cudaEventElapsedTime(&ms, start, stop);
+            ms /= kIterations;
+            std::string line = std::string("Tile order ") + (op == 0 ? "blur" : "rotate") + " " + tileOrderName(order) +
+                               " " + name + ": " + std::to_string(ms) + " ms, " + std::to_string(megapixels / ms * 1e3) +
+                               " MPix/s";
+            std::cout << line << std::endl;
+            logMessage(logFile, "INFO", line);
+        }
+    }
+
+    cudaEventDestroy(start);
+    cudaEventDestroy(stop);
+    cudaFree(d_input);
+    cudaFree(d_output);
+}
+
+void reportIntermediatePrecision(const cv::Mat& image, const std::string& name, std::ofstream& logFile) {
+    cv::Mat input = image.isContinuous() ? image : image.clone();
+    size_t size = input.total() * input.elemSize();
+    double sigma = options.sigma > 0 ? options.sigma : 2.0;
+    const int kIterations = 20;
+
+    unsigned char *d_input = nullptr, *d_output = nullptr;
+    if (cudaMalloc(&d_input, size) != cudaSuccess || cudaMalloc(&d_output, size) != cudaSuccess) {
+        logMessage(logFile, "ERROR", "Out of device memory for precision report of " + name);
+        cudaFree(d_input);
+        return;
+    }
+    cudaMemcpy(d_input, input.ptr(), size, cudaMemcpyHostToDevice);
+    cudaEvent_t start, stop;
+    cudaEventCreate(&start);
+    cudaEventCreate(&stop);
+
+    cv::Mat results[2];
+    float ms[2];
+    for (int half = 0; half < 2; half++) {
+        auto launch = [&] {
+            launchSeparableBlur(d_input, d_output, input.cols, input.rows, input.channels(), sigma,
+                                options.linearLight, half == 1, options.tileOrder, 0);
+        };
+        launch();  // warm-up
+        cudaEventRecord(start);
+        for (int i = 0; i < kIterations; i++) launch();
+        cudaEventRecord(stop);
+        cudaEventSynchronize(stop);
+        cudaEventElapsedTime(&ms[half], start, stop);
+        ms[half] /= kIterations;
+        results[half] = cv::Mat(input.rows, input.cols, input.type());
+        cudaMemcpy(results[half].ptr(), d_output, size, cudaMemcpyDeviceToHost);
+    }
+
+    int maxDiff = 0;
+    size_t differing = 0;
+    double sumDiff = 0, sumSquared = 0;
+    for (size_t i = 0; i < size; i++) {
+        int diff = std::abs((int)results[0].data[i] - (int)results[1].data[i]);
+        maxDiff = std::max(maxDiff, diff);
+        differing += diff != 0;
+        sumDiff += diff;
+        sumSquared += (double)diff * diff;
+    }
+    double mse = sumSquared / size;
+    std::string psnr = mse == 0 ? "inf" : std::to_string(10 * std::log10(255.0 * 255.0 / mse));
+    double mib = input.total() * input.channels() / (1024.0 * 1024.0);
+
+    std::string line = "FP16 intermediate " + name + " (sigma " + std::to_string(sigma) +
+                       (options.linearLight ? ", linear light" : "") + "): max diff " + std::to_string(maxDiff) +
+                       ", mean diff " + std::to_string(sumDiff / size) + ", PSNR " + psnr + " dB, " +
+                       std::to_string(100.0 * differing / size) + "% of samples differ; float32 " +
+                       std::to_string(ms[0]) + " ms (" + std::to_string(mib * sizeof(float)) + " MiB), fp16 " +
+                       std::to_string(ms[1]) + " ms (" + std::to_string(mib * sizeof(__half)) + " MiB)";
+    std::cout << line << std::endl;
+    logMessage(logFile, "INFO", line);
+
+    cudaEventDestroy(start);
+    cudaEventDestroy(stop);
+    cudaFree(d_input);
+    cudaFree(d_output);
+}
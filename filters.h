@@ -0,0 +1,139 @@
+#ifndef FILTERS_H_
+#define FILTERS_H_
+
+#include <cuda_runtime.h>
+#include <opencv2/opencv.hpp>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "overlay.h"
+#include "remap.h"
+#include "tensor_output.h"
+#include "tile_order.cuh"
+
+// Deepest à-trous decomposition; its dilated kernels reach 2 * (2^4 - 1) = 30
+// pixels, which is what one tile plus halo fits in shared memory.
+const int kMaxWaveletLayers = 4;
+
+// Most rectangles one image can be pixelated in.
+const int kMaxPixelateRegions = 16;
+
+// Largest pixelate cell side; a cell's 32-bit channel sums hold up to
+// 4096 x 4096 x 255.
+const int kMaxPixelateBlock = 4096;
+
+struct PixelRect {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// Process-wide filter configuration, set once from the command line before any
+// work starts (band workers inherit it across fork).
+struct FilterOptions {
+    TileOrder tileOrder = TileOrder::RowMajor;
+    double rotateDegrees = 0;  // rotate about the image centre before blurring
+    RemapModel remap;          // cached fixed-point warp before blurring (not with rotateDegrees)
+    double sigma = 0;          // > 0: separable Gaussian of this sigma instead of the 3x3 kernel
+    bool linearLight = false;  // separable blur on linear light instead of sRGB codes
+    bool fp16Intermediate = false;  // keep the separable blur's intermediate plane in half precision
+    // > 0: à-trous wavelet detail processing with this many layers instead of the blur
+    int waveletLayers = 0;
+    // Per layer, finest first: detail gain (1 keeps it) and soft threshold in 8-bit code units
+    double waveletGain[kMaxWaveletLayers] = {1, 1, 1, 1};
+    double waveletThreshold[kMaxWaveletLayers] = {0, 0, 0, 0};
+    // > 1: pixelate in block x block cells instead of blurring, within
+    // `pixelateRegions` only (the rest is copied) or over the whole image
+    int pixelateBlock = 0;
+    std::vector<PixelRect> pixelateRegions;
+};
+
+// Where the full-resolution source's pixel centre (x, y) lies in the image
+// being filtered: (scaleX * x + offsetX, scaleY * y + offsetY); a negative
+// scale mirrors. Previews and augment variants are views of their source, so
+// options given in source pixels (--pixelate_region, --remap) are mapped
+// through it. The source's size places its centre, which --remap rotate:
+// turns about; 0 means the view is the source itself.
+struct SourceView {
+    double scaleX = 1;
+    double scaleY = 1;
+    double offsetX = 0;
+    double offsetY = 0;
+    int sourceWidth = 0;
+    int sourceHeight = 0;
+
+    bool identity() const { return scaleX == 1 && scaleY == 1 && offsetX == 0 && offsetY == 0; }
+};
+
+void setFilterOptions(const FilterOptions& options);
+const FilterOptions& filterOptions();
+
+// "row", "morton" or "hilbert"
+bool parseTileOrder(const std::string& name, TileOrder* order);
+const char* tileOrderName(TileOrder order);
+
+// Number of neighbouring rows/columns the filter reads on each side of a pixel.
+// Callers that split an image (bands, tiles) must supply this many halo rows.
+int filterRadius();
+
+// Apply the filter chain (optional rotation or remap, then the blur or wavelet pass) to an interleaved
+// 8-bit image that is already on the device. A positive `sigma` replaces the
+// configured blur with a separable Gaussian of that sigma (with the configured
+// precision, colour space and tile order); rotation and remap still run.
+// False if a scratch buffer could not be allocated, in which case `d_output`
+// is not written.
+bool runFilter(const unsigned char* d_input, unsigned char* d_output, int width, int height, int channels,
+               cudaStream_t stream = 0, const SourceView& view = {}, const OverlayPlacement& overlay = {},
+               double sigma = 0);
+
+// Same chain, but the last pass stores each value as a tensor element
+// (layout, channel order, normalization and dtype from `format`), so no 8-bit
+// image is written and converted afterwards.
+bool runFilterToTensor(const unsigned char* d_input, void* d_tensor, const TensorFormat& format, int width,
+                       int height, int channels, cudaStream_t stream = 0);
+
+// Whether the configured chain is a single pass that reads only its radius
+// (the 3x3 blur or the wavelet pass), so it can be rerun on some tiles alone.
+bool filterSupportsTiles();
+
+// Rerun that pass on only the `tileCount` row-major tile indices in `d_tiles`
+// (device memory), leaving every other tile of `d_output` untouched.
+void runFilterTiles(const unsigned char* d_input, unsigned char* d_output, int width, int height, int channels,
+                    const int* d_tiles, int tileCount, const OverlayPlacement& overlay = {}, cudaStream_t stream = 0);
+
+// The calling thread's CUDA stream for the given priority, created on first use.
+cudaStream_t workerStream(bool highPriority);
+
+// Runs on the filtered image while it is still on the device, before download.
+using DeviceImageHook = std::function<void(const unsigned char* d_image, int width, int height, int channels,
+                                           cudaStream_t stream)>;
+
+// Upload a host image, filter it on `stream` and return the result. Empty on failure.
+cv::Mat filterImage(const cv::Mat& image, cudaStream_t stream = 0, const DeviceImageHook& onDevice = nullptr,
+                    const SourceView& view = {}, const OverlayPlacement& overlay = {});
+
+// Filter an image that is already on the device (e.g. decoded there) and
+// return the result. `d_input` stays owned by the caller. Empty on failure.
+// A placed overlay is composited as the last pass stores each pixel.
+cv::Mat filterDeviceImage(const unsigned char* d_input, int width, int height, int channels, cudaStream_t stream = 0,
+                          const DeviceImageHook& onDevice = nullptr, const OverlayPlacement& overlay = {},
+                          const SourceView& view = {});
+
+// Filter a device image straight into a host tensor of `tensorBytes` bytes.
+bool filterDeviceImageToTensor(const unsigned char* d_input, int width, int height, int channels,
+                               const TensorFormat& format, size_t tensorBytes, void* tensor, cudaStream_t stream = 0,
+                               const OverlayPlacement& overlay = {});
+
+// Run the separable blur on `image` with float32 and with half-precision
+// intermediates and log the difference (max/mean error, PSNR), timings and
+// intermediate size, to show whether --fp16_intermediate is safe for it.
+void reportIntermediatePrecision(const cv::Mat& image, const std::string& name, std::ofstream& logFile);
+
+// Time the blur and rotation kernels under every tile order on `image` and log
+// the throughput. Pair with Nsight Compute for L2/TLB hit rates (see README).
+void benchmarkTileOrders(const cv::Mat& image, const std::string& name, std::ofstream& logFile);
+
+#endif  // FILTERS_H_
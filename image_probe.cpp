@@ -0,0 +1,415 @@
+#include "image_probe.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+
+#include "common.h"
+
+namespace {
+
+constexpr size_t kWindow = 4096;
+
+// Serves small reads from the first 4 KB of the file, falling back to one
+// extra 4 KB window that moves to wherever the parser jumps. A file already in
+// memory is read in place.
+class HeaderReader {
+public:
+    explicit HeaderReader(int fd) : fd_(fd) {
+        ssize_t n = pread(fd_, head_, kWindow, 0);
+        headLen_ = n > 0 ? (size_t)n : 0;
+        struct stat st;
+        size_ = fstat(fd_, &st) == 0 ? (uint64_t)st.st_size : 0;
+    }
+
+    HeaderReader(const unsigned char* data, size_t size)
+        : fd_(-1), data_(data), dataLen_(size), headLen_(std::min(size, kWindow)), size_(size) {}
+
+    // Whether the `len` bytes at `offset` lie within the file, for ranges
+    // read later by the caller rather than through at().
+    bool contains(uint64_t offset, uint64_t len) const { return offset <= size_ && len <= size_ - offset; }
+
+    // `len` bytes at `offset`, or nullptr past the end of the file.
+    const unsigned char* at(uint64_t offset, size_t len) {
+        if (len > kWindow) return nullptr;
+        if (data_) return offset + len <= dataLen_ ? data_ + offset : nullptr;
+        if (offset + len <= headLen_) return head_ + offset;
+        if (windowLen_ > 0 && offset >= windowOffset_ && offset + len <= windowOffset_ + windowLen_) {
+            return window_ + (offset - windowOffset_);
+        }
+        ssize_t n = pread(fd_, window_, kWindow, (off_t)offset);
+        windowOffset_ = offset;
+        windowLen_ = n > 0 ? (size_t)n : 0;
+        return len <= windowLen_ ? window_ : nullptr;
+    }
+
+    size_t headLength() const { return headLen_; }
+
+private:
+    int fd_;
+    const unsigned char* data_ = nullptr;
+    size_t dataLen_ = 0;
+    unsigned char head_[kWindow];
+    size_t headLen_ = 0;
+    unsigned char window_[kWindow];
+    uint64_t windowOffset_ = 0;
+    size_t windowLen_ = 0;
+    uint64_t size_ = 0;
+};
+
+uint16_t be16(const unsigned char* p) { return (uint16_t)(p[0] << 8 | p[1]); }
+uint32_t be32(const unsigned char* p) { return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3]; }
+uint16_t le16(const unsigned char* p) { return (uint16_t)(p[0] | p[1] << 8); }
+uint32_t le32(const unsigned char* p) { return (uint32_t)le16(p) | (uint32_t)le16(p + 2) << 16; }
+uint64_t le64(const unsigned char* p) { return (uint64_t)le32(p) | (uint64_t)le32(p + 4) << 32; }
+uint64_t be64(const unsigned char* p) { return (uint64_t)be32(p) << 32 | be32(p + 4); }
+
+// The JPEG whose SOI is at `start`: the file itself, or one embedded in it.
+bool probeJpeg(HeaderReader& reader, ImageInfo* info, uint64_t start = 0) {
+    uint64_t pos = start + 2;
+    for (;;) {
+        const unsigned char* p = reader.at(pos, 2);
+        if (!p || p[0] != 0xFF) return false;
+        unsigned char marker = p[1];
+        if (marker == 0xFF) {  // fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {  // no length field
+            pos += 2;
+            continue;
+        }
+        if (marker == 0xD9 || marker == 0xDA) return false;  // EOI or scan before any frame header
+        const unsigned char* segment = reader.at(pos + 2, 2);
+        if (!segment) return false;
+        uint16_t length = be16(segment);
+        bool frameHeader = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        if (frameHeader) {
+            const unsigned char* sof = reader.at(pos + 4, 6);
+            if (!sof || length < 8) return false;
+            info->bitDepth = sof[0];
+            info->height = be16(sof + 1);
+            info->width = be16(sof + 3);
+            info->channels = sof[5];
+            return true;
+        }
+        pos += 2 + length;
+    }
+}
+
+// A TIFF structure inside a metadata segment (EXIF, MPF), with its offsets
+// relative to `base`.
+struct TiffBlock {
+    HeaderReader& reader;
+    uint64_t base;
+    bool little;
+
+    uint16_t u16(uint64_t offset) {
+        const unsigned char* p = reader.at(base + offset, 2);
+        return p ? (little ? le16(p) : be16(p)) : 0;
+    }
+    uint32_t u32(uint64_t offset) {
+        const unsigned char* p = reader.at(base + offset, 4);
+        return p ? (little ? le32(p) : be32(p)) : 0;
+    }
+    // The first value of `tag` in the IFD at `ifd` (a short or long stored in
+    // the entry), or 0 if absent.
+    uint32_t tagValue(uint32_t ifd, uint16_t tag) {
+        uint16_t count = u16(ifd);
+        for (uint16_t i = 0; i < count; i++) {
+            uint64_t entry = ifd + 2 + i * 12ull;
+            if (u16(entry) != tag) continue;
+            return u16(entry + 2) == 3 ? u16(entry + 8) : u32(entry + 8);
+        }
+        return 0;
+    }
+    // Offset of the IFD after the one at `ifd`, 0 if none.
+    uint32_t nextIfd(uint32_t ifd) { return u32(ifd + 2 + u16(ifd) * 12ull); }
+};
+
+// Byte order of the TIFF header at `base`; false if there is none.
+bool tiffByteOrder(HeaderReader& reader, uint64_t base, bool* little) {
+    const unsigned char* header = reader.at(base, 4);
+    if (!header) return false;
+    *little = std::memcmp(header, "II*\0", 4) == 0;
+    return *little || std::memcmp(header, "MM\0*", 4) == 0;
+}
+
+// Add the embedded JPEG at `offset` if it has a readable frame header. Its
+// length comes from untrusted metadata and must lie within the file, since
+// the preview is later read whole.
+void addEmbeddedJpeg(HeaderReader& reader, uint64_t offset, uint64_t length, std::vector<EmbeddedJpeg>* found) {
+    EmbeddedJpeg jpeg;
+    jpeg.offset = offset;
+    jpeg.length = length;
+    jpeg.info.format = ImageFormat::Jpeg;
+    const unsigned char* soi = reader.at(offset, 2);
+    if (length > 0 && reader.contains(offset, length) && soi && soi[0] == 0xFF && soi[1] == 0xD8 && probeJpeg(reader, &jpeg.info, offset) &&
+        jpeg.info.width > 0 && jpeg.info.height > 0) {
+        found->push_back(jpeg);
+    }
+}
+
+// EXIF (APP1): the orientation from IFD0 and the thumbnail from IFD1.
+void scanExif(HeaderReader& reader, uint64_t base, JpegPreviews* previews) {
+    bool little;
+    if (!tiffByteOrder(reader, base, &little)) return;
+    TiffBlock tiff{reader, base, little};
+    uint32_t ifd0 = tiff.u32(4);
+    uint32_t orientation = tiff.tagValue(ifd0, 0x0112);
+    if (orientation) previews->orientation = (int)orientation;
+    uint32_t ifd1 = tiff.nextIfd(ifd0);
+    if (ifd1 == 0) return;
+    uint32_t offset = tiff.tagValue(ifd1, 0x0201);  // JPEGInterchangeFormat
+    uint32_t length = tiff.tagValue(ifd1, 0x0202);
+    if (offset) addEmbeddedJpeg(reader, base + offset, length, &previews->embedded);
+}
+
+// MPF (APP2): every image of the Multi-Picture index except the primary one,
+// which is where cameras store their larger previews.
+void scanMpf(HeaderReader& reader, uint64_t base, JpegPreviews* previews) {
+    bool little;
+    if (!tiffByteOrder(reader, base, &little)) return;
+    TiffBlock tiff{reader, base, little};
+    uint32_t ifd = tiff.u32(4);
+    uint16_t count = tiff.u16(ifd);
+    for (uint16_t i = 0; i < count; i++) {
+        uint64_t entry = ifd + 2 + i * 12ull;
+        if (tiff.u16(entry) != 0xB002) continue;  // MPEntry: 16 bytes per image
+        uint32_t images = tiff.u32(entry + 4) / 16;
+        uint32_t table = tiff.u32(entry + 8);
+        for (uint32_t k = 0; k < images && k < 16; k++) {
+            uint32_t size = tiff.u32(table + k * 16 + 4);
+            uint32_t offset = tiff.u32(table + k * 16 + 8);
+            if (offset) addEmbeddedJpeg(reader, base + offset, size, &previews->embedded);
+        }
+    }
+}
+
+bool probePng(HeaderReader& reader, ImageInfo* info) {
+    const unsigned char* ihdr = reader.at(8, 18);
+    if (!ihdr || std::memcmp(ihdr + 4, "IHDR", 4) != 0) return false;
+    info->width = (int)be32(ihdr + 8);
+    info->height = (int)be32(ihdr + 12);
+    info->bitDepth = ihdr[16];
+    switch (ihdr[17]) {
+        case 0: info->channels = 1; break;  // gray
+        case 2: info->channels = 3; break;  // RGB
+        case 3: info->channels = 3; break;  // palette, expanded on decode
+        case 4: info->channels = 2; break;  // gray + alpha
+        case 6: info->channels = 4; break;  // RGBA
+        default: return false;
+    }
+    return true;
+}
+
+bool probeTiff(HeaderReader& reader, ImageInfo* info) {
+    const unsigned char* header = reader.at(0, 16);
+    if (!header) return false;
+    bool little = header[0] == 'I';
+    auto u16 = [&](const unsigned char* p) { return little ? le16(p) : be16(p); };
+    auto u32 = [&](const unsigned char* p) { return little ? le32(p) : be32(p); };
+    auto u64 = [&](const unsigned char* p) { return little ? le64(p) : be64(p); };
+    bool big = u16(header + 2) == 43;
+
+    uint64_t ifd = big ? u64(header + 8) : u32(header + 4);
+    const unsigned char* countField = reader.at(ifd, big ? 8 : 2);
+    if (!countField) return false;
+    uint64_t count = big ? u64(countField) : u16(countField);
+    size_t entrySize = big ? 20 : 12;
+    uint64_t first = ifd + (big ? 8 : 2);
+
+    info->channels = 1;
+    info->bitDepth = 1;
+    for (uint64_t i = 0; i < count; i++) {
+        const unsigned char* entry = reader.at(first + i * entrySize, entrySize);
+        if (!entry) return false;
+        uint16_t tag = u16(entry);
+        uint16_t type = u16(entry + 2);
+        const unsigned char* value = entry + (big ? 12 : 8);
+        // Only the first value matters; with several values it may live out of line
+        uint64_t valueCount = big ? u64(entry + 4) : u32(entry + 4);
+        size_t typeSize = type == 3 ? 2 : type == 16 ? 8 : 4;
+        if (valueCount * typeSize > (big ? 8u : 4u)) {
+            value = reader.at(big ? u64(value) : u32(value), typeSize);
+            if (!value) return false;
+        }
+        uint64_t v = type == 3 ? u16(value) : type == 16 ? u64(value) : u32(value);
+        if (tag == 256) info->width = (int)v;
+        if (tag == 257) info->height = (int)v;
+        if (tag == 258) info->bitDepth = (int)v;
+        if (tag == 277) info->channels = (int)v;
+    }
+    // The next IFD's offset follows the entries
+    const unsigned char* next = reader.at(first + count * entrySize, big ? 8 : 4);
+    info->multiPage = next && (big ? u64(next) : u32(next)) != 0;
+    return info->width > 0 && info->height > 0;
+}
+
+bool probeWebP(HeaderReader& reader, ImageInfo* info) {
+    const unsigned char* chunk = reader.at(12, 18);
+    if (!chunk) return false;
+    const unsigned char* data = chunk + 8;
+    info->bitDepth = 8;
+    if (std::memcmp(chunk, "VP8 ", 4) == 0) {
+        if (data[3] != 0x9D || data[4] != 0x01 || data[5] != 0x2A) return false;
+        info->width = le16(data + 6) & 0x3FFF;
+        info->height = le16(data + 8) & 0x3FFF;
+        info->channels = 3;
+    } else if (std::memcmp(chunk, "VP8L", 4) == 0) {
+        if (data[0] != 0x2F) return false;
+        uint32_t bits = le32(data + 1);
+        info->width = (int)(bits & 0x3FFF) + 1;
+        info->height = (int)((bits >> 14) & 0x3FFF) + 1;
+        info->channels = (bits >> 28) & 1 ? 4 : 3;
+    } else if (std::memcmp(chunk, "VP8X", 4) == 0) {
+        info->width = (int)(data[4] | data[5] << 8 | data[6] << 16) + 1;
+        info->height = (int)(data[7] | data[8] << 8 | data[9] << 16) + 1;
+        info->channels = data[0] & 0x10 ? 4 : 3;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool probePpm(HeaderReader& reader, ImageInfo* info) {
+    const unsigned char* p = reader.at(0, reader.headLength());
+    size_t len = reader.headLength();
+    size_t pos = 2;
+    int fields[3];
+    for (int& field : fields) {
+        // Whitespace and '#' comments may separate the fields
+        while (pos < len && (std::isspace(p[pos]) || p[pos] == '#')) {
+            if (p[pos] == '#') {
+                while (pos < len && p[pos] != '\n') pos++;
+            } else {
+                pos++;
+            }
+        }
+        if (pos >= len || !std::isdigit(p[pos])) return false;
+        field = 0;
+        while (pos < len && std::isdigit(p[pos])) field = field * 10 + (p[pos++] - '0');
+    }
+    info->width = fields[0];
+    info->height = fields[1];
+    info->bitDepth = fields[2] > 255 ? 16 : 8;
+    info->channels = p[1] == '6' ? 3 : 1;
+    return true;
+}
+
+bool probeHeader(HeaderReader& reader, ImageInfo* info) {
+    const unsigned char* magic = reader.at(0, 12);
+
+    bool ok = false;
+    if (magic && magic[0] == 0xFF && magic[1] == 0xD8) {
+        info->format = ImageFormat::Jpeg;
+        ok = probeJpeg(reader, info);
+    } else if (magic && std::memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        info->format = ImageFormat::Png;
+        ok = probePng(reader, info);
+    } else if (magic && (std::memcmp(magic, "II", 2) == 0 || std::memcmp(magic, "MM", 2) == 0)) {
+        info->format = ImageFormat::Tiff;
+        ok = probeTiff(reader, info);
+    } else if (magic && std::memcmp(magic, "RIFF", 4) == 0 && std::memcmp(magic + 8, "WEBP", 4) == 0) {
+        info->format = ImageFormat::WebP;
+        ok = probeWebP(reader, info);
+    } else if (reader.headLength() > 2 && reader.at(0, 2)[0] == 'P' &&
+               (reader.at(0, 2)[1] == '5' || reader.at(0, 2)[1] == '6')) {
+        info->format = ImageFormat::Ppm;
+        ok = probePpm(reader, info);
+    }
+    return ok && info->width > 0 && info->height > 0;
+}
+
+}  // namespace
+
+const char* imageFormatName(ImageFormat format) {
+    switch (format) {
+        case ImageFormat::Jpeg: return "jpeg";
+        case ImageFormat::Png: return "png";
+        case ImageFormat::Tiff: return "tiff";
+        case ImageFormat::WebP: return "webp";
+        case ImageFormat::Ppm: return "ppm";
+        default: return "unknown";
+    }
+}
+
+bool probeImage(const std::string& file, ImageInfo* info) {
+    *info = ImageInfo();
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    HeaderReader reader(fd);
+    bool ok = probeHeader(reader, info);
+    close(fd);
+    return ok;
+}
+
+bool probeImage(const std::vector<uint8_t>& data, ImageInfo* info) {
+    *info = ImageInfo();
+    HeaderReader reader(data.data(), data.size());
+    return probeHeader(reader, info);
+}
+
+bool probeJpegPreviews(const std::string& file, JpegPreviews* previews) {
+    *previews = JpegPreviews();
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    HeaderReader reader(fd);
+    const unsigned char* magic = reader.at(0, 2);
+    bool ok = magic && magic[0] == 0xFF && magic[1] == 0xD8;
+    // Metadata segments precede the frame header, so the walk ends there
+    uint64_t pos = 2;
+    while (ok) {
+        const unsigned char* p = reader.at(pos, 4);
+        if (!p || p[0] != 0xFF || p[1] == 0xDA || p[1] == 0xD9) {
+            ok = false;
+            break;
+        }
+        if (p[1] == 0xFF) {  // fill byte
+            pos++;
+            continue;
+        }
+        uint16_t length = be16(p + 2);
+        bool frameHeader = p[1] >= 0xC0 && p[1] <= 0xCF && p[1] != 0xC4 && p[1] != 0xC8 && p[1] != 0xCC;
+        if (frameHeader) break;
+        const unsigned char* id = reader.at(pos + 4, 6);
+        if (p[1] == 0xE1 && id && std::memcmp(id, "Exif\0\0", 6) == 0) scanExif(reader, pos + 10, previews);
+        if (p[1] == 0xE2 && id && std::memcmp(id, "MPF\0", 4) == 0) scanMpf(reader, pos + 8, previews);
+        pos += 2 + length;
+    }
+    previews->main.format = ImageFormat::Jpeg;
+    ok = ok && probeJpeg(reader, &previews->main) && previews->main.width > 0 && previews->main.height > 0;
+    close(fd);
+    return ok;
+}
+
+void benchmarkProbe(const std::vector<std::string>& files, std::ofstream& logFile) {
+    if (files.empty()) return;
+    // Untimed pass to warm the page cache
+    size_t failed = 0;
+    for (const auto& file : files) {
+        ImageInfo info;
+        if (!probeImage(file, &info)) failed++;
+    }
+
+    size_t probed = 0;
+    double elapsed = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (elapsed < 1000) {
+        for (const auto& file : files) {
+            ImageInfo info;
+            probeImage(file, &info);
+        }
+        probed += files.size();
+        elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    logMessage(logFile, "INFO", "Probed " + std::to_string(probed) + " headers of " + std::to_string(files.size()) +
+                                    " files (" + std::to_string(failed) + " unrecognised) in " +
+                                    std::to_string(elapsed) + " ms: " + std::to_string(probed * 1000.0 / elapsed) +
+                                    " files/s");
+}
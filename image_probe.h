@@ -0,0 +1,56 @@
+#ifndef IMAGE_PROBE_H_
+#define IMAGE_PROBE_H_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+enum class ImageFormat { Unknown, Jpeg, Png, Tiff, WebP, Ppm };
+
+const char* imageFormatName(ImageFormat format);
+
+// What the file header says, before any pixel is decoded.
+struct ImageInfo {
+    ImageFormat format = ImageFormat::Unknown;
+    int width = 0;
+    int height = 0;
+    int channels = 0;  // as stored; imread(IMREAD_COLOR) still yields 3
+    int bitDepth = 0;  // bits per sample
+    bool multiPage = false;  // a TIFF with more than one page
+};
+
+// Parse the dimensions of a JPEG (SOF), PNG (IHDR), TIFF/BigTIFF (first IFD),
+// WebP (VP8/VP8L/VP8X) or binary PPM from its header. Reads the first 4 KB with
+// one pread; only JPEGs with large metadata segments or TIFFs whose IFD lies
+// further in need another read. Returns false if the format is not recognised
+// or the header is truncated.
+bool probeImage(const std::string& file, ImageInfo* info);
+
+// Same, for a file already in memory (an object store download).
+bool probeImage(const std::vector<uint8_t>& data, ImageInfo* info);
+
+// A JPEG stored inside another JPEG's metadata.
+struct EmbeddedJpeg {
+    uint64_t offset = 0;  // of its SOI in the file
+    uint64_t length = 0;
+    ImageInfo info;       // from its own frame header
+};
+
+// A JPEG's frame header plus the previews cameras embed in it: the EXIF
+// thumbnail (IFD1 of APP1, usually 160x120) and the images of an MPF index
+// (APP2, often 1-2 MP).
+struct JpegPreviews {
+    ImageInfo main;
+    int orientation = 1;  // EXIF orientation of the main image; 1 is upright
+    std::vector<EmbeddedJpeg> embedded;
+};
+
+// Walk the metadata segments of a JPEG file and list the previews in it.
+// Only headers are read. False if the file is not a readable JPEG.
+bool probeJpegPreviews(const std::string& file, JpegPreviews* previews);
+
+// Probe every file repeatedly for about a second and log files/s.
+void benchmarkProbe(const std::vector<std::string>& files, std::ofstream& logFile);
+
+#endif  // IMAGE_PROBE_H_
@@ -4,120 +4,1220 @@
 #include <vector>
 #include <string>
 #include <filesystem>
+#include <memory>
 #include <fstream>
 #include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <csignal>
+#include <thread>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <tuple>
+
+#include "augment.h"
+#include "band_mode.h"
+#include "bayer.h"
+#include "buffer_pool.h"
+#include "common.h"
+#include "filters.h"
+#include "image_probe.h"
+#include "incremental.h"
+#include "jpeg_decoder.h"
+#include "jpeg_encoder.h"
+#include "labeling.h"
+#include "memory_budget.h"
+#include "object_store.h"
+#include "overlay.h"
+#include "page_stack.h"
+#include "preview.h"
+#include "profiler.h"
+#include "remap.h"
+#include "resource_limits.h"
+#include "source_cache.h"
+#include "stage_pipeline.h"
+#include "tensor_output.h"
+#include "thread_pool.h"
+#include "tiny_batch.h"
 
 using namespace cv;
 namespace fs = std::filesystem;
 
-// CUDA kernel for 2D Gaussian blur (simplified 3x3 kernel)
-__global__ void gaussianBlurKernel(unsigned char* input, unsigned char* output, int width, int height, int channels) {
-    int x = blockIdx.x * blockDim.x + threadIdx.x;
-    int y = blockIdx.y * blockDim.y + threadIdx.y;
+bool isImageFile(const std::string& file) {
+    std::string extension = fs::path(file).extension().string();
+    return extension == ".jpg" || extension == ".png" || extension == ".ppm" || extension == ".tif" ||
+           extension == ".tiff" || isRawFile(file);
+}
 
-    if (x >= width || y >= height) return;
+// File name of an input's result in the output directory
+std::string outputName(const std::string& file) {
+    return isRawFile(file) ? rawOutputName(file) : fs::path(file).filename().string();
+}
 
-    float kernel[3][3] = {
-        {1.0/16, 2.0/16, 1.0/16},
-        {2.0/16, 4.0/16, 2.0/16},
-        {1.0/16, 2.0/16, 1.0/16}
+// Collect the supported image files in a directory
+std::vector<std::string> listImages(const std::string& inputDir) {
+    std::vector<std::string> imageFiles;
+    for (const auto& entry : fs::directory_iterator(inputDir)) {
+        if (isImageFile(entry.path().string())) imageFiles.push_back(entry.path().string());
+    }
+    return imageFiles;
+}
+
+// Hands every input image to `visit`; false if the inputs could not be listed.
+// An object store prefix is listed a page at a time and each page is handed on
+// as it arrives, so the first images are decoding while later pages are still
+// being listed.
+using InputVisitor = std::function<void(const std::string& file)>;
+using InputLister = std::function<bool(const InputVisitor& visit)>;
+
+InputLister localInputs(std::vector<std::string> imageFiles) {
+    return [imageFiles](const InputVisitor& visit) {
+        for (const auto& file : imageFiles) visit(file);
+        return true;
     };
+}
 
-    for (int c = 0; c < channels; c++) {
-        float sum = 0.0;
-        for (int ky = -1; ky <= 1; ky++) {
-            for (int kx = -1; kx <= 1; kx++) {
-                int px = min(max(x + kx, 0), width - 1);
-                int py = min(max(y + ky, 0), height - 1);
-                sum += input[(py * width + px) * channels + c] * kernel[ky + 1][kx + 1];
+InputLister objectInputs(ObjectStore& store, const std::string& inputUrl, std::ofstream& logFile) {
+    return [&store, inputUrl, &logFile](const InputVisitor& visit) {
+        ObjectLocation prefix;
+        parseObjectUrl(inputUrl, &prefix);
+        std::string error;
+        bool listed = store.list(prefix, [&](const std::vector<ObjectInfo>& page) {
+            for (const auto& object : page) {
+                if (isImageFile(object.key)) visit(objectUrl({prefix.bucket, object.key}));
             }
+        }, &error);
+        if (!listed) {
+            std::cerr << "Failed to list " << inputUrl << ": " << error << std::endl;
+            logMessage(logFile, "ERROR", "Failed to list " + inputUrl + ": " + error);
         }
-        output[(y * width + x) * channels + c] = (unsigned char)sum;
+        return listed;
+    };
+}
+
+// Per-batch settings every stage of a full-resolution image reads.
+struct BatchContext {
+    std::string outputDir;
+    const LabelOptions& labelOptions;
+    const AugmentOptions& augment;
+    TensorBatchWriter* tensors;  // add results to tensor batches instead of encoding them
+    const Overlay* overlay;      // composited onto every output, augment variants and page-stack pages included
+    SourceCache* cache;
+    ObjectStore* store;          // for s3:// inputs and outputs
+    MemoryBudget& budget;
+    std::ofstream& logFile;
+
+    uint64_t outputBytes(int width, int height, int channels) const {
+        return tensors ? tensorBytes(tensors->options(), width, height, channels) : (uint64_t)width * height * channels;
+    }
+};
+
+// One full-resolution image on its way through the decode, filter and encode
+// stages, which may run on three different workers. The reservation travels
+// with it and is released once the output is written.
+struct ImageJob {
+    std::string file;
+    std::unique_ptr<BudgetReservation> reservation;
+    unsigned char* d_source = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 3;
+    bool raw = false;  // d_source holds the sensor frame, not yet demosaiced
+    Mat output;  // empty once augment or tensor output has already been written
+    std::vector<uint8_t> encoded;
+    std::vector<ComponentStats> components;
+    bool labelled = false;  // false if --label_threshold skipped an image too large for int labels
+
+    ~ImageJob() {
+        if (d_source) deviceBufferPool().release(d_source);
     }
+};
+
+void logFailure(const std::string& file, std::ofstream& logFile) {
+    std::cerr << "Failed to process " << file << std::endl;
+    logMessage(logFile, "ERROR", "Failed to process " + file);
 }
 
-// Get current timestamp for logging
-std::string getTimestamp() {
-    time_t now = time(0);
-    char* dt = ctime(&now);
-    std::string timestamp(dt);
-    return timestamp.substr(0, timestamp.length() - 1); // Remove newline
+// A raw frame is uploaded as it is; the filter stage demosaics it, in the same
+// pass as the blur where it can. `data` holds a downloaded object.
+bool decodeRawFrame(ImageJob& job, const BatchContext& batch, std::vector<uint8_t>& data, cudaStream_t stream) {
+    const BayerOptions& options = bayerOptions();
+    if (!isObjectUrl(job.file)) {
+        std::ifstream in(job.file, std::ios::binary | std::ios::ate);
+        data.resize(in ? (size_t)in.tellg() : 0);
+        in.seekg(0);
+        in.read(reinterpret_cast<char*>(data.data()), data.size());
+        if (!in) data.clear();
+    }
+    if (data.size() != options.frameBytes()) {
+        std::string error = "Raw frame " + job.file + " is " + std::to_string(data.size()) + " bytes, expected " +
+                            std::to_string(options.frameBytes()) + " for " + std::to_string(options.width) + "x" +
+                            std::to_string(options.height) + " at " + std::to_string(options.bits) + " bits";
+        std::cerr << error << std::endl;
+        logMessage(batch.logFile, "ERROR", error);
+        return false;
+    }
+
+    // Without fusion the demosaiced frame is resident alongside the raw one
+    bool fused = rawFilterFused() && !batch.augment.enabled();
+    job.width = options.width;
+    job.height = options.height;
+    job.channels = 3;
+    uint64_t colorBytes = (uint64_t)job.width * job.height * 3;
+    job.reservation.reset(new BudgetReservation(&batch.budget, data.size() + (fused ? 0 : colorBytes) +
+                                                                   batch.outputBytes(job.width, job.height, 3)));
+    job.raw = true;
+    job.d_source = deviceBufferPool().acquire(data.size());
+    if (job.d_source) cudaMemcpyAsync(job.d_source, data.data(), data.size(), cudaMemcpyHostToDevice, stream);
+    cudaStreamSynchronize(stream);
+    if (!job.d_source) logFailure(job.file, batch.logFile);
+    return job.d_source != nullptr;
 }
 
-// Process a batch of images and log results
-void processImages(const std::string& inputDir, const std::string& outputDir, std::ofstream& logFile) {
-    std::vector<std::string> imageFiles;
-    for (const auto& entry : fs::directory_iterator(inputDir)) {
-        if (entry.path().extension() == ".jpg" || entry.path().extension() == ".png") {
-            imageFiles.push_back(entry.path().string());
+// Replace a raw job's source with its demosaiced BGR frame, for the passes
+// that only take 8-bit images.
+bool demosaicJob(ImageJob& job, cudaStream_t stream) {
+    unsigned char* d_color = deviceBufferPool().acquire((size_t)job.width * job.height * 3);
+    if (!d_color) return false;
+    demosaicRawFrame(job.d_source, d_color, job.width, job.height, stream);
+    cudaStreamSynchronize(stream);
+    deviceBufferPool().release(job.d_source);
+    job.d_source = d_color;
+    job.raw = false;
+    return true;
+}
+
+// Decode stage: admit the image and leave it decoded in device memory.
+bool decodeImage(ImageJob& job, const BatchContext& batch, cudaStream_t stream) {
+    // Objects are downloaded whole (large ones as concurrent ranges) and
+    // decoded from memory; nothing is staged on local disk.
+    std::vector<uint8_t> object;
+    bool remote = isObjectUrl(job.file);
+    if (remote) {
+        ObjectLocation location;
+        std::string error;
+        if (!parseObjectUrl(job.file, &location) || !batch.store->get(location, &object, &error)) {
+            std::cerr << "Failed to download " << job.file << ": " << error << std::endl;
+            logMessage(batch.logFile, "ERROR", "Failed to download " + job.file + ": " + error);
+            return false;
         }
     }
+    if (isRawFile(job.file)) return decodeRawFrame(job, batch, object, stream);
 
-    if (imageFiles.empty()) {
-        std::cerr << "No images found in " << inputDir << std::endl;
-        logFile << "[" << getTimestamp() << "] ERROR: No images found in " << inputDir << std::endl;
-        return;
+    // Admit the image from its header before the decode allocates anything.
+    // Decoded input plus filtered output (image or tensor) stay resident until
+    // the filter finishes; IMREAD_COLOR always yields 8-bit BGR.
+    ImageInfo info;
+    bool probed = remote ? probeImage(object, &info) : probeImage(job.file, &info);
+    // Local page stacks take their own path; imdecode would keep only the first page
+    if (remote && info.multiPage) {
+        std::cerr << "Multi-page TIFF objects are not supported: " << job.file << std::endl;
+        logMessage(batch.logFile, "ERROR", "Multi-page TIFF objects are not supported, skipping " + job.file);
+        return false;
     }
+    uint64_t imageBytes = probed ? (uint64_t)info.width * info.height * 3 : 0;
+    job.reservation.reset(new BudgetReservation(
+        &batch.budget, imageBytes ? imageBytes + batch.outputBytes(info.width, info.height, 3) : 0));
 
-    logFile << "[" << getTimestamp() << "] INFO: Starting batch processing of " << imageFiles.size() << " images" << std::endl;
-
-    for (const auto& file : imageFiles) {
+    // Baseline JPEGs are decoded straight into device memory and filtered from
+    // there; whatever the native decoder declines goes through imread and is
+    // uploaded. The cache holds host images, so cached runs always use imread.
+    if (batch.cache || info.format != ImageFormat::Jpeg ||
+        !(remote ? decodeJpegToDevice(object, &job.d_source, &job.width, &job.height, stream)
+                 : decodeJpegToDevice(job.file, &job.d_source, &job.width, &job.height, stream))) {
         // Load image
-        Mat img = imread(file, IMREAD_COLOR);
+        bool cached = false;
+        Mat img = remote        ? imdecode(object, IMREAD_COLOR)
+                  : batch.cache ? batch.cache->load(job.file, IMREAD_COLOR, &cached)
+                                : imread(job.file, IMREAD_COLOR);
         if (img.empty()) {
-            std::cerr << "Failed to load " << file << std::endl;
-            logFile << "[" << getTimestamp() << "] ERROR: Failed to load " << file << std::endl;
+            std::cerr << "Failed to load " << job.file << std::endl;
+            logMessage(batch.logFile, "ERROR", "Failed to load " + job.file);
+            return false;
+        }
+
+        // Settle the reservation on the real size (or reserve now if the header
+        // was not recognised). A cached input is already paid for by the cache's
+        // share of the budget.
+        imageBytes = img.total() * img.elemSize();
+        uint64_t resultBytes = batch.outputBytes(img.cols, img.rows, img.channels());
+        job.reservation->reset(cached ? resultBytes : imageBytes + resultBytes);
+        if (!img.isContinuous()) img = img.clone();
+        job.width = img.cols;
+        job.height = img.rows;
+        job.channels = img.channels();
+        job.d_source = deviceBufferPool().acquire(imageBytes);
+        if (job.d_source) cudaMemcpyAsync(job.d_source, img.data, imageBytes, cudaMemcpyHostToDevice, stream);
+    }
+    // The filter stage uses another worker's stream
+    cudaStreamSynchronize(stream);
+    if (!job.d_source) logFailure(job.file, batch.logFile);
+    return job.d_source != nullptr;
+}
+
+// Write `job.output`, or the bytes the native encoder already produced, to
+// `outputFile`, followed by its component stats. An s3:// output is encoded in
+// memory and uploaded (in concurrent parts if large). False if the image could
+// not be stored.
+bool writeImage(const ImageJob& job, const BatchContext& batch, const std::string& outputFile) {
+    std::vector<int> params = {IMWRITE_JPEG_QUALITY, jpegEncodeOptions().quality};
+    if (isObjectUrl(outputFile)) {
+        std::vector<uint8_t> encoded;
+        if (job.encoded.empty() && !imencode(fs::path(outputFile).extension().string(), job.output, encoded, params)) {
+            return false;
+        }
+        const std::vector<uint8_t>& bytes = job.encoded.empty() ? encoded : job.encoded;
+        ObjectLocation location;
+        std::string error;
+        if (!parseObjectUrl(outputFile, &location) || !batch.store->put(location, bytes.data(), bytes.size(), &error)) {
+            logMessage(batch.logFile, "ERROR", "Failed to upload " + outputFile + ": " + error);
+            return false;
+        }
+        return true;  // --label_threshold needs a local output directory
+    }
+    bool written = true;
+    if (!job.encoded.empty()) {
+        std::ofstream out(outputFile, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(job.encoded.data()), job.encoded.size());
+        written = out.good();
+    } else {
+        written = imwrite(outputFile, job.output, params);
+    }
+    if (batch.labelOptions.enabled() && !job.labelled) {
+        logMessage(batch.logFile, "ERROR", "Not labelling " + job.file + ": more than " +
+                                               std::to_string(kMaxLabelPixels) + " pixels");
+    } else if (batch.labelOptions.enabled()) {
+        std::string statsFile = outputFile + ".components.csv";
+        if (!writeComponentStats(statsFile, job.components)) {
+            logMessage(batch.logFile, "ERROR", "Failed to write " + statsFile);
+        } else {
+            logMessage(batch.logFile, "INFO", "Labelled " + std::to_string(job.components.size()) +
+                                                  " components in " + job.file + " -> " + statsFile);
+        }
+    }
+    return written;
+}
+
+// Blob labeling and the native JPEG encoder both work on the blurred image
+// before it leaves the device; their results land in `job`.
+DeviceImageHook deviceHook(ImageJob& job, const BatchContext& batch) {
+    std::string extension = fs::path(job.file).extension().string();
+    bool encodeJpeg = jpegEncodeOptions().enabled && (extension == ".jpg" || extension == ".jpeg");
+    return [&job, &batch, encodeJpeg](const unsigned char* d_image, int width, int height, int channels,
+                                      cudaStream_t stream) {
+        if (batch.labelOptions.enabled()) {
+            job.labelled = (int64_t)width * height <= kMaxLabelPixels;
+            if (job.labelled) {
+                job.components = labelComponents(d_image, width, height, channels, batch.labelOptions, stream);
+            }
+        }
+        if (encodeJpeg && !encodeJpegFromDevice(d_image, width, height, channels, stream, &job.encoded)) {
+            job.encoded.clear();
+        }
+    };
+}
+
+// Filter stage: filter the decoded image and bring the result back to the host.
+// With augmentation, save `augment.variants` randomly transformed copies from
+// the one decode instead; with tensor output, add the result to a tensor
+// batch. Both write their own output, leaving `job.output` empty.
+bool filterImageJob(ImageJob& job, const BatchContext& batch, cudaStream_t stream) {
+    const std::string& file = job.file;
+    int width = job.width;
+    int height = job.height;
+    int channels = job.channels;
+
+    std::string outputFile = batch.outputDir + "/" + outputName(file);
+    std::string extension = fs::path(outputFile).extension().string();
+    DeviceImageHook onDevice = deviceHook(job, batch);
+
+    bool ok = true;
+    const AugmentOptions& augment = batch.augment;
+    // Raw frames are blurred straight from the sensor data unless another pass needs them in colour first
+    if (job.raw && (augment.enabled() || !rawFilterFused()) && !demosaicJob(job, stream)) {
+        logFailure(file, batch.logFile);
+        return false;
+    }
+    if (augment.enabled()) {
+        // Variants run one after another on this worker's stream, so the
+        // reservation (source plus one output) covers them all.
+        double mean = meanLuma(job.d_source, width, height, channels, stream);
+        std::string stem = batch.outputDir + "/" + fs::path(file).stem().string();
+        std::vector<std::string> variantFiles;
+        std::vector<AugmentParams> variantParams;
+        OverlayPlacement placement = batch.overlay ? batch.overlay->place(width, height) : OverlayPlacement();
+        for (int k = 0; k < augment.variants && ok; k++) {
+            AugmentParams params = augmentParams(augment, file, k, width, height);
+            job.encoded.clear();
+            Mat outputImg =
+                augmentDeviceImage(job.d_source, width, height, channels, mean, params, stream, onDevice, placement);
+            ok = !outputImg.empty();
+            if (!ok) break;
+            std::string variantFile = stem + "_aug" + std::to_string(k) + extension;
+            job.output = outputImg;
+            ok = writeImage(job, batch, variantFile);
+            if (!ok) {
+                logMessage(batch.logFile, "ERROR", "Failed to write " + variantFile);
+                break;
+            }
+            variantFiles.push_back(fs::path(variantFile).filename().string());
+            variantParams.push_back(params);
+        }
+        job.output.release();
+        if (ok && !writeAugmentParams(outputFile + ".augment.csv", variantFiles, variantParams)) {
+            logMessage(batch.logFile, "ERROR", "Failed to write " + outputFile + ".augment.csv");
+        }
+        if (ok) {
+            std::cout << "Augmented: " << file << " -> " << augment.variants << " variants" << std::endl;
+            logMessage(batch.logFile, "INFO", "Augmented " + file + " -> " + std::to_string(augment.variants) +
+                                                  " variants in " + batch.outputDir + " (Size: " +
+                                                  std::to_string(width) + "x" + std::to_string(height) + ")");
+        }
+    } else if (batch.tensors) {
+        OverlayPlacement placement = batch.overlay ? batch.overlay->place(width, height) : OverlayPlacement();
+        std::vector<unsigned char> tensor(batch.outputBytes(width, height, channels));
+        TensorFormat format = tensorFormat(batch.tensors->options());
+        ok = job.raw ? filterRawDeviceImageToTensor(job.d_source, width, height, format, tensor.size(), tensor.data(),
+                                                    stream, placement)
+                     : filterDeviceImageToTensor(job.d_source, width, height, channels, format, tensor.size(),
+                                                 tensor.data(), stream, placement);
+        std::string batchFile = ok ? batch.tensors->add(file, tensor.data(), width, height, channels) : "";
+        ok = !batchFile.empty();
+        if (ok) {
+            std::cout << "Processed: " << file << " -> " << batchFile << std::endl;
+            logMessage(batch.logFile, "INFO", "Processed " + file + " -> " + batchFile + " (Size: " +
+                                                  std::to_string(width) + "x" + std::to_string(height) + ")");
+        }
+    } else {
+        OverlayPlacement placement = batch.overlay ? batch.overlay->place(width, height) : OverlayPlacement();
+        job.output = job.raw ? filterRawDeviceImage(job.d_source, width, height, stream, onDevice, placement)
+                             : filterDeviceImage(job.d_source, width, height, channels, stream, onDevice, placement);
+        ok = !job.output.empty();
+    }
+
+    // Only the host result is left for the encode stage
+    cudaStreamSynchronize(stream);  // a failed filter may leave work in flight
+    deviceBufferPool().release(job.d_source);
+    job.d_source = nullptr;
+    // Never blocks: the output is part of what the decode stage reserved
+    if (ok && !job.output.empty()) job.reservation->shrinkTo(job.output.total() * job.output.elemSize());
+    if (!ok) logFailure(file, batch.logFile);
+    return ok;
+}
+
+// Tiny images wait in the filter stage until a group of their size is full.
+struct TinyGroups {
+    int groupSize = 0;  // 0: every image is filtered alone
+    std::mutex mutex;
+    std::map<std::tuple<int, int, int>, std::vector<std::shared_ptr<ImageJob>>> open;
+    uint64_t groups = 0;
+    uint64_t images = 0;
+
+    // Add `job`; returns its group once full, for the caller to run. Parked
+    // jobs keep their reservations, so while `budget` has a waiter the group
+    // is returned partly filled instead.
+    std::vector<std::shared_ptr<ImageJob>> add(const std::shared_ptr<ImageJob>& job, const MemoryBudget& budget) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::shared_ptr<ImageJob>>& group = open[std::make_tuple(job->width, job->height, job->channels)];
+        group.push_back(job);
+        std::vector<std::shared_ptr<ImageJob>> full;
+        if ((int)group.size() == groupSize || budget.hasWaiters()) full.swap(group);
+        return full;
+    }
+
+    // The partly filled groups, at the end of the batch or when the budget runs out.
+    std::vector<std::vector<std::shared_ptr<ImageJob>>> drain() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::vector<std::shared_ptr<ImageJob>>> partial;
+        for (auto& entry : open) {
+            if (!entry.second.empty()) partial.push_back(std::move(entry.second));
+        }
+        open.clear();
+        return partial;
+    }
+};
+
+// Filter stage for a group of same-size tiny images: blur them in one pass
+// and give each job its rows of the stacked result.
+void filterTinyJobs(const std::vector<std::shared_ptr<ImageJob>>& jobs, TinyGroups& tiny, const BatchContext& batch,
+                    cudaStream_t stream) {
+    std::vector<TinyImage> images;
+    for (const auto& job : jobs) images.push_back({job->d_source, deviceHook(*job, batch)});
+    int width = jobs.front()->width;
+    int height = jobs.front()->height;
+    Mat stacked = filterTinyGroup(images, width, height, jobs.front()->channels, tiny.groupSize, stream);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        ImageJob& job = *jobs[i];
+        deviceBufferPool().release(job.d_source);
+        job.d_source = nullptr;
+        if (stacked.empty()) {
+            logFailure(job.file, batch.logFile);
             continue;
         }
+        job.output = stacked.rowRange((int)i * height, (int)(i + 1) * height);
+        job.reservation->shrinkTo(job.output.total() * job.output.elemSize());
+    }
+    std::lock_guard<std::mutex> lock(tiny.mutex);
+    tiny.groups++;
+    tiny.images += jobs.size();
+}
 
-        int width = img.cols;
-        int height = img.rows;
-        int channels = img.channels();
-        size_t size = width * height * channels;
+// Encode stage: write the filtered image.
+void encodeImage(ImageJob& job, const BatchContext& batch) {
+    std::string outputFile = batch.outputDir + "/" + outputName(job.file);
+    if (!writeImage(job, batch, outputFile)) {
+        logFailure(job.file, batch.logFile);
+        return;
+    }
+    std::cout << "Processed: " << job.file << " -> " << outputFile << std::endl;
+    logMessage(batch.logFile, "INFO", "Processed " + job.file + " -> " + outputFile + " (Size: " +
+                                          std::to_string(job.output.cols) + "x" + std::to_string(job.output.rows) +
+                                          ")");
+}
 
-        // Allocate device memory
-        unsigned char *d_input, *d_output;
-        cudaMalloc(&d_input, size);
-        cudaMalloc(&d_output, size);
+// Cached device buffers only pay off while a host image is there to fill
+// them, so the pool never holds more than the in-flight budget.
+void capDeviceBufferPool(const PoolSizing& sizing, std::ofstream& logFile) {
+    size_t freeDevice = 0;
+    size_t totalDevice = 0;
+    cudaMemGetInfo(&freeDevice, &totalDevice);
+    deviceBufferPool().setCapacity(std::min<uint64_t>(freeDevice / 2, sizing.inFlightBytes));
+    logMessage(logFile, "INFO", "Device buffer pool cap " + std::to_string(deviceBufferPool().capacity() >> 20) +
+                                    " MiB (device free " + std::to_string(freeDevice >> 20) + " MiB)");
+}
 
-        // Copy image data to device
-        cudaMemcpy(d_input, img.data, size, cudaMemcpyHostToDevice);
+// Load the batch's watermark, if any. Without it the batch still runs, unmarked.
+std::unique_ptr<Overlay> loadOverlay(const OverlayOptions& overlayOptions, std::ofstream& logFile) {
+    std::unique_ptr<Overlay> overlay;
+    if (overlayOptions.enabled()) {
+        std::string error;
+        overlay = Overlay::load(overlayOptions, &error);
+        if (!overlay) logMessage(logFile, "ERROR", "Overlay disabled: " + error);
+    }
+    return overlay;
+}
 
-        // Launch kernel
-        dim3 blockSize(16, 16);
-        dim3 gridSize((width + blockSize.x - 1) / blockSize.x, (height + blockSize.y - 1) / blockSize.y);
-        gaussianBlurKernel<<<gridSize, blockSize>>>(d_input, d_output, width, height, channels);
+// Process a batch of images and log results. False if the inputs could not be listed.
+bool processImages(const InputLister& listInputs, const std::string& outputDir, const PreviewOptions& preview,
+                   const LabelOptions& labelOptions, const AugmentOptions& augment, const TensorOptions& tensorOptions,
+                   const OverlayOptions& overlayOptions, int tinyGroupSize, const PoolSizing& sizing,
+                   SourceCache* cache, ObjectStore* store, std::ofstream& logFile) {
+    logMessage(logFile, "INFO", "Starting batch processing");
 
-        // Copy result back to host
-        Mat outputImg(height, width, CV_8UC3);
-        cudaMemcpy(outputImg.data, d_output, size, cudaMemcpyDeviceToHost);
+    capDeviceBufferPool(sizing, logFile);
+    MemoryBudget budget(sizing.inFlightBytes - (cache ? cache->capacity() : 0));
+    int threads = sizing.threads;
 
-        // Save output
-        std::string outputFile = outputDir + "/" + fs::path(file).filename().string();
-        imwrite(outputFile, outputImg);
+    std::unique_ptr<TensorBatchWriter> tensors;
+    if (tensorOptions.enabled) tensors.reset(new TensorBatchWriter(outputDir, tensorOptions));
+    // The watermark is decoded and premultiplied here, once, and shared read-only by every worker
+    std::unique_ptr<Overlay> overlay = loadOverlay(overlayOptions, logFile);
+    BatchContext batch{outputDir, labelOptions, augment, tensors.get(), overlay.get(), cache, store, budget, logFile};
+    // Previews get their own copy, shrunk with its margin to the preview scale
+    std::unique_ptr<Overlay> previewOverlay;
+    if (overlay && preview.enabled()) {
+        OverlayOptions reduced = overlayOptions;
+        reduced.scale /= preview.scale;
+        reduced.margin = (reduced.margin + preview.scale / 2) / preview.scale;
+        previewOverlay = loadOverlay(reduced, logFile);
+    }
 
-        std::cout << "Processed: " << file << " -> " << outputFile << std::endl;
-        logFile << "[" << getTimestamp() << "] INFO: Processed " << file << " -> " << outputFile 
-                << " (Size: " << width << "x" << height << ")" << std::endl;
+    // Full-resolution images flow through decode, filter and encode pools whose
+    // sizes the pipeline adapts to the batch; page-stack pages are filter
+    // tasks there too. Previews get a quarter of the threads as a pool of their
+    // own, so preview latency stays flat no matter how much full-resolution
+    // work is queued, and the two never add up to more than `threads`.
+    enum { kDecodeStage, kFilterStage, kEncodeStage };
+    int previewThreads = preview.enabled() ? std::max(1, threads / 4) : 0;
+    StagePipeline pipeline({"decode", "filter", "encode"}, std::max(1, threads - previewThreads), logFile);
+    std::unique_ptr<ThreadPool> previewPool;
+    if (preview.enabled()) previewPool.reset(new ThreadPool(previewThreads));
+    auto submitFilter = [&](std::function<void()> task) { pipeline.submit(kFilterStage, std::move(task)); };
+    std::mutex statsMutex;
+    std::vector<double> previewLatencies;
+    std::vector<double> fullLatencies;
+    auto batchStart = std::chrono::steady_clock::now();
+    auto record = [&](std::vector<double>& latencies) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - batchStart).count();
+        std::lock_guard<std::mutex> lock(statsMutex);
+        latencies.push_back(ms);
+    };
+    auto encode = [&](std::shared_ptr<ImageJob> job) {
+        pipeline.submit(kEncodeStage, [&, job] {
+            encodeImage(*job, batch);
+            record(fullLatencies);
+        });
+    };
+    TinyGroups tiny;
+    tiny.groupSize = tinyGroupSize;
+    auto runTinyGroup = [&](const std::vector<std::shared_ptr<ImageJob>>& group) {
+        filterTinyJobs(group, tiny, batch, workerStream(false));
+        for (const auto& job : group) {
+            if (!job->output.empty()) encode(job);
+        }
+    };
+    // Parked tiny jobs hold budget an admitted image may be waiting for, so
+    // they run partly grouped rather than at the end of the batch
+    if (tiny.groupSize > 0) {
+        budget.setWaitHook([&] {
+            for (auto& group : tiny.drain()) pipeline.submit(kFilterStage, [&, group] { runTinyGroup(group); });
+        });
+    }
 
-        // Clean up
-        cudaFree(d_input);
-        cudaFree(d_output);
+    size_t imageCount = 0;
+    bool listed = listInputs([&](const std::string& file) {
+        imageCount++;
+        // Page stacks fan out into one filter task per page from this thread;
+        // a pipeline worker must not wait on tasks queued behind it.
+        // Multi-page objects are rejected in the decode stage.
+        if (!isObjectUrl(file) && isPageStack(file)) {
+            if (processPageStack(file, outputDir, submitFilter, 2 * threads, budget, overlay.get(), logFile)) {
+                record(fullLatencies);
+            }
+            return;
+        }
+        if (preview.enabled()) {
+            previewPool->submit([&, file] {
+                ProfileStage profileStage(profileTag("preview"));
+                if (emitPreview(file, preview, previewOverlay.get(), workerStream(true), logFile)) {
+                    record(previewLatencies);
+                }
+            });
+        }
+        auto job = std::make_shared<ImageJob>();
+        job->file = file;
+        pipeline.submit(kDecodeStage, [&, job] {
+            if (!decodeImage(*job, batch, workerStream(false))) return;
+            pipeline.submit(kFilterStage, [&, job] {
+                if (tiny.groupSize > 0 && !job->raw && isTinyImage(job->width, job->height)) {
+                    std::vector<std::shared_ptr<ImageJob>> group = tiny.add(job, budget);
+                    if (!group.empty()) runTinyGroup(group);
+                    return;
+                }
+                if (!filterImageJob(*job, batch, workerStream(false))) return;
+                if (job->output.empty()) {  // augment and tensor output are already written
+                    record(fullLatencies);
+                    return;
+                }
+                encode(job);
+            });
+        });
+    });
+    logMessage(logFile, "INFO", "Listed " + std::to_string(imageCount) + " images");
+    pipeline.wait();
+    // Partly filled groups run once nothing else can join them
+    for (auto& group : tiny.drain()) pipeline.submit(kFilterStage, [&, group] { runTinyGroup(group); });
+    pipeline.wait();
+    budget.setWaitHook(nullptr);
+    if (previewPool) previewPool->wait();
+    logMessage(logFile, "INFO", "Stage workers at finish " + pipeline.summary());
+    if (tensors) {
+        tensors->finish();
+        logMessage(logFile, "INFO", "Wrote " + std::to_string(tensors->files()) + " tensor batch files");
     }
 
-    logFile << "[" << getTimestamp() << "] INFO: Batch processing completed" << std::endl;
+    if (preview.enabled()) {
+        logMessage(logFile, "INFO", "Preview latency p50 " + std::to_string(percentile(previewLatencies, 50)) +
+                                        " ms, p99 " + std::to_string(percentile(previewLatencies, 99)) +
+                                        " ms; full-resolution p50 " + std::to_string(percentile(fullLatencies, 50)) +
+                                        " ms, p99 " + std::to_string(percentile(fullLatencies, 99)) + " ms");
+        std::string sources = previewDecodeSummary();
+        if (!sources.empty()) logMessage(logFile, "INFO", sources);
+    }
+    logMessage(logFile, "INFO", "In-flight peak " + std::to_string(budget.peak() >> 20) + " MiB of " +
+                                    std::to_string(budget.capacity() >> 20) + " MiB; device buffer pool hits " +
+                                    std::to_string(deviceBufferPool().hits()) + ", misses " +
+                                    std::to_string(deviceBufferPool().misses()) + "; JPEG decodes native " +
+                                    std::to_string(jpegNativeDecodes()) + ", via imread " +
+                                    std::to_string(jpegFallbackDecodes()));
+    if (filterOptions().remap.kind != RemapKind::None) {
+        logMessage(logFile, "INFO", "Remap maps built " + std::to_string(remapMapBuilds()) + ", reused " +
+                                        std::to_string(remapMapHits()));
+    }
+    if (cache) {
+        logMessage(logFile, "INFO", "Source cache hits " + std::to_string(cache->hits()) + ", misses " +
+                                        std::to_string(cache->misses()) + ", evictions " +
+                                        std::to_string(cache->evictions()) + ", holding " +
+                                        std::to_string(cache->bytes() >> 20) + " of " +
+                                        std::to_string(cache->capacity() >> 20) + " MiB");
+    }
+    if (bayerOptions().enabled) {
+        logMessage(logFile, "INFO", "Raw frames demosaiced (" +
+                                        std::string(demosaicMethodName(bayerOptions().method)) +
+                                        ") in the blur pass " + std::to_string(rawFramesFused()) + ", separately " +
+                                        std::to_string(rawFramesDemosaiced()));
+    }
+    if (tiny.groupSize > 0) {
+        logMessage(logFile, "INFO", "Filtered " + std::to_string(tiny.images) + " tiny images in " +
+                                        std::to_string(tiny.groups) + " groups of up to " +
+                                        std::to_string(tiny.groupSize));
+    }
+    if (store) logMessage(logFile, "INFO", "Object store " + store->summary());
+    deviceBufferPool().trim();
+    logMessage(logFile, "INFO", "Batch processing completed");
+    return listed;
+}
+
+// Filter the inputs as consecutive frames of one stream, in file name order,
+// recomputing only the tiles that changed since the previous frame. Frames
+// depend on each other, so they run one at a time on this thread.
+void processSequence(std::vector<std::string> frameFiles, const std::string& outputDir,
+                     const LabelOptions& labelOptions, const OverlayOptions& overlayOptions, const PoolSizing& sizing,
+                     SourceCache* cache, ObjectStore* store, std::ofstream& logFile) {
+    std::sort(frameFiles.begin(), frameFiles.end());
+    logMessage(logFile, "INFO", "Starting incremental processing of " + std::to_string(frameFiles.size()) + " frames");
+    capDeviceBufferPool(sizing, logFile);
+    MemoryBudget budget(sizing.inFlightBytes - (cache ? cache->capacity() : 0));
+    std::unique_ptr<Overlay> overlay = loadOverlay(overlayOptions, logFile);
+    AugmentOptions noAugment;
+    BatchContext batch{outputDir, labelOptions, noAugment, nullptr, overlay.get(), cache, store, budget, logFile};
+    IncrementalFilter incremental;
+    cudaStream_t stream = workerStream(false);
+
+    for (const auto& file : frameFiles) {
+        ImageJob job;
+        job.file = file;
+        if (!decodeImage(job, batch, stream)) continue;
+        if (job.raw && !demosaicJob(job, stream)) {
+            logFailure(file, logFile);
+            continue;
+        }
+        uint64_t tilesBefore = incremental.tiles();
+        uint64_t recomputedBefore = incremental.recomputedTiles();
+        OverlayPlacement placement = overlay ? overlay->place(job.width, job.height) : OverlayPlacement();
+        job.output = incremental.filter(job.d_source, job.width, job.height, job.channels, stream,
+                                        deviceHook(job, batch), placement);
+        deviceBufferPool().release(job.d_source);
+        job.d_source = nullptr;
+        if (job.output.empty()) {
+            logFailure(file, logFile);
+            continue;
+        }
+        encodeImage(job, batch);
+        logMessage(logFile, "INFO", "Recomputed " + std::to_string(incremental.recomputedTiles() - recomputedBefore) +
+                                        " of " + std::to_string(incremental.tiles() - tilesBefore) + " tiles of " +
+                                        file);
+    }
+
+    double percent = incremental.tiles() ? 100.0 * incremental.recomputedTiles() / incremental.tiles() : 0;
+    logMessage(logFile, "INFO", "Incremental processing of " + std::to_string(incremental.frames()) +
+                                    " frames recomputed " + std::to_string(incremental.recomputedTiles()) + " of " +
+                                    std::to_string(incremental.tiles()) + " tiles (" + std::to_string(percent) +
+                                    "%)");
+    if (store) logMessage(logFile, "INFO", "Object store " + store->summary());
+    deviceBufferPool().trim();
+}
+
+// Probe every input header and log the memory each would be admitted with,
+// without decoding or processing anything
+void planImages(const std::vector<std::string>& imageFiles, const PoolSizing& sizing, std::ofstream& logFile) {
+    uint64_t totalBytes = 0;
+    uint64_t largestBytes = 0;
+    int unknown = 0;
+    for (const auto& file : imageFiles) {
+        ImageInfo info;
+        if (!probeImage(file, &info)) {
+            unknown++;
+            logMessage(logFile, "WARNING", "Dry run: cannot probe " + file + "; it is admitted after decoding");
+            continue;
+        }
+        uint64_t bytes = 2ull * info.width * info.height * 3;
+        totalBytes += bytes;
+        largestBytes = std::max(largestBytes, bytes);
+        std::string line = file + ": " + imageFormatName(info.format) + " " + std::to_string(info.width) + "x" +
+                           std::to_string(info.height) + ", " + std::to_string(info.channels) + " ch, " +
+                           std::to_string(info.bitDepth) + " bit, reserves " + std::to_string(bytes >> 20) + " MiB";
+        std::cout << line << std::endl;
+        logMessage(logFile, "INFO", "Dry run: " + line);
+    }
+    uint64_t fit = largestBytes > 0 ? sizing.inFlightBytes / largestBytes : 0;
+    std::string summary = "Dry run: " + std::to_string(imageFiles.size()) + " images (" + std::to_string(unknown) +
+                          " unprobed), " + std::to_string(totalBytes >> 20) + " MiB total, largest " +
+                          std::to_string(largestBytes >> 20) + " MiB; " + std::to_string(fit) +
+                          " of the largest fit the " + std::to_string(sizing.inFlightBytes >> 20) +
+                          " MiB in-flight budget alongside " + std::to_string(sizing.threads) + " threads";
+    std::cout << summary << std::endl;
+    logMessage(logFile, "INFO", summary);
+}
+
+// Inputs whose output is missing or older than the input
+std::vector<std::string> staleImages(const std::vector<std::string>& imageFiles, const std::string& outputDir) {
+    std::vector<std::string> stale;
+    for (const auto& file : imageFiles) {
+        fs::path outputFile = fs::path(outputDir) / outputName(file);
+        std::error_code ec;
+        auto outputTime = fs::last_write_time(outputFile, ec);
+        if (ec || outputTime < fs::last_write_time(file, ec)) stale.push_back(file);
+    }
+    return stale;
+}
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) { stopRequested = 1; }
+
+// Keep polling the input directory and (re)process every image whose output is
+// missing or out of date, until SIGINT/SIGTERM. Deleting an output re-requests it.
+void watchImages(const std::string& inputDir, const std::string& outputDir, int intervalSeconds,
+                 const PreviewOptions& preview, const LabelOptions& labelOptions, const OverlayOptions& overlayOptions,
+                 const PoolSizing& sizing, SourceCache* cache, std::ofstream& logFile) {
+    std::signal(SIGINT, requestStop);
+    std::signal(SIGTERM, requestStop);
+    logMessage(logFile, "INFO", "Watching " + inputDir + " every " + std::to_string(intervalSeconds) + " s");
+    while (!stopRequested) {
+        std::vector<std::string> stale = staleImages(listImages(inputDir), outputDir);
+        if (!stale.empty()) {
+            processImages(localInputs(stale), outputDir, preview, labelOptions, AugmentOptions(), TensorOptions(),
+                          overlayOptions, 0, sizing, cache, nullptr, logFile);
+        }
+        for (int i = 0; i < intervalSeconds * 10 && !stopRequested; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    logMessage(logFile, "INFO", "Watch stopped");
+}
+
+// Comma-separated numbers into `values`, up to `count` of them; entries not
+// given keep their defaults.
+bool parseValueList(const std::string& list, double* values, int count) {
+    std::stringstream stream(list);
+    std::string item;
+    for (int i = 0; std::getline(stream, item, ','); i++) {
+        if (i >= count || item.empty()) return false;
+        values[i] = std::atof(item.c_str());
+    }
+    return true;
+}
+
+// One of two documented values: `first` sets *result, `second` clears it.
+bool parseChoice(const std::string& value, const char* first, const char* second, bool* result) {
+    if (value != first && value != second) return false;
+    *result = value == first;
+    return true;
+}
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " --input_dir <path> --output_dir <path> [options]" << std::endl
+              << "  Either directory may be an s3://bucket/prefix; set S3_ENDPOINT_URL for S3-compatible servers"
+              << std::endl
+              << "  --band_workers <n>      Split each image into n horizontal bands processed by worker processes"
+              << std::endl
+              << "  --band_output tif|raw   Band mode output format (default: tif)" << std::endl
+              << "  --band_scaling          Band mode: also time 1..n workers and log scaling efficiency"
+              << std::endl
+              << "  --preview_dir <path>    Write a low-resolution preview of every image here before the full result"
+              << std::endl
+              << "  --preview_scale 2|4|8   Preview downscale factor (default: 4)" << std::endl
+              << "  --preview_no_embedded   Always decode previews from the main image, never from an embedded"
+              << " EXIF/MPF JPEG" << std::endl
+              << "  --threads <n>           Worker threads (default: CPUs allowed by the cgroup quota/cpuset)"
+              << std::endl
+              << "  --memory_budget_mb <n>  In-flight image memory (default: half the cgroup memory limit)"
+              << std::endl
+              << "  --rotate <degrees>      Rotate each image about its centre before blurring" << std::endl
+              << "  --remap lens:fx,fy,cx,cy,k1,k2,p1,p2[,k3] | affine:a,b,c,d,e,f | rotate:<degrees>" << std::endl
+              << "                          Warp each image through a cached fixed-point map before blurring"
+              << std::endl
+              << "  --tile_order row|morton|hilbert  Order in which GPU tiles are issued (default: row)"
+              << std::endl
+              << "  --bench_tile_order      Time blur and rotation under every tile order instead of processing"
+              << std::endl
+              << "  --label_threshold <t>   Label blobs with luma >= t in the blurred output; stats go to"
+              << " <output>.components.csv" << std::endl
+              << "  --label_connectivity 4|8  Blob connectivity (default: 8)" << std::endl
+              << "  --watch <seconds>       Keep polling the input directory and reprocess stale or missing outputs"
+              << std::endl
+              << "  --cache_mb <n>          Keep up to n MiB of decoded sources for repeat requests (taken from the"
+              << " in-flight budget)" << std::endl
+              << "  --jpeg_decoder native|opencv  Decoder for JPEG inputs (default: native, falling back to"
+              << " imread for unsupported files)" << std::endl
+              << "  --jpeg_encoder native|opencv  Encoder for JPEG outputs (default: native)" << std::endl
+              << "  --jpeg_quality <q>      JPEG output quality 1-100 (default: 95)" << std::endl
+              << "  --dry_run               Probe every input header and log planned memory; process nothing"
+              << std::endl
+              << "  --probe_bench           Time header probing over the inputs instead of processing" << std::endl
+              << "  --cache_key mtime|hash  Identify cached sources by path+mtime (default) or by content hash"
+              << std::endl
+              << "  --sigma <s>             Separable Gaussian blur of this sigma instead of the 3x3 kernel"
+              << std::endl
+              << "  --linear_light          With --sigma, blur in linear light rather than on sRGB codes" << std::endl
+              << "  --fp16_intermediate     With --sigma, keep the intermediate plane in half precision" << std::endl
+              << "  --fp16_report           Compare float32 and fp16 intermediates on the inputs instead of"
+              << " processing" << std::endl
+              << "  --augment <k>           Write k randomly augmented variants of every input (crop, flip, colour"
+              << " and blur jitter)" << std::endl
+              << "  --augment_seed <n>      Seed for the variants' random draws (default: 0)" << std::endl
+              << "  --augment_crop <s>      Smallest crop, as a fraction of the image area (default: 0.6)" << std::endl
+              << "  --augment_no_flip       Never flip variants horizontally" << std::endl
+              << "  --augment_jitter b,c,s  Brightness, contrast and saturation jitter (default: 0.2,0.2,0.2)"
+              << std::endl
+              << "  --augment_sigma lo,hi   Blur each variant with a Gaussian of sigma drawn from [lo, hi]" << std::endl
+              << "  --tensor_out nchw|nhwc  Write results as .npy tensor batches instead of encoded images"
+              << std::endl
+              << "  --tensor_dtype f32|u8   Tensor element type (default: f32, scaled to [0, 1])" << std::endl
+              << "  --tensor_mean m1,m2,m3  Per-channel mean subtracted from f32 tensors (default: 0)" << std::endl
+              << "  --tensor_std s1,s2,s3   Per-channel std f32 tensors are divided by (default: 1)" << std::endl
+              << "  --tensor_batch <n>      Images per tensor file (default: 64)" << std::endl
+              << "  --tensor_bgr            Keep OpenCV's BGR channel order (default: RGB)" << std::endl
+              << "  --wavelet_layers <n>    A-trous wavelet detail processing with n layers (1-4) instead of the blur"
+              << std::endl
+              << "  --wavelet_gain g1,g2,.. Detail gain per layer, finest first (default: 1)" << std::endl
+              << "  --wavelet_threshold t1,t2,..  Soft threshold per layer in 8-bit code units (default: 0)"
+              << std::endl
+              << "  --overlay <file>        Composite this watermark (PNG alpha respected) onto every output"
+              << std::endl
+              << "  --overlay_anchor tl|tr|bl|br|center  Corner the watermark is placed in (default: br)" << std::endl
+              << "  --overlay_margin <px>   Distance from the anchored edges (default: 16)" << std::endl
+              << "  --overlay_scale <s>     Watermark scale relative to its file (default: 1)" << std::endl
+              << "  --overlay_opacity <a>   Extra opacity multiplier 0-1 (default: 1)" << std::endl
+              << "  --pixelate <n>          Pixelate in n x n cells instead of blurring (for redaction, n <= 4096)"
+              << std::endl
+              << "  --pixelate_region x,y,w,h  Only pixelate this rectangle; repeat for several (default: whole image)"
+              << std::endl
+              << "  --incremental           Treat the inputs as frames in name order and recompute only the tiles"
+              << " that changed" << std::endl
+              << "  --tiny_batch 8|16|32    Blur images up to " << kTinyMaxSide << "x" << kTinyMaxSide
+              << " in interleaved groups of this many same-size images" << std::endl
+              << "  --bench_tiny_batch      Time the blur of tiny inputs one at a time and grouped instead of"
+              << " processing" << std::endl
+              << "  --bayer rggb|bggr|grbg|gbrg  Read .raw inputs as Bayer sensor frames of this pattern; results"
+              << " are written as .png" << std::endl
+              << "  --raw_size <w>x<h>      Raw frame size" << std::endl
+              << "  --raw_bits 8|12|16      Raw sample depth; above 8, little-endian 16-bit words (default: 8)"
+              << std::endl
+              << "  --demosaic bilinear|mhc  Demosaic method (default: mhc, Malvar-He-Cutler)" << std::endl
+              << "  --white_balance r,g,b|auto  Gains for the red, green and blue samples, or gray world per frame"
+              << " (default: 1,1,1)" << std::endl
+              << "  --profile_out <file>    Sample the CPU stacks of every worker thread and write them folded to"
+              << " <file>, with a per-stage breakdown in <file>.stages.csv" << std::endl
+              << "  --profile_hz <n>        Samples per second of each thread's CPU time (default: 99)" << std::endl;
 }
 
 int main(int argc, char** argv) {
-    if (argc != 5 || std::string(argv[1]) != "--input_dir" || std::string(argv[3]) != "--output_dir") {
-        std::cerr << "Usage: " << argv[0] << " --input_dir <path> --output_dir <path>" << std::endl;
+    std::string inputDir;
+    std::string outputDir;
+    BandOptions bandOptions;
+    bandOptions.workers = 0;
+    PreviewOptions previewOptions;
+    int threads = 0;
+    long memoryBudgetMb = 0;
+    FilterOptions filterOptions;
+    bool benchTileOrder = false;
+    bool fp16Report = false;
+    bool incremental = false;
+    int tinyBatch = 0;
+    bool benchTinyBatch = false;
+    BayerOptions bayer;
+    ProfilerOptions profilerOptions;
+    LabelOptions labelOptions;
+    AugmentOptions augmentOptions;
+    TensorOptions tensorOptions;
+    OverlayOptions overlayOptions;
+    JpegDecodeOptions jpegOptions;
+    JpegEncodeOptions jpegEncoderOptions;
+    bool dryRun = false;
+    bool probeBench = false;
+    int watchSeconds = 0;
+    long cacheMb = 0;
+    CacheKeyMode cacheKeyMode = CacheKeyMode::PathMtime;
+
+    double jitter[3] = {augmentOptions.brightness, augmentOptions.contrast, augmentOptions.saturation};
+    double sigmaRange[2] = {0, 0};
+    double rect[4] = {0, 0, 0, 0};
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--input_dir" && hasValue) {
+            inputDir = argv[++i];
+        } else if (arg == "--output_dir" && hasValue) {
+            outputDir = argv[++i];
+        } else if (arg == "--band_workers" && hasValue) {
+            bandOptions.workers = std::atoi(argv[++i]);
+        } else if (arg == "--band_output" && hasValue &&
+                   parseChoice(argv[i + 1], "tif", "raw", &bandOptions.tiffOutput)) {
+            i++;
+        } else if (arg == "--band_scaling") {
+            bandOptions.scaling = true;
+        } else if (arg == "--preview_dir" && hasValue) {
+            previewOptions.dir = argv[++i];
+        } else if (arg == "--preview_scale" && hasValue) {
+            previewOptions.scale = std::atoi(argv[++i]);
+        } else if (arg == "--preview_no_embedded") {
+            previewOptions.embedded = false;
+        } else if (arg == "--threads" && hasValue) {
+            threads = std::atoi(argv[++i]);
+        } else if (arg == "--memory_budget_mb" && hasValue) {
+            memoryBudgetMb = std::atol(argv[++i]);
+        } else if (arg == "--rotate" && hasValue) {
+            filterOptions.rotateDegrees = std::atof(argv[++i]);
+        } else if (arg == "--remap" && hasValue && parseRemapModel(argv[i + 1], &filterOptions.remap)) {
+            i++;
+        } else if (arg == "--tile_order" && hasValue && parseTileOrder(argv[i + 1], &filterOptions.tileOrder)) {
+            i++;
+        } else if (arg == "--bench_tile_order") {
+            benchTileOrder = true;
+        } else if (arg == "--label_threshold" && hasValue) {
+            labelOptions.threshold = std::atoi(argv[++i]);
+        } else if (arg == "--label_connectivity" && hasValue) {
+            labelOptions.connectivity = std::atoi(argv[++i]) == 4 ? 4 : 8;
+        } else if (arg == "--jpeg_decoder" && hasValue &&
+                   parseChoice(argv[i + 1], "native", "opencv", &jpegOptions.enabled)) {
+            i++;
+        } else if (arg == "--jpeg_encoder" && hasValue &&
+                   parseChoice(argv[i + 1], "native", "opencv", &jpegEncoderOptions.enabled)) {
+            i++;
+        } else if (arg == "--jpeg_quality" && hasValue) {
+            jpegEncoderOptions.quality = std::min(std::max(std::atoi(argv[++i]), 1), 100);
+        } else if (arg == "--dry_run") {
+            dryRun = true;
+        } else if (arg == "--probe_bench") {
+            probeBench = true;
+        } else if (arg == "--watch" && hasValue) {
+            watchSeconds = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--cache_mb" && hasValue) {
+            cacheMb = std::atol(argv[++i]);
+        } else if (arg == "--cache_key" && hasValue && parseCacheKeyMode(argv[i + 1], &cacheKeyMode)) {
+            i++;
+        } else if (arg == "--sigma" && hasValue) {
+            filterOptions.sigma = std::max(0.0, std::atof(argv[++i]));
+        } else if (arg == "--linear_light") {
+            filterOptions.linearLight = true;
+        } else if (arg == "--fp16_intermediate") {
+            filterOptions.fp16Intermediate = true;
+        } else if (arg == "--fp16_report") {
+            fp16Report = true;
+        } else if (arg == "--augment" && hasValue) {
+            augmentOptions.variants = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--augment_seed" && hasValue) {
+            augmentOptions.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--augment_crop" && hasValue) {
+            augmentOptions.minCropScale = std::atof(argv[++i]);
+        } else if (arg == "--augment_no_flip") {
+            augmentOptions.flip = false;
+        } else if (arg == "--augment_jitter" && hasValue && parseValueList(argv[i + 1], jitter, 3)) {
+            i++;
+        } else if (arg == "--augment_sigma" && hasValue && parseValueList(argv[i + 1], sigmaRange, 2)) {
+            i++;
+        } else if (arg == "--tensor_out" && hasValue && parseTensorLayout(argv[i + 1], &tensorOptions.layout)) {
+            tensorOptions.enabled = true;
+            i++;
+        } else if (arg == "--tensor_dtype" && hasValue && parseTensorType(argv[i + 1], &tensorOptions.type)) {
+            i++;
+        } else if (arg == "--tensor_mean" && hasValue && parseValueList(argv[i + 1], tensorOptions.mean, 3)) {
+            i++;
+        } else if (arg == "--tensor_std" && hasValue && parseValueList(argv[i + 1], tensorOptions.stddev, 3)) {
+            i++;
+        } else if (arg == "--tensor_batch" && hasValue) {
+            tensorOptions.batch = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--tensor_bgr") {
+            tensorOptions.rgb = false;
+        } else if (arg == "--wavelet_layers" && hasValue) {
+            filterOptions.waveletLayers = std::min(std::max(std::atoi(argv[++i]), 0), kMaxWaveletLayers);
+        } else if (arg == "--wavelet_gain" && hasValue &&
+                   parseValueList(argv[i + 1], filterOptions.waveletGain, kMaxWaveletLayers)) {
+            i++;
+        } else if (arg == "--wavelet_threshold" && hasValue &&
+                   parseValueList(argv[i + 1], filterOptions.waveletThreshold, kMaxWaveletLayers)) {
+            i++;
+        } else if (arg == "--pixelate" && hasValue) {
+            filterOptions.pixelateBlock = std::min(std::max(0, std::atoi(argv[++i])), kMaxPixelateBlock);
+        } else if (arg == "--pixelate_region" && hasValue && parseValueList(argv[i + 1], rect, 4)) {
+            filterOptions.pixelateRegions.push_back({(int)rect[0], (int)rect[1], (int)rect[2], (int)rect[3]});
+            i++;
+        } else if (arg == "--incremental") {
+            incremental = true;
+        } else if (arg == "--tiny_batch" && hasValue) {
+            tinyBatch = std::atoi(argv[++i]);
+        } else if (arg == "--bench_tiny_batch") {
+            benchTinyBatch = true;
+        } else if (arg == "--bayer" && hasValue && parseBayerPattern(argv[i + 1], &bayer.pattern)) {
+            bayer.enabled = true;
+            i++;
+        } else if (arg == "--raw_size" && hasValue &&
+                   std::sscanf(argv[i + 1], "%dx%d", &bayer.width, &bayer.height) == 2) {
+            i++;
+        } else if (arg == "--raw_bits" && hasValue) {
+            bayer.bits = std::atoi(argv[++i]);
+        } else if (arg == "--demosaic" && hasValue && parseDemosaicMethod(argv[i + 1], &bayer.method)) {
+            i++;
+        } else if (arg == "--white_balance" && hasValue && std::string(argv[i + 1]) == "auto") {
+            bayer.autoWhiteBalance = true;
+            i++;
+        } else if (arg == "--white_balance" && hasValue && parseValueList(argv[i + 1], bayer.gains, 3)) {
+            i++;
+        } else if (arg == "--profile_out" && hasValue) {
+            profilerOptions.output = argv[++i];
+        } else if (arg == "--profile_hz" && hasValue) {
+            profilerOptions.hz = std::atoi(argv[++i]);
+        } else if (arg == "--overlay" && hasValue) {
+            overlayOptions.file = argv[++i];
+        } else if (arg == "--overlay_anchor" && hasValue && parseOverlayAnchor(argv[i + 1], &overlayOptions.anchor)) {
+            i++;
+        } else if (arg == "--overlay_margin" && hasValue) {
+            overlayOptions.margin = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--overlay_scale" && hasValue) {
+            overlayOptions.scale = std::atof(argv[++i]);
+        } else if (arg == "--overlay_opacity" && hasValue) {
+            overlayOptions.opacity = std::min(std::max(std::atof(argv[++i]), 0.0), 1.0);
+        } else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+    if (inputDir.empty() || outputDir.empty()) {
+        printUsage(argv[0]);
         return -1;
     }
+    augmentOptions.brightness = jitter[0];
+    augmentOptions.contrast = jitter[1];
+    augmentOptions.saturation = jitter[2];
+    augmentOptions.minSigma = std::max(0.0, sigmaRange[0]);
+    augmentOptions.maxSigma = std::max(augmentOptions.minSigma, sigmaRange[1]);
 
-    std::string inputDir = argv[2];
-    std::string outputDir = argv[4];
+    bool remap = filterOptions.remap.kind != RemapKind::None;
+    if (bandOptions.workers > 0 && (filterOptions.rotateDegrees != 0 || remap || labelOptions.enabled())) {
+        std::cerr << "--rotate, --remap and --label_threshold need the whole image and cannot be combined with"
+                  << " --band_workers" << std::endl;
+        return -1;
+    }
+    if (overlayOptions.enabled() && bandOptions.workers > 0) {
+        std::cerr << "--overlay cannot be combined with --band_workers" << std::endl;
+        return -1;
+    }
+    if (overlayOptions.scale <= 0) {
+        std::cerr << "--overlay_scale must be positive" << std::endl;
+        return -1;
+    }
+    if (remap && filterOptions.rotateDegrees != 0) {
+        std::cerr << "--remap already covers rotation (rotate:<degrees>); drop --rotate" << std::endl;
+        return -1;
+    }
+    if (filterOptions.waveletLayers > 0 && filterOptions.sigma > 0) {
+        std::cerr << "--wavelet_layers replaces the blur and cannot be combined with --sigma" << std::endl;
+        return -1;
+    }
+    if (filterOptions.waveletLayers > 0 && augmentOptions.maxSigma > 0) {
+        std::cerr << "--augment_sigma replaces the blur and cannot be combined with --wavelet_layers" << std::endl;
+        return -1;
+    }
+    bool pixelateRegionsOnly = !filterOptions.pixelateRegions.empty() && filterOptions.pixelateBlock == 0;
+    if (filterOptions.pixelateBlock == 1 || pixelateRegionsOnly) {
+        std::cerr << "--pixelate needs a cell size of at least 2 (--pixelate_region only limits where it applies)"
+                  << std::endl;
+        return -1;
+    }
+    if (filterOptions.pixelateBlock > 0 &&
+        (filterOptions.sigma > 0 || filterOptions.waveletLayers > 0 || bandOptions.workers > 0)) {
+        std::cerr << "--pixelate replaces the blur and cannot be combined with --sigma, --wavelet_layers or"
+                  << " --band_workers" << std::endl;
+        return -1;
+    }
+    if ((int)filterOptions.pixelateRegions.size() > kMaxPixelateRegions) {
+        std::cerr << "At most " << kMaxPixelateRegions << " --pixelate_region rectangles" << std::endl;
+        return -1;
+    }
+    if (tensorOptions.enabled &&
+        (bandOptions.workers > 0 || watchSeconds > 0 || augmentOptions.enabled() || labelOptions.enabled())) {
+        std::cerr << "--tensor_out cannot be combined with --band_workers, --watch, --augment or --label_threshold"
+                  << std::endl;
+        return -1;
+    }
+    for (double stddev : tensorOptions.stddev) {
+        if (stddev == 0) {
+            std::cerr << "--tensor_std values must be non-zero" << std::endl;
+            return -1;
+        }
+    }
+    if (augmentOptions.enabled() && (bandOptions.workers > 0 || watchSeconds > 0)) {
+        std::cerr << "--augment writes several outputs per input and cannot be combined with --band_workers or --watch"
+                  << std::endl;
+        return -1;
+    }
+    if (watchSeconds > 0 &&
+        (bandOptions.workers > 0 || benchTileOrder || benchTinyBatch || fp16Report || dryRun || probeBench)) {
+        std::cerr << "--watch only applies to regular processing" << std::endl;
+        return -1;
+    }
+    setFilterOptions(filterOptions);
+    if (incremental && (bandOptions.workers > 0 || watchSeconds > 0 || augmentOptions.enabled() ||
+                        tensorOptions.enabled || previewOptions.enabled())) {
+        std::cerr << "--incremental cannot be combined with --band_workers, --watch, --augment, --tensor_out or"
+                  << " --preview_dir" << std::endl;
+        return -1;
+    }
+    if (incremental && !filterSupportsTiles()) {
+        std::cerr << "--incremental recomputes single tiles and needs the 3x3 blur or --wavelet_layers; drop"
+                  << " --rotate, --remap and --sigma" << std::endl;
+        return -1;
+    }
+    if (tinyBatch != 0 && tinyBatch != 8 && tinyBatch != 16 && tinyBatch != kMaxTinyGroup) {
+        std::cerr << "--tiny_batch groups 8, 16 or " << kMaxTinyGroup << " images" << std::endl;
+        return -1;
+    }
+    if (tinyBatch > 0 && (bandOptions.workers > 0 || watchSeconds > 0 || incremental || augmentOptions.enabled() ||
+                          tensorOptions.enabled || overlayOptions.enabled())) {
+        std::cerr << "--tiny_batch cannot be combined with --band_workers, --watch, --incremental, --augment,"
+                  << " --tensor_out or --overlay" << std::endl;
+        return -1;
+    }
+    if ((tinyBatch > 0 || benchTinyBatch) && !tinyBatchSupported()) {
+        std::cerr << "--tiny_batch groups the 3x3 blur only; drop --rotate, --remap, --sigma, --wavelet_layers and"
+                  << " --pixelate" << std::endl;
+        return -1;
+    }
+    if (bayer.enabled && (bayer.width < 4 || bayer.height < 4 ||
+                          (bayer.bits != 8 && bayer.bits != 12 && bayer.bits != 16))) {
+        std::cerr << "--bayer needs --raw_size of at least 4x4 and --raw_bits 8, 12 or 16" << std::endl;
+        return -1;
+    }
+    if (bayer.enabled && (bandOptions.workers > 0 || previewOptions.enabled())) {
+        std::cerr << "--bayer cannot be combined with --band_workers or --preview_dir" << std::endl;
+        return -1;
+    }
+    for (double gain : bayer.gains) {
+        if (gain <= 0) {
+            std::cerr << "--white_balance gains must be positive" << std::endl;
+            return -1;
+        }
+    }
+    setBayerOptions(bayer);
+    // Band workers are separate processes, which the sampler does not follow
+    if (profilerOptions.enabled() && bandOptions.workers > 0) {
+        std::cerr << "--profile_out cannot be combined with --band_workers" << std::endl;
+        return -1;
+    }
+    bool remoteInput = isObjectUrl(inputDir);
+    bool remoteOutput = isObjectUrl(outputDir);
+    ObjectLocation location;
+    if ((remoteInput && !parseObjectUrl(inputDir, &location)) ||
+        (remoteOutput && !parseObjectUrl(outputDir, &location))) {
+        std::cerr << "Object store locations take the form s3://bucket/prefix" << std::endl;
+        return -1;
+    }
+    if ((remoteInput || remoteOutput) &&
+        (bandOptions.workers > 0 || watchSeconds > 0 || benchTileOrder || benchTinyBatch || fp16Report || dryRun ||
+         probeBench)) {
+        std::cerr << "s3:// directories only apply to regular and --incremental processing" << std::endl;
+        return -1;
+    }
+    if (remoteInput && (cacheMb > 0 || previewOptions.enabled())) {
+        std::cerr << "--cache_mb and --preview_dir need a local --input_dir" << std::endl;
+        return -1;
+    }
+    if (remoteOutput && (augmentOptions.enabled() || tensorOptions.enabled || labelOptions.enabled())) {
+        std::cerr << "--augment, --tensor_out and --label_threshold need a local --output_dir" << std::endl;
+        return -1;
+    }
+    // Output keys are <prefix>/<file name>
+    while (remoteOutput && outputDir.back() == '/') outputDir.pop_back();
 
-    if (!fs::exists(inputDir) || !fs::exists(outputDir)) {
+    if ((!remoteInput && !fs::exists(inputDir)) || (!remoteOutput && !fs::exists(outputDir)) ||
+        (!previewOptions.dir.empty() && !fs::exists(previewOptions.dir))) {
         std::cerr << "Input or output directory does not exist!" << std::endl;
         return -1;
     }
@@ -128,8 +1228,114 @@ int main(int argc, char** argv) {
         std::cerr << "Failed to open log file!" << std::endl;
         return -1;
     }
+    std::string profilerError;
+    if (profilerOptions.enabled() && !startProfiler(profilerOptions, &profilerError)) {
+        std::cerr << "--profile_out: " << profilerError << std::endl;
+        return -1;
+    }
+
+    // Size everything from what the container actually grants us, not from the host
+    ResourceLimits limits = detectResourceLimits();
+    PoolSizing sizing = derivePoolSizing(limits);
+    if (threads > 0) sizing.threads = threads;
+    if (memoryBudgetMb > 0) sizing.inFlightBytes = (uint64_t)memoryBudgetMb << 20;
+    // A large JPEG's restart intervals are huffman-coded on up to one thread per CPU
+    jpegOptions.threads = limits.cpus();
+    setJpegDecodeOptions(jpegOptions);
+    jpegEncoderOptions.threads = limits.cpus();
+    setJpegEncodeOptions(jpegEncoderOptions);
+    std::string limitsDescription = describeResourceLimits(limits, sizing);
+    std::cout << limitsDescription << std::endl;
+    logMessage(logFile, "INFO", limitsDescription);
+    if (bandOptions.workers > limits.cpus()) {
+        logMessage(logFile, "WARNING", std::to_string(bandOptions.workers) + " band workers exceed the " +
+                                           std::to_string(limits.cpus()) + " CPUs available");
+    }
+
+    // The cache lives across watch batches. It never takes more than half of
+    // the in-flight budget, so uncached work can still make progress.
+    std::unique_ptr<SourceCache> cache;
+    if (cacheMb > 0) {
+        uint64_t cacheBytes = std::min<uint64_t>((uint64_t)cacheMb << 20, sizing.inFlightBytes / 2);
+        cache.reset(new SourceCache(cacheBytes, cacheKeyMode));
+        logMessage(logFile, "INFO", "Source cache " + std::to_string(cacheBytes >> 20) + " MiB keyed by " +
+                                        (cacheKeyMode == CacheKeyMode::PathMtime ? "path+mtime" : "content hash"));
+    }
 
-    processImages(inputDir, outputDir, logFile);
+    if (watchSeconds > 0) {
+        watchImages(inputDir, outputDir, watchSeconds, previewOptions, labelOptions, overlayOptions, sizing, cache.get(),
+                    logFile);
+        stopProfiler(logFile);
+        logFile.close();
+        return 0;
+    }
+
+    // One client, and one pool of kept-alive connections, for the whole run
+    std::unique_ptr<ObjectStore> store;
+    if (remoteInput || remoteOutput) {
+        store.reset(new ObjectStore(objectStoreConfig()));
+        logMessage(logFile, "INFO", "Object store " + store->config().endpoint + " (region " +
+                                        store->config().region + ", " +
+                                        (store->config().accessKey.empty() ? "unsigned" : "SigV4") + ")");
+    }
+    // Object store inputs stream into the batch straight from the listing
+    if (remoteInput && !incremental) {
+        bool listed = processImages(objectInputs(*store, inputDir, logFile), outputDir, previewOptions, labelOptions,
+                                    augmentOptions, tensorOptions, overlayOptions, tinyBatch, sizing, cache.get(),
+                                    store.get(), logFile);
+        stopProfiler(logFile);
+        logFile.close();
+        return listed ? 0 : -1;
+    }
+
+    std::vector<std::string> imageFiles;
+    if (remoteInput) {
+        // Frames are processed in name order, so the whole listing comes first
+        if (!objectInputs(*store, inputDir, logFile)([&](const std::string& file) { imageFiles.push_back(file); })) {
+            stopProfiler(logFile);
+            return -1;
+        }
+    } else {
+        imageFiles = listImages(inputDir);
+    }
+    if (imageFiles.empty()) {
+        std::cerr << "No images found in " << inputDir << std::endl;
+        logFile << "[" << getTimestamp() << "] ERROR: No images found in " << inputDir << std::endl;
+        stopProfiler(logFile);
+        return -1;
+    }
+
+    if (dryRun) {
+        planImages(imageFiles, sizing, logFile);
+    } else if (probeBench) {
+        benchmarkProbe(imageFiles, logFile);
+    } else if (benchTileOrder) {
+        for (const auto& file : imageFiles) {
+            Mat img = imread(file, IMREAD_COLOR);
+            if (!img.empty()) benchmarkTileOrders(img, file, logFile);
+        }
+    } else if (benchTinyBatch) {
+        std::vector<Mat> images;
+        for (const auto& file : imageFiles) {
+            Mat img = imread(file, IMREAD_COLOR);
+            if (!img.empty()) images.push_back(img);
+        }
+        benchmarkTinyBatch(images, tinyBatch > 0 ? tinyBatch : kMaxTinyGroup, logFile);
+    } else if (fp16Report) {
+        for (const auto& file : imageFiles) {
+            Mat img = imread(file, IMREAD_COLOR);
+            if (!img.empty()) reportIntermediatePrecision(img, file, logFile);
+        }
+    } else if (bandOptions.workers > 0) {
+        processImagesInBands(imageFiles, outputDir, bandOptions, logFile);
+    } else if (incremental) {
+        processSequence(imageFiles, outputDir, labelOptions, overlayOptions, sizing, cache.get(), store.get(),
+                        logFile);
+    } else {
+        processImages(localInputs(imageFiles), outputDir, previewOptions, labelOptions, augmentOptions, tensorOptions,
+                      overlayOptions, tinyBatch, sizing, cache.get(), store.get(), logFile);
+    }
+    stopProfiler(logFile);
     logFile.close();
     return 0;
 }
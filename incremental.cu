@@ -0,0 +1,137 @@
+#include "incremental.h"
+
+#include <algorithm>
+#include <climits>
+#include <utility>
+
+#include "buffer_pool.h"
+
+namespace {
+
+// Dirty tiles of one frame, filled on the device and read back in one copy.
+struct DirtySummary {
+    int count;
+    int firstRow;  // tile rows spanned by the dirty tiles
+    int lastRow;
+    int padding;
+};
+
+// One block per tile: flag the tile if any byte differs from the previous
+// frame. Each thread compares its own pixel and the block votes, so the
+// compare runs at memory bandwidth and writes a single byte per tile.
+__global__ void diffTilesKernel(const unsigned char* current, const unsigned char* previous, int width, int height,
+                                int channels, unsigned char* changed) {
+    int x = blockIdx.x * kTileSize + threadIdx.x;
+    int y = blockIdx.y * kTileSize + threadIdx.y;
+    bool differs = false;
+    if (x < width && y < height) {
+        size_t offset = ((size_t)y * width + x) * channels;
+        for (int c = 0; c < channels; c++) differs |= current[offset + c] != previous[offset + c];
+    }
+    int any = __syncthreads_or(differs);
+    if (threadIdx.x == 0 && threadIdx.y == 0) changed[blockIdx.y * gridDim.x + blockIdx.x] = any ? 1 : 0;
+}
+
+// One thread per tile: a tile is dirty if a changed tile lies within `reach`
+// tiles of it (the filter radius, rounded up to whole tiles). Dirty tiles are
+// appended to `tiles` in no particular order; each is recomputed independently.
+__global__ void collectDirtyTilesKernel(const unsigned char* changed, int tilesX, int tilesY, int reach, bool all,
+                                        int* tiles, DirtySummary* summary) {
+    int tile = blockIdx.x * blockDim.x + threadIdx.x;
+    if (tile >= tilesX * tilesY) return;
+    int tileX = tile % tilesX;
+    int tileY = tile / tilesX;
+    bool dirty = all;
+    for (int ty = max(tileY - reach, 0); ty <= min(tileY + reach, tilesY - 1) && !dirty; ty++) {
+        for (int tx = max(tileX - reach, 0); tx <= min(tileX + reach, tilesX - 1) && !dirty; tx++) {
+            dirty = changed[ty * tilesX + tx] != 0;
+        }
+    }
+    if (!dirty) return;
+    tiles[atomicAdd(&summary->count, 1)] = tile;
+    atomicMin(&summary->firstRow, tileY);
+    atomicMax(&summary->lastRow, tileY);
+}
+
+}  // namespace
+
+IncrementalFilter::~IncrementalFilter() {
+    releaseBuffers();
+}
+
+void IncrementalFilter::releaseBuffers() {
+    DeviceBufferPool& pool = deviceBufferPool();
+    for (unsigned char** buffer : {&d_previous_, &d_current_, &d_output_, &d_state_}) {
+        if (*buffer) pool.release(*buffer);
+        *buffer = nullptr;
+    }
+    width_ = 0;
+    height_ = 0;
+    channels_ = 0;
+}
+
+bool IncrementalFilter::allocate(int width, int height, int channels) {
+    releaseBuffers();
+    TileGrid grid = makeTileGrid(width, height, TileOrder::RowMajor);
+    size_t tileCount = (size_t)grid.tilesX * grid.tilesY;
+    size_t size = (size_t)width * height * channels;
+    DeviceBufferPool& pool = deviceBufferPool();
+    d_previous_ = pool.acquire(size);
+    d_current_ = pool.acquire(size);
+    d_output_ = pool.acquire(size);
+    d_state_ = pool.acquire(sizeof(DirtySummary) + tileCount * (sizeof(int) + 1));
+    if (!d_previous_ || !d_current_ || !d_output_ || !d_state_) {
+        releaseBuffers();
+        return false;
+    }
+    width_ = width;
+    height_ = height;
+    channels_ = channels;
+    output_.create(height, width, CV_8UC(channels));
+    return true;
+}
+
+cv::Mat IncrementalFilter::filter(const unsigned char* d_frame, int width, int height, int channels,
+                                  cudaStream_t stream, const DeviceImageHook& onDevice,
+                                  const OverlayPlacement& overlay) {
+    bool full = width != width_ || height != height_ || channels != channels_;
+    if (full && !allocate(width, height, channels)) return cv::Mat();
+    size_t rowBytes = (size_t)width * channels;
+    cudaMemcpyAsync(d_current_, d_frame, rowBytes * height, cudaMemcpyDeviceToDevice, stream);
+
+    TileGrid grid = makeTileGrid(width, height, TileOrder::RowMajor);
+    int tileCount = grid.tilesX * grid.tilesY;
+    DirtySummary* d_summary = reinterpret_cast<DirtySummary*>(d_state_);
+    int* d_tiles = reinterpret_cast<int*>(d_state_ + sizeof(DirtySummary));
+    unsigned char* d_changed = d_state_ + sizeof(DirtySummary) + tileCount * sizeof(int);
+    if (!full) {
+        diffTilesKernel<<<dim3(grid.tilesX, grid.tilesY), tileBlock(), 0, stream>>>(d_current_, d_previous_, width,
+                                                                                    height, channels, d_changed);
+    }
+    DirtySummary summary = {0, INT_MAX, -1, 0};
+    cudaMemcpyAsync(d_summary, &summary, sizeof(summary), cudaMemcpyHostToDevice, stream);
+    int reach = (filterRadius() + kTileSize - 1) / kTileSize;
+    collectDirtyTilesKernel<<<(tileCount + 255) / 256, 256, 0, stream>>>(d_changed, grid.tilesX, grid.tilesY, reach,
+                                                                         full, d_tiles, d_summary);
+    cudaMemcpyAsync(&summary, d_summary, sizeof(summary), cudaMemcpyDeviceToHost, stream);
+    cudaStreamSynchronize(stream);  // the launch below is sized by the count
+
+    runFilterTiles(d_current_, d_output_, width, height, channels, d_tiles, summary.count, overlay, stream);
+    if (onDevice) onDevice(d_output_, width, height, channels, stream);
+    if (summary.count > 0) {
+        // Clean rows of the host copy are already current
+        int firstY = summary.firstRow * kTileSize;
+        int lastY = std::min(height, (summary.lastRow + 1) * kTileSize);
+        cudaMemcpyAsync(output_.ptr(firstY), d_output_ + firstY * rowBytes, (lastY - firstY) * rowBytes,
+                        cudaMemcpyDeviceToHost, stream);
+    }
+    if (cudaStreamSynchronize(stream) != cudaSuccess) {
+        releaseBuffers();  // start over from a full frame
+        return cv::Mat();
+    }
+    std::swap(d_current_, d_previous_);
+    frames_++;
+    tiles_ += tileCount;
+    recomputed_ += summary.count;
+    return output_;
+}
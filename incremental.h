@@ -0,0 +1,52 @@
+#ifndef INCREMENTAL_H_
+#define INCREMENTAL_H_
+
+#include <cuda_runtime.h>
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+
+#include "filters.h"
+
+// Filters a sequence of frames (video, screen captures) that mostly repeat
+// the previous one. Each frame is diffed against the previous frame tile by
+// tile on the device; only tiles within the filter radius of a changed tile
+// are recomputed, into an output buffer that keeps every other tile from the
+// previous frame, and only the rows holding recomputed tiles are downloaded.
+// The configured chain must pass filterSupportsTiles().
+class IncrementalFilter {
+public:
+    IncrementalFilter() = default;
+    ~IncrementalFilter();
+    IncrementalFilter(const IncrementalFilter&) = delete;
+    IncrementalFilter& operator=(const IncrementalFilter&) = delete;
+
+    // Filter the device frame `d_frame` (left owned by the caller) and return
+    // the whole result. The first frame, and any frame whose size or channel
+    // count differs from the previous one, is filtered in full. `overlay` must
+    // not move between frames of the same size. The returned Mat shares the
+    // buffer the next call updates. Empty on failure.
+    cv::Mat filter(const unsigned char* d_frame, int width, int height, int channels, cudaStream_t stream,
+                   const DeviceImageHook& onDevice = nullptr, const OverlayPlacement& overlay = {});
+
+    uint64_t frames() const { return frames_; }
+    uint64_t tiles() const { return tiles_; }
+    uint64_t recomputedTiles() const { return recomputed_; }
+
+private:
+    bool allocate(int width, int height, int channels);
+    void releaseBuffers();
+
+    int width_ = 0;
+    int height_ = 0;
+    int channels_ = 0;
+    unsigned char* d_previous_ = nullptr;  // last frame's input
+    unsigned char* d_current_ = nullptr;
+    unsigned char* d_output_ = nullptr;    // last frame's full result
+    unsigned char* d_state_ = nullptr;     // changed flags, dirty tile list and summary
+    cv::Mat output_;                       // host copy of d_output_
+    uint64_t frames_ = 0;
+    uint64_t tiles_ = 0;
+    uint64_t recomputed_ = 0;
+};
+
+#endif  // INCREMENTAL_H_
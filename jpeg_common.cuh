@@ -0,0 +1,20 @@
+#ifndef JPEG_COMMON_CUH_
+#define JPEG_COMMON_CUH_
+
+#include <cuda_runtime.h>
+
+// Shared by the JPEG decoder and encoder.
+
+// Natural-order index of the i-th coefficient in zigzag order.
+const int kZigzag[64] = {0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,  12, 19, 26, 33, 40, 48,
+                         41, 34, 27, 20, 13, 6,  7,  14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23,
+                         30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+// libjpeg's ISLOW DCTs (jidctint.c, jfdctint.c) work in 13-bit fixed point and
+// keep 2 extra bits between the row and column passes.
+constexpr int kConstBits = 13;
+constexpr int kPass1Bits = 2;
+
+__host__ __device__ __forceinline__ int descale(int x, int n) { return (x + (1 << (n - 1))) >> n; }
+
+#endif  // JPEG_COMMON_CUH_
@@ -0,0 +1,641 @@
+#include "jpeg_decoder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "jpeg_common.cuh"
+#include "profiler.h"
+#include "resource_limits.h"
+
+namespace {
+
+JpegDecodeOptions options;
+std::atomic<uint64_t> nativeDecodes(0);
+std::atomic<uint64_t> fallbackDecodes(0);
+
+const int kFastBits = 9;
+const int kBlocksPerCta = 32;  // 8 threads per 8x8 block
+
+struct HuffmanTable {
+    bool defined = false;
+    uint16_t fast[1 << kFastBits];  // length << 8 | symbol for codes of at most kFastBits, else 0
+    int maxCode[18];                // largest code of each length, -1 if none
+    int valueOffset[17];
+    uint8_t values[256];
+};
+
+bool buildHuffmanTable(const uint8_t* counts, const uint8_t* symbols, int symbolCount, HuffmanTable* table) {
+    std::memset(table->fast, 0, sizeof(table->fast));
+    int code = 0;
+    int k = 0;
+    for (int length = 1; length <= 16; length++) {
+        table->valueOffset[length] = k - code;
+        for (int i = 0; i < counts[length - 1]; i++, code++, k++) {
+            // Every code must fit in its length (libjpeg's JERR_BAD_HUFF_TABLE), or
+            // the fill below runs past the fast table
+            if (k >= symbolCount || code >= (1 << length)) return false;
+            table->values[k] = symbols[k];
+            if (length <= kFastBits) {
+                int shift = kFastBits - length;
+                for (int fill = 0; fill < (1 << shift); fill++) {
+                    table->fast[(code << shift) | fill] = (uint16_t)(length << 8 | symbols[k]);
+                }
+            }
+        }
+        table->maxCode[length] = counts[length - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+    table->maxCode[17] = INT_MAX;
+    table->defined = true;
+    return true;
+}
+
+// MSB-first reader over one restart interval. Stuffed 0xFF00 pairs are
+// collapsed; past the end it feeds zeros, which a valid stream never reaches.
+class BitReader {
+public:
+    BitReader(const uint8_t* begin, const uint8_t* end) : p_(begin), end_(end) {}
+
+    int decode(const HuffmanTable& table) {
+        if (bits_ < 16) fill();
+        uint16_t entry = table.fast[buffer_ >> (64 - kFastBits)];
+        if (entry) {
+            consume(entry >> 8);
+            return entry & 0xFF;
+        }
+        int length = kFastBits + 1;
+        int code = (int)(buffer_ >> (64 - length));
+        while (code > table.maxCode[length]) {
+            length++;
+            code = (int)(buffer_ >> (64 - length));
+        }
+        if (length > 16) return -1;
+        consume(length);
+        return table.values[table.valueOffset[length] + code];
+    }
+
+    // Read `size` bits and sign-extend them as in JPEG's EXTEND().
+    int receiveExtend(int size) {
+        if (size == 0) return 0;
+        if (bits_ < size) fill();
+        int value = (int)(buffer_ >> (64 - size));
+        consume(size);
+        return value < (1 << (size - 1)) ? value - (1 << size) + 1 : value;
+    }
+
+private:
+    void fill() {
+        while (bits_ <= 56) {
+            uint64_t byte = 0;
+            if (p_ < end_) {
+                byte = *p_++;
+                if (byte == 0xFF && p_ < end_) p_++;  // skip the stuffed zero
+            }
+            buffer_ |= byte << (56 - bits_);
+            bits_ += 8;
+        }
+    }
+
+    void consume(int n) {
+        buffer_ <<= n;
+        bits_ -= n;
+    }
+
+    const uint8_t* p_;
+    const uint8_t* end_;
+    uint64_t buffer_ = 0;
+    int bits_ = 0;
+};
+
+struct Component {
+    int id;
+    int h;
+    int v;
+    int quantTable;
+    int dcTable;
+    int acTable;
+    int blocksPerLine;
+    int blockRows;
+    size_t coefficientOffset;  // in coefficients
+};
+
+struct JpegHeader {
+    int width = 0;
+    int height = 0;
+    int restartInterval = 0;
+    int maxH = 1;
+    int maxV = 1;
+    int mcusX = 0;
+    int mcusY = 0;
+    std::vector<Component> components;
+    uint16_t quant[4][64];  // natural order
+    HuffmanTable dc[4];
+    HuffmanTable ac[4];
+    size_t scanStart = 0;  // first byte of entropy-coded data
+};
+
+uint16_t be16(const uint8_t* p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+// EXIF orientation tag, or 1 if absent.
+int exifOrientation(const uint8_t* app1, size_t length) {
+    if (length < 14 || std::memcmp(app1, "Exif\0\0", 6) != 0) return 1;
+    const uint8_t* tiff = app1 + 6;
+    size_t size = length - 6;
+    bool little = tiff[0] == 'I';
+    auto u16 = [&](const uint8_t* p) { return little ? (uint16_t)(p[0] | p[1] << 8) : be16(p); };
+    auto u32 = [&](const uint8_t* p) {
+        return little ? (uint32_t)u16(p) | (uint32_t)u16(p + 2) << 16 : (uint32_t)be16(p) << 16 | be16(p + 2);
+    };
+    uint32_t ifd = u32(tiff + 4);
+    if (ifd + 2 > size) return 1;
+    int count = u16(tiff + ifd);
+    for (int i = 0; i < count && ifd + 2 + (i + 1) * 12 <= size; i++) {
+        const uint8_t* entry = tiff + ifd + 2 + i * 12;
+        if (u16(entry) == 0x0112) return u16(entry + 8);
+    }
+    return 1;
+}
+
+// Parse everything up to the first scan. Fails on anything but a single
+// interleaved baseline scan in 8-bit gray or YCbCr with 4:4:4, 4:2:2 or 4:2:0.
+bool parseHeader(const std::vector<uint8_t>& data, JpegHeader* header) {
+    size_t size = data.size();
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+    bool sawFrame = false;
+    int adobeTransform = -1;
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return false;
+        uint8_t marker = data[pos + 1];
+        if (marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            pos += 2;
+            continue;
+        }
+        if (marker == 0xD9) return false;
+        size_t length = be16(&data[pos + 2]);
+        if (length < 2 || pos + 2 + length > size) return false;
+        const uint8_t* segment = &data[pos + 4];
+        size_t segmentLength = length - 2;
+
+        switch (marker) {
+            case 0xC0:
+            case 0xC1: {
+                if (segmentLength < 6 || segment[0] != 8) return false;
+                header->height = be16(segment + 1);
+                header->width = be16(segment + 3);
+                int count = segment[5];
+                if ((count != 1 && count != 3) || segmentLength < 6 + 3u * count || header->width == 0 ||
+                    header->height == 0) {
+                    return false;
+                }
+                for (int i = 0; i < count; i++) {
+                    Component c = {};
+                    c.id = segment[6 + 3 * i];
+                    c.h = segment[7 + 3 * i] >> 4;
+                    c.v = segment[7 + 3 * i] & 15;
+                    c.quantTable = segment[8 + 3 * i] & 3;
+                    header->components.push_back(c);
+                }
+                sawFrame = true;
+                break;
+            }
+            case 0xC4: {
+                size_t p = 0;
+                while (p + 17 <= segmentLength) {
+                    int tableClass = segment[p] >> 4;
+                    int index = segment[p] & 3;
+                    int total = 0;
+                    for (int i = 0; i < 16; i++) total += segment[p + 1 + i];
+                    if (total > 256 || p + 17 + total > segmentLength) return false;
+                    HuffmanTable* table = tableClass == 0 ? &header->dc[index] : &header->ac[index];
+                    if (!buildHuffmanTable(&segment[p + 1], &segment[p + 17], total, table)) return false;
+                    p += 17 + total;
+                }
+                break;
+            }
+            case 0xDB: {
+                size_t p = 0;
+                while (p < segmentLength) {
+                    bool wide = segment[p] >> 4;
+                    int index = segment[p] & 3;
+                    if (p + 1 + (wide ? 128 : 64) > segmentLength) return false;
+                    for (int i = 0; i < 64; i++) {
+                        header->quant[index][kZigzag[i]] =
+                            wide ? be16(&segment[p + 1 + 2 * i]) : segment[p + 1 + i];
+                    }
+                    p += 1 + (wide ? 128 : 64);
+                }
+                break;
+            }
+            case 0xDD:
+                if (segmentLength < 2) return false;
+                header->restartInterval = be16(segment);
+                break;
+            case 0xE1:
+                if (exifOrientation(segment, segmentLength) != 1) return false;
+                break;
+            case 0xEE:
+                if (segmentLength >= 12 && std::memcmp(segment, "Adobe", 5) == 0) adobeTransform = segment[11];
+                break;
+            case 0xDA: {
+                if (!sawFrame || segmentLength < 1) return false;
+                int count = segment[0];
+                if (count != (int)header->components.size() || segmentLength < 1 + 2u * count + 3) return false;
+                for (int i = 0; i < count; i++) {
+                    Component& c = header->components[i];
+                    if (segment[1 + 2 * i] != c.id) return false;
+                    c.dcTable = segment[2 + 2 * i] >> 4 & 3;
+                    c.acTable = segment[2 + 2 * i] & 3;
+                    if (!header->dc[c.dcTable].defined || !header->ac[c.acTable].defined) return false;
+                }
+                header->scanStart = pos + 2 + length;
+                if (header->components.size() == 3 && adobeTransform == 0) return false;  // RGB, not YCbCr
+                return true;
+            }
+            default:
+                // Progressive, lossless, hierarchical and arithmetic-coded frames
+                if (marker >= 0xC2 && marker <= 0xCF) return false;
+                break;
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+
+// Work out the MCU grid and coefficient layout. Returns the total number of
+// coefficients, or 0 for a sampling layout this decoder does not handle.
+size_t layoutComponents(JpegHeader* header) {
+    std::vector<Component>& components = header->components;
+    if (components.size() == 1) {
+        // A single-component scan is never interleaved: one block per MCU
+        components[0].h = components[0].v = 1;
+    } else {
+        const Component& y = components[0];
+        bool lumaOk = (y.h == 1 && y.v == 1) || (y.h == 2 && y.v == 1) || (y.h == 2 && y.v == 2);
+        bool chromaOk = components[1].h == 1 && components[1].v == 1 && components[2].h == 1 && components[2].v == 1;
+        if (!lumaOk || !chromaOk) return 0;
+    }
+    header->maxH = components[0].h;
+    header->maxV = components[0].v;
+    header->mcusX = (header->width + 8 * header->maxH - 1) / (8 * header->maxH);
+    header->mcusY = (header->height + 8 * header->maxV - 1) / (8 * header->maxV);
+    size_t total = 0;
+    for (Component& c : components) {
+        c.blocksPerLine = header->mcusX * c.h;
+        c.blockRows = header->mcusY * c.v;
+        c.coefficientOffset = total;
+        total += (size_t)c.blocksPerLine * c.blockRows * 64;
+    }
+    return total;
+}
+
+// Split the entropy-coded data at RSTn markers. Returns false if the scan is
+// not terminated by a marker.
+bool splitRestartIntervals(const std::vector<uint8_t>& data, size_t start,
+                           std::vector<std::pair<const uint8_t*, const uint8_t*>>* segments) {
+    const uint8_t* begin = data.data() + start;
+    const uint8_t* p = begin;
+    const uint8_t* end = data.data() + data.size();
+    while (p + 1 < end) {
+        p = static_cast<const uint8_t*>(std::memchr(p, 0xFF, end - p - 1));
+        if (!p) return false;
+        uint8_t next = p[1];
+        if (next == 0x00 || next == 0xFF) {
+            p += next == 0x00 ? 2 : 1;
+        } else if (next >= 0xD0 && next <= 0xD7) {
+            segments->push_back({begin, p});
+            p += 2;
+            begin = p;
+        } else {
+            segments->push_back({begin, p});
+            return true;
+        }
+    }
+    return false;
+}
+
+// Entropy-decode MCUs [firstMcu, lastMcu) of one restart interval into `coefficients`.
+bool decodeInterval(const JpegHeader& header, const uint8_t* begin, const uint8_t* end, int firstMcu, int lastMcu,
+                    int16_t* coefficients) {
+    BitReader reader(begin, end);
+    int predictors[3] = {0, 0, 0};
+    for (int mcu = firstMcu; mcu < lastMcu; mcu++) {
+        int mcuX = mcu % header.mcusX;
+        int mcuY = mcu / header.mcusX;
+        for (size_t ci = 0; ci < header.components.size(); ci++) {
+            const Component& c = header.components[ci];
+            const HuffmanTable& dc = header.dc[c.dcTable];
+            const HuffmanTable& ac = header.ac[c.acTable];
+            for (int v = 0; v < c.v; v++) {
+                for (int h = 0; h < c.h; h++) {
+                    size_t block = (size_t)(mcuY * c.v + v) * c.blocksPerLine + mcuX * c.h + h;
+                    int16_t* out = coefficients + c.coefficientOffset + block * 64;
+                    int size = reader.decode(dc);
+                    if (size < 0 || size > 11) return false;
+                    predictors[ci] += reader.receiveExtend(size);
+                    out[0] = (int16_t)predictors[ci];
+                    for (int k = 1; k < 64;) {
+                        int rs = reader.decode(ac);
+                        if (rs < 0) return false;
+                        int run = rs >> 4;
+                        size = rs & 15;
+                        if (size == 0) {
+                            if (run != 15) break;  // end of block
+                            k += 16;
+                            continue;
+                        }
+                        k += run;
+                        if (k > 63) return false;
+                        out[kZigzag[k++]] = (int16_t)reader.receiveExtend(size);
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// One 1-D pass of the ISLOW IDCT, descaling the outputs by `shift` bits. The
+// multipliers are jidctint.c's FIX() constants.
+__device__ __forceinline__ void idct1d(int i0, int i1, int i2, int i3, int i4, int i5, int i6, int i7, int shift,
+                                       int* out) {
+    int z1 = (i2 + i6) * 4433;
+    int tmp2 = z1 + i6 * -15137;
+    int tmp3 = z1 + i2 * 6270;
+    int tmp0 = (i0 + i4) << kConstBits;
+    int tmp1 = (i0 - i4) << kConstBits;
+    int tmp10 = tmp0 + tmp3;
+    int tmp13 = tmp0 - tmp3;
+    int tmp11 = tmp1 + tmp2;
+    int tmp12 = tmp1 - tmp2;
+
+    tmp0 = i7;
+    tmp1 = i5;
+    tmp2 = i3;
+    tmp3 = i1;
+    z1 = tmp0 + tmp3;
+    int z2 = tmp1 + tmp2;
+    int z3 = tmp0 + tmp2;
+    int z4 = tmp1 + tmp3;
+    int z5 = (z3 + z4) * 9633;
+    tmp0 *= 2446;
+    tmp1 *= 16819;
+    tmp2 *= 25172;
+    tmp3 *= 12299;
+    z1 *= -7373;
+    z2 *= -20995;
+    z3 = z3 * -16069 + z5;
+    z4 = z4 * -3196 + z5;
+    tmp0 += z1 + z3;
+    tmp1 += z2 + z4;
+    tmp2 += z2 + z3;
+    tmp3 += z1 + z4;
+
+    out[0] = descale(tmp10 + tmp3, shift);
+    out[7] = descale(tmp10 - tmp3, shift);
+    out[1] = descale(tmp11 + tmp2, shift);
+    out[6] = descale(tmp11 - tmp2, shift);
+    out[2] = descale(tmp12 + tmp1, shift);
+    out[5] = descale(tmp12 - tmp1, shift);
+    out[3] = descale(tmp13 + tmp0, shift);
+    out[4] = descale(tmp13 - tmp0, shift);
+}
+
+// Dequantize and inverse-transform one component. Each 8x8 block gets 8
+// threads: a column each for the first pass, a row each for the second.
+__global__ void idctKernel(const int16_t* coefficients, const uint16_t* quant, unsigned char* plane,
+                           int blocksPerLine, int blockCount, int planeStride) {
+    __shared__ int workspace[kBlocksPerCta][64];
+    int local = threadIdx.x / 8;
+    int lane = threadIdx.x % 8;
+    int block = blockIdx.x * kBlocksPerCta + local;
+    bool active = block < blockCount;
+    int* ws = workspace[local];
+
+    if (active) {
+        const int16_t* in = coefficients + (size_t)block * 64;
+        int column[8];
+        for (int k = 0; k < 8; k++) column[k] = in[k * 8 + lane] * quant[k * 8 + lane];
+        int out[8];
+        idct1d(column[0], column[1], column[2], column[3], column[4], column[5], column[6], column[7],
+               kConstBits - kPass1Bits, out);
+        for (int k = 0; k < 8; k++) ws[k * 8 + lane] = out[k];
+    }
+    __syncthreads();
+
+    if (active) {
+        const int* row = ws + lane * 8;
+        int out[8];
+        idct1d(row[0], row[1], row[2], row[3], row[4], row[5], row[6], row[7], kConstBits + kPass1Bits + 3, out);
+        int bx = block % blocksPerLine;
+        int by = block / blocksPerLine;
+        unsigned char* dst = plane + (size_t)(by * 8 + lane) * planeStride + bx * 8;
+        for (int k = 0; k < 8; k++) dst[k] = (unsigned char)min(max(out[k] + 128, 0), 255);
+    }
+}
+
+// libjpeg's fancy (triangular) upsampling of one chroma sample for output
+// pixel (x, y), with the edges replicated as jdsample.c does.
+__device__ int upsampleChroma(const unsigned char* plane, int stride, int chromaWidth, int chromaHeight, int x,
+                              int y, int hFactor, int vFactor) {
+    int cx = x / hFactor;
+    int cy = y / vFactor;
+    if (hFactor == 1) return plane[(size_t)cy * stride + cx];
+    int neighbourX = min(max(x & 1 ? cx + 1 : cx - 1, 0), chromaWidth - 1);
+    if (vFactor == 1) {
+        const unsigned char* row = plane + (size_t)cy * stride;
+        return (3 * row[cx] + row[neighbourX] + (x & 1 ? 2 : 1)) >> 2;
+    }
+    int neighbourY = min(max(y & 1 ? cy + 1 : cy - 1, 0), chromaHeight - 1);
+    const unsigned char* row = plane + (size_t)cy * stride;
+    const unsigned char* other = plane + (size_t)neighbourY * stride;
+    int thisSum = 3 * row[cx] + other[cx];
+    int neighbourSum = 3 * row[neighbourX] + other[neighbourX];
+    return (3 * thisSum + neighbourSum + (x & 1 ? 7 : 8)) >> 4;
+}
+
+// Upsample chroma and convert to interleaved BGR with jdcolor.c's fixed point.
+__global__ void colorConvertKernel(const unsigned char* luma, int lumaStride, const unsigned char* cb,
+                                   const unsigned char* cr, int chromaStride, int chromaWidth, int chromaHeight,
+                                   int hFactor, int vFactor, unsigned char* output, int width, int height) {
+    int x = blockIdx.x * blockDim.x + threadIdx.x;
+    int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+    int Y = luma[(size_t)y * lumaStride + x];
+    unsigned char* out = output + ((size_t)y * width + x) * 3;
+    if (!cb) {
+        out[0] = out[1] = out[2] = (unsigned char)Y;
+        return;
+    }
+    int Cb = upsampleChroma(cb, chromaStride, chromaWidth, chromaHeight, x, y, hFactor, vFactor) - 128;
+    int Cr = upsampleChroma(cr, chromaStride, chromaWidth, chromaHeight, x, y, hFactor, vFactor) - 128;
+    int r = Y + ((91881 * Cr + 32768) >> 16);
+    int g = Y + ((-22554 * Cb - 46802 * Cr + 32768) >> 16);
+    int b = Y + ((116130 * Cb + 32768) >> 16);
+    out[0] = (unsigned char)min(max(b, 0), 255);
+    out[1] = (unsigned char)min(max(g, 0), 255);
+    out[2] = (unsigned char)min(max(r, 0), 255);
+}
+
+bool readFile(const std::string& file, std::vector<uint8_t>* data) {
+    std::ifstream in(file, std::ios::binary | std::ios::ate);
+    if (!in) return false;
+    data->resize((size_t)in.tellg());
+    in.seekg(0);
+    return (bool)in.read(reinterpret_cast<char*>(data->data()), data->size());
+}
+
+// Entropy-decode every restart interval, spreading them over up to
+// options.threads threads. Small images decode on the calling thread.
+bool decodeScan(const JpegHeader& header, const std::vector<std::pair<const uint8_t*, const uint8_t*>>& segments,
+                int16_t* coefficients) {
+    int totalMcus = header.mcusX * header.mcusY;
+    int interval = header.restartInterval > 0 ? header.restartInterval : totalMcus;
+    int count = (totalMcus + interval - 1) / interval;
+    if ((int)segments.size() < count) return false;  // truncated
+
+    auto decodeSegment = [&](int i) {
+        return decodeInterval(header, segments[i].first, segments[i].second, i * interval,
+                              std::min(totalMcus, (i + 1) * interval), coefficients);
+    };
+    const int kParallelMinPixels = 1 << 20;
+    int threads = std::min(options.threads, count);
+    if (threads < 2 || (int64_t)header.width * header.height < kParallelMinPixels) {
+        for (int i = 0; i < count; i++) {
+            if (!decodeSegment(i)) return false;
+        }
+        return true;
+    }
+
+    // Intervals are handed out in small batches so uneven entropy density
+    // still balances across threads.
+    CpuShare share(threads);
+    threads = share.threads();
+    std::atomic<int> next(0);
+    std::atomic<bool> ok(true);
+    int batch = std::max(1, count / (threads * 8));
+    std::vector<std::thread> workers;
+    const char* stage = currentProfileStage();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&] {
+            ProfiledThread profiled(stage);
+            for (int first = next.fetch_add(batch); first < count && ok; first = next.fetch_add(batch)) {
+                for (int i = first; i < std::min(count, first + batch); i++) {
+                    if (!decodeSegment(i)) ok = false;
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    return ok;
+}
+
+bool decodeNative(const std::vector<uint8_t>& data, unsigned char** d_image, int* width, int* height,
+                  cudaStream_t stream) {
+    JpegHeader header;
+    if (!parseHeader(data, &header)) return false;
+    size_t coefficientCount = layoutComponents(&header);
+    if (coefficientCount == 0) return false;
+    std::vector<std::pair<const uint8_t*, const uint8_t*>> segments;
+    if (!splitRestartIntervals(data, header.scanStart, &segments)) return false;
+
+    std::vector<int16_t> coefficients(coefficientCount + header.components.size() * 64);
+    if (!decodeScan(header, segments, coefficients.data())) return false;
+    // Quantization tables ride along after the coefficients as 16-bit values
+    uint16_t* quant = reinterpret_cast<uint16_t*>(coefficients.data() + coefficientCount);
+    for (size_t i = 0; i < header.components.size(); i++) {
+        std::memcpy(quant + i * 64, header.quant[header.components[i].quantTable], 64 * sizeof(uint16_t));
+    }
+
+    size_t planesSize = 0;
+    for (const Component& c : header.components) planesSize += (size_t)c.blocksPerLine * c.blockRows * 64;
+    size_t coefficientBytes = coefficients.size() * sizeof(int16_t);
+    size_t outputSize = (size_t)header.width * header.height * 3;
+    DeviceBufferPool& pool = deviceBufferPool();
+    unsigned char* d_coefficients = pool.acquire(coefficientBytes);
+    unsigned char* d_planes = pool.acquire(planesSize);
+    unsigned char* d_output = pool.acquire(outputSize);
+    if (!d_coefficients || !d_planes || !d_output) {
+        pool.release(d_coefficients);
+        pool.release(d_planes);
+        pool.release(d_output);
+        return false;
+    }
+
+    cudaMemcpyAsync(d_coefficients, coefficients.data(), coefficientBytes, cudaMemcpyHostToDevice, stream);
+    const int16_t* d_coefficientBase = reinterpret_cast<const int16_t*>(d_coefficients);
+    const uint16_t* d_quant = reinterpret_cast<const uint16_t*>(d_coefficientBase + coefficientCount);
+    std::vector<unsigned char*> planes;
+    unsigned char* plane = d_planes;
+    for (size_t i = 0; i < header.components.size(); i++) {
+        const Component& c = header.components[i];
+        int blockCount = c.blocksPerLine * c.blockRows;
+        idctKernel<<<(blockCount + kBlocksPerCta - 1) / kBlocksPerCta, kBlocksPerCta * 8, 0, stream>>>(
+            d_coefficientBase + c.coefficientOffset, d_quant + i * 64, plane, c.blocksPerLine, blockCount,
+            c.blocksPerLine * 8);
+        planes.push_back(plane);
+        plane += (size_t)blockCount * 64;
+    }
+
+    const Component& luma = header.components[0];
+    bool color = header.components.size() == 3;
+    dim3 blockSize(16, 16);
+    dim3 gridSize((header.width + 15) / 16, (header.height + 15) / 16);
+    colorConvertKernel<<<gridSize, blockSize, 0, stream>>>(
+        planes[0], luma.blocksPerLine * 8, color ? planes[1] : nullptr, color ? planes[2] : nullptr,
+        color ? header.components[1].blocksPerLine * 8 : 0, (header.width + luma.h - 1) / luma.h,
+        (header.height + luma.v - 1) / luma.v, luma.h, luma.v, d_output, header.width, header.height);
+    cudaError_t status = cudaStreamSynchronize(stream);
+
+    pool.release(d_coefficients);
+    pool.release(d_planes);
+    if (status != cudaSuccess) {
+        pool.release(d_output);
+        return false;
+    }
+    *d_image = d_output;
+    *width = header.width;
+    *height = header.height;
+    return true;
+}
+
+}  // namespace
+
+void setJpegDecodeOptions(const JpegDecodeOptions& newOptions) { options = newOptions; }
+
+const JpegDecodeOptions& jpegDecodeOptions() { return options; }
+
+bool decodeJpegToDevice(const std::string& file, unsigned char** d_image, int* width, int* height,
+                        cudaStream_t stream) {
+    std::vector<uint8_t> data;
+    if (options.enabled && readFile(file, &data) && decodeNative(data, d_image, width, height, stream)) {
+        nativeDecodes++;
+        return true;
+    }
+    fallbackDecodes++;
+    return false;
+}
+
+bool decodeJpegToDevice(const std::vector<uint8_t>& data, unsigned char** d_image, int* width, int* height,
+                        cudaStream_t stream) {
+    if (options.enabled && decodeNative(data, d_image, width, height, stream)) {
+        nativeDecodes++;
+        return true;
+    }
+    fallbackDecodes++;
+    return false;
+}
+
+uint64_t jpegNativeDecodes() { return nativeDecodes; }
+
+uint64_t jpegFallbackDecodes() { return fallbackDecodes; }
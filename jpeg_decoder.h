@@ -0,0 +1,37 @@
+#ifndef JPEG_DECODER_H_
+#define JPEG_DECODER_H_
+
+#include <cuda_runtime.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Process-wide decoder configuration, set once from the command line.
+struct JpegDecodeOptions {
+    bool enabled = true;  // false: always use imread
+    int threads = 1;      // entropy-decode threads for images with restart markers, split among concurrent decodes
+};
+
+void setJpegDecodeOptions(const JpegDecodeOptions& options);
+const JpegDecodeOptions& jpegDecodeOptions();
+
+// Decode a baseline (huffman, 8-bit) JPEG straight into an interleaved BGR
+// device buffer from deviceBufferPool(), which the caller releases. Entropy
+// decoding runs on the CPU, split across threads at restart markers; IDCT,
+// chroma upsampling and colour conversion run on `stream` and match libjpeg's
+// defaults (ISLOW IDCT, fancy upsampling) bit for bit.
+//
+// Returns false without allocating for progressive, arithmetic-coded, 12-bit,
+// CMYK/RGB, EXIF-rotated or otherwise unsupported files; use imread for those.
+bool decodeJpegToDevice(const std::string& file, unsigned char** d_image, int* width, int* height,
+                        cudaStream_t stream = 0);
+
+// Same, for a file already in memory (an object store download).
+bool decodeJpegToDevice(const std::vector<uint8_t>& data, unsigned char** d_image, int* width, int* height,
+                        cudaStream_t stream = 0);
+
+// Images decoded natively vs. handed back to imread, since startup.
+uint64_t jpegNativeDecodes();
+uint64_t jpegFallbackDecodes();
+
+#endif  // JPEG_DECODER_H_
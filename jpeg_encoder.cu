@@ -0,0 +1,482 @@
+#include "jpeg_encoder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+#include "buffer_pool.h"
+#include "jpeg_common.cuh"
+#include "profiler.h"
+#include "resource_limits.h"
+
+namespace {
+
+JpegEncodeOptions options;
+
+const int kBlocksPerCta = 32;  // 8 threads per 8x8 block
+
+// ITU T.81 Annex K tables, as libjpeg's jcparam.c / jstdhuff.c.
+const uint8_t kLumaQuant[64] = {16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+                                14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+                                18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+                                49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+const uint8_t kChromaQuant[64] = {17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+                                  24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+                                  99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+                                  99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+
+const uint8_t kDcLumaBits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+const uint8_t kDcChromaBits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+const uint8_t kDcValues[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+const uint8_t kAcLumaBits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+const uint8_t kAcLumaValues[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71,
+    0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
+    0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+const uint8_t kAcChromaBits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+const uint8_t kAcChromaValues[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+    0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+    0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+    0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+// Zigzag position of each natural-order coefficient.
+__constant__ int kNaturalToZigzag[64] = {0,  1,  5,  6,  14, 15, 27, 28, 2,  4,  7,  13, 16, 26, 29, 42,
+                                         3,  8,  12, 17, 25, 30, 41, 43, 9,  11, 18, 24, 31, 40, 44, 53,
+                                         10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,
+                                         21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63};
+
+struct HuffmanCode {
+    uint16_t code[256];
+    uint8_t size[256];
+};
+
+void buildHuffmanCode(const uint8_t* bits, const uint8_t* values, HuffmanCode* table) {
+    std::memset(table->size, 0, sizeof(table->size));
+    int code = 0;
+    int k = 0;
+    for (int length = 1; length <= 16; length++) {
+        for (int i = 0; i < bits[length - 1]; i++, k++, code++) {
+            table->code[values[k]] = (uint16_t)code;
+            table->size[values[k]] = (uint8_t)length;
+        }
+        code <<= 1;
+    }
+}
+
+// libjpeg's jpeg_quality_scaling + jpeg_add_quant_table with force_baseline.
+void scaleQuantTable(const uint8_t* base, int quality, uint16_t* table) {
+    quality = std::min(std::max(quality, 1), 100);
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (int i = 0; i < 64; i++) {
+        table[i] = (uint16_t)std::min(std::max((base[i] * scale + 50) / 100, 1), 255);
+    }
+}
+
+// MSB-first writer with 0xFF byte stuffing; pads the last byte with ones.
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t>* out) : out_(out) {}
+
+    void put(uint32_t code, int size) {
+        buffer_ = buffer_ << size | (code & ((1u << size) - 1));
+        bits_ += size;
+        while (bits_ >= 8) {
+            uint8_t byte = (uint8_t)(buffer_ >> (bits_ - 8));
+            out_->push_back(byte);
+            if (byte == 0xFF) out_->push_back(0);
+            bits_ -= 8;
+        }
+    }
+
+    void flush() {
+        if (bits_ > 0) put(0x7F, 8 - bits_);
+    }
+
+private:
+    std::vector<uint8_t>* out_;
+    uint64_t buffer_ = 0;
+    int bits_ = 0;
+};
+
+struct Component {
+    int id;
+    int h;
+    int v;
+    int blocksPerLine;  // blocks that hold image data
+    int blockRows;
+    size_t coefficientOffset;
+    const uint16_t* quant;
+    const HuffmanCode* dc;
+    const HuffmanCode* ac;
+};
+
+struct Layout {
+    int width;
+    int height;
+    int maxH;
+    int maxV;
+    int mcusX;
+    int mcusY;
+    std::vector<Component> components;
+};
+
+int bitLength(int value) {
+    int magnitude = value < 0 ? -value : value;
+    int bits = 0;
+    while (magnitude) {
+        bits++;
+        magnitude >>= 1;
+    }
+    return bits;
+}
+
+void encodeBlock(BitWriter& writer, const int16_t* block, int dc, int* predictor, const HuffmanCode& dcCode,
+                 const HuffmanCode& acCode) {
+    int diff = dc - *predictor;
+    *predictor = dc;
+    int size = bitLength(diff);
+    writer.put(dcCode.code[size], dcCode.size[size]);
+    if (size) writer.put(diff < 0 ? diff - 1 : diff, size);
+
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        int value = block ? block[k] : 0;
+        if (value == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            writer.put(acCode.code[0xF0], acCode.size[0xF0]);
+            run -= 16;
+        }
+        size = bitLength(value);
+        int symbol = run << 4 | size;
+        writer.put(acCode.code[symbol], acCode.size[symbol]);
+        writer.put(value < 0 ? value - 1 : value, size);
+        run = 0;
+    }
+    if (run > 0) writer.put(acCode.code[0], acCode.size[0]);
+}
+
+// Huffman-code one MCU row as a restart interval. Blocks past the image's
+// last block row/column are libjpeg's dummy blocks: no AC, and the DC of the
+// block before them in the MCU.
+void encodeMcuRow(const Layout& layout, const int16_t* coefficients, int mcuY, std::vector<uint8_t>* out) {
+    BitWriter writer(out);
+    int predictors[3] = {0, 0, 0};
+    int dcs[4];
+    for (int mcuX = 0; mcuX < layout.mcusX; mcuX++) {
+        for (size_t ci = 0; ci < layout.components.size(); ci++) {
+            const Component& c = layout.components[ci];
+            for (int v = 0; v < c.v; v++) {
+                for (int h = 0; h < c.h; h++) {
+                    int bx = mcuX * c.h + h;
+                    int by = mcuY * c.v + v;
+                    const int16_t* block = nullptr;
+                    int dc;
+                    if (by >= c.blockRows) {
+                        dc = dcs[(v - 1) * c.h + c.h - 1];
+                    } else if (bx >= c.blocksPerLine) {
+                        dc = dcs[v * c.h + h - 1];
+                    } else {
+                        block = coefficients + c.coefficientOffset + ((size_t)by * c.blocksPerLine + bx) * 64;
+                        dc = block[0];
+                    }
+                    dcs[v * c.h + h] = dc;
+                    encodeBlock(writer, block, dc, &predictors[ci], *c.dc, *c.ac);
+                }
+            }
+        }
+    }
+    writer.flush();
+}
+
+// jccolor.c's fixed-point RGB -> YCbCr for the component `component` of the
+// pixel at (x, y), with coordinates clamped to the image as libjpeg's edge
+// expansion does.
+__device__ int convertedSample(const unsigned char* image, int width, int height, int channels, int component, int x,
+                               int y) {
+    x = min(x, width - 1);
+    y = min(y, height - 1);
+    const unsigned char* p = image + ((size_t)y * width + x) * channels;
+    if (channels == 1) return p[0];
+    int b = p[0];
+    int g = p[1];
+    int r = p[2];
+    if (component == 0) return (19595 * r + 38470 * g + 7471 * b + 32768) >> 16;
+    if (component == 1) return (-11059 * r - 21709 * g + 32768 * b + (128 << 16) + 32767) >> 16;
+    return (32768 * r - 27439 * g - 5329 * b + (128 << 16) + 32767) >> 16;
+}
+
+// Sample (x, y) of a component plane, downsampled as jcsample.c does (2x2 or
+// 2x1 box with alternating rounding bias). Rows past the last real chroma row
+// repeat it.
+__device__ int componentSample(const unsigned char* image, int width, int height, int channels, int component,
+                               int hFactor, int vFactor, int planeHeight, int x, int y) {
+    if (hFactor == 1) return convertedSample(image, width, height, channels, component, x, y);
+    y = min(y, planeHeight - 1);
+    int x0 = 2 * x;
+    int y0 = vFactor * y;
+    int sum = convertedSample(image, width, height, channels, component, x0, y0) +
+              convertedSample(image, width, height, channels, component, x0 + 1, y0);
+    if (vFactor == 1) return (sum + (x & 1)) >> 1;
+    sum += convertedSample(image, width, height, channels, component, x0, y0 + 1) +
+           convertedSample(image, width, height, channels, component, x0 + 1, y0 + 1);
+    return (sum + (x & 1 ? 2 : 1)) >> 2;
+}
+
+// One 1-D pass of jfdctint.c's ISLOW FDCT. The first (row) pass keeps
+// kPass1Bits of extra precision, the second removes it.
+__device__ __forceinline__ void fdct1d(const int* d, bool firstPass, int* out) {
+    int tmp0 = d[0] + d[7];
+    int tmp7 = d[0] - d[7];
+    int tmp1 = d[1] + d[6];
+    int tmp6 = d[1] - d[6];
+    int tmp2 = d[2] + d[5];
+    int tmp5 = d[2] - d[5];
+    int tmp3 = d[3] + d[4];
+    int tmp4 = d[3] - d[4];
+
+    int tmp10 = tmp0 + tmp3;
+    int tmp13 = tmp0 - tmp3;
+    int tmp11 = tmp1 + tmp2;
+    int tmp12 = tmp1 - tmp2;
+    int shift = firstPass ? kConstBits - kPass1Bits : kConstBits + kPass1Bits;
+    out[0] = firstPass ? (tmp10 + tmp11) << kPass1Bits : descale(tmp10 + tmp11, kPass1Bits);
+    out[4] = firstPass ? (tmp10 - tmp11) << kPass1Bits : descale(tmp10 - tmp11, kPass1Bits);
+    int z1 = (tmp12 + tmp13) * 4433;
+    out[2] = descale(z1 + tmp13 * 6270, shift);
+    out[6] = descale(z1 + tmp12 * -15137, shift);
+
+    z1 = tmp4 + tmp7;
+    int z2 = tmp5 + tmp6;
+    int z3 = tmp4 + tmp6;
+    int z4 = tmp5 + tmp7;
+    int z5 = (z3 + z4) * 9633;
+    tmp4 *= 2446;
+    tmp5 *= 16819;
+    tmp6 *= 25172;
+    tmp7 *= 12299;
+    z1 *= -7373;
+    z2 *= -20995;
+    z3 = z3 * -16069 + z5;
+    z4 = z4 * -3196 + z5;
+    out[7] = descale(tmp4 + z1 + z3, shift);
+    out[5] = descale(tmp5 + z2 + z4, shift);
+    out[3] = descale(tmp6 + z2 + z3, shift);
+    out[1] = descale(tmp7 + z1 + z4, shift);
+}
+
+// Colour-convert, downsample, transform and quantize one component. Each 8x8
+// block gets 8 threads: a row each for the first pass, a column each for the
+// second. Output blocks are in zigzag order, ready for the huffman coder.
+__global__ void fdctKernel(const unsigned char* image, int width, int height, int channels, int component,
+                           int hFactor, int vFactor, int planeHeight, const uint16_t* quant, int blocksPerLine,
+                           int blockCount, int16_t* coefficients) {
+    __shared__ int workspace[kBlocksPerCta][64];
+    int local = threadIdx.x / 8;
+    int lane = threadIdx.x % 8;
+    int block = blockIdx.x * kBlocksPerCta + local;
+    bool active = block < blockCount;
+    int* ws = workspace[local];
+    int bx = block % blocksPerLine;
+    int by = block / blocksPerLine;
+
+    if (active) {
+        int row[8];
+        for (int k = 0; k < 8; k++) {
+            row[k] = componentSample(image, width, height, channels, component, hFactor, vFactor, planeHeight,
+                                     bx * 8 + k, by * 8 + lane) -
+                     128;
+        }
+        fdct1d(row, true, ws + lane * 8);
+    }
+    __syncthreads();
+
+    if (active) {
+        int column[8];
+        for (int k = 0; k < 8; k++) column[k] = ws[k * 8 + lane];
+        int out[8];
+        fdct1d(column, false, out);
+        int16_t* dst = coefficients + (size_t)block * 64;
+        for (int k = 0; k < 8; k++) {
+            // The DCT output is scaled by 8; round half away from zero as jcdctmgr.c does
+            int natural = k * 8 + lane;
+            int divisor = quant[natural] << 3;
+            int value = out[k];
+            int magnitude = ((value < 0 ? -value : value) + (divisor >> 1)) / divisor;
+            dst[kNaturalToZigzag[natural]] = (int16_t)(value < 0 ? -magnitude : magnitude);
+        }
+    }
+}
+
+void putMarker(std::vector<uint8_t>& out, uint8_t marker, size_t length) {
+    out.push_back(0xFF);
+    out.push_back(marker);
+    out.push_back((uint8_t)((length + 2) >> 8));
+    out.push_back((uint8_t)(length + 2));
+}
+
+void writeHeader(const Layout& layout, const uint16_t quant[2][64], std::vector<uint8_t>& out) {
+    out.insert(out.end(), {0xFF, 0xD8});
+    putMarker(out, 0xE0, 14);  // JFIF 1.01, 1:1 aspect
+    out.insert(out.end(), {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0});
+
+    bool color = layout.components.size() == 3;
+    for (int t = 0; t < (color ? 2 : 1); t++) {
+        putMarker(out, 0xDB, 65);
+        out.push_back((uint8_t)t);
+        for (int i = 0; i < 64; i++) out.push_back((uint8_t)quant[t][kZigzag[i]]);
+    }
+
+    putMarker(out, 0xC0, 6 + 3 * layout.components.size());
+    out.insert(out.end(), {8, (uint8_t)(layout.height >> 8), (uint8_t)layout.height, (uint8_t)(layout.width >> 8),
+                           (uint8_t)layout.width, (uint8_t)layout.components.size()});
+    for (size_t i = 0; i < layout.components.size(); i++) {
+        const Component& c = layout.components[i];
+        out.insert(out.end(), {(uint8_t)c.id, (uint8_t)(c.h << 4 | c.v), (uint8_t)(i > 0)});
+    }
+
+    auto putTable = [&](int tableClass, int index, const uint8_t* bits, const uint8_t* values) {
+        int count = 0;
+        for (int i = 0; i < 16; i++) count += bits[i];
+        putMarker(out, 0xC4, 17 + count);
+        out.push_back((uint8_t)(tableClass << 4 | index));
+        out.insert(out.end(), bits, bits + 16);
+        out.insert(out.end(), values, values + count);
+    };
+    putTable(0, 0, kDcLumaBits, kDcValues);
+    putTable(1, 0, kAcLumaBits, kAcLumaValues);
+    if (color) {
+        putTable(0, 1, kDcChromaBits, kDcValues);
+        putTable(1, 1, kAcChromaBits, kAcChromaValues);
+    }
+
+    putMarker(out, 0xDD, 2);  // one restart interval per MCU row
+    out.insert(out.end(), {(uint8_t)(layout.mcusX >> 8), (uint8_t)layout.mcusX});
+
+    putMarker(out, 0xDA, 4 + 2 * layout.components.size());
+    out.push_back((uint8_t)layout.components.size());
+    for (size_t i = 0; i < layout.components.size(); i++) {
+        out.push_back((uint8_t)layout.components[i].id);
+        out.push_back(i > 0 ? 0x11 : 0x00);
+    }
+    out.insert(out.end(), {0, 63, 0});
+}
+
+}  // namespace
+
+void setJpegEncodeOptions(const JpegEncodeOptions& newOptions) { options = newOptions; }
+
+const JpegEncodeOptions& jpegEncodeOptions() { return options; }
+
+bool encodeJpegFromDevice(const unsigned char* d_image, int width, int height, int channels, cudaStream_t stream,
+                          std::vector<uint8_t>* jpeg) {
+    if ((channels != 1 && channels != 3) || width <= 0 || height <= 0 || width > 65535 || height > 65535) {
+        return false;
+    }
+    static HuffmanCode dcLuma, acLuma, dcChroma, acChroma;
+    static bool tablesBuilt = [] {
+        buildHuffmanCode(kDcLumaBits, kDcValues, &dcLuma);
+        buildHuffmanCode(kAcLumaBits, kAcLumaValues, &acLuma);
+        buildHuffmanCode(kDcChromaBits, kDcValues, &dcChroma);
+        buildHuffmanCode(kAcChromaBits, kAcChromaValues, &acChroma);
+        return true;
+    }();
+    (void)tablesBuilt;
+
+    uint16_t quant[2][64];
+    scaleQuantTable(kLumaQuant, options.quality, quant[0]);
+    scaleQuantTable(kChromaQuant, options.quality, quant[1]);
+
+    // 4:2:0 for colour, as libjpeg's defaults; a gray image has one 1x1 component
+    Layout layout;
+    layout.width = width;
+    layout.height = height;
+    layout.maxH = layout.maxV = channels == 3 ? 2 : 1;
+    layout.mcusX = (width + 8 * layout.maxH - 1) / (8 * layout.maxH);
+    layout.mcusY = (height + 8 * layout.maxV - 1) / (8 * layout.maxV);
+    size_t coefficientCount = 0;
+    for (int i = 0; i < channels; i++) {
+        Component c;
+        c.id = i + 1;
+        c.h = c.v = i == 0 ? layout.maxH : 1;
+        int planeWidth = (width * c.h + layout.maxH - 1) / layout.maxH;
+        int planeHeight = (height * c.v + layout.maxV - 1) / layout.maxV;
+        c.blocksPerLine = (planeWidth + 7) / 8;
+        c.blockRows = (planeHeight + 7) / 8;
+        c.coefficientOffset = coefficientCount;
+        c.quant = quant[i > 0];
+        c.dc = i > 0 ? &dcChroma : &dcLuma;
+        c.ac = i > 0 ? &acChroma : &acLuma;
+        coefficientCount += (size_t)c.blocksPerLine * c.blockRows * 64;
+        layout.components.push_back(c);
+    }
+
+    DeviceBufferPool& pool = deviceBufferPool();
+    size_t quantBytes = sizeof(quant);
+    unsigned char* d_buffer = pool.acquire(coefficientCount * sizeof(int16_t) + quantBytes);
+    if (!d_buffer) return false;
+    int16_t* d_coefficients = reinterpret_cast<int16_t*>(d_buffer);
+    uint16_t* d_quant = reinterpret_cast<uint16_t*>(d_coefficients + coefficientCount);
+    cudaMemcpyAsync(d_quant, quant, quantBytes, cudaMemcpyHostToDevice, stream);
+    for (int i = 0; i < channels; i++) {
+        const Component& c = layout.components[i];
+        int blockCount = c.blocksPerLine * c.blockRows;
+        int planeHeight = (height * c.v + layout.maxV - 1) / layout.maxV;
+        fdctKernel<<<(blockCount + kBlocksPerCta - 1) / kBlocksPerCta, kBlocksPerCta * 8, 0, stream>>>(
+            d_image, width, height, channels, i, layout.maxH / c.h, layout.maxV / c.v, planeHeight,
+            d_quant + (i > 0) * 64, c.blocksPerLine, blockCount, d_coefficients + c.coefficientOffset);
+    }
+    std::vector<int16_t> coefficients(coefficientCount);
+    cudaMemcpyAsync(coefficients.data(), d_coefficients, coefficientCount * sizeof(int16_t), cudaMemcpyDeviceToHost,
+                    stream);
+    cudaError_t status = cudaStreamSynchronize(stream);
+    pool.release(d_buffer);
+    if (status != cudaSuccess) return false;
+
+    // Each MCU row is an independent restart interval; code them in parallel
+    // and stitch them together with RSTn markers.
+    std::vector<std::vector<uint8_t>> rows(layout.mcusY);
+    const int kParallelMinPixels = 1 << 20;
+    int threads = std::min(options.threads, layout.mcusY);
+    if (threads < 2 || (int64_t)width * height < kParallelMinPixels) {
+        for (int y = 0; y < layout.mcusY; y++) encodeMcuRow(layout, coefficients.data(), y, &rows[y]);
+    } else {
+        CpuShare share(threads);
+        std::atomic<int> next(0);
+        std::vector<std::thread> workers;
+        const char* stage = currentProfileStage();
+        for (int t = 0; t < share.threads(); t++) {
+            workers.emplace_back([&] {
+                ProfiledThread profiled(stage);
+                for (int y = next++; y < layout.mcusY; y = next++) {
+                    encodeMcuRow(layout, coefficients.data(), y, &rows[y]);
+                }
+            });
+        }
+        for (auto& worker : workers) worker.join();
+    }
+
+    jpeg->clear();
+    writeHeader(layout, quant, *jpeg);
+    for (int y = 0; y < layout.mcusY; y++) {
+        jpeg->insert(jpeg->end(), rows[y].begin(), rows[y].end());
+        if (y + 1 < layout.mcusY) jpeg->insert(jpeg->end(), {0xFF, (uint8_t)(0xD0 + (y & 7))});
+    }
+    jpeg->insert(jpeg->end(), {0xFF, 0xD9});
+    return true;
+}
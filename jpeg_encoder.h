@@ -0,0 +1,28 @@
+#ifndef JPEG_ENCODER_H_
+#define JPEG_ENCODER_H_
+
+#include <cuda_runtime.h>
+#include <cstdint>
+#include <vector>
+
+// Process-wide encoder configuration, set once from the command line.
+struct JpegEncodeOptions {
+    bool enabled = true;  // false: always use imwrite
+    int quality = 95;     // libjpeg quality scale, as IMWRITE_JPEG_QUALITY
+    int threads = 1;      // huffman-coding threads, split among images coded at once
+};
+
+void setJpegEncodeOptions(const JpegEncodeOptions& options);
+const JpegEncodeOptions& jpegEncodeOptions();
+
+// Encode an interleaved 8-bit BGR (or gray) image that is on the device as a
+// baseline JPEG with imwrite's defaults: 4:2:0, standard huffman tables and
+// libjpeg's quality scaling. Colour conversion, downsampling, FDCT and
+// quantization run on `stream`, bit-exact with libjpeg. Each MCU row is a
+// restart interval, so rows are huffman-coded on separate threads and
+// concatenated. Returns false if `channels` is not 1 or 3 or the device is
+// out of memory.
+bool encodeJpegFromDevice(const unsigned char* d_image, int width, int height, int channels, cudaStream_t stream,
+                          std::vector<uint8_t>* jpeg);
+
+#endif  // JPEG_ENCODER_H_
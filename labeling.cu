@@ -0,0 +1,232 @@
+#include "labeling.h"
+
+#include <algorithm>
+#include <climits>
+#include <fstream>
+
+#include "buffer_pool.h"
+#include "filters.h"
+#include "tile_order.cuh"
+
+namespace {
+
+const int kBackground = -1;
+
+struct DeviceStats {
+    int root;  // first pixel of the component in raster order
+    unsigned int area;
+    int minX;
+    int minY;
+    int maxX;
+    int maxY;
+    unsigned long long sumX;
+    unsigned long long sumY;
+};
+
+__device__ bool isForeground(const unsigned char* image, size_t pixel, int channels, int threshold) {
+    const unsigned char* p = image + pixel * channels;
+    int luma = channels >= 3 ? (29 * p[0] + 150 * p[1] + 77 * p[2]) >> 8 : p[0];
+    return luma >= threshold;
+}
+
+__device__ int findRoot(int* parent, int i) {
+    while (parent[i] != i) i = parent[i];
+    return i;
+}
+
+// Lock-free union: always hang the larger root under the smaller one. The CAS
+// only succeeds while `a` is still a root; if another thread re-linked it in
+// the meantime we retry from the new roots.
+__device__ void unite(int* parent, int a, int b) {
+    while (true) {
+        a = findRoot(parent, a);
+        b = findRoot(parent, b);
+        if (a == b) return;
+        if (a < b) {
+            int t = a;
+            a = b;
+            b = t;
+        }
+        if (atomicCAS(&parent[a], a, b) == a) return;
+    }
+}
+
+// Pass 1: label each 16x16 tile on its own in shared memory and publish the
+// result as global pixel indices. Local roots are the smallest local index,
+// which is also the smallest global index, so the global merge can keep the
+// same "smaller index wins" rule.
+__global__ void localLabelKernel(const unsigned char* image, int* labels, int width, int height, int channels,
+                                 int threshold, int connectivity, TileGrid grid) {
+    __shared__ int parent[kTileSize * kTileSize];
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int lx = threadIdx.x;
+    int ly = threadIdx.y;
+    int x = tileX * kTileSize + lx;
+    int y = tileY * kTileSize + ly;
+    int local = ly * kTileSize + lx;
+    bool inside = x < width && y < height;
+    size_t pixel = (size_t)y * width + x;
+
+    bool foreground = inside && isForeground(image, pixel, channels, threshold);
+    parent[local] = foreground ? local : kBackground;
+    __syncthreads();
+
+    if (foreground) {
+        if (lx > 0 && parent[local - 1] != kBackground) unite(parent, local, local - 1);
+        if (ly > 0 && parent[local - kTileSize] != kBackground) unite(parent, local, local - kTileSize);
+        if (connectivity == 8 && ly > 0) {
+            if (lx > 0 && parent[local - kTileSize - 1] != kBackground) unite(parent, local, local - kTileSize - 1);
+            if (lx < kTileSize - 1 && parent[local - kTileSize + 1] != kBackground) {
+                unite(parent, local, local - kTileSize + 1);
+            }
+        }
+    }
+    __syncthreads();
+
+    if (!inside) return;
+    if (!foreground) {
+        labels[pixel] = kBackground;
+        return;
+    }
+    int root = findRoot(parent, local);
+    labels[pixel] = (tileY * kTileSize + root / kTileSize) * width + tileX * kTileSize + root % kTileSize;
+}
+
+// Pass 2: merge components that touch across tile borders.
+__global__ void mergeBordersKernel(int* labels, int width, int height, int connectivity, TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int lx = threadIdx.x;
+    int ly = threadIdx.y;
+    int x = tileX * kTileSize + lx;
+    int y = tileY * kTileSize + ly;
+    if (x >= width || y >= height) return;
+    bool leftEdge = lx == 0 && x > 0;
+    bool topEdge = ly == 0 && y > 0;
+    bool rightEdge = lx == kTileSize - 1 && x < width - 1;
+    if (!leftEdge && !topEdge && !(connectivity == 8 && rightEdge && y > 0)) return;
+
+    int i = y * width + x;
+    if (labels[i] == kBackground) return;
+    if (leftEdge && labels[i - 1] != kBackground) unite(labels, i, i - 1);
+    if (topEdge && labels[i - width] != kBackground) unite(labels, i, i - width);
+    if (connectivity == 8 && y > 0) {
+        // Diagonals cross a tile border whenever either end sits on one
+        if (x > 0 && (leftEdge || topEdge) && labels[i - width - 1] != kBackground) unite(labels, i, i - width - 1);
+        if (x < width - 1 && (rightEdge || topEdge) && labels[i - width + 1] != kBackground) {
+            unite(labels, i, i - width + 1);
+        }
+    }
+}
+
+// Pass 3: point every pixel straight at its root, and give each root a
+// compact component id.
+__global__ void flattenKernel(int* labels, int* ids, int* componentCount, int width, int height, TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * kTileSize + threadIdx.x;
+    int y = tileY * kTileSize + threadIdx.y;
+    if (x >= width || y >= height) return;
+    int i = y * width + x;
+    if (labels[i] == kBackground) return;
+    int root = findRoot(labels, i);
+    if (root == i) ids[i] = atomicAdd(componentCount, 1);
+    labels[i] = root;
+}
+
+// Pass 4: accumulate area, bounding box and centroid sums per component.
+__global__ void statsKernel(const int* labels, const int* ids, DeviceStats* stats, int width, int height,
+                            TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * kTileSize + threadIdx.x;
+    int y = tileY * kTileSize + threadIdx.y;
+    if (x >= width || y >= height) return;
+    int label = labels[y * width + x];
+    if (label == kBackground) return;
+    DeviceStats& s = stats[ids[label]];
+    s.root = label;  // every pixel of the component writes the same value
+    atomicAdd(&s.area, 1u);
+    atomicMin(&s.minX, x);
+    atomicMin(&s.minY, y);
+    atomicMax(&s.maxX, x);
+    atomicMax(&s.maxY, y);
+    atomicAdd(&s.sumX, (unsigned long long)x);
+    atomicAdd(&s.sumY, (unsigned long long)y);
+}
+
+__global__ void initStatsKernel(DeviceStats* stats, int count) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= count) return;
+    DeviceStats empty = {0, 0u, INT_MAX, INT_MAX, -1, -1, 0ull, 0ull};
+    stats[i] = empty;
+}
+
+}  // namespace
+
+std::vector<ComponentStats> labelComponents(const unsigned char* d_image, int width, int height, int channels,
+                                            const LabelOptions& options, cudaStream_t stream) {
+    std::vector<ComponentStats> components;
+    size_t pixels = (size_t)width * height;
+    if ((int64_t)pixels > kMaxLabelPixels) return components;
+    DeviceBufferPool& pool = deviceBufferPool();
+    int* d_labels = reinterpret_cast<int*>(pool.acquire(pixels * sizeof(int)));
+    int* d_ids = reinterpret_cast<int*>(pool.acquire(pixels * sizeof(int) + sizeof(int)));
+    if (!d_labels || !d_ids) {
+        pool.release(reinterpret_cast<unsigned char*>(d_labels));
+        pool.release(reinterpret_cast<unsigned char*>(d_ids));
+        return components;
+    }
+    int* d_count = d_ids + pixels;  // the counter lives after the id map
+
+    TileGrid grid = makeTileGrid(width, height, filterOptions().tileOrder);
+    cudaMemsetAsync(d_count, 0, sizeof(int), stream);
+    localLabelKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_image, d_labels, width, height, channels,
+                                                                        options.threshold, options.connectivity, grid);
+    mergeBordersKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_labels, width, height,
+                                                                          options.connectivity, grid);
+    flattenKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_labels, d_ids, d_count, width, height, grid);
+    int count = 0;
+    cudaMemcpyAsync(&count, d_count, sizeof(int), cudaMemcpyDeviceToHost, stream);
+    cudaStreamSynchronize(stream);
+
+    if (count > 0) {
+        DeviceStats* d_stats = reinterpret_cast<DeviceStats*>(pool.acquire(count * sizeof(DeviceStats)));
+        if (d_stats) {
+            initStatsKernel<<<(count + 255) / 256, 256, 0, stream>>>(d_stats, count);
+            statsKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_labels, d_ids, d_stats, width, height,
+                                                                           grid);
+            std::vector<DeviceStats> stats(count);
+            cudaMemcpyAsync(stats.data(), d_stats, count * sizeof(DeviceStats), cudaMemcpyDeviceToHost, stream);
+            cudaStreamSynchronize(stream);
+            pool.release(reinterpret_cast<unsigned char*>(d_stats));
+
+            // Root ids come from an atomic counter; renumber in raster order
+            // of each component's first pixel so ids do not depend on block
+            // scheduling.
+            std::sort(stats.begin(), stats.end(),
+                      [](const DeviceStats& a, const DeviceStats& b) { return a.root < b.root; });
+            for (const auto& s : stats) {
+                components.push_back({0, s.area, s.minX, s.minY, s.maxX - s.minX + 1, s.maxY - s.minY + 1,
+                                      (double)s.sumX / s.area, (double)s.sumY / s.area});
+            }
+        }
+    }
+    pool.release(reinterpret_cast<unsigned char*>(d_labels));
+    pool.release(reinterpret_cast<unsigned char*>(d_ids));
+
+    for (size_t i = 0; i < components.size(); i++) components[i].id = (int)i + 1;
+    return components;
+}
+
+bool writeComponentStats(const std::string& path, const std::vector<ComponentStats>& components) {
+    std::ofstream out(path);
+    if (!out.is_open()) return false;
+    out << "id,area,x,y,width,height,centroid_x,centroid_y\n";
+    for (const auto& c : components) {
+        out << c.id << "," << c.area << "," << c.x << "," << c.y << "," << c.width << "," << c.height << ","
+            << c.centroidX << "," << c.centroidY << "\n";
+    }
+    return out.good();
+}
@@ -0,0 +1,45 @@
+#ifndef LABELING_H_
+#define LABELING_H_
+
+#include <cuda_runtime.h>
+#include <climits>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Blob labeling of the blurred output: pixels whose luma is at or above the
+// threshold are foreground and are grouped into 4- or 8-connected components.
+struct LabelOptions {
+    int threshold = -1;  // 0-255; negative disables labeling
+    int connectivity = 8;
+
+    bool enabled() const { return threshold >= 0; }
+};
+
+// Labels and union-find parents are int pixel indices, so larger images are
+// not labelled.
+const int64_t kMaxLabelPixels = INT_MAX;
+
+struct ComponentStats {
+    int id;
+    uint32_t area;
+    int x;
+    int y;
+    int width;
+    int height;
+    double centroidX;
+    double centroidY;
+};
+
+// Label an interleaved 8-bit image already on the device. Tiles are labelled
+// independently in shared memory, then merged across tile borders with a
+// lock-free union-find in global memory. Components are returned in raster
+// order of their first pixel, with ids counting from 1. Empty for images of
+// more than kMaxLabelPixels pixels.
+std::vector<ComponentStats> labelComponents(const unsigned char* d_image, int width, int height, int channels,
+                                            const LabelOptions& options, cudaStream_t stream);
+
+// Write one CSV row per component.
+bool writeComponentStats(const std::string& path, const std::vector<ComponentStats>& components);
+
+#endif  // LABELING_H_
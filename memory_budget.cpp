@@ -0,0 +1,40 @@
+#include "memory_budget.h"
+
+#include <algorithm>
+
+void MemoryBudget::acquire(uint64_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto fits = [&] { return used_ + bytes <= capacity_ || used_ == 0; };
+    if (!fits()) {
+        // Counted before the hook runs, so a holder that checks hasWaiters()
+        // after it has drained does not park again
+        waiters_++;
+        if (waitHook_) {
+            lock.unlock();
+            waitHook_();
+            lock.lock();
+        }
+        released_.wait(lock, fits);
+        waiters_--;
+    }
+    used_ += bytes;
+    peak_ = std::max(peak_, used_);
+}
+
+void MemoryBudget::release(uint64_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ -= std::min(bytes, used_);
+    }
+    released_.notify_all();
+}
+
+bool MemoryBudget::hasWaiters() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return waiters_ > 0;
+}
+
+uint64_t MemoryBudget::peak() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_;
+}
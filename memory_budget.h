@@ -0,0 +1,80 @@
+#ifndef MEMORY_BUDGET_H_
+#define MEMORY_BUDGET_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+// Counting semaphore over bytes. Tasks reserve the memory their images need
+// before holding it and block while the budget is exhausted, so the number of
+// images in flight adapts to their size instead of being a fixed count.
+class MemoryBudget {
+public:
+    explicit MemoryBudget(uint64_t capacity) : capacity_(capacity) {}
+
+    // Block until `bytes` fit. A request larger than the whole budget is
+    // admitted once nothing else is in flight, so it cannot wait forever.
+    void acquire(uint64_t bytes);
+    void release(uint64_t bytes);
+
+    // Called, outside the lock, each time an acquire is about to wait, so
+    // holders parked on more work (partly filled tiny groups) can hand theirs
+    // on. Set it before any acquire runs.
+    void setWaitHook(std::function<void()> hook) { waitHook_ = std::move(hook); }
+    // Whether an acquire is waiting now; holders check it before parking.
+    bool hasWaiters() const;
+
+    uint64_t capacity() const { return capacity_; }
+    uint64_t peak() const;
+
+private:
+    const uint64_t capacity_;
+    uint64_t used_ = 0;
+    uint64_t peak_ = 0;
+    int waiters_ = 0;
+    std::function<void()> waitHook_;
+    mutable std::mutex mutex_;
+    std::condition_variable released_;
+};
+
+// Holds a reservation for the lifetime of a scope.
+class BudgetReservation {
+public:
+    BudgetReservation(MemoryBudget* budget, uint64_t bytes) : budget_(budget), bytes_(bytes) {
+        if (budget_) budget_->acquire(bytes_);
+    }
+    ~BudgetReservation() {
+        if (budget_) budget_->release(bytes_);
+    }
+
+    // Swap the reservation for one of `bytes`. The old amount is released
+    // first, so growing never deadlocks against other holders; shrinking
+    // never blocks.
+    void reset(uint64_t bytes) {
+        if (!budget_ || bytes == bytes_) return;
+        if (bytes < bytes_) {
+            shrinkTo(bytes);
+            return;
+        }
+        budget_->release(bytes_);
+        bytes_ = bytes;
+        budget_->acquire(bytes_);
+    }
+
+    // Give back all but `bytes` without blocking. Tasks that must not wait
+    // (the filter stage, which admitted images queue behind) use this.
+    void shrinkTo(uint64_t bytes) {
+        if (!budget_ || bytes >= bytes_) return;
+        budget_->release(bytes_ - bytes);
+        bytes_ = bytes;
+    }
+    BudgetReservation(const BudgetReservation&) = delete;
+    BudgetReservation& operator=(const BudgetReservation&) = delete;
+
+private:
+    MemoryBudget* budget_;
+    uint64_t bytes_;
+};
+
+#endif  // MEMORY_BUDGET_H_
@@ -0,0 +1,518 @@
+#include "object_store.h"
+
+#include <curl/curl.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+#include "profiler.h"
+
+namespace {
+
+constexpr char kScheme[] = "s3://";
+constexpr int kMaxParts = 10000;  // S3's limit for one multipart upload
+constexpr char kEmptyPayloadHash[] = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+std::string hex(const unsigned char* bytes, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string text;
+    for (size_t i = 0; i < size; i++) {
+        text += digits[bytes[i] >> 4];
+        text += digits[bytes[i] & 15];
+    }
+    return text;
+}
+
+std::string sha256Hex(const std::string& text) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(text.data()), text.size(), digest);
+    return hex(digest, sizeof(digest));
+}
+
+std::string hmacSha256(const std::string& key, const std::string& text) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    HMAC(EVP_sha256(), key.data(), (int)key.size(), reinterpret_cast<const unsigned char*>(text.data()), text.size(),
+         digest, &length);
+    return std::string(reinterpret_cast<char*>(digest), length);
+}
+
+// Percent-encode everything but RFC 3986 unreserved characters, as SigV4
+// expects; keys keep their '/' separators in the path.
+std::string uriEncode(const std::string& text, bool keepSlash) {
+    std::string encoded;
+    for (unsigned char c : text) {
+        if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (keepSlash && c == '/')) {
+            encoded += (char)c;
+        } else {
+            char escape[4];
+            std::snprintf(escape, sizeof(escape), "%%%02X", c);
+            encoded += escape;
+        }
+    }
+    return encoded;
+}
+
+std::string xmlUnescape(const std::string& text) {
+    static const std::pair<const char*, char> entities[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}};
+    std::string plain;
+    for (size_t i = 0; i < text.size(); i++) {
+        bool replaced = false;
+        for (const auto& entity : entities) {
+            size_t length = std::strlen(entity.first);
+            if (text.compare(i, length, entity.first) == 0) {
+                plain += entity.second;
+                i += length - 1;
+                replaced = true;
+                break;
+            }
+        }
+        if (!replaced) plain += text[i];
+    }
+    return plain;
+}
+
+// Contents of every <tag>...</tag> element, in order. The S3 responses read
+// here are flat enough that this is all the XML parsing they need.
+std::vector<std::string> xmlElements(const std::string& xml, const std::string& tag) {
+    std::vector<std::string> elements;
+    std::string open = "<" + tag + ">";
+    std::string close = "</" + tag + ">";
+    for (size_t start = xml.find(open); start != std::string::npos; start = xml.find(open, start)) {
+        start += open.size();
+        size_t end = xml.find(close, start);
+        if (end == std::string::npos) break;
+        elements.push_back(xml.substr(start, end - start));
+        start = end + close.size();
+    }
+    return elements;
+}
+
+std::string xmlElement(const std::string& xml, const std::string& tag) {
+    std::vector<std::string> elements = xmlElements(xml, tag);
+    return elements.empty() ? "" : xmlUnescape(elements[0]);
+}
+
+std::string environment(const char* name) {
+    const char* value = std::getenv(name);
+    return value ? value : "";
+}
+
+// State one transfer's libcurl callbacks share.
+struct Transfer {
+    CURL* curl;
+    std::string* body;
+    std::vector<std::pair<std::string, std::string>>* headers;
+    unsigned char* sink;  // successful response bodies go here instead of `body`
+    size_t sinkSize;
+    size_t received = 0;
+    const unsigned char* upload;
+    size_t uploadSize;
+    size_t uploaded = 0;
+};
+
+size_t writeBody(char* data, size_t size, size_t count, void* user) {
+    Transfer* transfer = static_cast<Transfer*>(user);
+    size_t bytes = size * count;
+    long status = 0;
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (transfer->sink && status >= 200 && status < 300) {
+        if (transfer->received + bytes > transfer->sinkSize) return 0;  // more than asked for: abort
+        std::memcpy(transfer->sink + transfer->received, data, bytes);
+    } else {
+        transfer->body->append(data, bytes);
+    }
+    transfer->received += bytes;
+    return bytes;
+}
+
+size_t readBody(char* buffer, size_t size, size_t count, void* user) {
+    Transfer* transfer = static_cast<Transfer*>(user);
+    size_t bytes = std::min(size * count, transfer->uploadSize - transfer->uploaded);
+    if (bytes == 0) return 0;
+    std::memcpy(buffer, transfer->upload + transfer->uploaded, bytes);
+    transfer->uploaded += bytes;
+    return bytes;
+}
+
+// libcurl rewinds the body when it resends on a fresh connection
+int seekBody(void* user, curl_off_t offset, int origin) {
+    Transfer* transfer = static_cast<Transfer*>(user);
+    if (origin != SEEK_SET || offset < 0 || (size_t)offset > transfer->uploadSize) return CURL_SEEKFUNC_FAIL;
+    transfer->uploaded = (size_t)offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+size_t readHeader(char* data, size_t size, size_t count, void* user) {
+    Transfer* transfer = static_cast<Transfer*>(user);
+    std::string line(data, size * count);
+    size_t colon = line.find(':');
+    if (colon != std::string::npos) {
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+        size_t begin = line.find_first_not_of(" \t", colon + 1);
+        size_t end = line.find_last_not_of(" \t\r\n");
+        std::string value = begin == std::string::npos || end < begin ? "" : line.substr(begin, end - begin + 1);
+        transfer->headers->emplace_back(name, value);
+    }
+    return size * count;
+}
+
+// Run `work` on `streams` threads, this one included.
+void runConcurrently(int streams, const std::function<void()>& work) {
+    std::vector<std::thread> threads;
+    const char* stage = currentProfileStage();
+    for (int i = 1; i < streams; i++) {
+        threads.emplace_back([&work, stage] {
+            ProfiledThread profiled(stage);
+            work();
+        });
+    }
+    work();
+    for (auto& thread : threads) thread.join();
+}
+
+}  // namespace
+
+bool isObjectUrl(const std::string& path) { return path.compare(0, std::strlen(kScheme), kScheme) == 0; }
+
+bool parseObjectUrl(const std::string& url, ObjectLocation* location) {
+    if (!isObjectUrl(url)) return false;
+    std::string path = url.substr(std::strlen(kScheme));
+    size_t slash = path.find('/');
+    location->bucket = path.substr(0, slash);
+    location->key = slash == std::string::npos ? "" : path.substr(slash + 1);
+    return !location->bucket.empty();
+}
+
+std::string objectUrl(const ObjectLocation& location) {
+    return kScheme + location.bucket + "/" + location.key;
+}
+
+ObjectStoreConfig objectStoreConfig() {
+    ObjectStoreConfig config;
+    std::string region = environment("AWS_REGION");
+    if (region.empty()) region = environment("AWS_DEFAULT_REGION");
+    if (!region.empty()) config.region = region;
+    config.endpoint = environment("S3_ENDPOINT_URL");
+    if (config.endpoint.empty()) config.endpoint = environment("AWS_ENDPOINT_URL");
+    if (config.endpoint.empty()) config.endpoint = "https://s3." + config.region + ".amazonaws.com";
+    while (!config.endpoint.empty() && config.endpoint.back() == '/') config.endpoint.pop_back();
+    config.accessKey = environment("AWS_ACCESS_KEY_ID");
+    config.secretKey = environment("AWS_SECRET_ACCESS_KEY");
+    config.sessionToken = environment("AWS_SESSION_TOKEN");
+    return config;
+}
+
+struct ObjectStore::Response {
+    long status = 0;  // 0 if no response arrived
+    std::string body;
+    size_t received = 0;
+    std::vector<std::pair<std::string, std::string>> headers;  // names lower-cased
+
+    std::string header(const std::string& name) const {
+        for (const auto& header : headers) {
+            if (header.first == name) return header.second;
+        }
+        return "";
+    }
+};
+
+ObjectStore::ObjectStore(const ObjectStoreConfig& config) : config_(config) {
+    static std::once_flag curlInit;
+    std::call_once(curlInit, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+    size_t hostStart = config_.endpoint.find("://");
+    host_ = config_.endpoint.substr(hostStart == std::string::npos ? 0 : hostStart + 3);
+    host_ = host_.substr(0, host_.find('/'));
+}
+
+ObjectStore::~ObjectStore() {
+    for (void* handle : idle_) curl_easy_cleanup(static_cast<CURL*>(handle));
+}
+
+void* ObjectStore::acquireHandle() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (idle_.empty()) return curl_easy_init();
+    void* handle = idle_.back();
+    idle_.pop_back();
+    return handle;
+}
+
+void ObjectStore::releaseHandle(void* handle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_back(handle);
+}
+
+std::string ObjectStore::summary() const {
+    return std::to_string(requests_.load()) + " requests on " + std::to_string(connections_.load()) +
+           " connections, " + std::to_string(bytesIn_.load() >> 20) + " MiB in, " +
+           std::to_string(bytesOut_.load() >> 20) + " MiB out";
+}
+
+bool ObjectStore::send(const std::string& method, const ObjectLocation& location,
+                       const std::vector<std::pair<std::string, std::string>>& query, const std::string& range,
+                       const unsigned char* body, size_t bodySize, unsigned char* sink, size_t sinkSize,
+                       Response* response, std::string* error) {
+    for (int attempt = 0;; attempt++) {
+        *response = Response();
+        if (sendOnce(method, location, query, range, body, bodySize, sink, sinkSize, response, error)) return true;
+        bool transient = response->status == 0 || response->status >= 500 || response->status == 429;
+        if (!transient || attempt >= config_.retries) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100 << attempt));
+    }
+}
+
+bool ObjectStore::sendOnce(const std::string& method, const ObjectLocation& location,
+                           const std::vector<std::pair<std::string, std::string>>& query, const std::string& range,
+                           const unsigned char* body, size_t bodySize, unsigned char* sink, size_t sinkSize,
+                           Response* response, std::string* error) {
+    // Path-style addressing works for AWS and every S3-compatible server
+    std::string path = "/" + location.bucket;
+    if (!location.key.empty()) path += "/" + uriEncode(location.key, true);
+    std::vector<std::pair<std::string, std::string>> params;
+    for (const auto& param : query) params.emplace_back(uriEncode(param.first, false), uriEncode(param.second, false));
+    std::sort(params.begin(), params.end());
+    std::string queryString;
+    for (const auto& param : params) queryString += (queryString.empty() ? "" : "&") + param.first + "=" + param.second;
+
+    // SigV4. Bodies are streamed unhashed (S3 accepts UNSIGNED-PAYLOAD), so a
+    // large part is never read twice; the request line and headers are signed.
+    bool upload = method == "PUT" || method == "POST";
+    std::string payloadHash = upload ? "UNSIGNED-PAYLOAD" : kEmptyPayloadHash;
+    std::time_t now = std::time(nullptr);
+    std::tm utc;
+    gmtime_r(&now, &utc);
+    char amzDate[17];
+    std::strftime(amzDate, sizeof(amzDate), "%Y%m%dT%H%M%SZ", &utc);
+    std::vector<std::string> headers = {"Host: " + host_, "x-amz-content-sha256: " + payloadHash,
+                                        std::string("x-amz-date: ") + amzDate};
+    if (!config_.sessionToken.empty()) headers.push_back("x-amz-security-token: " + config_.sessionToken);
+    if (!config_.accessKey.empty()) {
+        std::string canonicalHeaders;
+        std::string signedHeaders;
+        for (const auto& header : headers) {
+            size_t colon = header.find(':');
+            std::string name = header.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+            canonicalHeaders += name + ":" + header.substr(colon + 2) + "\n";
+            signedHeaders += (signedHeaders.empty() ? "" : ";") + name;
+        }
+        std::string date(amzDate, 8);
+        std::string scope = date + "/" + config_.region + "/s3/aws4_request";
+        std::string canonicalRequest = method + "\n" + path + "\n" + queryString + "\n" + canonicalHeaders + "\n" +
+                                       signedHeaders + "\n" + payloadHash;
+        std::string stringToSign = std::string("AWS4-HMAC-SHA256\n") + amzDate + "\n" + scope + "\n" +
+                                   sha256Hex(canonicalRequest);
+        std::string key = hmacSha256("AWS4" + config_.secretKey, date);
+        key = hmacSha256(hmacSha256(hmacSha256(key, config_.region), "s3"), "aws4_request");
+        std::string signature = hmacSha256(key, stringToSign);
+        headers.push_back("Authorization: AWS4-HMAC-SHA256 Credential=" + config_.accessKey + "/" + scope +
+                          ", SignedHeaders=" + signedHeaders + ", Signature=" +
+                          hex(reinterpret_cast<const unsigned char*>(signature.data()), signature.size()));
+    }
+    if (!range.empty()) headers.push_back("Range: bytes=" + range);
+    headers.push_back("Expect:");  // no 100-continue round trip before each body
+
+    CURL* curl = static_cast<CURL*>(acquireHandle());
+    if (!curl) {
+        *error = "cannot create a libcurl handle";
+        return false;
+    }
+    // Resetting options keeps the handle's open connections
+    curl_easy_reset(curl);
+    Transfer transfer{curl, &response->body, &response->headers, sink, sinkSize, 0, body, bodySize, 0};
+    curl_slist* headerList = nullptr;
+    for (const auto& header : headers) headerList = curl_slist_append(headerList, header.c_str());
+    std::string url = config_.endpoint + path + (queryString.empty() ? "" : "?" + queryString);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_PATH_AS_IS, 1L);  // keys may hold "../"; the path is signed as sent
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);  // give up on a stalled transfer after 30 s
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeBody);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, readHeader);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &transfer);
+    if (upload) {
+        curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, readBody);
+        curl_easy_setopt(curl, CURLOPT_READDATA, &transfer);
+        curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seekBody);
+        curl_easy_setopt(curl, CURLOPT_SEEKDATA, &transfer);
+        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)bodySize);
+    }
+    if (method != "GET" && method != "PUT") curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method.c_str());
+
+    CURLcode result = curl_easy_perform(curl);
+    long connects = 0;
+    curl_off_t downloaded = 0;
+    curl_off_t uploaded = 0;
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+    if (result == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response->status);
+    curl_slist_free_all(headerList);
+    releaseHandle(curl);
+    requests_++;
+    connections_ += connects;
+    bytesIn_ += downloaded;
+    bytesOut_ += uploaded;
+    response->received = transfer.received;
+
+    if (result != CURLE_OK) {
+        *error = method + " " + url + ": " + curl_easy_strerror(result);
+        return false;
+    }
+    if (response->status < 200 || response->status >= 300) {
+        *error = method + " " + url + ": HTTP " + std::to_string(response->status);
+        std::string code = xmlElement(response->body, "Code");
+        if (!code.empty()) *error += " " + code + " (" + xmlElement(response->body, "Message") + ")";
+        return false;
+    }
+    return true;
+}
+
+bool ObjectStore::list(const ObjectLocation& prefix,
+                       const std::function<void(const std::vector<ObjectInfo>&)>& onPage, std::string* error) {
+    std::string keyPrefix = prefix.key;
+    if (!keyPrefix.empty() && keyPrefix.back() != '/') keyPrefix += '/';
+    std::string token;
+    do {
+        std::vector<std::pair<std::string, std::string>> query = {
+            {"list-type", "2"}, {"prefix", keyPrefix}, {"delimiter", "/"}};
+        if (!token.empty()) query.emplace_back("continuation-token", token);
+        Response response;
+        if (!send("GET", {prefix.bucket, ""}, query, "", nullptr, 0, nullptr, 0, &response, error)) return false;
+        std::vector<ObjectInfo> page;
+        for (const auto& contents : xmlElements(response.body, "Contents")) {
+            ObjectInfo object;
+            object.key = xmlElement(contents, "Key");
+            object.size = std::strtoull(xmlElement(contents, "Size").c_str(), nullptr, 10);
+            if (!object.key.empty() && object.key.back() != '/') page.push_back(object);
+        }
+        onPage(page);
+        token = xmlElement(response.body, "IsTruncated") == "true" ? xmlElement(response.body, "NextContinuationToken")
+                                                                   : "";
+    } while (!token.empty());
+    return true;
+}
+
+bool ObjectStore::get(const ObjectLocation& object, std::vector<unsigned char>* data, std::string* error) {
+    Response first;
+    if (!send("GET", object, {}, "0-" + std::to_string(config_.rangeBytes - 1), nullptr, 0, nullptr, 0, &first,
+              error)) {
+        if (first.status != 416) return false;
+        data->clear();  // an empty object has no first byte to range over
+        return true;
+    }
+    data->assign(first.body.begin(), first.body.end());
+    // "bytes 0-8388607/<total>"; a server that ignores Range sends the whole object with 200
+    uint64_t total = data->size();
+    std::string contentRange = first.header("content-range");
+    size_t slash = contentRange.rfind('/');
+    if (first.status == 206 && slash != std::string::npos) {
+        total = std::strtoull(contentRange.c_str() + slash + 1, nullptr, 10);
+    }
+    if (total <= data->size()) return true;
+
+    uint64_t fetched = data->size();
+    data->resize(total);
+    uint64_t rangeCount = (total - fetched + config_.rangeBytes - 1) / config_.rangeBytes;
+    std::atomic<uint64_t> next(0);
+    std::atomic<bool> ok(true);
+    std::mutex errorMutex;
+    runConcurrently((int)std::min<uint64_t>(config_.rangeStreams, rangeCount), [&] {
+        for (uint64_t i = next++; i < rangeCount && ok; i = next++) {
+            uint64_t begin = fetched + i * config_.rangeBytes;
+            uint64_t end = std::min(total, begin + config_.rangeBytes);
+            Response response;
+            std::string rangeError;
+            bool received = send("GET", object, {}, std::to_string(begin) + "-" + std::to_string(end - 1), nullptr,
+                                 0, data->data() + begin, end - begin, &response, &rangeError) &&
+                            response.received == end - begin;
+            if (!received) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (ok) *error = rangeError.empty() ? "short range from " + objectUrl(object) : rangeError;
+                ok = false;
+            }
+        }
+    });
+    return ok;
+}
+
+bool ObjectStore::put(const ObjectLocation& object, const unsigned char* data, size_t size, std::string* error) {
+    if (size > config_.partBytes) return putMultipart(object, data, size, error);
+    Response response;
+    return send("PUT", object, {}, "", data, size, nullptr, 0, &response, error);
+}
+
+bool ObjectStore::putMultipart(const ObjectLocation& object, const unsigned char* data, size_t size,
+                               std::string* error) {
+    uint64_t partBytes = std::max<uint64_t>(config_.partBytes, (size + kMaxParts - 1) / kMaxParts);
+    Response created;
+    if (!send("POST", object, {{"uploads", ""}}, "", nullptr, 0, nullptr, 0, &created, error)) return false;
+    std::string uploadId = xmlElement(created.body, "UploadId");
+    if (uploadId.empty()) {
+        *error = "no UploadId for " + objectUrl(object);
+        return false;
+    }
+
+    int partCount = (int)((size + partBytes - 1) / partBytes);
+    std::vector<std::string> etags(partCount);
+    std::atomic<int> next(0);
+    std::atomic<bool> ok(true);
+    std::mutex errorMutex;
+    runConcurrently(std::min(config_.partStreams, partCount), [&] {
+        for (int i = next++; i < partCount && ok; i = next++) {
+            uint64_t begin = (uint64_t)i * partBytes;
+            Response response;
+            std::string partError;
+            bool sent = send("PUT", object, {{"partNumber", std::to_string(i + 1)}, {"uploadId", uploadId}}, "",
+                             data + begin, (size_t)std::min<uint64_t>(partBytes, size - begin), nullptr, 0, &response,
+                             &partError);
+            etags[i] = response.header("etag");
+            if (!sent || etags[i].empty()) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (ok) *error = partError.empty() ? "no ETag for a part of " + objectUrl(object) : partError;
+                ok = false;
+            }
+        }
+    });
+
+    if (ok) {
+        std::string manifest = "<CompleteMultipartUpload>";
+        for (int i = 0; i < partCount; i++) {
+            manifest += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>" + etags[i] +
+                        "</ETag></Part>";
+        }
+        manifest += "</CompleteMultipartUpload>";
+        Response completed;
+        ok = send("POST", object, {{"uploadId", uploadId}}, "", reinterpret_cast<const unsigned char*>(manifest.data()),
+                  manifest.size(), nullptr, 0, &completed, error);
+        // Completion can fail after the 200 status line, with the error in the body
+        if (ok && !xmlElements(completed.body, "Error").empty()) {
+            *error = "completing " + objectUrl(object) + ": " + xmlElement(completed.body, "Code") + " (" +
+                     xmlElement(completed.body, "Message") + ")";
+            ok = false;
+        }
+    }
+    if (!ok) {
+        // Stored parts are billed until the upload is aborted
+        Response aborted;
+        std::string abortError;
+        send("DELETE", object, {{"uploadId", uploadId}}, "", nullptr, 0, nullptr, 0, &aborted, &abortError);
+    }
+    return ok;
+}
@@ -0,0 +1,108 @@
+#ifndef OBJECT_STORE_H_
+#define OBJECT_STORE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// An object, or a key prefix, in an S3-compatible store: s3://bucket/key.
+struct ObjectLocation {
+    std::string bucket;
+    std::string key;
+};
+
+bool isObjectUrl(const std::string& path);
+// False unless `url` is s3:// followed by a non-empty bucket name.
+bool parseObjectUrl(const std::string& url, ObjectLocation* location);
+std::string objectUrl(const ObjectLocation& location);
+
+struct ObjectInfo {
+    std::string key;
+    uint64_t size = 0;
+};
+
+// Where the store is and how it is accessed. objectStoreConfig() fills it
+// from the environment: S3_ENDPOINT_URL (or AWS_ENDPOINT_URL) for MinIO and
+// other S3-compatible servers, AWS_REGION (or AWS_DEFAULT_REGION),
+// AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and AWS_SESSION_TOKEN. Without
+// credentials, requests are sent unsigned.
+struct ObjectStoreConfig {
+    std::string endpoint;  // scheme://host[:port]; buckets are addressed path-style
+    std::string region = "us-east-1";
+    std::string accessKey;
+    std::string secretKey;
+    std::string sessionToken;
+    uint64_t rangeBytes = 8ull << 20;  // larger objects are fetched as concurrent ranged GETs
+    int rangeStreams = 4;              // ranges of one object in flight at once
+    uint64_t partBytes = 8ull << 20;   // larger outputs are uploaded in concurrent parts
+    int partStreams = 4;
+    int retries = 3;                   // for connection errors, 5xx and throttling
+};
+
+ObjectStoreConfig objectStoreConfig();
+
+// A client for the S3 API subset the batch needs: ListObjectsV2, GET (ranged
+// for large objects), PUT and multipart upload, signed with SigV4. Safe to use
+// from any number of threads. Requests borrow a libcurl handle from a pool and
+// return it afterwards, so connections are kept alive and reused across
+// requests and threads instead of paying a TCP and TLS handshake per object.
+class ObjectStore {
+public:
+    explicit ObjectStore(const ObjectStoreConfig& config);
+    ~ObjectStore();
+    ObjectStore(const ObjectStore&) = delete;
+    ObjectStore& operator=(const ObjectStore&) = delete;
+
+    // The objects directly under `prefix` (treated as a directory, like a
+    // local input directory), a page of up to 1000 at a time. `onPage` runs as
+    // soon as each page arrives, before the next is requested, so it should
+    // hand the objects on rather than process them.
+    bool list(const ObjectLocation& prefix, const std::function<void(const std::vector<ObjectInfo>&)>& onPage,
+              std::string* error);
+
+    // The whole object. The first range tells its size; anything beyond it is
+    // fetched in config.rangeBytes ranges on up to config.rangeStreams
+    // connections at once, straight into `data`.
+    bool get(const ObjectLocation& object, std::vector<unsigned char>* data, std::string* error);
+
+    // Store `size` bytes at `object`: one PUT, or a multipart upload whose
+    // parts go out on up to config.partStreams connections at once.
+    bool put(const ObjectLocation& object, const unsigned char* data, size_t size, std::string* error);
+
+    const ObjectStoreConfig& config() const { return config_; }
+    // Requests, new connections and bytes moved since construction, for the log.
+    std::string summary() const;
+
+private:
+    struct Response;
+
+    // One signed request, retried on transient failures. The response body
+    // goes into `sink` (exactly `sinkSize` bytes) if given, else response->body.
+    bool send(const std::string& method, const ObjectLocation& location,
+              const std::vector<std::pair<std::string, std::string>>& query, const std::string& range,
+              const unsigned char* body, size_t bodySize, unsigned char* sink, size_t sinkSize, Response* response,
+              std::string* error);
+    bool sendOnce(const std::string& method, const ObjectLocation& location,
+                  const std::vector<std::pair<std::string, std::string>>& query, const std::string& range,
+                  const unsigned char* body, size_t bodySize, unsigned char* sink, size_t sinkSize,
+                  Response* response, std::string* error);
+    bool putMultipart(const ObjectLocation& object, const unsigned char* data, size_t size, std::string* error);
+
+    void* acquireHandle();
+    void releaseHandle(void* handle);
+
+    ObjectStoreConfig config_;
+    std::string host_;  // the Host header, as signed
+    std::mutex mutex_;
+    std::vector<void*> idle_;  // CURL easy handles, each keeping its connections open
+    std::atomic<uint64_t> requests_{0};
+    std::atomic<uint64_t> connections_{0};
+    std::atomic<uint64_t> bytesIn_{0};
+    std::atomic<uint64_t> bytesOut_{0};
+};
+
+#endif  // OBJECT_STORE_H_
@@ -0,0 +1,94 @@
+#include "overlay.h"
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <vector>
+
+bool parseOverlayAnchor(const std::string& name, OverlayAnchor* anchor) {
+    if (name == "tl") *anchor = OverlayAnchor::TopLeft;
+    else if (name == "tr") *anchor = OverlayAnchor::TopRight;
+    else if (name == "bl") *anchor = OverlayAnchor::BottomLeft;
+    else if (name == "br") *anchor = OverlayAnchor::BottomRight;
+    else if (name == "center") *anchor = OverlayAnchor::Center;
+    else return false;
+    return true;
+}
+
+std::unique_ptr<Overlay> Overlay::load(const OverlayOptions& options, std::string* error) {
+    cv::Mat image = cv::imread(options.file, cv::IMREAD_UNCHANGED);
+    if (image.empty()) {
+        *error = "Failed to load overlay " + options.file;
+        return nullptr;
+    }
+    if (image.depth() == CV_16U) image.convertTo(image, CV_8U, 1.0 / 257);
+    if (image.channels() == 1) cv::cvtColor(image, image, cv::COLOR_GRAY2BGRA);
+    if (image.channels() == 3) cv::cvtColor(image, image, cv::COLOR_BGR2BGRA);
+
+    // Premultiply before scaling so transparent pixels do not bleed their colour
+    double opacity = std::min(std::max(options.opacity, 0.0), 1.0);
+    cv::Mat premultiplied(image.rows, image.cols, CV_8UC4);
+    for (int y = 0; y < image.rows; y++) {
+        const cv::Vec4b* src = image.ptr<cv::Vec4b>(y);
+        cv::Vec4b* dst = premultiplied.ptr<cv::Vec4b>(y);
+        for (int x = 0; x < image.cols; x++) {
+            double alpha = src[x][3] * opacity;
+            for (int c = 0; c < 3; c++) dst[x][c] = (unsigned char)(src[x][c] * alpha / 255 + 0.5);
+            dst[x][3] = (unsigned char)(alpha + 0.5);
+        }
+    }
+    if (options.scale != 1.0) {
+        int width = std::max(1, (int)(image.cols * options.scale + 0.5));
+        int height = std::max(1, (int)(image.rows * options.scale + 0.5));
+        cv::resize(premultiplied, premultiplied, cv::Size(width, height), 0, 0,
+                   options.scale < 1.0 ? cv::INTER_AREA : cv::INTER_LINEAR);
+    }
+    if (!premultiplied.isContinuous()) premultiplied = premultiplied.clone();
+
+    std::unique_ptr<Overlay> overlay(new Overlay());
+    overlay->options_ = options;
+    overlay->width_ = premultiplied.cols;
+    overlay->height_ = premultiplied.rows;
+    size_t size = premultiplied.total() * premultiplied.elemSize();
+    if (cudaMalloc(&overlay->d_pixels_, size) != cudaSuccess) {
+        overlay->d_pixels_ = nullptr;
+        *error = "Out of device memory for overlay " + options.file;
+        return nullptr;
+    }
+    cudaMemcpy(overlay->d_pixels_, premultiplied.data, size, cudaMemcpyHostToDevice);
+    return overlay;
+}
+
+Overlay::~Overlay() {
+    if (d_pixels_) cudaFree(d_pixels_);
+}
+
+OverlayPlacement Overlay::place(int width, int height) const {
+    OverlayPlacement placement;
+    placement.pixels = d_pixels_;
+    placement.width = width_;
+    placement.height = height_;
+    int margin = options_.margin;
+    switch (options_.anchor) {
+        case OverlayAnchor::TopLeft:
+            placement.x = margin;
+            placement.y = margin;
+            break;
+        case OverlayAnchor::TopRight:
+            placement.x = width - width_ - margin;
+            placement.y = margin;
+            break;
+        case OverlayAnchor::BottomLeft:
+            placement.x = margin;
+            placement.y = height - height_ - margin;
+            break;
+        case OverlayAnchor::BottomRight:
+            placement.x = width - width_ - margin;
+            placement.y = height - height_ - margin;
+            break;
+        case OverlayAnchor::Center:
+            placement.x = (width - width_) / 2;
+            placement.y = (height - height_) / 2;
+            break;
+    }
+    return placement;
+}
@@ -0,0 +1,54 @@
+#ifndef OVERLAY_H_
+#define OVERLAY_H_
+
+#include <cuda_runtime.h>
+#include <memory>
+#include <string>
+
+enum class OverlayAnchor { TopLeft, TopRight, BottomLeft, BottomRight, Center };
+
+// Watermark composited onto every output: full-resolution images, tensors,
+// augment variants, page-stack pages and (scaled down) previews.
+struct OverlayOptions {
+    std::string file;  // empty disables the overlay; PNG with alpha, or opaque
+    OverlayAnchor anchor = OverlayAnchor::BottomRight;
+    int margin = 16;      // pixels from the anchored edges
+    double scale = 1.0;   // of the watermark's own size
+    double opacity = 1.0;
+
+    bool enabled() const { return !file.empty(); }
+};
+
+// "tl", "tr", "bl", "br" or "center"
+bool parseOverlayAnchor(const std::string& name, OverlayAnchor* anchor);
+
+// Where the final filter pass finds the watermark: premultiplied BGRA pixels
+// on the device and the output rectangle they cover. Null pixels: no overlay.
+struct OverlayPlacement {
+    const uchar4* pixels = nullptr;
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// The watermark, decoded, scaled, premultiplied and uploaded once per batch.
+class Overlay {
+public:
+    // Null (with `error` set) if the file cannot be read or the device is out of memory.
+    static std::unique_ptr<Overlay> load(const OverlayOptions& options, std::string* error);
+    ~Overlay();
+
+    // Placement on a width x height output; parts outside the image are clipped.
+    OverlayPlacement place(int width, int height) const;
+
+private:
+    Overlay() = default;
+
+    OverlayOptions options_;
+    uchar4* d_pixels_ = nullptr;
+    int width_ = 0;
+    int height_ = 0;
+};
+
+#endif  // OVERLAY_H_
@@ -0,0 +1,102 @@
+#include "page_stack.h"
+
+#include <opencv2/opencv.hpp>
+#include <condition_variable>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+#include "filters.h"
+#include "profiler.h"
+#include "tiff_writer.h"
+
+namespace fs = std::filesystem;
+
+bool isPageStack(const std::string& file) {
+    std::string extension = fs::path(file).extension().string();
+    if (extension != ".tif" && extension != ".tiff") return false;
+    return cv::imcount(file, cv::IMREAD_ANYCOLOR) > 1;
+}
+
+bool processPageStack(const std::string& file, const std::string& outputDir, const TaskSubmitter& submit,
+                      int maxInFlight, MemoryBudget& budget, const Overlay* overlay, std::ofstream& logFile) {
+    // One decoder walks the pages in order, so each IFD is read once
+    cv::ImageCollection pages(file, cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH);
+    int pageCount = (int)pages.size();
+    cv::Mat first = pageCount > 0 ? pages.at(0) : cv::Mat();
+    if (!first.empty() && first.depth() != CV_8U) {
+        std::cerr << "Page stack " << file << " is not 8-bit" << std::endl;
+        logMessage(logFile, "ERROR", "Page stack " + file + " has " + std::to_string(8 * first.elemSize1()) +
+                                         "-bit pages; only 8-bit stacks are supported");
+        return false;
+    }
+    std::string outputFile = outputDir + "/" + fs::path(file).filename().string();
+    TiffPageWriter writer;
+    if (first.empty() || !writer.open(outputFile)) {
+        std::cerr << "Failed to open page stack " << file << std::endl;
+        logMessage(logFile, "ERROR", "Failed to open page stack " + file);
+        return false;
+    }
+    logMessage(logFile, "INFO", "Processing " + std::to_string(pageCount) + " pages of " + file);
+
+    // Finished pages wait here until every earlier page has been written.
+    std::mutex mutex;
+    std::condition_variable pageDone;
+    std::map<int, cv::Mat> finished;
+    int submitted = 0;
+    int written = 0;
+    bool ok = true;
+
+    // Pages are decoded here in order and filtered on the workers
+    auto submitPage = [&](int page) {
+        cv::Mat image = page == 0 ? first : pages.at(page);
+        pages.releaseCache(page);
+        if (page == 0) first.release();
+        if (!image.empty() && image.depth() != CV_8U) {
+            logMessage(logFile, "ERROR", "Page " + std::to_string(page) + " of " + file + " is not 8-bit");
+            image.release();
+        }
+        auto reservation = std::make_shared<BudgetReservation>(&budget, 2 * image.total() * image.elemSize());
+        submit([&, page, image, reservation] {
+            ProfileStage profileStage(profileTag("page_stack"));
+            OverlayPlacement placement = overlay ? overlay->place(image.cols, image.rows) : OverlayPlacement();
+            cv::Mat result =
+                image.empty() ? cv::Mat() : filterImage(image, workerStream(false), nullptr, {}, placement);
+            std::lock_guard<std::mutex> lock(mutex);
+            finished[page] = result;
+            pageDone.notify_all();
+        });
+    };
+
+    while (written < pageCount) {
+        while (submitted < pageCount && submitted - written < maxInFlight) submitPage(submitted++);
+
+        cv::Mat page;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pageDone.wait(lock, [&] { return finished.count(written) > 0; });
+            page = finished[written];
+            finished.erase(written);
+        }
+        if (page.empty()) {
+            logMessage(logFile, "ERROR", "Failed to process page " + std::to_string(written) + " of " + file);
+            ok = false;
+        } else if (!writer.appendPage(page.data, page.cols, page.rows, page.channels(), page.step)) {
+            logMessage(logFile, "ERROR", "Failed to write page " + std::to_string(written) + " to " + outputFile);
+            ok = false;
+        }
+        written++;
+    }
+    ok = writer.close() && ok;
+
+    if (ok) {
+        std::cout << "Processed: " << file << " -> " << outputFile << " (" << pageCount << " pages)" << std::endl;
+        logMessage(logFile, "INFO", "Processed " + file + " -> " + outputFile + " (" + std::to_string(pageCount) +
+                                        " pages, " + std::to_string(maxInFlight) + " in flight)");
+    }
+    return ok;
+}
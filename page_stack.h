@@ -0,0 +1,26 @@
+#ifndef PAGE_STACK_H_
+#define PAGE_STACK_H_
+
+#include <fstream>
+#include <functional>
+#include <string>
+
+#include "memory_budget.h"
+#include "overlay.h"
+
+// True for TIFFs with more than one page; imread would silently keep only the first.
+bool isPageStack(const std::string& file);
+
+// Queues a task on worker threads.
+using TaskSubmitter = std::function<void(std::function<void()> task)>;
+
+// Decode the pages of a multi-page TIFF in order, filter each as an independent
+// task handed to `submit` and write the results in page order to a multi-page BigTIFF in
+// `outputDir`. At most `maxInFlight` pages are decoded or waiting to be written
+// at any time. Only 8-bit stacks are supported; others fail with an error.
+// `overlay`, if not null, is placed on every page by that page's size.
+// Runs on the calling thread, which must not be one of the workers `submit` feeds.
+bool processPageStack(const std::string& file, const std::string& outputDir, const TaskSubmitter& submit,
+                      int maxInFlight, MemoryBudget& budget, const Overlay* overlay, std::ofstream& logFile);
+
+#endif  // PAGE_STACK_H_
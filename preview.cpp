@@ -0,0 +1,149 @@
+#include "preview.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+
+#include "common.h"
+#include "filters.h"
+#include "image_probe.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// JPEG decodes at these reductions directly from the DCT coefficients; other
+// formats are decoded in full and downscaled inside OpenCV.
+int reducedReadFlag(int scale) {
+    if (scale >= 8) return cv::IMREAD_REDUCED_COLOR_8;
+    if (scale >= 4) return cv::IMREAD_REDUCED_COLOR_4;
+    return cv::IMREAD_REDUCED_COLOR_2;
+}
+
+// Where previews came from. Decode times are in microseconds; source sizes in
+// pixels of the main image, so reduced decodes give a cost per pixel.
+std::atomic<uint64_t> previews{0};
+std::atomic<uint64_t> embeddedHits{0};
+std::atomic<uint64_t> embeddedMicros{0};
+std::atomic<uint64_t> embeddedPixels{0};
+std::atomic<uint64_t> jpegDecodes{0};
+std::atomic<uint64_t> jpegDecodeMicros{0};
+std::atomic<uint64_t> jpegDecodePixels{0};
+
+// The smallest embedded preview of `file` that covers its main image at
+// 1/scale, decoded (itself reduced where that still covers the target) and
+// scaled to exactly the size a reduced decode of the main image would have.
+// False if there is none; `previews` is what the header walk found.
+bool loadEmbeddedPreview(const std::string& file, int scale, JpegPreviews* previews, cv::Mat* image) {
+    if (!probeJpegPreviews(file, previews) || previews->orientation != 1) return false;
+    const ImageInfo& main = previews->main;
+    int width = (main.width + scale - 1) / scale;
+    int height = (main.height + scale - 1) / scale;
+    const EmbeddedJpeg* best = nullptr;
+    for (const auto& candidate : previews->embedded) {
+        const ImageInfo& info = candidate.info;
+        // Thumbnails of images of other proportions are letterboxed
+        bool sameAspect = std::llabs((long long)info.width * main.height - (long long)info.height * main.width) <=
+                          (long long)main.width * info.height / 100;
+        if (info.width < width || info.height < height || !sameAspect) continue;
+        if (!best || (uint64_t)info.width * info.height < (uint64_t)best->info.width * best->info.height) {
+            best = &candidate;
+        }
+    }
+    if (!best) return false;
+
+    std::vector<unsigned char> data(best->length);
+    std::ifstream in(file, std::ios::binary);
+    in.seekg((std::streamoff)best->offset);
+    in.read(reinterpret_cast<char*>(data.data()), data.size());
+    if (!in) return false;
+    int reduction = 1;
+    for (int factor : {8, 4, 2}) {
+        if ((best->info.width + factor - 1) / factor >= width && (best->info.height + factor - 1) / factor >= height) {
+            reduction = factor;
+            break;
+        }
+    }
+    *image = cv::imdecode(data, reduction > 1 ? reducedReadFlag(reduction) : cv::IMREAD_COLOR);
+    if (image->empty()) return false;
+    if (image->cols != width || image->rows != height) {
+        cv::resize(*image, *image, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+    }
+    return true;
+}
+
+}  // namespace
+
+bool emitPreview(const std::string& file, const PreviewOptions& options, const Overlay* overlay, cudaStream_t stream,
+                 std::ofstream& logFile) {
+    auto start = std::chrono::steady_clock::now();
+    JpegPreviews jpeg;
+    cv::Mat img;
+    bool embedded = options.embedded && loadEmbeddedPreview(file, options.scale, &jpeg, &img);
+    if (!embedded) img = cv::imread(file, reducedReadFlag(options.scale));
+    uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start)
+                          .count();
+    uint64_t pixels = (uint64_t)jpeg.main.width * jpeg.main.height;
+    previews++;
+    if (embedded) {
+        embeddedHits++;
+        embeddedMicros += micros;
+        embeddedPixels += pixels;
+    } else if (pixels > 0 && !img.empty()) {
+        jpegDecodes++;
+        jpegDecodeMicros += micros;
+        jpegDecodePixels += pixels;
+    }
+    if (img.empty()) {
+        logMessage(logFile, "ERROR", "Failed to load preview of " + file);
+        return false;
+    }
+
+    // Full-resolution options (--pixelate_region, --remap) scaled to the preview, by
+    // the decoded size where the header gives the source's
+    ImageInfo source = jpeg.main;
+    if (source.width == 0 && !probeImage(file, &source)) source = ImageInfo();
+    SourceView view;
+    view.scaleX = source.width > 0 ? (double)img.cols / source.width : 1.0 / options.scale;
+    view.scaleY = source.height > 0 ? (double)img.rows / source.height : 1.0 / options.scale;
+    view.offsetX = view.scaleX / 2 - 0.5;
+    view.offsetY = view.scaleY / 2 - 0.5;
+    view.sourceWidth = source.width > 0 ? source.width : img.cols * options.scale;
+    view.sourceHeight = source.height > 0 ? source.height : img.rows * options.scale;
+    OverlayPlacement placement = overlay ? overlay->place(img.cols, img.rows) : OverlayPlacement();
+    cv::Mat preview = filterImage(img, stream, nullptr, view, placement);
+    if (preview.empty()) {
+        logMessage(logFile, "ERROR", "Failed to filter preview of " + file);
+        return false;
+    }
+
+    if (options.callback) options.callback(file, preview);
+    if (!options.dir.empty()) {
+        std::string previewFile = options.dir + "/" + fs::path(file).filename().string();
+        if (!cv::imwrite(previewFile, preview)) {
+            logMessage(logFile, "ERROR", "Failed to write preview " + previewFile);
+            return false;
+        }
+        std::cout << "Preview: " << file << " -> " << previewFile << std::endl;
+    }
+    logMessage(logFile, "INFO", "Preview " + file + (embedded ? " from embedded JPEG" : "") + " (Size: " +
+                                    std::to_string(preview.cols) + "x" + std::to_string(preview.rows) + ")");
+    return true;
+}
+
+std::string previewDecodeSummary() {
+    if (previews == 0) return "";
+    std::string summary = "Previews from embedded JPEGs " + std::to_string(embeddedHits) + " of " +
+                          std::to_string(previews) + " (" + std::to_string(100.0 * embeddedHits / previews) + "%)";
+    if (embeddedHits > 0) summary += ", " + std::to_string(embeddedMicros / 1e3 / embeddedHits) + " ms each";
+    if (jpegDecodes > 0) {
+        summary += "; reduced JPEG decodes " + std::to_string(jpegDecodeMicros / 1e3 / jpegDecodes) + " ms each";
+        // What the hits would have cost at the reduced decodes' rate for their size
+        double perPixel = (double)jpegDecodeMicros / jpegDecodePixels;
+        double saved = (embeddedPixels * perPixel - embeddedMicros) / 1e3;
+        if (embeddedHits > 0) summary += ", about " + std::to_string(saved) + " ms of decoding saved";
+    }
+    return summary;
+}
@@ -0,0 +1,40 @@
+#ifndef PREVIEW_H_
+#define PREVIEW_H_
+
+#include <cuda_runtime.h>
+#include <opencv2/opencv.hpp>
+#include <fstream>
+#include <functional>
+#include <string>
+
+#include "overlay.h"
+
+// Receives each low-resolution preview as soon as it is ready.
+using PreviewCallback = std::function<void(const std::string& file, const cv::Mat& preview)>;
+
+// Progressive output: a reduced-resolution decode plus the same blur gives a
+// preview in a fraction of the full-resolution time. Previews are scheduled as
+// high-priority pool tasks on high-priority CUDA streams.
+struct PreviewOptions {
+    std::string dir;           // write previews here (same filename as the full output)
+    int scale = 4;             // decode at 1/scale resolution: 2, 4 or 8
+    bool embedded = true;      // start from a JPEG's embedded preview when it is large enough
+    PreviewCallback callback;  // optional, called with every preview
+
+    bool enabled() const { return !dir.empty() || callback != nullptr; }
+};
+
+// Decode `file` at reduced resolution, filter it and deliver the preview. A
+// JPEG whose EXIF thumbnail or MPF preview covers the preview size (with the
+// same aspect ratio and no EXIF rotation) is previewed from that instead, and
+// the multi-megapixel main image is never touched. `overlay`, if not null, is
+// a watermark loaded at the preview scale.
+bool emitPreview(const std::string& file, const PreviewOptions& options, const Overlay* overlay, cudaStream_t stream,
+                 std::ofstream& logFile);
+
+// How many previews came from embedded JPEGs, their decode time against that
+// of reduced JPEG decodes and the time saved, since startup. Empty before the
+// first preview.
+std::string previewDecodeSummary();
+
+#endif  // PREVIEW_H_
@@ -0,0 +1,328 @@
+#include "profiler.h"
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace {
+
+const int kMaxDepth = 64;
+// Samples one thread can take between collector passes; at 99 Hz a thread
+// fills it only if the collector stalls for ten seconds.
+const int kRingSize = 1024;
+constexpr auto kCollectInterval = std::chrono::milliseconds(100);
+
+struct Sample {
+    const char* stage;
+    int depth;
+    uintptr_t frames[kMaxDepth];  // innermost first
+};
+
+// One registered thread. Its SIGPROF handler fills `ring` at `head`; the
+// collector reads up to `head` and then advances `tail`.
+struct ThreadProfile {
+    Sample ring[kRingSize];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};       // ring full
+    std::atomic<uint64_t> handlerNanos{0};  // CPU time spent in the handler
+    uintptr_t stackLow = 0;
+    uintptr_t stackHigh = 0;
+    timer_t timer;
+    std::atomic<bool> finished{false};  // the thread no longer samples
+};
+
+thread_local ThreadProfile* currentProfile = nullptr;
+thread_local const char* currentStage = nullptr;
+
+std::atomic<bool> running{false};
+ProfilerOptions options;
+std::unique_ptr<ProfiledThread> mainThread;
+
+// Guards everything below; the handler never takes it.
+std::mutex mutex;
+std::vector<std::unique_ptr<ThreadProfile>> profiles;
+// Stage pointer followed by the frames, as raw bytes -> samples
+std::unordered_map<std::string, uint64_t> counts;
+uint64_t samples = 0;
+uint64_t dropped = 0;
+uint64_t overheadNanos = 0;  // handlers and collector
+int threads = 0;
+bool stopping = false;
+std::condition_variable stopCollector;
+std::thread collector;
+
+std::mutex tagMutex;
+std::set<std::string> tags;
+
+uint64_t threadCpuNanos() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Each frame starts with the caller's frame pointer followed by the return
+// address. The walk stops at a frame outside this thread's stack or not
+// further up it, so code built without frame pointers only truncates stacks.
+int walkStack(const ucontext_t* context, const ThreadProfile* profile, uintptr_t* frames) {
+#if defined(__x86_64__)
+    uintptr_t pc = context->uc_mcontext.gregs[REG_RIP];
+    uintptr_t fp = context->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    uintptr_t pc = context->uc_mcontext.pc;
+    uintptr_t fp = context->uc_mcontext.regs[29];
+#else
+    return 0;
+#endif
+    int depth = 0;
+    frames[depth++] = pc;
+    while (depth < kMaxDepth && fp >= profile->stackLow && fp + 2 * sizeof(uintptr_t) <= profile->stackHigh &&
+           fp % sizeof(uintptr_t) == 0) {
+        const uintptr_t* frame = reinterpret_cast<const uintptr_t*>(fp);
+        if (frame[1] == 0) break;
+        frames[depth++] = frame[1];
+        if (frame[0] <= fp) break;
+        fp = frame[0];
+    }
+    return depth;
+}
+
+// Async-signal-safe: touches only the thread's own ring and atomics.
+void onSample(int, siginfo_t*, void* context) {
+    ThreadProfile* profile = currentProfile;
+    if (!profile) return;
+    int savedErrno = errno;
+    uint64_t start = threadCpuNanos();
+    uint64_t head = profile->head.load(std::memory_order_relaxed);
+    if (head - profile->tail.load(std::memory_order_acquire) >= (uint64_t)kRingSize) {
+        profile->dropped.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        Sample& sample = profile->ring[head % kRingSize];
+        sample.stage = currentStage;
+        sample.depth = walkStack(static_cast<const ucontext_t*>(context), profile, sample.frames);
+        profile->head.store(head + 1, std::memory_order_release);
+    }
+    profile->handlerNanos.fetch_add(threadCpuNanos() - start, std::memory_order_relaxed);
+    errno = savedErrno;
+}
+
+// Fold every ring into `counts` and retire the profiles of exited threads. Holds mutex.
+void collect() {
+    for (auto it = profiles.begin(); it != profiles.end();) {
+        ThreadProfile& profile = **it;
+        bool finished = profile.finished.load(std::memory_order_acquire);  // before the last drain
+        uint64_t head = profile.head.load(std::memory_order_acquire);
+        for (uint64_t i = profile.tail.load(std::memory_order_relaxed); i < head; i++) {
+            const Sample& sample = profile.ring[i % kRingSize];
+            std::string key(reinterpret_cast<const char*>(&sample.stage), sizeof(sample.stage));
+            key.append(reinterpret_cast<const char*>(sample.frames), sample.depth * sizeof(uintptr_t));
+            counts[key]++;
+            samples++;
+        }
+        profile.tail.store(head, std::memory_order_release);
+        if (finished || stopping) {
+            dropped += profile.dropped;
+            overheadNanos += profile.handlerNanos;
+        }
+        it = finished ? profiles.erase(it) : it + 1;
+    }
+}
+
+void collectorLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopCollector.wait_for(lock, kCollectInterval, [] { return stopping; })) collect();
+    overheadNanos += threadCpuNanos();
+}
+
+// Function name for a frame, or module+offset when the symbol is not exported
+// (the makefile links with -rdynamic so the executable's own are).
+std::string symbolName(uintptr_t address, std::map<uintptr_t, std::string>& cache) {
+    auto cached = cache.find(address);
+    if (cached != cache.end()) return cached->second;
+    Dl_info info;
+    std::string name;
+    char buffer[64];
+    if (dladdr(reinterpret_cast<void*>(address), &info) && info.dli_sname) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        name = status == 0 && demangled ? demangled : info.dli_sname;
+        std::free(demangled);
+    } else if (dladdr(reinterpret_cast<void*>(address), &info) && info.dli_fname) {
+        std::string module = info.dli_fname;
+        std::snprintf(buffer, sizeof(buffer), "+0x%llx",
+                      (unsigned long long)(address - reinterpret_cast<uintptr_t>(info.dli_fbase)));
+        name = module.substr(module.find_last_of('/') + 1) + buffer;
+    } else {
+        std::snprintf(buffer, sizeof(buffer), "0x%llx", (unsigned long long)address);
+        name = buffer;
+    }
+    std::replace(name.begin(), name.end(), ';', ':');  // the folded format's separator
+    cache[address] = name;
+    return name;
+}
+
+}  // namespace
+
+bool startProfiler(const ProfilerOptions& newOptions, std::string* error) {
+    if (newOptions.hz <= 0 || newOptions.hz > 10000) {
+        *error = "sampling rate must be 1-10000 Hz";
+        return false;
+    }
+    options = newOptions;
+    struct sigaction action = {};
+    action.sa_sigaction = onSample;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0) {
+        *error = "cannot install the SIGPROF handler";
+        return false;
+    }
+    running = true;
+    collector = std::thread(collectorLoop);
+    mainThread.reset(new ProfiledThread(profileTag("main")));
+    return true;
+}
+
+void stopProfiler(std::ofstream& logFile) {
+    if (!running.exchange(false)) return;
+    mainThread.reset();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stopCollector.notify_all();
+    collector.join();
+    std::lock_guard<std::mutex> lock(mutex);
+    collect();
+
+    // Symbolize once per address; stacks that differ only in call sites within
+    // the same functions merge into one line
+    std::map<uintptr_t, std::string> symbols;
+    std::map<std::string, uint64_t> folded;
+    std::map<std::string, uint64_t> stages;
+    for (const auto& entry : counts) {
+        const char* stage;
+        std::memcpy(&stage, entry.first.data(), sizeof(stage));
+        const uintptr_t* frames = reinterpret_cast<const uintptr_t*>(entry.first.data() + sizeof(stage));
+        int depth = (int)((entry.first.size() - sizeof(stage)) / sizeof(uintptr_t));
+        std::string line = stage ? stage : "other";
+        stages[line] += entry.second;
+        for (int i = depth - 1; i >= 0; i--) {
+            // Return addresses point after the call; look up the call itself
+            line += ";" + symbolName(i > 0 ? frames[i] - 1 : frames[i], symbols);
+        }
+        folded[line] += entry.second;
+    }
+
+    std::ofstream out(options.output);
+    for (const auto& entry : folded) out << entry.first << " " << entry.second << "\n";
+    bool written = out.good();
+    out.close();
+    std::string stagesFile = options.output + ".stages.csv";
+    std::ofstream csv(stagesFile);
+    csv << "stage,samples,cpu_ms,share\n";
+    double periodMs = 1000.0 / options.hz;
+    for (const auto& entry : stages) {
+        double share = samples ? 100.0 * entry.second / samples : 0;
+        csv << entry.first << "," << entry.second << "," << entry.second * periodMs << "," << share << "\n";
+        logMessage(logFile, "INFO", "Profile stage " + entry.first + ": " +
+                                        std::to_string((uint64_t)(entry.second * periodMs)) + " ms CPU (" +
+                                        std::to_string(share) + "%)");
+    }
+    written = written && csv.good();
+
+    // Overhead relative to the CPU time the samples stand for
+    double sampledNanos = samples * periodMs * 1e6;
+    double overhead = sampledNanos > 0 ? 100.0 * overheadNanos / sampledNanos : 0;
+    std::string summary = "Profiled " + std::to_string(samples) + " samples at " + std::to_string(options.hz) +
+                          " Hz on " + std::to_string(threads) + " threads (" + std::to_string(dropped) +
+                          " dropped), sampling overhead " + std::to_string(overhead) + "% of CPU time; " +
+                          std::to_string(folded.size()) + " stacks -> " + options.output + ", stages -> " +
+                          stagesFile;
+    std::cout << summary << std::endl;
+    logMessage(logFile, written ? "INFO" : "ERROR", written ? summary : "Failed to write " + options.output);
+}
+
+const char* profileTag(const std::string& name) {
+    std::lock_guard<std::mutex> lock(tagMutex);
+    return tags.insert(name).first->c_str();
+}
+
+const char* currentProfileStage() { return currentStage; }
+
+ProfiledThread::ProfiledThread(const char* stage) : profile_(nullptr) {
+    currentStage = stage;
+    if (!running) return;
+    std::unique_ptr<ThreadProfile> profile(new ThreadProfile);
+    pthread_attr_t attributes;
+    if (pthread_getattr_np(pthread_self(), &attributes) == 0) {
+        void* low = nullptr;
+        size_t size = 0;
+        pthread_attr_getstack(&attributes, &low, &size);
+        profile->stackLow = reinterpret_cast<uintptr_t>(low);
+        profile->stackHigh = profile->stackLow + size;
+        pthread_attr_destroy(&attributes);
+    }
+    // A timer on this thread's CPU clock, signalling this thread
+    sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &profile->timer) != 0) return;
+
+    ThreadProfile* raw = profile.get();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        profiles.push_back(std::move(profile));
+        threads++;
+    }
+    currentProfile = raw;
+    long periodNs = 1000000000L / options.hz;
+    itimerspec period = {};
+    period.it_interval.tv_sec = periodNs / 1000000000L;
+    period.it_interval.tv_nsec = periodNs % 1000000000L;
+    period.it_value = period.it_interval;
+    timer_settime(raw->timer, 0, &period, nullptr);
+    profile_ = raw;
+}
+
+ProfiledThread::~ProfiledThread() {
+    ThreadProfile* profile = static_cast<ThreadProfile*>(profile_);
+    if (!profile) return;
+    currentProfile = nullptr;  // a signal still in flight is ignored
+    timer_delete(profile->timer);
+    profile->finished.store(true, std::memory_order_release);
+}
+
+ProfileStage::ProfileStage(const char* stage) : previous_(currentStage) { currentStage = stage; }
+
+ProfileStage::~ProfileStage() { currentStage = previous_; }
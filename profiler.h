@@ -0,0 +1,59 @@
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <fstream>
+#include <string>
+
+// Built-in sampling CPU profiler, for hosts where perf and friends are not
+// available. Every registered thread gets a POSIX timer on its own CPU clock
+// that raises SIGPROF on that thread; the handler records the thread's current
+// stage tag and a frame-pointer stack into a per-thread ring, and a collector
+// thread folds the rings into counts. Nothing is allocated or locked in the
+// handler, and blocked threads cost nothing since their clock stands still.
+struct ProfilerOptions {
+    std::string output;  // folded stacks; the per-stage breakdown goes to <output>.stages.csv
+    int hz = 99;         // samples per second of each thread's CPU time
+
+    bool enabled() const { return !output.empty(); }
+};
+
+// Start sampling and register the calling thread (tagged "main").
+bool startProfiler(const ProfilerOptions& options, std::string* error);
+
+// Stop sampling, write the folded stacks and the per-stage breakdown, and log
+// a summary with the measured sampling overhead. No-op if not started.
+void stopProfiler(std::ofstream& logFile);
+
+// A stable tag for `name`, for ProfileStage. Tags live until exit.
+const char* profileTag(const std::string& name);
+
+// The calling thread's current tag, or null.
+const char* currentProfileStage();
+
+// Samples the calling thread for its lifetime, starting under `stage`.
+// Construct one at the top of every worker thread; a no-op while the profiler
+// is off.
+class ProfiledThread {
+public:
+    explicit ProfiledThread(const char* stage = nullptr);
+    ~ProfiledThread();
+    ProfiledThread(const ProfiledThread&) = delete;
+    ProfiledThread& operator=(const ProfiledThread&) = delete;
+
+private:
+    void* profile_;
+};
+
+// Attributes the calling thread's samples to `stage` within a scope.
+class ProfileStage {
+public:
+    explicit ProfileStage(const char* stage);
+    ~ProfileStage();
+    ProfileStage(const ProfileStage&) = delete;
+    ProfileStage& operator=(const ProfileStage&) = delete;
+
+private:
+    const char* previous_;
+};
+
+#endif  // PROFILER_H_
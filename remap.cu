@@ -0,0 +1,248 @@
+#include "remap.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "remap.cuh"
+#include "tile_order.cuh"
+
+namespace {
+
+// A calibration batch uses one or two models and a few frame sizes.
+const size_t kCachedMaps = 4;
+
+// Model in the form the build kernel evaluates, output pixel -> source.
+struct MapParams {
+    bool lens;
+    float fx, fy, cx, cy, k1, k2, p1, p2, k3;
+    float m[6];
+};
+
+struct CachedMap {
+    std::vector<double> key;
+    std::shared_ptr<const RemapMap> map;
+};
+
+struct MapCache {
+    std::mutex mutex;
+    std::list<CachedMap> maps;  // most recently used first
+};
+
+// Cached maps hand their buffers back to the device buffer pool when they are
+// destroyed, so the cache is created after the pool and destroyed before it
+// at exit.
+MapCache& mapCache() {
+    deviceBufferPool();
+    static MapCache cache;
+    return cache;
+}
+std::atomic<uint64_t> builds{0};
+std::atomic<uint64_t> hits{0};
+
+std::vector<double> mapKey(const RemapModel& model, int width, int height) {
+    return {(double)model.kind, (double)width, (double)height, model.fx, model.fy, model.cx, model.cy, model.k1,
+            model.k2, model.p1, model.p2, model.k3, model.m[0], model.m[1], model.m[2], model.m[3], model.m[4],
+            model.m[5], model.degrees};
+}
+
+// The inverse mapping rotateKernel uses for a width x height image, as an affine matrix.
+void rotationMatrix(double degrees, int width, int height, double m[6]) {
+    double radians = degrees * M_PI / 180.0;
+    double cosA = std::cos(radians);
+    double sinA = std::sin(radians);
+    double cx = 0.5 * (width - 1);
+    double cy = 0.5 * (height - 1);
+    double rotation[6] = {cosA, sinA, cx - cosA * cx - sinA * cy, -sinA, cosA, cy + sinA * cx - cosA * cy};
+    std::copy(rotation, rotation + 6, m);
+}
+
+MapParams mapParams(const RemapModel& model, int width, int height) {
+    MapParams params = {};
+    params.lens = model.kind == RemapKind::Lens;
+    params.fx = (float)model.fx;
+    params.fy = (float)model.fy;
+    params.cx = (float)model.cx;
+    params.cy = (float)model.cy;
+    params.k1 = (float)model.k1;
+    params.k2 = (float)model.k2;
+    params.p1 = (float)model.p1;
+    params.p2 = (float)model.p2;
+    params.k3 = (float)model.k3;
+    double m[6] = {model.m[0], model.m[1], model.m[2], model.m[3], model.m[4], model.m[5]};
+    if (model.kind == RemapKind::Rotate) rotationMatrix(model.degrees, width, height, m);
+    for (int i = 0; i < 6; i++) params.m[i] = (float)m[i];
+    return params;
+}
+
+__global__ void buildMapKernel(int2* map, int width, int height, MapParams params, TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * blockDim.x + threadIdx.x;
+    int y = tileY * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+
+    float sx, sy;
+    if (params.lens) {
+        float u = (x - params.cx) / params.fx;
+        float v = (y - params.cy) / params.fy;
+        float r2 = u * u + v * v;
+        float radial = 1 + r2 * (params.k1 + r2 * (params.k2 + r2 * params.k3));
+        float du = u * radial + 2 * params.p1 * u * v + params.p2 * (r2 + 2 * u * u);
+        float dv = v * radial + params.p1 * (r2 + 2 * v * v) + 2 * params.p2 * u * v;
+        sx = params.fx * du + params.cx;
+        sy = params.fy * dv + params.cy;
+    } else {
+        sx = params.m[0] * x + params.m[1] * y + params.m[2];
+        sy = params.m[3] * x + params.m[4] * y + params.m[5];
+    }
+    // Anything more than a pixel outside samples only black; clamping keeps
+    // wild lens extrapolation inside the fixed-point range.
+    sx = fminf(fmaxf(sx, -2.0f), width + 1.0f);
+    sy = fminf(fmaxf(sy, -2.0f), height + 1.0f);
+    map[(size_t)y * width + x] = make_int2(__float2int_rn(sx * kRemapFractionScale),
+                                           __float2int_rn(sy * kRemapFractionScale));
+}
+
+__global__ void remapKernel(const unsigned char* input, unsigned char* output, int width, int height, int channels,
+                            const int2* map, TileGrid grid) {
+    int tileX, tileY;
+    if (!tileCoords(grid, blockIdx.x, &tileX, &tileY)) return;
+    int x = tileX * blockDim.x + threadIdx.x;
+    int y = tileY * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+
+    size_t pixel = (size_t)y * width + x;
+    remapPixel(input, width, height, channels, map[pixel], output + pixel * channels);
+}
+
+}  // namespace
+
+RemapMap::~RemapMap() {
+    if (d_map) deviceBufferPool().release(reinterpret_cast<unsigned char*>(d_map));
+}
+
+bool parseRemapModel(const std::string& spec, RemapModel* model) {
+    size_t colon = spec.find(':');
+    if (colon == std::string::npos) return false;
+    std::string kind = spec.substr(0, colon);
+    std::vector<double> values;
+    std::stringstream stream(spec.substr(colon + 1));
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (item.empty()) return false;
+        values.push_back(std::atof(item.c_str()));
+    }
+
+    RemapModel parsed;
+    if (kind == "lens" && (values.size() == 8 || values.size() == 9)) {
+        parsed.kind = RemapKind::Lens;
+        parsed.fx = values[0];
+        parsed.fy = values[1];
+        parsed.cx = values[2];
+        parsed.cy = values[3];
+        parsed.k1 = values[4];
+        parsed.k2 = values[5];
+        parsed.p1 = values[6];
+        parsed.p2 = values[7];
+        if (values.size() == 9) parsed.k3 = values[8];
+        if (parsed.fx == 0 || parsed.fy == 0) return false;
+    } else if (kind == "affine" && values.size() == 6) {
+        parsed.kind = RemapKind::Affine;
+        std::copy(values.begin(), values.end(), parsed.m);
+    } else if (kind == "rotate" && values.size() == 1) {
+        parsed.kind = RemapKind::Rotate;
+        parsed.degrees = values[0];
+    } else {
+        return false;
+    }
+    *model = parsed;
+    return true;
+}
+
+RemapModel viewRemapModel(const RemapModel& model, int sourceWidth, int sourceHeight, double scaleX, double offsetX,
+                          double scaleY, double offsetY) {
+    RemapModel view = model;
+    if (model.kind == RemapKind::Rotate) {
+        // About the source's centre, which a crop or flip moves
+        view.kind = RemapKind::Affine;
+        rotationMatrix(model.degrees, sourceWidth, sourceHeight, view.m);
+    }
+    if (model.kind == RemapKind::Lens) {
+        // The normalized coordinates, and so the distortion, stay the same
+        view.fx = scaleX * model.fx;
+        view.cx = scaleX * model.cx + offsetX;
+        view.fy = scaleY * model.fy;
+        view.cy = scaleY * model.cy + offsetY;
+    } else if (view.kind == RemapKind::Affine) {
+        // V M V^-1 for V = diag(scale) plus offset
+        double m[6];
+        std::copy(view.m, view.m + 6, m);
+        view.m[0] = m[0];
+        view.m[1] = m[1] * scaleX / scaleY;
+        view.m[3] = m[3] * scaleY / scaleX;
+        view.m[4] = m[4];
+        view.m[2] = scaleX * m[2] + offsetX - view.m[0] * offsetX - view.m[1] * offsetY;
+        view.m[5] = scaleY * m[5] + offsetY - view.m[3] * offsetX - view.m[4] * offsetY;
+    }
+    return view;
+}
+
+std::shared_ptr<const RemapMap> remapMap(const RemapModel& model, int width, int height, cudaStream_t stream) {
+    std::vector<double> key = mapKey(model, width, height);
+    MapCache& cache = mapCache();
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        for (auto it = cache.maps.begin(); it != cache.maps.end(); ++it) {
+            if (it->key != key) continue;
+            cache.maps.splice(cache.maps.begin(), cache.maps, it);
+            hits++;
+            return it->map;
+        }
+    }
+
+    // Two workers missing on the same key both build; the later insert wins.
+    auto map = std::make_shared<RemapMap>();
+    map->d_map = reinterpret_cast<int2*>(deviceBufferPool().acquire((size_t)width * height * sizeof(int2)));
+    if (!map->d_map) return nullptr;
+    map->width = width;
+    map->height = height;
+    TileGrid grid = makeTileGrid(width, height, TileOrder::RowMajor);
+    buildMapKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(map->d_map, width, height,
+                                                                       mapParams(model, width, height), grid);
+    if (cudaStreamSynchronize(stream) != cudaSuccess) return nullptr;
+    builds++;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    for (auto it = cache.maps.begin(); it != cache.maps.end(); ++it) {
+        if (it->key == key) {
+            cache.maps.erase(it);
+            break;
+        }
+    }
+    cache.maps.push_front({key, map});
+    // Evicted maps are freed once the last in-flight user drops them
+    if (cache.maps.size() > kCachedMaps) cache.maps.pop_back();
+    return map;
+}
+
+void launchRemap(const unsigned char* d_input, unsigned char* d_output, int width, int height, int channels,
+                 const RemapMap& map, TileOrder order, cudaStream_t stream) {
+    TileGrid grid = makeTileGrid(width, height, order);
+    remapKernel<<<tileLaunchGrid(grid), tileBlock(), 0, stream>>>(d_input, d_output, width, height, channels,
+                                                                    map.d_map, grid);
+}
+
+uint64_t remapMapBuilds() {
+    return builds;
+}
+
+uint64_t remapMapHits() {
+    return hits;
+}
@@ -0,0 +1,38 @@
+#ifndef REMAP_CUH_
+#define REMAP_CUH_
+
+#include <cuda_runtime.h>
+
+// Source positions are stored as round(position * 32): the integer pixel in
+// the high bits and a 5-bit fraction that indexes the bilinear weights, as
+// OpenCV's INTER_BITS fixed-point maps do.
+const int kRemapFractionBits = 5;
+const int kRemapFractionScale = 1 << kRemapFractionBits;
+
+// Bilinear sample of every channel at fixed-point `source`, with integer
+// weights that sum to 32 * 32. Taps outside the image contribute black.
+__device__ __forceinline__ void remapPixel(const unsigned char* input, int width, int height, int channels,
+                                           int2 source, unsigned char* out) {
+    int x0 = source.x >> kRemapFractionBits;
+    int y0 = source.y >> kRemapFractionBits;
+    int fx = source.x & (kRemapFractionScale - 1);
+    int fy = source.y & (kRemapFractionScale - 1);
+    int weights[4] = {(kRemapFractionScale - fx) * (kRemapFractionScale - fy), fx * (kRemapFractionScale - fy),
+                      (kRemapFractionScale - fx) * fy, fx * fy};
+    const unsigned char* taps[4];
+    for (int t = 0; t < 4; t++) {
+        int px = x0 + (t & 1);
+        int py = y0 + (t >> 1);
+        bool inside = px >= 0 && py >= 0 && px < width && py < height;
+        taps[t] = inside ? input + ((size_t)py * width + px) * channels : nullptr;
+    }
+    for (int c = 0; c < channels; c++) {
+        int sum = 0;
+        for (int t = 0; t < 4; t++) {
+            if (taps[t]) sum += weights[t] * taps[t][c];
+        }
+        out[c] = (unsigned char)((sum + (1 << (2 * kRemapFractionBits - 1))) >> (2 * kRemapFractionBits));
+    }
+}
+
+#endif  // REMAP_CUH_
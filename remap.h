@@ -0,0 +1,65 @@
+#ifndef REMAP_H_
+#define REMAP_H_
+
+#include <cuda_runtime.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "tile_order.cuh"
+
+enum class RemapKind { None, Lens, Affine, Rotate };
+
+// Geometric warp applied before the blur. Every kind maps an output pixel to
+// the source position it samples.
+struct RemapModel {
+    RemapKind kind = RemapKind::None;
+    // Lens: pinhole intrinsics and Brown-Conrady distortion, as in
+    // cv::initUndistortRectifyMap with the camera matrix kept as the new one
+    double fx = 0, fy = 0, cx = 0, cy = 0;
+    double k1 = 0, k2 = 0, p1 = 0, p2 = 0, k3 = 0;
+    // Affine: sx = m[0] x + m[1] y + m[2], sy = m[3] x + m[4] y + m[5]
+    double m[6] = {1, 0, 0, 0, 1, 0};
+    // Rotate: about the image centre, like --rotate
+    double degrees = 0;
+};
+
+// "lens:fx,fy,cx,cy,k1,k2,p1,p2[,k3]", "affine:a,b,c,d,e,f" or "rotate:degrees".
+bool parseRemapModel(const std::string& spec, RemapModel* model);
+
+// `model`, given in full-resolution pixels of a sourceWidth x sourceHeight
+// image, for an image whose pixel centres lie at x' = scaleX * x + offsetX,
+// y' = scaleY * y + offsetY (a preview or an augment variant; a negative scale
+// mirrors). Lens intrinsics and affine coefficients are conjugated by that
+// mapping; a rotation becomes the affine turn about the source's centre.
+RemapModel viewRemapModel(const RemapModel& model, int sourceWidth, int sourceHeight, double scaleX, double offsetX,
+                          double scaleY, double offsetY);
+
+// Per-pixel source positions for one model and image size, in device memory.
+// Coordinates are fixed point with kRemapFractionBits fractional bits.
+struct RemapMap {
+    int2* d_map = nullptr;
+    int width = 0;
+    int height = 0;
+
+    RemapMap() = default;
+    RemapMap(const RemapMap&) = delete;
+    RemapMap& operator=(const RemapMap&) = delete;
+    ~RemapMap();
+};
+
+// Map for `model` at width x height. Built on `stream` on first use and kept in
+// a small LRU shared by every worker, so a batch of same-size frames builds it
+// once. Callers must finish using it (synchronize) before dropping the pointer.
+// Null if the device is out of memory.
+std::shared_ptr<const RemapMap> remapMap(const RemapModel& model, int width, int height, cudaStream_t stream);
+
+// Bilinear remap of an interleaved 8-bit image; samples outside the source are black.
+void launchRemap(const unsigned char* d_input, unsigned char* d_output, int width, int height, int channels,
+                 const RemapMap& map, TileOrder order, cudaStream_t stream);
+
+// Maps built vs. served from the cache, since startup.
+uint64_t remapMapBuilds();
+uint64_t remapMapHits();
+
+#endif  // REMAP_H_
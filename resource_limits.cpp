@@ -0,0 +1,193 @@
+#include "resource_limits.h"
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+const char* kCgroupRoot = "/sys/fs/cgroup";
+
+// In-flight pixels get this fraction of the memory limit; the rest covers
+// encoder/decoder scratch, the CUDA runtime and the allocator's slack.
+const double kInFlightFraction = 0.5;
+
+bool readLine(const std::string& path, std::string& line) {
+    std::ifstream file(path);
+    return file.is_open() && std::getline(file, line);
+}
+
+// Count CPUs in a list such as "0-3,8,10-11".
+int countCpuList(const std::string& list) {
+    int count = 0;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty()) continue;
+        size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        count += last - first + 1;
+    }
+    return count;
+}
+
+// Directories from `leaf` up to `mount`; cgroup limits nest, so the effective
+// limit is the smallest one on the way to the root.
+std::vector<std::string> cgroupDirs(const std::string& mount, std::string path) {
+    std::vector<std::string> dirs;
+    while (!path.empty() && path != "/") {
+        dirs.push_back(mount + path);
+        path = path.substr(0, path.rfind('/'));
+    }
+    dirs.push_back(mount);
+    return dirs;
+}
+
+void applyQuota(ResourceLimits& limits, double quota) {
+    if (quota > 0 && (limits.cpuQuota == 0 || quota < limits.cpuQuota)) limits.cpuQuota = quota;
+}
+
+void applyCpuset(ResourceLimits& limits, const std::string& list) {
+    int count = countCpuList(list);
+    if (count > 0 && (limits.cpusetCpus == 0 || count < limits.cpusetCpus)) limits.cpusetCpus = count;
+}
+
+void applyMemory(ResourceLimits& limits, const std::string& value) {
+    if (value.empty() || value == "max") return;
+    uint64_t bytes = std::strtoull(value.c_str(), nullptr, 10);
+    // v1 reports "unlimited" as a huge page-aligned number
+    if (bytes == 0 || bytes >= limits.hostMemory) return;
+    if (limits.memoryLimit == 0 || bytes < limits.memoryLimit) limits.memoryLimit = bytes;
+}
+
+void readCgroupV2(ResourceLimits& limits, const std::string& path) {
+    std::string line;
+    for (const auto& dir : cgroupDirs(kCgroupRoot, path)) {
+        if (readLine(dir + "/cpu.max", line) && line.compare(0, 3, "max") != 0) {
+            double quota = 0, period = 0;
+            std::istringstream(line) >> quota >> period;
+            if (period > 0) applyQuota(limits, quota / period);
+        }
+        if (readLine(dir + "/cpuset.cpus.effective", line)) applyCpuset(limits, line);
+        if (readLine(dir + "/memory.max", line)) applyMemory(limits, line);
+    }
+}
+
+void readCgroupV1(ResourceLimits& limits, const std::string& controller, const std::string& path) {
+    std::string line;
+    std::vector<std::string> mounts;
+    if (controller == "cpu") mounts = {"/cpu,cpuacct", "/cpu"};
+    else mounts = {"/" + controller};
+
+    for (const auto& mount : mounts) {
+        // Without a cgroup namespace the path is relative to the host root,
+        // with one the container's cgroup is mounted at the controller root.
+        std::vector<std::string> dirs = cgroupDirs(kCgroupRoot + mount, path);
+        for (const auto& dir : dirs) {
+            if (controller == "cpu" && readLine(dir + "/cpu.cfs_quota_us", line)) {
+                double quota = std::atof(line.c_str());
+                std::string periodLine;
+                if (quota > 0 && readLine(dir + "/cpu.cfs_period_us", periodLine) && std::atof(periodLine.c_str()) > 0) {
+                    applyQuota(limits, quota / std::atof(periodLine.c_str()));
+                }
+            } else if (controller == "cpuset" && readLine(dir + "/cpuset.cpus", line)) {
+                applyCpuset(limits, line);
+            } else if (controller == "memory" && readLine(dir + "/memory.limit_in_bytes", line)) {
+                applyMemory(limits, line);
+            }
+        }
+    }
+}
+
+// Images in a parallel huffman-coding section right now.
+std::atomic<int> activeShares{0};
+
+}  // namespace
+
+int ResourceLimits::cpus() const {
+    int cpus = hostCpus;
+    if (affinityCpus > 0) cpus = std::min(cpus, affinityCpus);
+    if (cpusetCpus > 0) cpus = std::min(cpus, cpusetCpus);
+    // Round the quota down: a fractional CPU cannot host a full-time worker
+    // and is better left to the main thread and the kernel.
+    if (cpuQuota > 0) cpus = std::min(cpus, (int)std::floor(cpuQuota));
+    return std::max(cpus, 1);
+}
+
+uint64_t ResourceLimits::memory() const {
+    return memoryLimit > 0 ? memoryLimit : hostMemory;
+}
+
+ResourceLimits detectResourceLimits() {
+    ResourceLimits limits;
+    limits.hostCpus = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    limits.hostMemory = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) limits.affinityCpus = CPU_COUNT(&mask);
+
+    // Each line is "hierarchy-id:controllers:path"; v2 uses "0::path".
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line;
+    bool v1 = false;
+    bool v2 = false;
+    while (std::getline(cgroups, line)) {
+        size_t first = line.find(':');
+        size_t second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) continue;
+        std::string controllers = line.substr(first + 1, second - first - 1);
+        std::string path = line.substr(second + 1);
+        if (controllers.empty()) {
+            std::string probe;
+            if (readLine(std::string(kCgroupRoot) + "/cgroup.controllers", probe)) {
+                readCgroupV2(limits, path);
+                v2 = true;
+            }
+            continue;
+        }
+        std::stringstream ss(controllers);
+        std::string controller;
+        while (std::getline(ss, controller, ',')) {
+            if (controller == "cpu" || controller == "cpuset" || controller == "memory") {
+                readCgroupV1(limits, controller, path);
+                v1 = true;
+            }
+        }
+    }
+    if (v2) limits.source = "cgroup v2";
+    else if (v1) limits.source = "cgroup v1";
+    return limits;
+}
+
+PoolSizing derivePoolSizing(const ResourceLimits& limits) {
+    PoolSizing sizing;
+    sizing.threads = limits.cpus();
+    sizing.inFlightBytes = (uint64_t)(limits.memory() * kInFlightFraction);
+    return sizing;
+}
+
+std::string describeResourceLimits(const ResourceLimits& limits, const PoolSizing& sizing) {
+    std::ostringstream out;
+    out << "Resource limits (" << limits.source << "): cpus=" << limits.cpus() << " (host " << limits.hostCpus
+        << ", affinity " << limits.affinityCpus << ", cpuset " << (limits.cpusetCpus ? std::to_string(limits.cpusetCpus) : "none")
+        << ", quota " << (limits.cpuQuota > 0 ? std::to_string(limits.cpuQuota) : "none") << "), memory="
+        << (limits.memory() >> 20) << " MiB (" << (limits.memoryLimit ? "cgroup limit" : "host RAM")
+        << ") -> threads=" << sizing.threads << ", in-flight budget=" << (sizing.inFlightBytes >> 20) << " MiB";
+    return out.str();
+}
+
+CpuShare::CpuShare(int cpus) {
+    int active = ++activeShares;
+    threads_ = std::max(1, cpus / active);
+}
+
+CpuShare::~CpuShare() {
+    activeShares--;
+}
@@ -0,0 +1,57 @@
+#ifndef RESOURCE_LIMITS_H_
+#define RESOURCE_LIMITS_H_
+
+#include <cstdint>
+#include <string>
+
+// CPU and memory actually available to this process. Inside a container the
+// host's core count and RAM are misleading; the cgroup CPU quota, cpuset and
+// memory limit are what the kernel enforces.
+struct ResourceLimits {
+    std::string source = "host";  // "cgroup v2", "cgroup v1" or "host"
+    int hostCpus = 1;             // online CPUs on the host
+    int affinityCpus = 0;         // CPUs in our scheduler affinity mask (0: unknown)
+    int cpusetCpus = 0;           // CPUs in the cgroup cpuset (0: no cpuset)
+    double cpuQuota = 0;          // quota / period in CPUs (0: unlimited)
+    uint64_t hostMemory = 0;      // physical RAM
+    uint64_t memoryLimit = 0;     // cgroup memory limit (0: unlimited)
+
+    // CPUs we can keep busy without being throttled.
+    int cpus() const;
+    // Memory we may use before the OOM killer steps in.
+    uint64_t memory() const;
+};
+
+// Read cgroup v2 (cpu.max, cpuset.cpus.effective, memory.max) or v1
+// (cpu.cfs_quota_us/cpu.cfs_period_us, cpuset.cpus, memory.limit_in_bytes)
+// limits for this process, taking the tightest value along the cgroup path.
+ResourceLimits detectResourceLimits();
+
+// Pool and budget sizes derived from the limits.
+struct PoolSizing {
+    int threads;               // pool workers
+    uint64_t inFlightBytes;    // decoded/filtered pixels held by in-flight tasks
+};
+
+PoolSizing derivePoolSizing(const ResourceLimits& limits);
+
+std::string describeResourceLimits(const ResourceLimits& limits, const PoolSizing& sizing);
+
+// Helper threads for one image's parallel huffman coding. Images coding at
+// the same time split `cpus` between them, so pipeline workers decoding and
+// encoding large JPEGs at once run about `cpus` helpers in total rather than
+// `cpus` each. Hold it for the duration of the parallel section.
+class CpuShare {
+public:
+    explicit CpuShare(int cpus);
+    ~CpuShare();
+    CpuShare(const CpuShare&) = delete;
+    CpuShare& operator=(const CpuShare&) = delete;
+
+    int threads() const { return threads_; }
+
+private:
+    int threads_;
+};
+
+#endif  // RESOURCE_LIMITS_H_
@@ -0,0 +1,116 @@
+#include "source_cache.h"
+
+#include <sys/stat.h>
+
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+namespace {
+
+// FNV-1a; collisions only matter between files that are also the same size,
+// which is part of the key.
+uint64_t hashBytes(const std::vector<unsigned char>& bytes) {
+    uint64_t hash = 1469598103934665603ull;
+    for (unsigned char b : bytes) {
+        hash ^= b;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+}  // namespace
+
+bool parseCacheKeyMode(const std::string& name, CacheKeyMode* mode) {
+    if (name == "mtime") {
+        *mode = CacheKeyMode::PathMtime;
+    } else if (name == "hash") {
+        *mode = CacheKeyMode::ContentHash;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+cv::Mat SourceCache::load(const std::string& file, int flags, bool* hit) {
+    if (hit) *hit = false;
+    std::string key = std::to_string(flags) + ":";
+    std::vector<unsigned char> bytes;
+
+    if (mode_ == CacheKeyMode::PathMtime) {
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0) return cv::Mat();
+        key += file + ":" + std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec) + "." +
+               std::to_string(st.st_mtim.tv_nsec);
+    } else {
+        std::ifstream in(file, std::ios::binary);
+        if (!in) return cv::Mat();
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        key += std::to_string(bytes.size()) + ":" + std::to_string(hashBytes(bytes));
+    }
+
+    cv::Mat image = lookup(key);
+    if (!image.empty()) {
+        if (hit) *hit = true;
+        return image;
+    }
+
+    // Two workers missing on the same key both decode; the later insert wins.
+    image = bytes.empty() ? cv::imread(file, flags) : cv::imdecode(bytes, flags);
+    if (!image.empty()) insert(key, image);
+    return image;
+}
+
+cv::Mat SourceCache::lookup(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        misses_++;
+        return cv::Mat();
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+    hits_++;
+    return it->second->image;
+}
+
+void SourceCache::insert(const std::string& key, const cv::Mat& image) {
+    uint64_t size = image.total() * image.elemSize();
+    if (size > capacity_) return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        bytes_ -= it->second->bytes;
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+    while (bytes_ + size > capacity_ && !lru_.empty()) {
+        bytes_ -= lru_.back().bytes;
+        index_.erase(lru_.back().key);
+        lru_.pop_back();
+        evictions_++;
+    }
+    lru_.push_front(Entry{key, image, size});
+    index_[key] = lru_.begin();
+    bytes_ += size;
+}
+
+uint64_t SourceCache::bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+}
+
+uint64_t SourceCache::hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+}
+
+uint64_t SourceCache::misses() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+}
+
+uint64_t SourceCache::evictions() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return evictions_;
+}
@@ -0,0 +1,60 @@
+#ifndef SOURCE_CACHE_H_
+#define SOURCE_CACHE_H_
+
+#include <opencv2/opencv.hpp>
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// How a cached source is identified.
+enum class CacheKeyMode {
+    PathMtime,    // path, size and mtime from stat(); a hit does no I/O at all
+    ContentHash,  // hash of the file bytes; a hit still reads the file but skips the decode
+};
+
+bool parseCacheKeyMode(const std::string& name, CacheKeyMode* mode);
+
+// Bounded LRU cache of decoded source images, for watch mode where the same
+// sources are requested again and again. Cached Mats are shared with callers
+// and must be treated as read-only. The cache's bytes are carved out of the
+// in-flight memory budget by the caller, so they are never counted twice.
+class SourceCache {
+public:
+    SourceCache(uint64_t capacity, CacheKeyMode mode) : capacity_(capacity), mode_(mode) {}
+
+    // Decoded `file` (imread flags `flags`), from the cache when possible.
+    // `hit` (optional) reports whether the decode was skipped. Returns an
+    // empty Mat if the file cannot be read or decoded.
+    cv::Mat load(const std::string& file, int flags, bool* hit = nullptr);
+
+    uint64_t capacity() const { return capacity_; }
+    uint64_t bytes() const;
+    uint64_t hits() const;
+    uint64_t misses() const;
+    uint64_t evictions() const;
+
+private:
+    struct Entry {
+        std::string key;
+        cv::Mat image;
+        uint64_t bytes;
+    };
+
+    cv::Mat lookup(const std::string& key);
+    void insert(const std::string& key, const cv::Mat& image);
+
+    const uint64_t capacity_;
+    const CacheKeyMode mode_;
+    mutable std::mutex mutex_;
+    std::list<Entry> lru_;  // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    uint64_t bytes_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t evictions_ = 0;
+};
+
+#endif  // SOURCE_CACHE_H_
@@ -0,0 +1,203 @@
+#include "stage_pipeline.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "common.h"
+#include "profiler.h"
+
+namespace {
+
+constexpr auto kWindow = std::chrono::milliseconds(200);
+constexpr double kSmoothing = 0.5;   // weight of the newest window
+constexpr double kSaturated = 0.85;  // a bottleneck's workers are at least this busy...
+constexpr double kBacklog = 1.0;     // ...with at least this many tasks queued per worker
+constexpr double kIdle = 0.5;        // a donor's workers are at most this busy, with nothing queued
+constexpr int kConfirmWindows = 3;
+constexpr int kCooldownWindows = 5;
+
+std::string percent(double fraction) { return std::to_string((int)(fraction * 100 + 0.5)) + "%"; }
+
+}  // namespace
+
+StagePipeline::StagePipeline(const std::vector<std::string>& stageNames, int threads, std::ofstream& logFile)
+    : logFile_(logFile) {
+    for (const auto& name : stageNames) {
+        Stage stage;
+        stage.name = name;
+        stage.tag = profileTag(name);
+        stages_.push_back(std::move(stage));
+    }
+    threads = std::max(threads, (int)stages_.size());
+    windowStart_ = Clock::now();
+    // Start evenly split; the controller moves workers once it has seen the load
+    for (int i = 0; i < threads; i++) {
+        assignment_.push_back(i % (int)stages_.size());
+        stages_[assignment_.back()].workers++;
+    }
+    runningStage_.assign(threads, -1);
+    taskStart_.assign(threads, windowStart_);
+    logMessage(logFile_, "INFO", "Stage workers " + describeWorkers());
+    for (int i = 0; i < threads; i++) workers_.emplace_back(&StagePipeline::workerLoop, this, i);
+    controller_ = std::thread(&StagePipeline::controllerLoop, this);
+}
+
+StagePipeline::~StagePipeline() {
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    stopController_.notify_all();
+    for (auto& worker : workers_) worker.join();
+    controller_.join();
+}
+
+void StagePipeline::submit(int stage, std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stages_[stage].queue.push_back(std::move(task));
+        pending_++;
+    }
+    wake_.notify_all();
+}
+
+void StagePipeline::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return pending_ == 0; });
+}
+
+std::string StagePipeline::describeWorkers() const {
+    std::string text;
+    for (const auto& stage : stages_) {
+        if (!text.empty()) text += ", ";
+        text += stage.name + " " + std::to_string(stage.workers);
+    }
+    return text;
+}
+
+std::string StagePipeline::summary() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string text = describeWorkers() + " after " + std::to_string(rebalances_) + " rebalances; busy";
+    for (size_t i = 0; i < stages_.size(); i++) {
+        char busy[64];
+        std::snprintf(busy, sizeof(busy), " %.0f ms over %llu tasks", stages_[i].totalBusyMs,
+                      (unsigned long long)stages_[i].tasks);
+        text += (i ? ", " : " ") + stages_[i].name + busy;
+    }
+    return text;
+}
+
+int StagePipeline::rebalances() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return rebalances_;
+}
+
+void StagePipeline::workerLoop(int worker) {
+    ProfiledThread profiled;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        // The assignment may change while waiting, so look it up on every wake
+        wake_.wait(lock, [&] { return stop_ || !stages_[assignment_[worker]].queue.empty(); });
+        int stage = assignment_[worker];
+        if (stages_[stage].queue.empty()) return;  // stopping with nothing left for this worker
+        std::function<void()> task = std::move(stages_[stage].queue.front());
+        stages_[stage].queue.pop_front();
+        runningStage_[worker] = stage;
+        taskStart_[worker] = Clock::now();
+        const char* tag = stages_[stage].tag;
+        lock.unlock();
+        {
+            ProfileStage profileStage(tag);
+            task();
+        }
+        lock.lock();
+        chargeBusy(worker, Clock::now());
+        stages_[stage].tasks++;
+        runningStage_[worker] = -1;
+        if (--pending_ == 0) idle_.notify_all();
+    }
+}
+
+void StagePipeline::chargeBusy(int worker, Clock::time_point now) {
+    double ms = std::chrono::duration<double, std::milli>(now - taskStart_[worker]).count();
+    taskStart_[worker] = now;
+    Stage& stage = stages_[runningStage_[worker]];
+    stage.busyMs += ms;
+    stage.totalBusyMs += ms;
+}
+
+void StagePipeline::controllerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+        if (stopController_.wait_for(lock, kWindow, [this] { return stop_; })) break;
+        sample(Clock::now());
+    }
+}
+
+void StagePipeline::sample(Clock::time_point now) {
+    double windowMs = std::chrono::duration<double, std::milli>(now - windowStart_).count();
+    windowStart_ = now;
+    if (windowMs <= 0) return;
+    // Tasks still running count towards the window they ran in
+    for (size_t worker = 0; worker < runningStage_.size(); worker++) {
+        if (runningStage_[worker] >= 0) chargeBusy((int)worker, now);
+    }
+    for (auto& stage : stages_) {
+        // A worker that just moved may still finish a task for its old stage
+        double utilization = std::min(1.0, stage.busyMs / (windowMs * stage.workers));
+        stage.utilization = kSmoothing * utilization + (1 - kSmoothing) * stage.utilization;
+        stage.queued = kSmoothing * stage.queue.size() + (1 - kSmoothing) * stage.queued;
+        stage.busyMs = 0;
+    }
+    if (cooldown_ > 0) {
+        cooldown_--;
+        return;
+    }
+
+    // The bottleneck is saturated and has the deepest backlog per worker; the
+    // donor is the least busy stage with nothing waiting and a worker to spare.
+    // The gap between kSaturated and kIdle keeps a balanced pipeline still.
+    int to = -1;
+    for (size_t s = 0; s < stages_.size(); s++) {
+        const Stage& stage = stages_[s];
+        if (stage.utilization < kSaturated || stage.queued < kBacklog * stage.workers) continue;
+        if (to < 0 || stage.queued / stage.workers > stages_[to].queued / stages_[to].workers) to = (int)s;
+    }
+    int from = -1;
+    for (size_t s = 0; s < stages_.size(); s++) {
+        const Stage& stage = stages_[s];
+        if ((int)s == to || stage.workers <= 1 || stage.utilization > kIdle || stage.queued >= 0.5) continue;
+        if (from < 0 || stage.utilization < stages_[from].utilization) from = (int)s;
+    }
+    if (to < 0 || from < 0) {
+        candidateWindows_ = 0;
+        return;
+    }
+    if (from != candidateFrom_ || to != candidateTo_) {
+        candidateFrom_ = from;
+        candidateTo_ = to;
+        candidateWindows_ = 0;
+    }
+    if (++candidateWindows_ < kConfirmWindows) return;
+
+    // Prefer a donor worker that is idle right now; a busy one switches after its task
+    int worker = -1;
+    for (size_t w = 0; w < assignment_.size(); w++) {
+        if (assignment_[w] != from) continue;
+        if (worker < 0 || (runningStage_[w] < 0 && runningStage_[worker] >= 0)) worker = (int)w;
+    }
+    assignment_[worker] = to;
+    stages_[from].workers--;
+    stages_[to].workers++;
+    rebalances_++;
+    cooldown_ = kCooldownWindows;
+    candidateWindows_ = 0;
+    logMessage(logFile_, "INFO", "Rebalanced a worker from " + stages_[from].name + " (busy " +
+                                     percent(stages_[from].utilization) + ") to " + stages_[to].name + " (busy " +
+                                     percent(stages_[to].utilization) + ", " +
+                                     std::to_string((int)(stages_[to].queued + 0.5)) + " queued): " +
+                                     describeWorkers());
+    wake_.notify_all();
+}
@@ -0,0 +1,85 @@
+#ifndef STAGE_PIPELINE_H_
+#define STAGE_PIPELINE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Worker threads split into one pool per pipeline stage (decode, filter,
+// encode, ...). Each stage has its own queue and its own workers, and a
+// controller thread moves workers between the pools while the batch runs: a
+// stage whose workers are saturated with tasks queued behind them takes a
+// worker from the least busy stage. Every stage always keeps at least one
+// worker, so tasks handing work to the next stage can never deadlock.
+class StagePipeline {
+public:
+    // `threads` is raised to one per stage if it is smaller.
+    StagePipeline(const std::vector<std::string>& stageNames, int threads, std::ofstream& logFile);
+    ~StagePipeline();
+
+    // Queue `task` on `stage`. Tasks may submit follow-up work to any stage.
+    void submit(int stage, std::function<void()> task);
+
+    // Block until every submitted task, including follow-ups, has finished.
+    void wait();
+
+    // Current split, rebalance count and each stage's total busy time, for the log.
+    std::string summary() const;
+    int rebalances() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stage {
+        std::string name;
+        const char* tag = nullptr;  // for the profiler
+        std::deque<std::function<void()>> queue;
+        int workers = 0;  // assigned, including any still finishing a task for another stage
+        double busyMs = 0;  // in the current sampling window
+        double totalBusyMs = 0;
+        uint64_t tasks = 0;
+        double utilization = 0;  // busy fraction, smoothed over windows
+        double queued = 0;  // queue length, smoothed over windows
+    };
+
+    void workerLoop(int worker);
+    void controllerLoop();
+    // One sampling window: update stats and maybe move a worker. Holds mutex_.
+    void sample(Clock::time_point now);
+    void chargeBusy(int worker, Clock::time_point now);
+    // "decode 2, filter 3, encode 1". Holds mutex_ or runs before the workers start.
+    std::string describeWorkers() const;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    std::condition_variable stopController_;
+    std::vector<Stage> stages_;
+    std::vector<int> assignment_;  // stage each worker serves
+    std::vector<int> runningStage_;  // stage of the task a worker is running, or -1
+    std::vector<Clock::time_point> taskStart_;
+    Clock::time_point windowStart_;
+    int pending_ = 0;
+    bool stop_ = false;
+
+    // Hysteresis: a move must be proposed this many windows in a row, and
+    // none happens again until the cooldown has passed.
+    int candidateFrom_ = -1;
+    int candidateTo_ = -1;
+    int candidateWindows_ = 0;
+    int cooldown_ = 0;
+    int rebalances_ = 0;
+
+    std::ofstream& logFile_;
+    std::vector<std::thread> workers_;
+    std::thread controller_;
+};
+
+#endif  // STAGE_PIPELINE_H_
@@ -0,0 +1,160 @@
+#include "tensor_output.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fstream>
+
+namespace {
+
+// Fixed .npy header size, so entries can be written before the final count is
+// known and the header rewritten in place; 128 bytes fits any 4D shape.
+const size_t kHeaderBytes = 128;
+
+std::string npyHeader(const TensorOptions& options, int count, int width, int height, int channels) {
+    std::string shape = options.layout == TensorLayout::NCHW
+                            ? std::to_string(count) + ", " + std::to_string(channels) + ", " +
+                                  std::to_string(height) + ", " + std::to_string(width)
+                            : std::to_string(count) + ", " + std::to_string(height) + ", " +
+                                  std::to_string(width) + ", " + std::to_string(channels);
+    std::string dict = std::string("{'descr': '") + (options.type == TensorType::Float32 ? "<f4" : "|u1") +
+                       "', 'fortran_order': False, 'shape': (" + shape + "), }";
+    // Magic, version 1.0, little-endian header length, then the padded dict
+    std::string header("\x93NUMPY\x01\x00", 8);
+    size_t dictBytes = kHeaderBytes - header.size() - 2;
+    header += (char)(dictBytes & 0xFF);
+    header += (char)(dictBytes >> 8);
+    dict.resize(dictBytes - 1, ' ');
+    return header + dict + "\n";
+}
+
+bool pwriteAll(int fd, const unsigned char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, (off_t)offset);
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+}  // namespace
+
+struct TensorBatchWriter::Batch {
+    std::string path;
+    int fd = -1;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int assigned = 0;  // slots handed out
+    int written = 0;   // slots whose pwrite has finished
+    bool failed = false;
+    std::vector<std::string> sources;
+};
+
+bool parseTensorLayout(const std::string& name, TensorLayout* layout) {
+    if (name == "nchw") {
+        *layout = TensorLayout::NCHW;
+    } else if (name == "nhwc") {
+        *layout = TensorLayout::NHWC;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parseTensorType(const std::string& name, TensorType* type) {
+    if (name == "f32") {
+        *type = TensorType::Float32;
+    } else if (name == "u8") {
+        *type = TensorType::UInt8;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+TensorFormat tensorFormat(const TensorOptions& options) {
+    TensorFormat format;
+    format.layout = options.layout;
+    format.type = options.type;
+    format.rgb = options.rgb;
+    for (int c = 0; c < 3; c++) {
+        format.scale[c] = (float)(1.0 / (255.0 * options.stddev[c]));
+        format.bias[c] = (float)(-options.mean[c] / options.stddev[c]);
+    }
+    format.scale[3] = 1.0f / 255;  // alpha is only rescaled
+    return format;
+}
+
+size_t tensorBytes(const TensorOptions& options, int width, int height, int channels) {
+    return (size_t)width * height * channels * (options.type == TensorType::Float32 ? sizeof(float) : 1);
+}
+
+TensorBatchWriter::TensorBatchWriter(const std::string& outputDir, const TensorOptions& options)
+    : outputDir_(outputDir), options_(options) {
+    if (options_.batch < 1) options_.batch = 1;
+}
+
+TensorBatchWriter::~TensorBatchWriter() {
+    finish();
+}
+
+std::string TensorBatchWriter::add(const std::string& source, const void* tensor, int width, int height,
+                                   int channels) {
+    auto key = std::make_tuple(width, height, channels);
+    std::shared_ptr<Batch> batch;
+    int slot = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::shared_ptr<Batch>& current = open_[key];
+        if (!current) {
+            current = std::make_shared<Batch>();
+            current->path = outputDir_ + "/tensors_" + std::to_string(width) + "x" + std::to_string(height) + "x" +
+                            std::to_string(channels) + "_" + std::to_string(sequence_[key]++) + ".npy";
+            current->fd = open(current->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            current->width = width;
+            current->height = height;
+            current->channels = channels;
+            current->sources.resize(options_.batch);
+            if (current->fd < 0) {
+                open_.erase(key);
+                return "";
+            }
+            files_++;
+        }
+        batch = current;
+        slot = batch->assigned++;
+        batch->sources[slot] = source;
+        // A full batch takes no more entries; the last writer closes it
+        if (batch->assigned == options_.batch) open_.erase(key);
+    }
+
+    size_t bytes = tensorBytes(options_, width, height, channels);
+    bool ok = pwriteAll(batch->fd, static_cast<const unsigned char*>(tensor), bytes, kHeaderBytes + slot * bytes);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    batch->written++;
+    if (!ok) batch->failed = true;
+    if (batch->written == options_.batch && !close(*batch)) ok = false;
+    return ok ? batch->path : "";
+}
+
+void TensorBatchWriter::finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : open_) close(*entry.second);
+    open_.clear();
+}
+
+bool TensorBatchWriter::close(Batch& batch) {
+    if (batch.fd < 0) return !batch.failed;
+    std::string header = npyHeader(options_, batch.assigned, batch.width, batch.height, batch.channels);
+    bool ok = pwriteAll(batch.fd, reinterpret_cast<const unsigned char*>(header.data()), header.size(), 0);
+    ok = ::close(batch.fd) == 0 && ok;
+    batch.fd = -1;
+
+    std::ofstream list(batch.path.substr(0, batch.path.size() - 4) + ".txt");
+    for (int i = 0; i < batch.assigned; i++) list << batch.sources[i] << "\n";
+    return ok && list.good() && !batch.failed;
+}
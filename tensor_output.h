@@ -0,0 +1,78 @@
+#ifndef TENSOR_OUTPUT_H_
+#define TENSOR_OUTPUT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+enum class TensorLayout { NCHW, NHWC };
+enum class TensorType { Float32, UInt8 };
+
+// Write filtered images as packed .npy tensors instead of encoded images.
+struct TensorOptions {
+    bool enabled = false;
+    TensorLayout layout = TensorLayout::NCHW;
+    TensorType type = TensorType::Float32;
+    bool rgb = true;  // channel order; OpenCV images are BGR
+    // Float32 only: (value / 255 - mean) / stddev per output channel, torchvision style
+    double mean[3] = {0, 0, 0};
+    double stddev[3] = {1, 1, 1};
+    int batch = 64;  // images per .npy file
+};
+
+// "nchw"/"nhwc" and "f32"/"u8"
+bool parseTensorLayout(const std::string& name, TensorLayout* layout);
+bool parseTensorType(const std::string& name, TensorType* type);
+
+// What the last filter pass needs to store a pixel as a tensor element:
+// element = code * scale[c] + bias[c], with c the output channel.
+struct TensorFormat {
+    TensorLayout layout = TensorLayout::NCHW;
+    TensorType type = TensorType::Float32;
+    bool rgb = true;
+    float scale[4] = {1, 1, 1, 1};
+    float bias[4] = {0, 0, 0, 0};
+};
+
+TensorFormat tensorFormat(const TensorOptions& options);
+
+// Bytes of one width x height x channels image as a tensor.
+size_t tensorBytes(const TensorOptions& options, int width, int height, int channels);
+
+// Packs same-shaped images into .npy batches in the output directory, named
+// tensors_<W>x<H>x<C>_<n>.npy with a .txt listing the source of each entry.
+// Each image is written straight to its slot with one pwrite, so workers
+// finishing in any order never buffer a batch in memory. Thread-safe.
+class TensorBatchWriter {
+public:
+    TensorBatchWriter(const std::string& outputDir, const TensorOptions& options);
+    ~TensorBatchWriter();
+
+    // Returns the batch file the tensor went to, or an empty string on failure.
+    std::string add(const std::string& source, const void* tensor, int width, int height, int channels);
+
+    // Finalize partly filled batches. Call once every add() has returned.
+    void finish();
+
+    const TensorOptions& options() const { return options_; }
+    int files() const { return files_; }
+
+private:
+    struct Batch;
+
+    bool close(Batch& batch);
+
+    std::string outputDir_;
+    TensorOptions options_;
+    std::mutex mutex_;
+    std::map<std::tuple<int, int, int>, std::shared_ptr<Batch>> open_;
+    std::map<std::tuple<int, int, int>, int> sequence_;
+    int files_ = 0;
+};
+
+#endif  // TENSOR_OUTPUT_H_
@@ -0,0 +1,63 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+#include "profiler.h"
+
+ThreadPool::ThreadPool(int threads, int reservedHigh) {
+    threads = std::max(threads, 1);
+    reservedHigh = std::min(std::max(reservedHigh, 0), threads - 1);
+    for (int i = 0; i < threads; i++) {
+        workers_.emplace_back(&ThreadPool::workerLoop, this, i < reservedHigh);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> task, bool highPriority) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        (highPriority ? high_ : low_).push_back(std::move(task));
+        pending_++;
+    }
+    wake_.notify_all();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return pending_ == 0; });
+}
+
+void ThreadPool::workerLoop(bool highOnly) {
+    ProfiledThread profiled;
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&] { return stop_ || !high_.empty() || (!highOnly && !low_.empty()); });
+            if (!high_.empty()) {
+                task = std::move(high_.front());
+                high_.pop_front();
+            } else if (!highOnly && !low_.empty()) {
+                task = std::move(low_.front());
+                low_.pop_front();
+            } else {
+                return;  // stopping with nothing left for this worker
+            }
+        }
+        task();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_--;
+        }
+        idle_.notify_all();
+    }
+}
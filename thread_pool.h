@@ -0,0 +1,40 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size worker pool with two priority levels. High-priority tasks always
+// run before queued low-priority ones, and `reservedHigh` of the workers never
+// pick up low-priority work, so a latency-sensitive task never waits behind a
+// full pool of long-running batch tasks.
+class ThreadPool {
+public:
+    ThreadPool(int threads, int reservedHigh = 0);
+    ~ThreadPool();
+
+    void submit(std::function<void()> task, bool highPriority = false);
+
+    // Block until every submitted task has finished.
+    void wait();
+
+    int size() const { return (int)workers_.size(); }
+
+private:
+    void workerLoop(bool highOnly);
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    std::deque<std::function<void()>> high_;
+    std::deque<std::function<void()>> low_;
+    int pending_ = 0;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+#endif  // THREAD_POOL_H_
@@ -0,0 +1,162 @@
+#include "tiff_writer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace {
+
+const int kTypeShort = 3;
+const int kTypeLong = 4;
+const int kTypeLong8 = 16;
+const uint64_t kDataAlignment = 4096;
+
+void put16(std::vector<unsigned char>& buf, uint16_t v) {
+    buf.push_back(v & 0xFF);
+    buf.push_back(v >> 8);
+}
+
+void put64(std::vector<unsigned char>& buf, uint64_t v) {
+    for (int i = 0; i < 8; i++) buf.push_back((v >> (8 * i)) & 0xFF);
+}
+
+// One 20-byte BigTIFF directory entry. Values up to 8 bytes are stored inline.
+void putEntry(std::vector<unsigned char>& buf, uint16_t tag, uint16_t type, uint64_t count,
+              const std::vector<uint64_t>& values) {
+    put16(buf, tag);
+    put16(buf, type);
+    put64(buf, count);
+    size_t start = buf.size();
+    int width = type == kTypeShort ? 2 : (type == kTypeLong ? 4 : 8);
+    for (uint64_t v : values) {
+        for (int i = 0; i < width; i++) buf.push_back((v >> (8 * i)) & 0xFF);
+    }
+    while (buf.size() < start + 8) buf.push_back(0);
+}
+
+// Serialize the directory for one page whose pixel strip starts at dataOffset.
+std::vector<unsigned char> buildIfd(int width, int height, int channels, uint64_t dataOffset,
+                                    uint64_t nextIfdOffset) {
+    std::vector<unsigned char> ifd;
+    std::vector<uint64_t> bits(channels, 8);
+    uint64_t stripBytes = (uint64_t)width * height * channels;
+    uint64_t entries = channels == 4 ? 11 : 10;
+
+    put64(ifd, entries);
+    putEntry(ifd, 256, kTypeLong, 1, {(uint64_t)width});                 // ImageWidth
+    putEntry(ifd, 257, kTypeLong, 1, {(uint64_t)height});                // ImageLength
+    putEntry(ifd, 258, kTypeShort, channels, bits);                      // BitsPerSample
+    putEntry(ifd, 259, kTypeShort, 1, {1});                              // Compression: none
+    putEntry(ifd, 262, kTypeShort, 1, {channels >= 3 ? 2u : 1u});      // Photometric: RGB / gray
+    putEntry(ifd, 273, kTypeLong8, 1, {dataOffset});                     // StripOffsets
+    putEntry(ifd, 277, kTypeShort, 1, {(uint64_t)channels});             // SamplesPerPixel
+    putEntry(ifd, 278, kTypeLong, 1, {(uint64_t)height});                // RowsPerStrip
+    putEntry(ifd, 279, kTypeLong8, 1, {stripBytes});                     // StripByteCounts
+    putEntry(ifd, 284, kTypeShort, 1, {1});                              // PlanarConfig: chunky
+    if (channels == 4) putEntry(ifd, 338, kTypeShort, 1, {2});           // ExtraSamples: alpha
+    put64(ifd, nextIfdOffset);
+    return ifd;
+}
+
+bool writeAll(int fd, const unsigned char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+void put64At(unsigned char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+}  // namespace
+
+bool preallocateImageFile(const std::string& path, int width, int height, int channels, bool tiff,
+                          uint64_t* dataOffset) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    uint64_t offset = 0;
+    bool ok = true;
+    if (tiff) {
+        // Header, then the single IFD, then the pixel strip on a page boundary.
+        std::vector<unsigned char> header = {'I', 'I', 43, 0, 8, 0, 0, 0};
+        put64(header, 16);
+        std::vector<unsigned char> ifd = buildIfd(width, height, channels, 0, 0);
+        offset = (header.size() + ifd.size() + kDataAlignment - 1) / kDataAlignment * kDataAlignment;
+        ifd = buildIfd(width, height, channels, offset, 0);
+        ok = writeAll(fd, header.data(), header.size(), 0) && writeAll(fd, ifd.data(), ifd.size(), header.size());
+    }
+
+    uint64_t total = offset + (uint64_t)width * height * channels;
+    if (ok && posix_fallocate(fd, 0, total) != 0) {
+        // Filesystems without fallocate support still get a correctly sized (sparse) file.
+        ok = ftruncate(fd, total) == 0;
+    }
+    close(fd);
+    *dataOffset = offset;
+    return ok;
+}
+
+void swapRedBlue(unsigned char* pixels, size_t pixelCount, int channels) {
+    if (channels < 3) return;
+    for (size_t i = 0; i < pixelCount; i++) {
+        std::swap(pixels[i * channels], pixels[i * channels + 2]);
+    }
+}
+
+TiffPageWriter::~TiffPageWriter() {
+    if (fd_ >= 0) ::close(fd_);
+}
+
+bool TiffPageWriter::open(const std::string& path) {
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) return false;
+    std::vector<unsigned char> header = {'I', 'I', 43, 0, 8, 0, 0, 0};
+    put64(header, 0);  // first IFD, patched by the first appendPage
+    nextPointer_ = 8;
+    offset_ = header.size();
+    pages_ = 0;
+    return writeAll(fd_, header.data(), header.size(), 0);
+}
+
+bool TiffPageWriter::appendPage(const unsigned char* pixels, int width, int height, int channels, size_t stride) {
+    if (fd_ < 0) return false;
+
+    // Pixel strip first, one converted row at a time
+    uint64_t dataOffset = offset_;
+    size_t rowBytes = (size_t)width * channels;
+    std::vector<unsigned char> row(rowBytes);
+    for (int y = 0; y < height; y++) {
+        memcpy(row.data(), pixels + y * stride, rowBytes);
+        swapRedBlue(row.data(), width, channels);
+        if (!writeAll(fd_, row.data(), rowBytes, dataOffset + y * rowBytes)) return false;
+    }
+
+    // Then the directory, word aligned, and link it from the previous one
+    uint64_t ifdOffset = (dataOffset + rowBytes * height + 7) / 8 * 8;
+    std::vector<unsigned char> ifd = buildIfd(width, height, channels, dataOffset, 0);
+    unsigned char link[8];
+    put64At(link, ifdOffset);
+    if (!writeAll(fd_, ifd.data(), ifd.size(), ifdOffset) || !writeAll(fd_, link, sizeof(link), nextPointer_)) {
+        return false;
+    }
+    nextPointer_ = ifdOffset + ifd.size() - 8;
+    offset_ = ifdOffset + ifd.size();
+    pages_++;
+    return true;
+}
+
+bool TiffPageWriter::close() {
+    if (fd_ < 0) return false;
+    bool ok = ::close(fd_) == 0 && pages_ > 0;
+    fd_ = -1;
+    return ok;
+}
@@ -0,0 +1,40 @@
+#ifndef TIFF_WRITER_H_
+#define TIFF_WRITER_H_
+
+#include <cstdint>
+#include <string>
+
+// Minimal uncompressed BigTIFF (64-bit offsets) output. Each page stores its
+// pixels as one contiguous RGB(A)/gray strip, so a row can be written with a
+// single pwrite at dataOffset + y * rowBytes without touching the rest of the file.
+
+// Create `path` sized for a width x height x channels image and return the file
+// offset of the first pixel. With `tiff` false the file is headerless raw BGR.
+bool preallocateImageFile(const std::string& path, int width, int height, int channels, bool tiff,
+                          uint64_t* dataOffset);
+
+// Streams pages to a multi-page BigTIFF in order. Only the page being appended
+// is ever held, so a stack of any length is written in bounded memory.
+class TiffPageWriter {
+public:
+    ~TiffPageWriter();
+
+    bool open(const std::string& path);
+    // Append one 8-bit BGR/BGRA/gray page; `stride` is the byte distance between rows.
+    bool appendPage(const unsigned char* pixels, int width, int height, int channels, size_t stride);
+    bool close();
+
+    int pages() const { return pages_; }
+
+private:
+    int fd_ = -1;
+    uint64_t offset_ = 0;       // end of file
+    uint64_t nextPointer_ = 0;  // where the offset of the next IFD goes
+    int pages_ = 0;
+};
+
+// Swap the first and third channel of `pixelCount` interleaved pixels in place
+// (OpenCV BGR <-> TIFF RGB).
+void swapRedBlue(unsigned char* pixels, size_t pixelCount, int channels);
+
+#endif  // TIFF_WRITER_H_
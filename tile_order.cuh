@@ -0,0 +1,117 @@
+#ifndef TILE_ORDER_CUH_
+#define TILE_ORDER_CUH_
+
+#include <cuda_runtime.h>
+
+// Order in which thread blocks (16x16-pixel tiles) are issued. Blocks are
+// dispatched roughly in linear index order, so mapping the linear index onto a
+// space-filling curve keeps the blocks resident at any moment close together
+// in 2D and improves L2/TLB reuse for neighbourhood and remapping kernels.
+enum class TileOrder { RowMajor, Morton, Hilbert };
+
+// Curves are laid over square super-tiles of curveSide x curveSide tiles
+// (a power of two) that are themselves visited row by row, so a long thin
+// band does not pay for an enclosing power-of-two square of empty blocks.
+struct TileGrid {
+    int tilesX;
+    int tilesY;
+    int curveSide;
+    int superTilesX;
+    int superTilesY;
+    TileOrder order;
+    // Sparse launch: block i handles tiles[i], a row-major tile index, and the
+    // curve is ignored. Used to recompute only the tiles that changed.
+    const int* tiles = nullptr;
+    int tileCount = 0;
+};
+
+const int kTileSize = 16;
+const int kMaxCurveSide = 64;
+
+inline TileGrid makeTileGrid(int width, int height, TileOrder order) {
+    TileGrid grid;
+    grid.tilesX = (width + kTileSize - 1) / kTileSize;
+    grid.tilesY = (height + kTileSize - 1) / kTileSize;
+    grid.order = order;
+    grid.curveSide = 1;
+    if (order != TileOrder::RowMajor) {
+        int shortSide = grid.tilesX < grid.tilesY ? grid.tilesX : grid.tilesY;
+        while (grid.curveSide * 2 <= shortSide && grid.curveSide < kMaxCurveSide) grid.curveSide *= 2;
+    }
+    grid.superTilesX = (grid.tilesX + grid.curveSide - 1) / grid.curveSide;
+    grid.superTilesY = (grid.tilesY + grid.curveSide - 1) / grid.curveSide;
+    return grid;
+}
+
+// One-dimensional launch covering every tile of the grid (or of its list).
+inline dim3 tileLaunchGrid(const TileGrid& grid) {
+    if (grid.tiles) return dim3(grid.tileCount);
+    return dim3(grid.superTilesX * grid.superTilesY * grid.curveSide * grid.curveSide);
+}
+
+inline dim3 tileBlock() {
+    return dim3(kTileSize, kTileSize);
+}
+
+// Keep the even bits of v, packed into the low half.
+__host__ __device__ inline unsigned compactBits(unsigned v) {
+    v &= 0x55555555;
+    v = (v | (v >> 1)) & 0x33333333;
+    v = (v | (v >> 2)) & 0x0F0F0F0F;
+    v = (v | (v >> 4)) & 0x00FF00FF;
+    v = (v | (v >> 8)) & 0x0000FFFF;
+    return v;
+}
+
+// Position d along a Hilbert curve filling a side x side square.
+__host__ __device__ inline void hilbertToXY(int side, unsigned d, int* x, int* y) {
+    int hx = 0;
+    int hy = 0;
+    for (int s = 1; s < side; s *= 2) {
+        int rx = 1 & (d / 2);
+        int ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                hx = s - 1 - hx;
+                hy = s - 1 - hy;
+            }
+            int t = hx;
+            hx = hy;
+            hy = t;
+        }
+        hx += s * rx;
+        hy += s * ry;
+        d /= 4;
+    }
+    *x = hx;
+    *y = hy;
+}
+
+// Tile handled by linear block `block`; false for padding blocks past the image.
+__host__ __device__ inline bool tileCoords(const TileGrid& grid, unsigned block, int* tileX, int* tileY) {
+    if (grid.tiles) {
+        *tileX = grid.tiles[block] % grid.tilesX;
+        *tileY = grid.tiles[block] / grid.tilesX;
+        return true;
+    }
+    if (grid.order == TileOrder::RowMajor) {
+        *tileX = block % grid.tilesX;
+        *tileY = block / grid.tilesX;
+        return *tileY < grid.tilesY;
+    }
+    unsigned perSuper = grid.curveSide * grid.curveSide;
+    unsigned super = block / perSuper;
+    unsigned d = block % perSuper;
+    int cx, cy;
+    if (grid.order == TileOrder::Morton) {
+        cx = compactBits(d);
+        cy = compactBits(d >> 1);
+    } else {
+        hilbertToXY(grid.curveSide, d, &cx, &cy);
+    }
+    *tileX = (super % grid.superTilesX) * grid.curveSide + cx;
+    *tileY = (super / grid.superTilesX) * grid.curveSide + cy;
+    return *tileX < grid.tilesX && *tileY < grid.tilesY;
+}
+
+#endif  // TILE_ORDER_CUH_
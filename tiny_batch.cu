@@ -0,0 +1,195 @@
+#include "tiny_batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <tuple>
+
+#include "blur_kernel.cuh"
+#include "buffer_pool.h"
+#include "common.h"
+
+namespace {
+
+const int kTransposeRows = 8;  // blockDim.y of the (de-)interleave kernels
+
+struct TinyPointers {
+    const unsigned char* image[kMaxTinyGroup];
+};
+
+// Gather 32 consecutive bytes of each image (coalesced per image) into shared
+// memory, then write them out image-minor: interleaved[e * group + i] =
+// image[i][e], again as one contiguous run per block. Lanes past `count` are
+// zero.
+__global__ void interleaveKernel(TinyPointers images, int count, int group, size_t elements,
+                                 unsigned char* interleaved) {
+    __shared__ unsigned char tile[kMaxTinyGroup][kMaxTinyGroup + 1];
+    size_t first = (size_t)blockIdx.x * kMaxTinyGroup;
+    size_t e = first + threadIdx.x;
+    for (int i = threadIdx.y; i < group; i += kTransposeRows) {
+        tile[i][threadIdx.x] = i < count && e < elements ? images.image[i][e] : 0;
+    }
+    __syncthreads();
+    int thread = threadIdx.y * kMaxTinyGroup + threadIdx.x;
+    for (int o = thread; o < kMaxTinyGroup * group; o += kMaxTinyGroup * kTransposeRows) {
+        int i = o % group;
+        int offset = o / group;
+        if (first + offset < elements) interleaved[(first + offset) * group + i] = tile[i][offset];
+    }
+}
+
+// The inverse, into `count` images stacked one after another.
+__global__ void deinterleaveKernel(const unsigned char* interleaved, int count, int group, size_t elements,
+                                   unsigned char* stacked) {
+    __shared__ unsigned char tile[kMaxTinyGroup][kMaxTinyGroup + 1];
+    size_t first = (size_t)blockIdx.x * kMaxTinyGroup;
+    int thread = threadIdx.y * kMaxTinyGroup + threadIdx.x;
+    for (int o = thread; o < kMaxTinyGroup * group; o += kMaxTinyGroup * kTransposeRows) {
+        int i = o % group;
+        int offset = o / group;
+        if (first + offset < elements) tile[i][offset] = interleaved[(first + offset) * group + i];
+    }
+    __syncthreads();
+    size_t e = first + threadIdx.x;
+    for (int i = threadIdx.y; i < count; i += kTransposeRows) {
+        if (e < elements) stacked[i * elements + e] = tile[i][threadIdx.x];
+    }
+}
+
+// gaussianBlurKernel over a group-way interleaved image: thread t handles
+// lane t % group of pixel t / group, so a warp covers 32 / group neighbouring
+// pixels of every image and each tap is one contiguous load. Both blur through
+// blur3x3, so the results are identical.
+__global__ void blurInterleavedKernel(const unsigned char* input, unsigned char* output, int width, int height,
+                                      int channels, int group) {
+    size_t t = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+    if (t >= (size_t)width * height * group) return;
+    int lane = (int)(t % group);
+    int pixel = (int)(t / group);
+    int x = pixel % width;
+    int y = pixel / width;
+
+    for (int c = 0; c < channels; c++) {
+        output[(((size_t)y * width + x) * channels + c) * group + lane] = blur3x3([&](int kx, int ky) {
+            int px = min(max(x + kx, 0), width - 1);
+            int py = min(max(y + ky, 0), height - 1);
+            return input[(((size_t)py * width + px) * channels + c) * group + lane];
+        });
+    }
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+}  // namespace
+
+bool isTinyImage(int width, int height) {
+    return width <= kTinyMaxSide && height <= kTinyMaxSide;
+}
+
+bool tinyBatchSupported() {
+    const FilterOptions& options = filterOptions();
+    return filterSupportsTiles() && options.waveletLayers == 0;
+}
+
+cv::Mat filterTinyGroup(const std::vector<TinyImage>& images, int width, int height, int channels, int group,
+                        cudaStream_t stream) {
+    int count = (int)images.size();
+    if (count == 0 || count > group || group > kMaxTinyGroup || kMaxTinyGroup % group != 0) return cv::Mat();
+    size_t elements = (size_t)width * height * channels;
+    DeviceBufferPool& pool = deviceBufferPool();
+    unsigned char* d_interleaved = pool.acquire(2 * elements * group);  // input and blurred planes
+    unsigned char* d_stacked = pool.acquire(elements * count);
+    if (!d_interleaved || !d_stacked) {
+        pool.release(d_interleaved);
+        pool.release(d_stacked);
+        return cv::Mat();
+    }
+
+    TinyPointers pointers = {};
+    for (int i = 0; i < count; i++) pointers.image[i] = images[i].d_image;
+    unsigned char* d_blurred = d_interleaved + elements * group;
+    unsigned int chunks = (unsigned int)((elements + kMaxTinyGroup - 1) / kMaxTinyGroup);
+    dim3 transposeBlock(kMaxTinyGroup, kTransposeRows);
+    interleaveKernel<<<chunks, transposeBlock, 0, stream>>>(pointers, count, group, elements, d_interleaved);
+    size_t threads = (size_t)width * height * group;
+    blurInterleavedKernel<<<(unsigned int)((threads + 255) / 256), 256, 0, stream>>>(d_interleaved, d_blurred, width,
+                                                                                      height, channels, group);
+    deinterleaveKernel<<<chunks, transposeBlock, 0, stream>>>(d_blurred, count, group, elements, d_stacked);
+    for (int i = 0; i < count; i++) {
+        if (images[i].onDevice) images[i].onDevice(d_stacked + i * elements, width, height, channels, stream);
+    }
+    cv::Mat output(count * height, width, CV_8UC(channels));
+    cudaMemcpyAsync(output.data, d_stacked, elements * count, cudaMemcpyDeviceToHost, stream);
+    cudaError_t status = cudaStreamSynchronize(stream);
+
+    pool.release(d_interleaved);
+    pool.release(d_stacked);
+    return status == cudaSuccess ? output : cv::Mat();
+}
+
+void benchmarkTinyBatch(const std::vector<cv::Mat>& images, int group, std::ofstream& logFile) {
+    const int kIterations = 20;
+    // Same-size images form the groups, as in a batch
+    std::map<std::tuple<int, int, int>, std::vector<unsigned char*>> bySize;
+    DeviceBufferPool& pool = deviceBufferPool();
+    for (const cv::Mat& image : images) {
+        if (!isTinyImage(image.cols, image.rows)) continue;
+        cv::Mat input = image.isContinuous() ? image : image.clone();
+        size_t size = input.total() * input.elemSize();
+        unsigned char* d_image = pool.acquire(size);
+        if (!d_image) continue;
+        cudaMemcpy(d_image, input.data, size, cudaMemcpyHostToDevice);
+        bySize[std::make_tuple(input.cols, input.rows, input.channels())].push_back(d_image);
+    }
+
+    for (auto& entry : bySize) {
+        int width = std::get<0>(entry.first);
+        int height = std::get<1>(entry.first);
+        int channels = std::get<2>(entry.first);
+        std::vector<unsigned char*>& d_images = entry.second;
+        size_t size = (size_t)width * height * channels;
+        cv::Mat output(height, width, CV_8UC(channels));
+        unsigned char* d_output = pool.acquire(size);
+        if (!d_output) continue;
+        cudaStream_t stream = workerStream(false);
+
+        // What the pipeline does per image: filter, download, sync
+        auto filterEach = [&] {
+            for (unsigned char* d_image : d_images) {
+                runFilter(d_image, d_output, width, height, channels, stream);
+                cudaMemcpyAsync(output.data, d_output, size, cudaMemcpyDeviceToHost, stream);
+                cudaStreamSynchronize(stream);
+            }
+        };
+        auto filterGroups = [&] {
+            for (size_t first = 0; first < d_images.size(); first += group) {
+                std::vector<TinyImage> members;
+                for (size_t i = first; i < std::min(d_images.size(), first + group); i++) {
+                    members.push_back({d_images[i], nullptr});
+                }
+                filterTinyGroup(members, width, height, channels, group, stream);
+            }
+        };
+        double rates[2];
+        for (int grouped = 0; grouped < 2; grouped++) {
+            grouped ? filterGroups() : filterEach();  // warm-up
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < kIterations; i++) grouped ? filterGroups() : filterEach();
+            rates[grouped] = d_images.size() * kIterations / (elapsedMs(start) / 1e3);
+        }
+        pool.release(d_output);
+
+        std::string line = "Tiny batch " + std::to_string(width) + "x" + std::to_string(height) + "x" +
+                           std::to_string(channels) + " (" + std::to_string(d_images.size()) + " images): one at a time " +
+                           std::to_string((int)rates[0]) + " images/s, groups of " + std::to_string(group) + " " +
+                           std::to_string((int)rates[1]) + " images/s (" + std::to_string(rates[1] / rates[0]) + "x)";
+        std::cout << line << std::endl;
+        logMessage(logFile, "INFO", line);
+    }
+    for (auto& entry : bySize) {
+        for (unsigned char* d_image : entry.second) pool.release(d_image);
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef TINY_BATCH_H_
+#define TINY_BATCH_H_
+
+#include <cuda_runtime.h>
+#include <opencv2/opencv.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "filters.h"
+
+// Images at most this many pixels on each side are grouped with --tiny_batch.
+const int kTinyMaxSide = 64;
+// Largest group: one image per lane of a warp.
+const int kMaxTinyGroup = 32;
+
+// Icons and thumbnails are too small to fill the GPU one at a time: a 32x32
+// image is four tiles, and its launch, sync and download cost more than the
+// blur. A group of up to kMaxTinyGroup images of the same size is instead
+// interleaved on the device so that consecutive bytes hold the same sample of
+// consecutive images. One pass then blurs the whole group, each warp lane
+// working on the same pixel of a different image. Every lane of a warp takes
+// the same edge branches and loads one contiguous run of bytes, however small
+// or oddly sized the images are. The result is de-interleaved and downloaded
+// in one copy.
+struct TinyImage {
+    const unsigned char* d_image;  // interleaved 8-bit, owned by the caller
+    DeviceImageHook onDevice;      // runs on this image's filtered result, before download
+};
+
+bool isTinyImage(int width, int height);
+
+// Whether the configured chain can run grouped: only the 3x3 blur.
+bool tinyBatchSupported();
+
+// Blur `images` (all `width` x `height` x `channels`, at most `group` of them)
+// interleaved `group` ways; `group` divides 32. Returns them stacked, image i
+// in rows [i * height, (i + 1) * height). Identical to filtering each alone.
+// Empty on failure.
+cv::Mat filterTinyGroup(const std::vector<TinyImage>& images, int width, int height, int channels, int group,
+                        cudaStream_t stream = 0);
+
+// Time the blur of every tiny image in `images`, one at a time and in groups
+// of `group` (each including its download), and log images/s for both.
+void benchmarkTinyBatch(const std::vector<cv::Mat>& images, int group, std::ofstream& logFile);
+
+#endif  // TINY_BATCH_H_